@@ -0,0 +1,344 @@
+/*
+
+*/
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif /* _WIN32 */
+#include <algorithm>
+#include <exception>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/optional.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "IOStream.hpp"
+#include "Erlang.hpp"
+#include "Logger.hpp"
+#include "Metrics.hpp"
+#include "PortServer.hpp"
+#include "TermSort.hpp"
+#include "Defines.hpp"
+
+#include <boost/asio/yield.hpp>
+
+static bool g_copyFiles = false; // --copy-files: read into the reply instead of sendfile
+static size_t g_sortThreads = 0; // --sort-threads, 0 - one per core
+
+// Request counts by encoded key: one table per worker with --affinity, else the first one under
+// g_hitsMutex
+typedef std::map<std::string, UInt64> HitTable;
+static std::vector<HitTable> g_hits(1);
+static bool g_affinity = false;
+static boost::mutex g_hitsMutex;
+
+//-------------------------------------------------------------------------------------------------
+// One in-flight request of the port. The server keeps --sessions of them, a session that waits
+// for its blocking work costs its members only, the others keep serving.
+class Session: public Erlang::PortServer::Coroutine
+{
+	private: Erlang::PortServer::Request Request_;
+	private: int Command_;
+	private: boost::optional<Erlang::Reference> DS_;
+	private: UInt32 SleepUs_; // Of sleep, rows of scan
+	private: boost::optional<Erlang::Binary> Binary_;
+	private: std::string Key_; // Encoded, of hits
+	private: size_t ListPos_;  // Of sort in the frame, 0 - none
+	private: Metrics::Timer Timer_;
+	
+	public: Session(void):
+		Command_(-1),
+		SleepUs_(0),
+		ListPos_(0)
+	{
+	}
+	
+	// {Command,DS,...}, false if the frame is not a command
+	private: bool Decode(void)
+	{
+		Erlang::ETFStatus status;
+		Erlang::ETFReader er(&Request_.Frame[0], Request_.Frame.size(), false, status);
+		UInt32 tupleSize = 0;
+		if(status && (status = er.TryReadTuple(tupleSize)) && (status = er.TryReadNumber(Command_)) && (status = er.TryReadReference(DS_)) && tupleSize == 3) {
+			if(Command_ == 5 || Command_ == 6)
+				status = er.TryReadNumber(SleepUs_);
+			else if(Command_ == 4 || Command_ == 7)
+				status = er.TryReadBinary(Binary_);
+			else if(Command_ == 9) {
+				size_t pos = er.Tell();
+				if((status = er.TrySkipTerm()))
+					ListPos_ = pos;
+			}
+			else if(Command_ == 8) {
+				size_t pos = er.Tell();
+				if((status = er.TrySkipTerm()))
+					Key_.assign((const char*)&Request_.Frame[pos], er.Tell() - pos);
+			}
+		}
+		if(!status) {
+			LOG_WARNING("Invalid request: {} at {}", status.What(), (UInt32)status.Offset);
+			return false;
+		}
+		Timer_.Record(Metrics::Decode, (UInt32)Command_);
+		return true;
+	}
+	
+	// Stands for disk or a subprocess, runs on a blocking thread; gives up once the request is
+	// cancelled, checked every millisecond
+	private: void Sleep(void)
+	{
+		boost::chrono::steady_clock::time_point end = boost::chrono::steady_clock::now() + boost::chrono::microseconds(SleepUs_);
+		for(boost::chrono::steady_clock::time_point now = boost::chrono::steady_clock::now(); now < end && !Cancelled(); now = boost::chrono::steady_clock::now())
+			boost::this_thread::sleep_for(std::min<boost::chrono::steady_clock::duration>(end - now, boost::chrono::milliseconds(1)));
+	}
+	
+	// {?CMD_SCAN,DS,Rows} -> {chunk,DS,[{N,<<"row N">>},...]}..., {done,DS,Rows}: stands for a
+	// query whose rows come one by one, streamed from the blocking thread as they are produced
+	private: void Scan(void)
+	{
+		Erlang::ChunkWriter chunks(*DS_, ReplySink());
+		char row[32];
+		for(UInt32 n = 0; n < SleepUs_; ++n) {
+			if(Cancelled())
+				return;
+			int size = snprintf(row, sizeof(row), "row %u", (unsigned)n);
+			chunks.Row().WriteTuple(2).WriteNumber(n).WriteBinary((const byte*)row, (size_t)size);
+			if(!chunks.EndRow())
+				return;
+		}
+		if(!chunks.Done())
+			LOG_ERROR("IO Error When Reply");
+	}
+	
+	// {?CMD_FILE,DS,Path} -> {file,DS,Contents} or {error,DS,enoent}: the file goes from the page
+	// cache to the pipe or socket without being read into the process
+	private: void SendFile(void)
+	{
+		std::string path((const char*)(const byte*)*Binary_ + 5, Binary_->Size() - 5);
+		Erlang::ETFWriter ewr;
+		int fd = open(path.c_str(), O_RDONLY);
+		struct stat st;
+		if(fd < 0 || fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+			if(fd >= 0)
+				close(fd);
+			ewr.WriteTuple(3).WriteAtom("error").WriteReference(*DS_).WriteAtom("enoent");
+			if(!Reply(ewr))
+				LOG_ERROR("IO Error When Reply");
+			return;
+		}
+		
+		size_t size = (size_t)st.st_size;
+		bool written = false;
+		ewr.WriteTuple(3).WriteAtom("file").WriteReference(*DS_);
+		if(g_copyFiles) {
+			std::vector<byte> data(size);
+			size_t got = 0;
+			for(int n = 0; got < size && (n = (int)read(fd, &data[got], (unsigned)(size - got))) > 0; got += (size_t)n);
+			written = Reply(ewr.WriteBinary(data.empty() ? NULL : &data[0], got));
+		}
+		else {
+			size_t split = ewr.WriteBinaryHeader(size).BytesCount();
+			written = ReplyFile(ewr, split, fd, 0, size);
+		}
+		close(fd);
+		if(!written)
+			LOG_ERROR("IO Error When Reply");
+	}
+	
+	// {?CMD_SORT,DS,List} -> {sorted,DS,Sorted} or {error,DS,badarg}: lists:sort of the encoded
+	// elements, on --sort-threads threads of its own
+	private: void Sort(void)
+	{
+		Erlang::ETFStatus status;
+		Erlang::ETFReader er(&Request_.Frame[0], Request_.Frame.size(), false, status);
+		er.Seek(ListPos_);
+		Erlang::ETFWriter ewr;
+		ewr.WriteTuple(3).WriteAtom("sorted").WriteReference(*DS_);
+		if(!Erlang::TermSort::TrySort(er, ewr, g_sortThreads)) {
+			Erlang::ETFWriter error;
+			error.WriteTuple(3).WriteAtom("error").WriteReference(*DS_).WriteAtom("badarg");
+			ewr = error;
+		}
+		if(!Reply(ewr))
+			LOG_ERROR("IO Error When Reply");
+	}
+	
+	// {?CMD_HITS,DS,Key} -> {hits,DS,Count}: Key seen Count times. With --affinity all requests
+	// of a key come to the worker of its phash2, whose table is touched by that thread only.
+	private: UInt64 Hit(void)
+	{
+		if(g_affinity)
+			return ++g_hits[Worker()][Key_];
+		boost::mutex::scoped_lock lock(g_hitsMutex);
+		return ++g_hits[0][Key_];
+	}
+	
+	private: void Encode(Erlang::ETFWriter& ewr)
+	{
+		if(Command_ == 2) // {?CMD_PING,DS,...} -> {pong,DS}
+			ewr.WriteTuple(2).WriteAtom("pong").WriteReference(*DS_);
+		else if(Command_ == 4 && Binary_) // {?CMD_BINARY,DS,Bin} -> {binary,DS,Bin}
+			ewr.WriteTuple(3).WriteAtom("binary").WriteReference(*DS_).WriteBinary(*Binary_);
+		else if(Command_ == 5) // {?CMD_SLEEP,DS,Us} -> {slept,DS,Us}
+			ewr.WriteTuple(3).WriteAtom("slept").WriteReference(*DS_).WriteNumber(SleepUs_);
+		else if(Command_ == 8)
+			ewr.WriteTuple(3).WriteAtom("hits").WriteReference(*DS_).WriteNumber(Hit());
+		else if(Command_ == (int)Metrics::COMMAND) {
+			Metrics::Snapshot snapshot;
+			Metrics::Collect(snapshot);
+			ewr.WriteTuple(3).WriteAtom("metrics").WriteReference(*DS_);
+			Metrics::Write(ewr, snapshot);
+		}
+		else
+			ewr.WriteTuple(3).WriteAtom("error").WriteReference(*DS_).WriteAtom("unknown_command");
+	}
+	
+	public: void operator ()(void)
+	{
+		reenter(this) for(;;) {
+			yield NextRequest(Request_);
+			if(Request_.Frame.empty())
+				break; // Port closed
+			Timer_ = Metrics::Timer();
+			if(!Decode() || Command_ == 3) // {?CMD_CLOSE,DS} - Erlang closes the port next
+				continue;
+			if(Command_ == 5 || Command_ == 6 || (Command_ == 7 && Binary_) || (Command_ == 9 && ListPos_)) {
+				yield Blocking(boost::bind(Command_ == 5 ? &Session::Sleep : Command_ == 6 ? &Session::Scan : Command_ == 7 ? &Session::SendFile : &Session::Sort, this));
+				if(Cancelled()) {
+					Metrics::Add(Metrics::Cancelled); // '$cancel' or deadline, no reply
+					DS_ = boost::none;
+					Binary_ = boost::none;
+					ListPos_ = 0;
+					continue;
+				}
+				Timer_ = Metrics::Timer();
+			}
+			if(Command_ == 6 || Command_ == 7 || Command_ == 9) { // Replied while scanning, from the file or sorting
+				DS_ = boost::none;
+				Binary_ = boost::none;
+				ListPos_ = 0;
+				continue;
+			}
+			{
+				Erlang::ETFWriter ewr;
+				Encode(ewr);
+				Timer_.Record(Metrics::Encode, (UInt32)Command_);
+				if(!Reply(ewr))
+					LOG_ERROR("IO Error When Reply");
+			}
+			DS_ = boost::none;
+			Binary_ = boost::none;
+		}
+	}
+};
+//-------------------------------------------------------------------------------------------------
+static Erlang::PortServer* g_pServer = NULL;
+
+static void OnSignal(int)
+{
+	if(g_pServer)
+		g_pServer->Stop();
+}
+
+// Options: --packet 2|4, --workers N, --blocking N, --sessions N, --max-queued N,
+// --limit COMMAND:N (repeated), --reject, --no-log, --listen PATH (Unix domain socket besides
+// the port), --no-stdio (not a port: serves the socket until SIGINT or SIGTERM), --control PATH
+// (socket of the control lane), --batch-bytes N, --batch-delay US (replies to '$batch' frames),
+// --copy-files (file replies read into a buffer, to compare with sendfile), --affinity N
+// (requests go to workers by phash2 of their element N, 3 for {Command,DS,Key}), --sort-threads N,
+// --max-frame BYTES (longest {packet,4} frame a peer may send)
+int main(int argc, char* argv[])
+{
+	UInt32 packetSize = 2;
+	size_t workers = 4, blocking = 16, sessions = 1024;
+	Erlang::PortServer::Admission admission;
+	Erlang::PortServer::Batching batching;
+	Erlang::PortServer::Affinity affinity;
+	bool logging = true;
+	const char* listen = NULL;
+	const char* control = NULL;
+	bool stdio = true;
+	size_t maxFrame = IOStream::DEFAULT_MAX_FRAME_SIZE;
+	for(int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		bool value = (i + 1 < argc);
+		if(arg == "--packet" && value)
+			packetSize = (argv[++i][0] == '4' ? 4 : 2);
+		else if(arg == "--workers" && value)
+			workers = (size_t)strtoul(argv[++i], NULL, 10);
+		else if(arg == "--blocking" && value)
+			blocking = (size_t)strtoul(argv[++i], NULL, 10);
+		else if(arg == "--sessions" && value)
+			sessions = (size_t)strtoul(argv[++i], NULL, 10);
+		else if(arg == "--max-queued" && value)
+			admission.MaxQueued = (size_t)strtoul(argv[++i], NULL, 10);
+		else if(arg == "--limit" && value) {
+			char* end = NULL;
+			int command = (int)strtol(argv[++i], &end, 10);
+			if(*end == ':')
+				admission.Limits[command] = (size_t)strtoul(end + 1, NULL, 10);
+		}
+		else if(arg == "--reject")
+			admission.Reject = true;
+		else if(arg == "--no-log")
+			logging = false;
+		else if(arg == "--listen" && value)
+			listen = argv[++i];
+		else if(arg == "--no-stdio")
+			stdio = false;
+		else if(arg == "--control" && value)
+			control = argv[++i];
+		else if(arg == "--batch-bytes" && value)
+			batching.MaxBytes = (size_t)strtoul(argv[++i], NULL, 10);
+		else if(arg == "--batch-delay" && value)
+			batching.DelayUs = (UInt32)strtoul(argv[++i], NULL, 10);
+		else if(arg == "--copy-files")
+			g_copyFiles = true;
+		else if(arg == "--sort-threads" && value)
+			g_sortThreads = (size_t)strtoul(argv[++i], NULL, 10);
+		else if(arg == "--affinity" && value)
+			affinity.KeyElement = (UInt32)strtoul(argv[++i], NULL, 10);
+		else if(arg == "--max-frame" && value)
+			maxFrame = (size_t)strtoull(argv[++i], NULL, 10);
+	}
+	if(logging)
+		Logger::Start("Log.txt");
+	Stream::SetMode(Stream::StdIn, Stream::Binary);
+	Stream::SetMode(Stream::StdOut, Stream::Binary);
+	
+	Erlang::PortServer server(packetSize);
+	server.SetAdmission(admission);
+	server.SetBatching(batching);
+	server.SetAffinity(affinity);
+	server.SetMaxFrameSize(maxFrame);
+	g_affinity = (affinity.KeyElement != 0);
+	g_hits.resize(std::max<size_t>(workers, 1));
+	server.ServeStdio(stdio);
+	if((listen && !server.Listen(listen)) || (control && !server.ListenControl(control)))
+		return 1;
+	g_pServer = &server;
+	signal(SIGINT, OnSignal);
+	signal(SIGTERM, OnSignal);
+#ifndef _WIN32
+	if(listen || control)
+		signal(SIGPIPE, SIG_IGN); // sendfile to a socket whose peer is gone
+#endif /* _WIN32 */
+	for(size_t i = 0; i < std::max<size_t>(sessions, 1); ++i)
+		server.Spawn(new Session);
+	int ret = server.Run(workers, blocking);
+	g_pServer = NULL;
+	LOG_INFO("Port closed");
+	Logger::Stop();
+	return ret;
+}
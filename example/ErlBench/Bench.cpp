@@ -0,0 +1,833 @@
+/*
+
+*/
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <vector>
+#include <new>
+
+#include <boost/atomic.hpp>
+#include <boost/chrono.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "IOStream.hpp"
+#include "Erlang.hpp"
+#include "ETFTemplate.hpp"
+#include "ParallelDecoder.hpp"
+#include "PendingTable.hpp"
+#include "Defines.hpp"
+
+//-------------------------------------------------------------------------------------------------
+// Allocation counter - every operator new in the process is counted
+static boost::atomic<size_t> g_Allocations(0);
+
+void* operator new(size_t size)
+{
+	g_Allocations.fetch_add(1, boost::memory_order_relaxed);
+	void* p = malloc(size ? size : 1);
+	if(!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void* p) throw()
+{
+	free(p);
+}
+
+void operator delete[](void* p) throw()
+{
+	free(p);
+}
+
+void operator delete(void* p, size_t) throw()
+{
+	free(p);
+}
+
+void operator delete[](void* p, size_t) throw()
+{
+	free(p);
+}
+//-------------------------------------------------------------------------------------------------
+class Bench
+{
+	private: typedef boost::chrono::steady_clock Clock;
+	private: static const size_t BATCH_SIZE = 16; // Ops per timed sample, keeps clock overhead out of ns/op
+	
+	public: typedef void (*EncodeFunction)(Erlang::ETFWriter&);
+	public: typedef void (*DecodeFunction)(Erlang::ETFReader&);
+	
+	public: struct Corpus
+	{
+		public: std::string Name;
+		public: std::vector<byte> Term; // Encoded term with version number
+		public: EncodeFunction Encode; // NULL if ETFWriter can't produce the term (bignums)
+		public: DecodeFunction Decode;
+	};
+	
+	public: struct Options
+	{
+		public: size_t Iterations;
+		public: std::string Filter;
+		public: std::string ReplayFile;
+		
+		public: Options(void):
+			Iterations(20000)
+		{
+		}
+	};
+	
+	private: struct Result
+	{
+		public: double NsPerOp;
+		public: double P99Ns;
+		public: double MBps;
+		public: double AllocsPerOp;
+	};
+	
+	private: static FILE*& Report(void)
+	{
+		static FILE* f = stdout;
+		return f;
+	}
+	
+	private: static double Nanoseconds(Clock::time_point begin, Clock::time_point end)
+	{
+		return (double)boost::chrono::duration_cast<boost::chrono::nanoseconds>(end - begin).count();
+	}
+	
+	private: static void Print(const std::string& name, const Result& r)
+	{
+		fprintf(Report(), "%-36s %12.1f %12.1f %10.1f %10.2f\n", name.c_str(), r.NsPerOp, r.P99Ns, r.MBps, r.AllocsPerOp);
+		fflush(Report());
+	}
+	
+	private: static bool Selected(const Options& opt, const std::string& name)
+	{
+		return opt.Filter.empty() || name.find(opt.Filter) != std::string::npos;
+	}
+	
+	// Run op iterations times in timed batches of BATCH_SIZE, bytes is the payload size of one op
+	private: template<typename Op> static Result Measure(Op op, size_t iterations, size_t bytes)
+	{
+		for(size_t i = 0; i < iterations/10 + 1; ++i) // Warm up
+			op();
+		
+		std::vector<double> samples;
+		samples.reserve(iterations/BATCH_SIZE + 1);
+		size_t allocations = g_Allocations.load();
+		Clock::time_point begin = Clock::now();
+		for(size_t done = 0; done < iterations; done += BATCH_SIZE) {
+			Clock::time_point b = Clock::now();
+			for(size_t i = 0; i < BATCH_SIZE; ++i)
+				op();
+			samples.push_back(Nanoseconds(b, Clock::now())/BATCH_SIZE);
+		}
+		Clock::time_point end = Clock::now();
+		size_t ops = samples.size()*BATCH_SIZE;
+		
+		Result r;
+		r.NsPerOp = Nanoseconds(begin, end)/ops;
+		std::sort(samples.begin(), samples.end());
+		r.P99Ns = samples[std::min(samples.size() - 1, (size_t)(samples.size()*0.99))];
+		r.MBps = (r.NsPerOp > 0 ? bytes/r.NsPerOp*1e9/(1024.0*1024.0) : 0);
+		r.AllocsPerOp = double(g_Allocations.load() - allocations)/ops;
+		return r;
+	}
+	
+	//---------------------------------------------------------------------------------------------
+	// Corpora
+	private: static const Erlang::Reference& SampleReference(void)
+	{
+		// #Ref<0.1.2.3> from nonode@nohost as NEWER_REFERENCE_EXT
+		static const byte buf[] = {131,90,0,3,119,13,'n','o','n','o','d','e','@','n','o','h','o','s','t',0,0,0,0,0,0,0,1,0,0,0,2,0,0,0,3};
+		static Erlang::Reference ref = Erlang::ETFReader(buf, sizeof(buf)).ReadReference();
+		return ref;
+	}
+	
+	private: static const Erlang::Binary& SampleBinary(size_t size)
+	{
+		static std::deque<Erlang::Binary> binaries; // deque keeps references valid on push_back
+		for(size_t i = 0; i < binaries.size(); ++i)
+			if(binaries[i].Size() == size + 5)
+				return binaries[i];
+		std::vector<byte> buf(1 + 5 + size);
+		buf[0] = Erlang::ERL_VERSION;
+		buf[1] = Erlang::BINARY_EXT;
+		RWBinary::Write(&buf[2], (UInt32)size);
+		for(size_t i = 0; i < size; ++i)
+			buf[6 + i] = (byte)(i*31);
+		binaries.push_back(Erlang::ETFReader(&buf[0], buf.size()).ReadBinary());
+		return binaries.back();
+	}
+	
+	private: static const char* LongString(void)
+	{
+		static std::string str;
+		for(size_t i = str.size(); i < 8000; ++i)
+			str.push_back((char)('a' + i%26));
+		return str.c_str();
+	}
+	
+	// {1,Ref,"hi there !",'a.t.o.m',[],<<>>,[11025,11206,10255]}
+	private: static void EncodeCommand(Erlang::ETFWriter& ewr)
+	{
+		static const wchar_t unicode[] = { 11025, 11206, 10255, 0 };
+		ewr.WriteTuple(7).
+				WriteNumber(1).
+				WriteReference(SampleReference()).
+				WriteString("hi there !").
+				WriteAtom("a.t.o.m").
+				WriteNil().
+				WriteBinary(SampleBinary(0)).
+				WriteString(unicode);
+	}
+	
+	private: static void DecodeCommand(Erlang::ETFReader& er)
+	{
+		er.ReadTuple();
+		er.ReadNumber<int>();
+		Erlang::Reference ref = er.ReadReference();
+		delete[] er.ReadUnicode();
+		delete[] er.ReadAtom();
+		er.ReadNil();
+		Erlang::Binary bin = er.ReadBinary();
+		delete[] er.ReadUnicode();
+	}
+	
+	// {record,I,F,atom,...} - 64 fields
+	private: static void EncodeRecord(Erlang::ETFWriter& ewr)
+	{
+		ewr.WriteTuple(64).WriteAtom("record");
+		for(int i = 1; i < 64; ++i) {
+			if(i%3 == 0)
+				ewr.WriteNumber(i);
+			else if(i%3 == 1)
+				ewr.WriteNumber(i*0.5);
+			else
+				ewr.WriteAtom("field_value");
+		}
+	}
+	
+	private: static void DecodeRecord(Erlang::ETFReader& er)
+	{
+		er.ReadTuple();
+		delete[] er.ReadAtom();
+		for(int i = 1; i < 64; ++i) {
+			if(i%3 == 0)
+				er.ReadNumber<int>();
+			else if(i%3 == 1)
+				er.ReadNumber<Int64>();
+			else
+				delete[] er.ReadAtom();
+		}
+	}
+	
+	private: static void EncodeLongString(Erlang::ETFWriter& ewr)
+	{
+		ewr.WriteString(LongString());
+	}
+	
+	private: static void DecodeLongString(Erlang::ETFReader& er)
+	{
+		delete[] er.ReadUnicode();
+	}
+	
+	private: static void EncodeLargeBinary(Erlang::ETFWriter& ewr)
+	{
+		ewr.WriteBinary(SampleBinary(60000));
+	}
+	
+	private: static void DecodeLargeBinary(Erlang::ETFReader& er)
+	{
+		Erlang::Binary bin = er.ReadBinary();
+	}
+	
+	private: static void EncodeNumericList(Erlang::ETFWriter& ewr)
+	{
+		ewr.WriteList(4096);
+		for(int i = 0; i < 4096; ++i)
+			ewr.WriteNumber(i*1000);
+		ewr.WriteNil();
+	}
+	
+	private: static void DecodeNumericList(Erlang::ETFReader& er)
+	{
+		UInt32 size = er.ReadList();
+		for(UInt32 i = 0; i < size; ++i)
+			er.ReadNumber<int>();
+		er.ReadNil();
+	}
+	
+	// [N1,...] - 512 SMALL_BIG_EXT 8-byte integers, ETFWriter has no bignum encoder
+	private: static std::vector<byte> BignumList(void)
+	{
+		std::vector<byte> buf(1, (byte)Erlang::ERL_VERSION);
+		byte list[] = { Erlang::LIST_EXT, 0, 0, 0, 0 };
+		RWBinary::Write(&list[1], (UInt32)512);
+		buf.insert(buf.end(), list, list + sizeof(list));
+		for(UInt64 i = 0; i < 512; ++i) {
+			UInt64 value = 0x1000000000000000ULL + i*0x0123456789ULL;
+			buf.push_back(Erlang::SMALL_BIG_EXT);
+			buf.push_back(8);
+			buf.push_back((byte)(i%2)); // Sign
+			for(int d = 0; d < 8; ++d)
+				buf.push_back((byte)(value >> (8*d))); // Little-endian digits
+		}
+		buf.push_back(Erlang::NIL_EXT);
+		return buf;
+	}
+	
+	private: static void DecodeBignums(Erlang::ETFReader& er)
+	{
+		UInt32 size = er.ReadList();
+		for(UInt32 i = 0; i < size; ++i)
+			er.ReadNumber<Int64>();
+		er.ReadNil();
+	}
+	
+	private: static Corpus MakeCorpus(const char* name, EncodeFunction encode, DecodeFunction decode)
+	{
+		Corpus c;
+		Erlang::ETFWriter ewr;
+		encode(ewr);
+		c.Name = name;
+		c.Term = ewr.ToVector<byte>();
+		c.Encode = encode;
+		c.Decode = decode;
+		return c;
+	}
+	
+	public: static std::vector<Corpus> Corpora(void)
+	{
+		std::vector<Corpus> corpora;
+		corpora.push_back(MakeCorpus("command-tuple", EncodeCommand, DecodeCommand));
+		corpora.push_back(MakeCorpus("wide-record", EncodeRecord, DecodeRecord));
+		corpora.push_back(MakeCorpus("long-string", EncodeLongString, DecodeLongString));
+		corpora.push_back(MakeCorpus("large-binary", EncodeLargeBinary, DecodeLargeBinary));
+		corpora.push_back(MakeCorpus("numeric-list", EncodeNumericList, DecodeNumericList));
+		Corpus bignums;
+		bignums.Name = "bignums";
+		bignums.Term = BignumList();
+		bignums.Encode = NULL;
+		bignums.Decode = DecodeBignums;
+		corpora.push_back(bignums);
+		return corpora;
+	}
+	
+	//---------------------------------------------------------------------------------------------
+	// Codec
+	private: struct EncodeOp
+	{
+		public: EncodeFunction Encode;
+		public: void operator ()(void) const
+		{
+			Erlang::ETFWriter ewr;
+			Encode(ewr);
+		}
+	};
+	
+	private: struct DecodeOp
+	{
+		public: const Corpus* pCorpus;
+		public: bool Validate; // One structural pass over the term before it is read
+		public: void operator ()(void) const
+		{
+			Erlang::ETFReader er(&pCorpus->Term[0], pCorpus->Term.size());
+			if(Validate)
+				er.Validate();
+			pCorpus->Decode(er);
+		}
+	};
+	
+	public: static void RunCodec(const Options& opt)
+	{
+		std::vector<Corpus> corpora = Corpora();
+		for(size_t i = 0; i < corpora.size(); ++i) {
+			const Corpus& c = corpora[i];
+			// Scale iterations down for big terms, so every case takes about the same time
+			size_t iterations = std::max<size_t>(BATCH_SIZE*8, opt.Iterations*64/(c.Term.size()/64 + 64));
+			if(c.Encode && Selected(opt, "encode/" + c.Name)) {
+				EncodeOp op = { c.Encode };
+				Print("encode/" + c.Name, Measure(op, iterations, c.Term.size()));
+			}
+			if(Selected(opt, "decode/" + c.Name)) {
+				DecodeOp op = { &c, false };
+				Print("decode/" + c.Name, Measure(op, iterations, c.Term.size()));
+			}
+			if(Selected(opt, "validated/" + c.Name)) {
+				DecodeOp op = { &c, true };
+				Print("validated/" + c.Name, Measure(op, iterations, c.Term.size()));
+			}
+		}
+	}
+	
+	//---------------------------------------------------------------------------------------------
+	// Pending table - Take of a reference that is not in a table of 4096 slots ('$cancel' after the
+	// reply), on a fresh table and after 200000 requests went through it with 1000 in flight
+	private: typedef Erlang::PendingTable<Erlang::Reference, UInt64> PendingTable;
+	
+	// #Ref<0.n.0.0>
+	private: static Erlang::Reference NumberedReference(UInt32 n)
+	{
+		std::vector<byte> buf(35);
+		memcpy(&buf[0], (const byte*)"\x83\x5a\x00\x03\x77\x0dnonode@nohost", 19);
+		RWBinary::Write(&buf[23], n);
+		return Erlang::ETFReader(&buf[0], buf.size()).ReadReference();
+	}
+	
+	private: struct PendingMissOp
+	{
+		public: PendingTable* pTable;
+		public: const std::vector<Erlang::Reference>* pMisses;
+		public: size_t* pNext;
+		public: void operator ()(void) const
+		{
+			UInt64 value = 0;
+			pTable->Take((*pMisses)[(*pNext)++ % pMisses->size()], value);
+		}
+	};
+	
+	public: static void RunPending(const Options& opt)
+	{
+		std::vector<Erlang::Reference> misses;
+		for(UInt32 i = 0; i < 1024; ++i)
+			misses.push_back(NumberedReference(0x80000000 + i));
+		PendingTable table(4096);
+		size_t next = 0;
+		PendingMissOp op = { &table, &misses, &next };
+		if(Selected(opt, "pending/miss"))
+			Print("pending/miss", Measure(op, opt.Iterations, 0));
+		if(!Selected(opt, "pending/miss-churned"))
+			return;
+		UInt64 value = 0;
+		for(UInt32 i = 0; i < 1000; ++i)
+			table.Insert(NumberedReference(0x40000000 + i), i);
+		for(UInt32 i = 0; i < 200000; ++i) {
+			Erlang::Reference ref = NumberedReference(i);
+			if(!table.Insert(ref, i) || !table.Take(ref, value) || value != i)
+				fprintf(stderr, "pending table lost request %u\n", i);
+		}
+		if(table.Count() != 1000)
+			fprintf(stderr, "pending table holds %u requests of 1000\n", (unsigned)table.Count());
+		Print("pending/miss-churned", Measure(op, opt.Iterations, 0));
+	}
+	
+	//---------------------------------------------------------------------------------------------
+	// Reply template - ErlPort's command 1 reply {command1,N,Ref,{Ret,"Unicode String"}} encoded
+	// by ETFWriter, then made from ETFTemplate by one reused ETFInstance
+	private: static const Erlang::ETFTemplate& Command1Reply(void)
+	{
+		static Erlang::ETFTemplate t;
+		if(!t.HolesCount())
+			t.WriteTuple(4).
+				WriteAtom("command1").
+				IntegerHole().
+				ReferenceHole().
+				WriteTuple(2).
+					IntegerHole().
+					WriteString(L"Unicode String");
+		return t;
+	}
+	
+	private: struct ReplyOp
+	{
+		public: const Erlang::Reference* pRef;
+		public: Erlang::ETFInstance* pInstance; // NULL - ETFWriter
+		public: void operator ()(void) const
+		{
+			if(pInstance) {
+				pInstance->Reset().SetNumber(0, 1).SetReference(1, *pRef).SetNumber(2, 0);
+				return;
+			}
+			Erlang::ETFWriter ewr;
+			ewr.WriteTuple(4).
+				WriteAtom("command1").
+				WriteNumber(1).
+				WriteReference(*pRef).
+				WriteTuple(2).
+					WriteNumber(0).
+					WriteString(L"Unicode String");
+		}
+	};
+	
+	public: static void RunTemplate(const Options& opt)
+	{
+		Erlang::Reference ref = NumberedReference(1);
+		Erlang::ETFInstance instance(Command1Reply());
+		size_t bytes = instance.SetNumber(0, 1).SetReference(1, ref).SetNumber(2, 0).BytesCount();
+		if(Selected(opt, "encode/command1-reply")) {
+			ReplyOp op = { &ref, NULL };
+			Print("encode/command1-reply", Measure(op, opt.Iterations, bytes));
+		}
+		if(Selected(opt, "template/command1-reply")) {
+			ReplyOp op = { &ref, &instance };
+			Print("template/command1-reply", Measure(op, opt.Iterations, bytes));
+		}
+	}
+	
+	//---------------------------------------------------------------------------------------------
+	// Parallel decode - a list of RECORDS wide records read by one thread, then by ParallelDecoder
+	// (the serial Scan included) on 1, 2 and 4 threads
+	private: static const size_t RECORDS = 8192;
+	
+	private: static void DecodeRecordList(Erlang::ETFReader& er)
+	{
+		UInt32 size = er.ReadList();
+		for(UInt32 i = 0; i < size; ++i)
+			DecodeRecord(er);
+		er.ReadNil();
+	}
+	
+	private: struct ParallelOp
+	{
+		public: const std::vector<byte>* pTerm;
+		public: size_t Threads; // 0 - Scan only
+		public: void operator ()(void) const
+		{
+			Erlang::ETFReader er(&(*pTerm)[0], pTerm->size(), false);
+			Erlang::ParallelDecoder pd;
+			pd.Scan(er);
+			if(Threads)
+				pd.Run(boost::bind(&DecodeRecord, _1), Threads);
+		}
+	};
+	
+	public: static void RunParallel(const Options& opt)
+	{
+		Erlang::ETFWriter ewr;
+		ewr.WriteList(RECORDS);
+		for(size_t i = 0; i < RECORDS; ++i)
+			EncodeRecord(ewr);
+		ewr.WriteNil();
+		std::vector<byte> term = ewr.ToVector<byte>();
+		size_t iterations = std::max<size_t>(BATCH_SIZE*8, opt.Iterations*64/(term.size()/64 + 64));
+		if(Selected(opt, "decode/record-list")) {
+			Corpus c;
+			c.Term = term;
+			c.Decode = DecodeRecordList;
+			DecodeOp op = { &c, false };
+			Print("decode/record-list", Measure(op, iterations, term.size()));
+		}
+		if(Selected(opt, "scan/record-list")) {
+			ParallelOp op = { &term, 0 };
+			Print("scan/record-list", Measure(op, iterations, term.size()));
+		}
+		const size_t threads[] = { 1, 2, 4 };
+		for(size_t i = 0; i < sizeof(threads)/sizeof(threads[0]); ++i) {
+			char name[64];
+			snprintf(name, sizeof(name), "parallel/record-list/%ut", (unsigned)threads[i]);
+			if(Selected(opt, name)) {
+				ParallelOp op = { &term, threads[i] };
+				Print(name, Measure(op, iterations, term.size()));
+			}
+		}
+	}
+	
+	//---------------------------------------------------------------------------------------------
+	// Byte order - WORDS big-endian numbers from an odd address into a host order array, with
+	// RWBinary::ReadArray (ByteOrder::Convert) and with ByteOrder::Load one number at a time
+	private: static const size_t WORDS = 4095;
+	
+	private: template<typename T> struct ArrayOp
+	{
+		public: const byte* pSrc;
+		public: T* pValues;
+		public: bool Bulk;
+		public: void operator ()(void) const
+		{
+			if(Bulk) {
+				RWBinary::ReadArray(pSrc, pValues, WORDS);
+				return;
+			}
+			for(size_t i = 0; i < WORDS; ++i)
+				pValues[i] = (T)ByteOrder::Load<sizeof(T)*8>(pSrc + i*sizeof(T));
+		}
+	};
+	
+	private: template<typename T> static void RunArray(const Options& opt, const std::vector<byte>& src)
+	{
+		std::vector<T> values(WORDS);
+		const char* ways[] = { "load", "convert" };
+		for(size_t i = 0; i < 2; ++i) {
+			char name[64];
+			snprintf(name, sizeof(name), "byteorder/%s-%ubit", ways[i], (unsigned)(sizeof(T)*8));
+			if(Selected(opt, name)) {
+				ArrayOp<T> op = { &src[1], &values[0], i != 0 };
+				Print(name, Measure(op, opt.Iterations, WORDS*sizeof(T)));
+			}
+		}
+	}
+	
+	public: static void RunByteOrder(const Options& opt)
+	{
+		std::vector<byte> src(1 + WORDS*sizeof(UInt64));
+		for(size_t i = 0; i < src.size(); ++i)
+			src[i] = (byte)(i*31);
+		RunArray<UInt16>(opt, src);
+		RunArray<UInt32>(opt, src);
+		RunArray<UInt64>(opt, src);
+	}
+	
+	//---------------------------------------------------------------------------------------------
+	// Stream framing - Stream is bound to fds 0 and 1, so one end of a pipe or socketpair is dup'ed
+	// over them while a helper thread plays the Erlang side on the other end.
+	private: static void Feed(int fd, const std::vector<byte>* pFrames, size_t rounds)
+	{
+		for(size_t r = 0; r < rounds; ++r) {
+			size_t wrote = 0;
+			while(wrote < pFrames->size()) {
+				ssize_t n = ::write(fd, &(*pFrames)[wrote], pFrames->size() - wrote);
+				if(n <= 0)
+					return;
+				wrote += (size_t)n;
+			}
+		}
+	}
+	
+	private: static void Drain(int fd)
+	{
+		static byte buf[1 << 16];
+		while(::read(fd, buf, sizeof(buf)) > 0)
+			;
+	}
+	
+	// {packet,2} stream of frames
+	private: static std::vector<byte> Frame(const std::vector<std::vector<byte> >& frames)
+	{
+		std::vector<byte> stream;
+		for(size_t i = 0; i < frames.size(); ++i) {
+			byte len[2];
+			RWBinary::Write(len, (UInt16)frames[i].size());
+			stream.insert(stream.end(), len, len + 2);
+			stream.insert(stream.end(), frames[i].begin(), frames[i].end());
+		}
+		return stream;
+	}
+	
+	private: static bool Channel(bool socket, int fds[2])
+	{
+		return (socket ? ::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) : ::pipe(fds)) == 0;
+	}
+	
+	private: struct Read2Op
+	{
+		public: byte* pBuffer;
+		public: bool Decode; // Also construct ETFReader, as the port loop does
+		public: void operator ()(void) const
+		{
+			ErrorInfo ei;
+			UInt16 size = Stream::Read2(pBuffer, &ei);
+			if(Decode && size) {
+				Erlang::ETFReader er(pBuffer, size, false);
+				er.GetNextTag();
+			}
+		}
+	};
+	
+	private: struct Write2Op
+	{
+		public: const std::vector<byte>* pFrame;
+		public: void operator ()(void) const
+		{
+			ErrorInfo ei;
+			Stream::Write2(&(*pFrame)[0], (UInt16)pFrame->size(), &ei);
+		}
+	};
+	
+	// Read all frames count times from fd 0
+	private: static void RunRead(const std::string& name, const std::vector<std::vector<byte> >& frames, size_t count, bool socket, bool decode)
+	{
+		int fds[2];
+		if(!Channel(socket, fds)) {
+			perror("channel");
+			return;
+		}
+		std::vector<byte> stream = Frame(frames);
+		size_t bytes = stream.size()/frames.size();
+		size_t total = count + count/10 + 1 + BATCH_SIZE; // Measure() warm up and batch rounding
+		size_t rounds = total/frames.size() + 1;
+		std::vector<byte> buffer(MAX_MESSAGE_LENGTH);
+		int in = ::dup(0);
+		::dup2(fds[0], 0);
+		boost::thread feeder(Feed, fds[1], &stream, rounds);
+		Read2Op op = { &buffer[0], decode };
+		Print(name, Measure(op, count, bytes));
+		::close(0); // Unblocks the feeder
+		::close(fds[0]);
+		feeder.join();
+		::close(fds[1]);
+		::dup2(in, 0);
+		::close(in);
+	}
+	
+	// Write frame count times to fd 1
+	private: static void RunWrite(const std::string& name, const std::vector<byte>& frame, size_t count, bool socket)
+	{
+		int fds[2];
+		if(!Channel(socket, fds)) {
+			perror("channel");
+			return;
+		}
+		int out = ::dup(1);
+		::dup2(fds[1], 1);
+		::close(fds[1]);
+		boost::thread drain(Drain, fds[0]);
+		Write2Op op = { &frame };
+		Print(name, Measure(op, count, frame.size() + 2));
+		::dup2(out, 1); // Closes the last write end, drain sees EOF
+		::close(out);
+		drain.join();
+		::close(fds[0]);
+	}
+	
+	public: static void RunFraming(const Options& opt)
+	{
+		std::vector<Corpus> corpora = Corpora();
+		const char* transport[] = { "pipe", "socketpair" };
+		for(size_t i = 0; i < corpora.size(); ++i) {
+			const Corpus& c = corpora[i];
+			size_t count = std::max<size_t>(BATCH_SIZE*8, opt.Iterations*64/(c.Term.size()/64 + 64));
+			std::vector<std::vector<byte> > frames(1, c.Term);
+			for(int t = 0; t < 2; ++t) {
+				std::string read = std::string("read2/") + transport[t] + "/" + c.Name;
+				std::string write = std::string("write2/") + transport[t] + "/" + c.Name;
+				if(Selected(opt, read))
+					RunRead(read, frames, count, t == 1, false);
+				if(Selected(opt, write))
+					RunWrite(write, c.Term, count, t == 1);
+			}
+		}
+	}
+	
+	private: struct ReplayOp
+	{
+		public: Replay* pReplay;
+		public: void operator ()(void) const
+		{
+			Replay::Frame f;
+			if(!pReplay->Next(f)) {
+				pReplay->Rewind();
+				pReplay->Next(f);
+			}
+			Erlang::ETFReader er(f.Data, f.Size, false);
+			er.SkipTerm();
+		}
+	};
+	
+	// Capture of a port (ErlPort --capture): the mapped file is walked in place, every term is
+	// read without copy and skipped over; frames from Erlang also go through Read2.
+	private: static bool RunCapture(const Options& opt)
+	{
+		std::vector<std::vector<byte> > frames;
+		size_t records = 0, bytes = 0;
+		Replay replay(opt.ReplayFile);
+		Replay::Frame f;
+		for(; replay.Next(f); ++records) {
+			if(f.Direction == Capture::In && f.Size <= MAX_MESSAGE_LENGTH)
+				frames.push_back(std::vector<byte>(f.Data, f.Data + f.Size));
+			bytes += f.Size;
+		}
+		replay.Rewind();
+		if(!records) {
+			fprintf(stderr, "%s: no frames\n", opt.ReplayFile.c_str());
+			return false;
+		}
+		fprintf(Report(), "replaying %u frames (%u from Erlang) from %s\n", (unsigned)records, (unsigned)frames.size(), opt.ReplayFile.c_str());
+		ReplayOp op = { &replay };
+		Print("replay/mmap", Measure(op, std::max(opt.Iterations, records), bytes/records));
+		if(!frames.empty()) {
+			size_t count = std::max(opt.Iterations, frames.size());
+			RunRead("replay/pipe", frames, count, false, true);
+			RunRead("replay/socketpair", frames, count, true, true);
+		}
+		return true;
+	}
+	
+	// Frames recorded from a real port ({packet,2} stream as written by Erlang, or a capture file)
+	// are read back through Read2 and ETFReader.
+	public: static bool RunReplay(const Options& opt)
+	{
+		if(Replay::IsCapture(opt.ReplayFile))
+			return RunCapture(opt);
+		FILE* f = fopen(opt.ReplayFile.c_str(), "rb");
+		if(!f) {
+			perror(opt.ReplayFile.c_str());
+			return false;
+		}
+		std::vector<std::vector<byte> > frames;
+		byte len[2];
+		while(fread(len, 1, 2, f) == 2) {
+			UInt16 size = 0;
+			RWBinary::Read(len, size);
+			std::vector<byte> frame(size);
+			if(!size || fread(&frame[0], 1, size, f) != size)
+				break;
+			frames.push_back(frame);
+		}
+		fclose(f);
+		if(frames.empty()) {
+			fprintf(stderr, "%s: no frames\n", opt.ReplayFile.c_str());
+			return false;
+		}
+		fprintf(Report(), "replaying %u frames from %s\n", (unsigned)frames.size(), opt.ReplayFile.c_str());
+		size_t count = std::max(opt.Iterations, frames.size());
+		RunRead("replay/pipe", frames, count, false, true);
+		RunRead("replay/socketpair", frames, count, true, true);
+		return true;
+	}
+	
+	public: static int Main(int argc, char* argv[])
+	{
+		Options opt;
+		for(int i = 1; i < argc; ++i) {
+			std::string arg = argv[i];
+			if(arg == "--iterations" && i + 1 < argc)
+				opt.Iterations = (size_t)strtoul(argv[++i], NULL, 10);
+			else if(arg == "--filter" && i + 1 < argc)
+				opt.Filter = argv[++i];
+			else if(arg == "--replay" && i + 1 < argc)
+				opt.ReplayFile = argv[++i];
+			else {
+				fprintf(stderr, "usage: %s [--iterations N] [--filter SUBSTRING] [--replay FILE]\n", argv[0]);
+				return 1;
+			}
+		}
+		if(!opt.Iterations)
+			opt.Iterations = 1;
+		signal(SIGPIPE, SIG_IGN); // Helper threads see EPIPE when a framing case ends
+		
+		// Keep the report on the real stdout, fds 0 and 1 get redirected while framing runs
+		Report() = fdopen(::dup(1), "w");
+		fprintf(Report(), "%-36s %12s %12s %10s %10s\n", "benchmark", "ns/op", "p99 ns/op", "MB/s", "allocs/op");
+		if(!opt.ReplayFile.empty())
+			return RunReplay(opt) ? 0 : 1;
+		RunCodec(opt);
+		RunPending(opt);
+		RunTemplate(opt);
+		RunParallel(opt);
+		RunByteOrder(opt);
+		RunFraming(opt);
+		return 0;
+	}
+};
+//-------------------------------------------------------------------------------------------------
+int main(int argc, char* argv[])
+{
+	return Bench::Main(argc, argv);
+}
@@ -0,0 +1,387 @@
+/*
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "Erlang.hpp"
+#include "TermSort.hpp"
+#include "Defines.hpp"
+
+//-------------------------------------------------------------------------------------------------
+// Known answers: results the library must share with the Erlang emulator, checked against fixed
+// tables instead of against the library itself, and the bulk byte order conversion the codec
+// builds on. Run by ctest, every wrong row is printed and the exit code is not 0 if there was one.
+class Check
+{
+	private: struct PHash2Case
+	{
+		public: const char* Term; // Erlang source, or how the encoding differs from term_to_binary
+		public: const char* Etf;  // Encoded term (with version number), hex
+		public: UInt32 Hash;      // erlang:phash2(Term, 1 bsl 32)
+	};
+	
+	private: struct OrderCase
+	{
+		public: const char* Term;
+		public: const char* Etf;
+	};
+	
+	private: struct EqualCase
+	{
+		public: const char* Terms; // A == B
+		public: const char* A;
+		public: const char* B;
+	};
+	
+	private: static std::vector<byte> Hex(const char* hex)
+	{
+		std::vector<byte> bytes;
+		for(size_t i = 0; hex[i] && hex[i + 1]; i += 2) {
+			unsigned x = 0;
+			sscanf(hex + i, "%2x", &x);
+			bytes.push_back((byte)x);
+		}
+		return bytes;
+	}
+	
+	// ETFReader::TryPHash2 of the encoded terms. Rows are what erlcheck:phash2() prints on a node
+	// (erlcheck.erl next to this file): add terms there and paste its output here. The values below
+	// were computed from make_hash2 of erts/emulator/beam/utils.c without a node at hand, to be
+	// confirmed by a run of erlcheck:phash2() (OTP 20 or later, for UTF-8 atoms).
+	private: static size_t PHash2(void)
+	{
+		static const PHash2Case cases[] =
+		{
+			// Atoms, top level (hashpjw of the name) and nested
+			{"a", "83770161", 97U},
+			{"ok", "8377026f6b", 1883U},
+			{"abcdefghijklmnopqrstuvwxyz0123456789", "8377246162636465666768696a6b6c6d6e6f707172737475767778797a30313233343536373839", 108887817U},
+			{"'caf\\x{e9}'", "837705636166c3a9", 432201U},
+			{"'caf\\x{e9}' (ATOM_EXT)", "83640004636166e9", 432201U},
+			{"'\\x{3c0}'", "837702cf80", 3440U},
+			{"{a}", "836801770161", 1365471536U},
+			{"[a]", "836c000000017701616a", 1772222576U},
+			{"[a,b]", "836c000000027701617701626a", 2079940793U},
+			{"{ok,'caf\\x{e9}'}", "83680277026f6b7705636166c3a9", 834693761U},
+			{"[[a]]", "836c000000016c000000017701616a6a", 1438717175U},
+			// Integers: small, the 28-bit boundary, bignums
+			{"0", "836100", 3175731469U},
+			{"1", "836101", 539485162U},
+			{"-1", "8362ffffffff", 1117813597U},
+			{"255", "8361ff", 715823293U},
+			{"256", "836200000100", 3929335767U},
+			{"-256", "8362ffffff00", 2771613476U},
+			{"134217727", "836207ffffff", 4273352567U},
+			{"134217728", "836208000000", 2232048528U},
+			{"-134217728", "8362f8000000", 874979335U},
+			{"-134217729", "8362f7ffffff", 3118511698U},
+			{"2147483647", "83627fffffff", 3426189386U},
+			{"-2147483648", "836280000000", 2832818325U},
+			{"2147483648", "836e040000000080", 2346888107U},
+			{"4294967296", "836e05000000000001", 3731526247U},
+			{"1 bsl 59", "836e08000000000000000008", 3334388088U},
+			{"1 bsl 63", "836e08000000000000000080", 3608783564U},
+			{"-(1 bsl 63)", "836e08010000000000000080", 710941318U},
+			{"1 bsl 64", "836e0900000000000000000001", 1365008623U},
+			{"(1 bsl 64) + 1", "836e0900010000000000000001", 1578977979U},
+			{"1 bsl 100", "836e0d0000000000000000000000000010", 2239386218U},
+			{"-(1 bsl 100)", "836e0d0100000000000000000000000010", 528873168U},
+			{"{134217728}", "8368016208000000", 2159835479U},
+			{"{-1,1 bsl 64}", "83680262ffffffff6e0900000000000000000001", 1351610722U},
+			{"1000 (SMALL_BIG_EXT)", "836e0200e803", 4226537057U},
+			// Floats
+			{"0.0", "83460000000000000000", 30973154U},
+			{"1.0", "83463ff0000000000000", 2652214599U},
+			{"-1.5", "8346bff8000000000000", 4014173997U},
+			{"3.141592653589793", "8346400921fb54442d18", 1367582626U},
+			{"1.0e300", "83467e37e43c8800759c", 2188869134U},
+			{"5.0e-324", "83460000000000000001", 3240286270U},
+			{"{1.0}", "836801463ff0000000000000", 3553992732U},
+			{"[0.5]", "836c00000001463fe00000000000006a", 1443873183U},
+			// Binaries and bitstrings
+			{"<<>>", "836d00000000", 2802362398U},
+			{"<<1>>", "836d0000000101", 2783324808U},
+			{"<<\"abc\">>", "836d00000003616263", 762000491U},
+			{"<<\"abcdefghijk\">>", "836d0000000b6162636465666768696a6b", 2173413503U},
+			{"<<\"abcdefghijkl\">>", "836d0000000c6162636465666768696a6b6c", 998851592U},
+			{"<<\"abcdefghijklm\">>", "836d0000000d6162636465666768696a6b6c6d", 2508026305U},
+			{"<<\"abcdefghijklmnopqrstuvwxy\">>", "836d000000196162636465666768696a6b6c6d6e6f70717273747576777879", 1309480805U},
+			{"<<1:1>>", "834d000000010180", 3289530339U},
+			{"<<255,3:2>>", "834d0000000202ffc0", 2657901750U},
+			{"<<\"abc\",5:3>>", "834d0000000403616263a0", 2196028055U},
+			{"{<<>>}", "8368016d00000000", 611273455U},
+			{"[<<\"x\">>]", "836c000000016d00000001786a", 1906993132U},
+			{"{a,<<\"x\">>}", "8368027701616d0000000178", 3970050631U},
+			// Strings and lists
+			{"[]", "836a", 3468870702U},
+			{"\"a\"", "836b000161", 980871114U},
+			{"\"abc\"", "836b0003616263", 3936729570U},
+			{"\"abc\" (LIST_EXT)", "836c000000036161616261636a", 3936729570U},
+			{"\"abc\" ([$a|\"bc\"])", "836c0000000161616b00026263", 3936729570U},
+			{"\"abcd\"", "836b000461626364", 1936245590U},
+			{"\"abcde\"", "836b00056162636465", 4139331593U},
+			{"\"abcde\" (LIST_EXT)", "836c00000005616161626163616461656a", 4139331593U},
+			{"[1,256,2]", "836c000000036101620000010061026a", 1131105369U},
+			{"[97,98|c]", "836c0000000261616162770163", 3194457157U},
+			{"\"ab\" ++ [a]", "836c00000003616161627701616a", 594449415U},
+			{"[a|b]", "836c00000001770161770162", 456638414U},
+			{"[[]]", "836c000000016a6a", 1267840521U},
+			{"[\"ab\",\"cd\"]", "836c000000026b000261626b000263646a", 2769690744U},
+			{"{[]}", "8368016a", 3346336000U},
+			// Tuples
+			{"{}", "836800", 3075096148U},
+			{"{1,2,3}", "836803610161026103", 48563502U},
+			{"{a,{b,{c}}}", "83680277016168027701626801770163", 3936426684U},
+			{"{1,\"ab\",<<\"ab\">>,[]}", "83680461016b000261626d0000000261626a", 1039962226U},
+			{"{1,2} (LARGE_TUPLE_EXT)", "83690000000261016102", 1069748682U},
+		};
+		size_t count = sizeof(cases)/sizeof(cases[0]), wrong = 0;
+		for(size_t i = 0; i < count; ++i) {
+			std::vector<byte> etf = Hex(cases[i].Etf);
+			Erlang::ETFReader er(&etf[0], etf.size(), false);
+			UInt32 hash = 0;
+			Erlang::ETFStatus status = er.TryPHash2(hash);
+			if(!status || hash != cases[i].Hash) {
+				printf("phash2      %s: %u, expected %u (%s)\n", cases[i].Term, hash, cases[i].Hash, status.What());
+				++wrong;
+			}
+		}
+		printf("phash2      %u terms, %u wrong\n", (unsigned)count, (unsigned)wrong);
+		return wrong;
+	}
+	
+	private: static int Compare(const std::vector<byte>& a, const std::vector<byte>& b, Erlang::ETFStatus& status)
+	{
+		Erlang::ETFReader ra(&a[0], a.size(), false), rb(&b[0], b.size(), false);
+		int order = 0;
+		status = ra.TryCompare(rb, order);
+		return order;
+	}
+	
+	// ETFReader::TryCompare and TermSort against the standard order: every term of the table is
+	// less than the ones after it, and lists:sort of the table reversed gives it back. Rows are
+	// what erlcheck:order() prints, the terms sorted by a node (the pids, ports and references of
+	// foreign nodes decoded from their bytes). Like the phash2 table, the rows below were put in
+	// order by hand from the documented term order and the emulator's compare (erl_utils.c) and
+	// are to be confirmed by a run of erlcheck:order(); funs are external ones only.
+	private: static size_t Order(void)
+	{
+		static const OrderCase cases[] =
+		{
+			// Numbers: integers against floats exactly, on both sides of 2^53
+			{"-(1 bsl 1000)", "836e7e01000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000001"},
+			{"-1.0e300", "8346fe37e43c8800759c"},
+			{"-134217729", "8362f7ffffff"},
+			{"-1", "8362ffffffff"},
+			{"0", "836100"},
+			{"0.5", "83463fe0000000000000"},
+			{"1", "836101"},
+			{"1.5", "83463ff8000000000000"},
+			{"2", "836102"},
+			{"9007199254740991", "836e0700ffffffffffff1f"},
+			{"9007199254740992.0", "83464340000000000000"},
+			{"9007199254740993", "836e070001000000000020"},
+			{"9007199254740994.0", "83464340000000000001"},
+			{"1 bsl 64", "836e0900000000000000000001"},
+			{"(1 bsl 64) + 1", "836e0900010000000000000001"},
+			{"1.0e300", "83467e37e43c8800759c"},
+			{"1 bsl 1000", "836e7e00000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000001"},
+			// Atoms: by their characters, Latin-1 and UTF-8 encodings alike
+			{"a", "83770161"},
+			{"ab", "8377026162"},
+			{"b", "83770162"},
+			{"caf", "837703636166"},
+			{"cafz", "8377046361667a"},
+			{"'caf\\x{e9}' (ATOM_EXT)", "83640004636166e9"},
+			{"'caf\\x{ff}'", "837705636166c3bf"},
+			{"'caf\\x{3c0}'", "837705636166cf80"},
+			{"z", "8377017a"},
+			// References: node, then the words from the most significant (ID[0] is the least)
+			{"#Ref<a@h.0.0.1>", "835a0003770361406800000001000000010000000000000000"},
+			{"#Ref<a@h.0.1.0>", "835a0003770361406800000001000000000000000100000000"},
+			{"#Ref<a@h.0.1.7> (NEW_REFERENCE_EXT)", "837200027703614068010000000700000001"},
+			{"#Ref<a@h.1.0.0>", "835a0003770361406800000001000000000000000000000001"},
+			{"#Ref<b@h.0.0.0>", "835a0003770362406800000001000000000000000000000000"},
+			// Funs: external funs by module, function, arity
+			{"fun lists:map/2", "837177056c6973747377036d61706102"},
+			{"fun lists:sort/1", "837177056c697374737704736f72746101"},
+			{"fun lists:sort/2", "837177056c697374737704736f72746102"},
+			{"fun maps:get/2", "837177046d61707377036765746102"},
+			// Ports
+			{"#Port<a@h.5>", "835977036140680000000500000001"},
+			{"#Port<a@h.6> (V4_PORT_EXT)", "83787703614068000000000000000600000001"},
+			{"#Port<a@h.1099511627776> (V4_PORT_EXT)", "83787703614068000001000000000000000001"},
+			{"#Port<b@h.1>", "835977036240680000000100000001"},
+			// Pids: node, then serial, then number
+			{"<a@h.5.0>", "83587703614068000000050000000000000001"},
+			{"<a@h.6.0>", "83587703614068000000060000000000000001"},
+			{"<a@h.5.1>", "83587703614068000000050000000100000001"},
+			{"<b@h.1.0>", "83587703624068000000010000000000000001"},
+			// Tuples: size, then the elements
+			{"{}", "836800"},
+			{"{b}", "836801770162"},
+			{"{a,a}", "836802770161770161"},
+			{"{a,b}", "836802770161770162"},
+			{"{1,2,3}", "836803610161026103"},
+			{"{a,a,a}", "836803770161770161770161"},
+			// Maps: size, then the keys in order (integers before floats), then the values, nested alike
+			{"#{}", "837400000000"},
+			{"#{1 => b}", "8374000000016101770162"},
+			{"#{1.0 => a}", "837400000001463ff0000000000000770161"},
+			{"#{a => #{b => 1}}", "83740000000177016174000000017701626101"},
+			{"#{a => #{b => 2}}", "83740000000177016174000000017701626102"},
+			{"#{a => #{c => 0}}", "83740000000177016174000000017701636100"},
+			{"#{a => 1,b => 2}", "83740000000277016161017701626102"},
+			// Nil, lists (STRING_EXT and LIST_EXT alike), improper tails
+			{"[]", "836a"},
+			{"[1|2]", "836c0000000161016102"},
+			{"[1]", "836b000101"},
+			{"[1,2]", "836b00020102"},
+			{"\"ab\"", "836b00026162"},
+			{"[97,98,99] (LIST_EXT)", "836c000000036161616261636a"},
+			{"\"ac\"", "836b00026163"},
+			{"[a]", "836c000000017701616a"},
+			{"[[]]", "836c000000016a6a"},
+			{"[[1]]", "836c000000016b0001016a"},
+			{"[<<>>]", "836c000000016d000000006a"},
+			// Bitstrings: bit by bit, a prefix first
+			{"<<>>", "836d00000000"},
+			{"<<0:1>>", "834d000000010100"},
+			{"<<0>>", "836d0000000100"},
+			{"<<0,1:1>>", "834d00000002010080"},
+			{"<<1,2>>", "836d000000020102"},
+			{"<<2>>", "836d0000000102"},
+			{"<<127>>", "836d000000017f"},
+			{"<<1:1>>", "834d000000010180"},
+			{"<<128>>", "836d0000000180"},
+			{"<<255>>", "836d00000001ff"},
+		};
+		static const EqualCase equal[] =
+		{
+			{"1 == 1.0", "836101", "83463ff0000000000000"},
+			{"9007199254740992 == 9007199254740992.0", "836e070000000000000020", "83464340000000000000"},
+			{"1 bsl 64 == 18446744073709551616.0", "836e0900000000000000000001", "834643f0000000000000"},
+			{"1000 (SMALL_BIG_EXT) == 1000", "836e0200e803", "8362000003e8"},
+			{"'caf\\x{e9}' (ATOM_EXT) == 'caf\\x{e9}'", "83640004636166e9", "837705636166c3a9"},
+			{"'caf\\x{e9}' (SMALL_ATOM_EXT) == 'caf\\x{e9}'", "837304636166e9", "837705636166c3a9"},
+			{"\"abc\" == [97,98,99] (LIST_EXT)", "836b0003616263", "836c000000036161616261636a"},
+			{"\"\" (STRING_EXT) == []", "836b0000", "836a"},
+			{"#{a => 1,b => 2} == #{b => 2,a => 1} (keys out of order)", "83740000000277016161017701626102", "83740000000277016261027701616101"},
+			{"#Port<a@h.5> == #Port<a@h.5> (V4_PORT_EXT)", "835977036140680000000500000001", "83787703614068000000000000000500000001"},
+			{"#Ref<a@h.0.0.7> == #Ref<a@h.7> (NEW_REFERENCE_EXT)", "835a0003770361406800000001000000070000000000000000", "8372000177036140680100000007"},
+		};
+		size_t count = sizeof(cases)/sizeof(cases[0]), pairs = sizeof(equal)/sizeof(equal[0]), wrong = 0;
+		std::vector<std::vector<byte> > terms;
+		for(size_t i = 0; i < count; ++i)
+			terms.push_back(Hex(cases[i].Etf));
+		for(size_t i = 0; i < count; ++i) {
+			for(size_t j = 0; j < count; ++j) {
+				Erlang::ETFStatus status;
+				int order = Compare(terms[i], terms[j], status);
+				int expected = (i < j ? -1 : (i > j ? 1 : 0));
+				if(!status || order != expected) {
+					printf("order       %s vs %s: %d, expected %d (%s)\n", cases[i].Term, cases[j].Term, order, expected, status.What());
+					++wrong;
+				}
+			}
+		}
+		for(size_t i = 0; i < pairs; ++i) {
+			Erlang::ETFStatus status;
+			int order = Compare(Hex(equal[i].A), Hex(equal[i].B), status);
+			if(!status || order) {
+				printf("order       %s: %d, expected 0 (%s)\n", equal[i].Terms, order, status.What());
+				++wrong;
+			}
+		}
+		
+		// The table reversed as one list, sorted
+		Erlang::ETFWriter list;
+		list.WriteList((UInt32)count);
+		for(size_t i = count; i--; )
+			list.WriteEncoded(&terms[i][1], terms[i].size() - 1);
+		list.WriteNil();
+		Erlang::ETFWriter expected;
+		expected.WriteList((UInt32)count);
+		for(size_t i = 0; i < count; ++i)
+			expected.WriteEncoded(&terms[i][1], terms[i].size() - 1);
+		expected.WriteNil();
+		Erlang::ETFReader er(list, list.BytesCount(), false);
+		Erlang::ETFWriter sorted;
+		Erlang::ETFStatus status = Erlang::TermSort::TrySort(er, sorted);
+		if(!status || sorted.BytesCount() != expected.BytesCount() || memcmp((const byte*)sorted, (const byte*)expected, expected.BytesCount())) {
+			printf("order       lists:sort of the table reversed is not the table (%s)\n", status.What());
+			++wrong;
+		}
+		printf("order       %u terms, %u equal pairs, lists:sort, %u wrong\n", (unsigned)count, (unsigned)pairs, (unsigned)wrong);
+		return wrong;
+	}
+	
+	// RWBinary::ReadArray/WriteArray (ByteOrder::Convert) against ByteOrder::Load/Store one number at
+	// a time: counts either side of the 16-byte blocks, every misalignment, and in place
+	private: template<typename T> static size_t Array(size_t& arrays)
+	{
+		const unsigned bits = sizeof(T)*8;
+		const size_t MAX_COUNT = 37;
+		size_t wrong = 0;
+		std::vector<byte> src(8 + MAX_COUNT*sizeof(T)), dst(src.size());
+		for(size_t i = 0; i < src.size(); ++i)
+			src[i] = (byte)(i*37 + 1);
+		for(size_t count = 0; count <= MAX_COUNT; ++count)
+			for(size_t offset = 0; offset < 8; ++offset, ++arrays) {
+				const byte* p = &src[offset];
+				std::vector<T> values(count + 1);
+				bool ok = (RWBinary::ReadArray(p, &values[0], count) == p + count*sizeof(T));
+				for(size_t i = 0; i < count; ++i)
+					ok = ok && (values[i] == ByteOrder::Load<sizeof(T)*8>(p + i*sizeof(T)));
+				memset(&dst[0], 0, dst.size());
+				ok = ok && (RWBinary::WriteArray(&dst[offset], &values[0], count) == &dst[offset] + count*sizeof(T));
+				ok = ok && !memcmp(&dst[offset], p, count*sizeof(T));
+				for(size_t i = 0; i < count; ++i) {
+					byte word[sizeof(T)];
+					ByteOrder::Store<sizeof(T)*8>(word, values[i]);
+					ok = ok && !memcmp(word, &dst[offset + i*sizeof(T)], sizeof(T));
+				}
+				// In place, there and back
+				ByteOrder::Convert<sizeof(T)*8>(&dst[offset], &dst[offset], count);
+				ok = ok && (!count || !memcmp(&dst[offset], &values[0], count*sizeof(T)));
+				ByteOrder::Convert<sizeof(T)*8>(&dst[offset], &dst[offset], count);
+				ok = ok && !memcmp(&dst[offset], p, count*sizeof(T));
+				if(!ok) {
+					printf("byteorder   %u bit, %u numbers at offset %u differ from Load/Store\n", bits, (unsigned)count, (unsigned)offset);
+					++wrong;
+				}
+			}
+		return wrong;
+	}
+	
+	private: static size_t Arrays(void)
+	{
+		static const byte bytes[] = { 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08 };
+		size_t wrong = 0, arrays = 0;
+		if(ByteOrder::Load<16>(bytes) != 0x0102U || ByteOrder::Load<32>(bytes) != 0x01020304UL || ByteOrder::Load<64>(bytes) != 0x0102030405060708ULL) {
+			printf("byteorder   01 02 03 04 05 06 07 08 not loaded big-endian\n");
+			++wrong;
+		}
+		wrong += Array<UInt16>(arrays);
+		wrong += Array<UInt32>(arrays);
+		wrong += Array<UInt64>(arrays);
+		printf("byteorder   %u arrays, %u wrong\n", (unsigned)arrays, (unsigned)wrong);
+		return wrong;
+	}
+	
+	public: static int Main(int, char*[])
+	{
+		size_t wrong = PHash2();
+		wrong += Order();
+		wrong += Arrays();
+		return (wrong ? 1 : 0);
+	}
+};
+//-------------------------------------------------------------------------------------------------
+int main(int argc, char* argv[])
+{
+	return Check::Main(argc, argv);
+}
@@ -0,0 +1,259 @@
+%
+%
+%
+
+-module(erlcheck).
+
+-export([phash2/0, order/0]).
+
+% Known answers of ErlCheck (Check.cpp), printed from a node as C rows to paste in its tables:
+%   erlc erlcheck.erl && erl -noshell -s erlcheck phash2 -s init stop
+%   erlc erlcheck.erl && erl -noshell -s erlcheck order -s init stop
+
+
+% {"Term", "ETF hex", erlang:phash2(Term, 1 bsl 32)} of every term of phash2_terms/0
+phash2() ->
+	lists:foreach
+	(
+		fun({Text, Term}) ->
+			Etf = etf(Term),
+			io:format("\t\t\t{\"~s\", \"~s\", ~bU},~n", [escape(Text), hex(Etf), erlang:phash2(binary_to_term(Etf), 1 bsl 32)])
+		end,
+		phash2_terms()
+	).
+
+% {Text, Term}, or {Text, {etf, Bin}} for an encoding term_to_binary does not produce
+phash2_terms() ->
+	[
+		% Atoms, top level (hashpjw of the name) and nested
+		{"a", a},
+		{"ok", ok},
+		{"abcdefghijklmnopqrstuvwxyz0123456789", abcdefghijklmnopqrstuvwxyz0123456789},
+		{"'caf\\x{e9}'", 'caf\x{e9}'},
+		{"'caf\\x{e9}' (ATOM_EXT)", {etf, <<131,100,4:16,"caf",16#e9>>}},
+		{"'\\x{3c0}'", '\x{3c0}'},
+		{"{a}", {a}},
+		{"[a]", [a]},
+		{"[a,b]", [a,b]},
+		{"{ok,'caf\\x{e9}'}", {ok,'caf\x{e9}'}},
+		{"[[a]]", [[a]]},
+		% Integers: small, the 28-bit boundary, bignums
+		{"0", 0},
+		{"1", 1},
+		{"-1", -1},
+		{"255", 255},
+		{"256", 256},
+		{"-256", -256},
+		{"134217727", 134217727},
+		{"134217728", 134217728},
+		{"-134217728", -134217728},
+		{"-134217729", -134217729},
+		{"2147483647", 2147483647},
+		{"-2147483648", -2147483648},
+		{"2147483648", 2147483648},
+		{"4294967296", 4294967296},
+		{"1 bsl 59", 1 bsl 59},
+		{"1 bsl 63", 1 bsl 63},
+		{"-(1 bsl 63)", -(1 bsl 63)},
+		{"1 bsl 64", 1 bsl 64},
+		{"(1 bsl 64) + 1", (1 bsl 64) + 1},
+		{"1 bsl 100", 1 bsl 100},
+		{"-(1 bsl 100)", -(1 bsl 100)},
+		{"{134217728}", {134217728}},
+		{"{-1,1 bsl 64}", {-1,1 bsl 64}},
+		{"1000 (SMALL_BIG_EXT)", {etf, <<131,110,2,0,16#e8,3>>}},
+		% Floats
+		{"0.0", 0.0},
+		{"1.0", 1.0},
+		{"-1.5", -1.5},
+		{"3.141592653589793", 3.141592653589793},
+		{"1.0e300", 1.0e300},
+		{"5.0e-324", 5.0e-324},
+		{"{1.0}", {1.0}},
+		{"[0.5]", [0.5]},
+		% Binaries and bitstrings
+		{"<<>>", <<>>},
+		{"<<1>>", <<1>>},
+		{"<<\"abc\">>", <<"abc">>},
+		{"<<\"abcdefghijk\">>", <<"abcdefghijk">>},
+		{"<<\"abcdefghijkl\">>", <<"abcdefghijkl">>},
+		{"<<\"abcdefghijklm\">>", <<"abcdefghijklm">>},
+		{"<<\"abcdefghijklmnopqrstuvwxy\">>", <<"abcdefghijklmnopqrstuvwxy">>},
+		{"<<1:1>>", <<1:1>>},
+		{"<<255,3:2>>", <<255,3:2>>},
+		{"<<\"abc\",5:3>>", <<"abc",5:3>>},
+		{"{<<>>}", {<<>>}},
+		{"[<<\"x\">>]", [<<"x">>]},
+		{"{a,<<\"x\">>}", {a,<<"x">>}},
+		% Strings and lists
+		{"[]", []},
+		{"\"a\"", "a"},
+		{"\"abc\"", "abc"},
+		{"\"abc\" (LIST_EXT)", {etf, <<131,108,3:32,97,97,97,98,97,99,106>>}},
+		{"\"abc\" ([$a|\"bc\"])", {etf, <<131,108,1:32,97,97,107,2:16,"bc">>}},
+		{"\"abcd\"", "abcd"},
+		{"\"abcde\"", "abcde"},
+		{"\"abcde\" (LIST_EXT)", {etf, <<131,108,5:32,97,97,97,98,97,99,97,100,97,101,106>>}},
+		{"[1,256,2]", [1,256,2]},
+		{"[97,98|c]", [97,98|c]},
+		{"\"ab\" ++ [a]", "ab" ++ [a]},
+		{"[a|b]", [a|b]},
+		{"[[]]", [[]]},
+		{"[\"ab\",\"cd\"]", ["ab","cd"]},
+		{"{[]}", {[]}},
+		% Tuples
+		{"{}", {}},
+		{"{1,2,3}", {1,2,3}},
+		{"{a,{b,{c}}}", {a,{b,{c}}}},
+		{"{1,\"ab\",<<\"ab\">>,[]}", {1,"ab",<<"ab">>,[]}},
+		{"{1,2} (LARGE_TUPLE_EXT)", {etf, <<131,105,2:32,97,1,97,2>>}}
+	].
+
+% {"Term", "ETF hex"} of order_terms/0 as lists:sort puts them, a comment between terms that are
+% ==; then {"A == B", "ETF hex", "ETF hex"} of equal_terms/0, a comment for pairs that are not
+order() ->
+	Sorted = lists:sort(fun({_, A}, {_, B}) -> term(A) =< term(B) end, order_terms()),
+	lists:foldl
+	(
+		fun({Text, Term}, Last) ->
+			Value = term(Term),
+			case Last of
+				{ok, Prev} when Prev == Value -> io:format("\t\t\t// == the term before~n");
+				_ -> ok
+			end,
+			io:format("\t\t\t{\"~s\", \"~s\"},~n", [escape(Text), hex(etf(Term))]),
+			{ok, Value}
+		end,
+		none,
+		Sorted
+	),
+	lists:foreach
+	(
+		fun({Text, A, B}) ->
+			case term(A) == term(B) of
+				true -> io:format("\t\t\t{\"~s\", \"~s\", \"~s\"},~n", [escape(Text), hex(etf(A)), hex(etf(B))]);
+				false -> io:format("\t\t\t// not equal: ~s~n", [Text])
+			end
+		end,
+		equal_terms()
+	).
+
+% {Text, Term} in any order, or {Text, {etf, Bin}} as for phash2_terms/0
+order_terms() ->
+	[
+		% Numbers: integers against floats exactly, on both sides of 2^53
+		{"-(1 bsl 1000)", -(1 bsl 1000)},
+		{"-1.0e300", -1.0e300},
+		{"-134217729", -134217729},
+		{"-1", -1},
+		{"0", 0},
+		{"0.5", 0.5},
+		{"1", 1},
+		{"1.5", 1.5},
+		{"2", 2},
+		{"9007199254740991", 9007199254740991},
+		{"9007199254740992.0", 9007199254740992.0},
+		{"9007199254740993", 9007199254740993},
+		{"9007199254740994.0", 9007199254740994.0},
+		{"1 bsl 64", 1 bsl 64},
+		{"(1 bsl 64) + 1", (1 bsl 64) + 1},
+		{"1.0e300", 1.0e300},
+		{"1 bsl 1000", 1 bsl 1000},
+		% Atoms: by their characters, Latin-1 and UTF-8 encodings alike
+		{"a", a},
+		{"ab", ab},
+		{"b", b},
+		{"caf", caf},
+		{"cafz", cafz},
+		{"'caf\\x{e9}' (ATOM_EXT)", {etf, unhex("83640004636166e9")}},
+		{"'caf\\x{ff}'", 'caf\x{ff}'},
+		{"'caf\\x{3c0}'", 'caf\x{3c0}'},
+		{"z", z},
+		% References: node, then the words from the most significant (ID[0] is the least)
+		{"#Ref<a@h.0.0.1>", {etf, unhex("835a0003770361406800000001000000010000000000000000")}},
+		{"#Ref<a@h.0.1.0>", {etf, unhex("835a0003770361406800000001000000000000000100000000")}},
+		{"#Ref<a@h.0.1.7> (NEW_REFERENCE_EXT)", {etf, unhex("837200027703614068010000000700000001")}},
+		{"#Ref<a@h.1.0.0>", {etf, unhex("835a0003770361406800000001000000000000000000000001")}},
+		{"#Ref<b@h.0.0.0>", {etf, unhex("835a0003770362406800000001000000000000000000000000")}},
+		% Funs: external funs by module, function, arity
+		{"fun lists:map/2", fun lists:map/2},
+		{"fun lists:sort/1", fun lists:sort/1},
+		{"fun lists:sort/2", fun lists:sort/2},
+		{"fun maps:get/2", fun maps:get/2},
+		% Ports
+		{"#Port<a@h.5>", {etf, unhex("835977036140680000000500000001")}},
+		{"#Port<a@h.6> (V4_PORT_EXT)", {etf, unhex("83787703614068000000000000000600000001")}},
+		{"#Port<a@h.1099511627776> (V4_PORT_EXT)", {etf, unhex("83787703614068000001000000000000000001")}},
+		{"#Port<b@h.1>", {etf, unhex("835977036240680000000100000001")}},
+		% Pids: node, then serial, then number
+		{"<a@h.5.0>", {etf, unhex("83587703614068000000050000000000000001")}},
+		{"<a@h.6.0>", {etf, unhex("83587703614068000000060000000000000001")}},
+		{"<a@h.5.1>", {etf, unhex("83587703614068000000050000000100000001")}},
+		{"<b@h.1.0>", {etf, unhex("83587703624068000000010000000000000001")}},
+		% Tuples: size, then the elements
+		{"{}", {}},
+		{"{b}", {b}},
+		{"{a,a}", {a,a}},
+		{"{a,b}", {a,b}},
+		{"{1,2,3}", {1,2,3}},
+		{"{a,a,a}", {a,a,a}},
+		% Maps: size, then the keys in order (integers before floats), then the values, nested alike
+		{"#{}", #{}},
+		{"#{1 => b}", #{1 => b}},
+		{"#{1.0 => a}", #{1.0 => a}},
+		{"#{a => #{b => 1}}", #{a => #{b => 1}}},
+		{"#{a => #{b => 2}}", #{a => #{b => 2}}},
+		{"#{a => #{c => 0}}", #{a => #{c => 0}}},
+		{"#{a => 1,b => 2}", #{a => 1,b => 2}},
+		% Nil, lists (STRING_EXT and LIST_EXT alike), improper tails
+		{"[]", []},
+		{"[1|2]", [1|2]},
+		{"[1]", [1]},
+		{"[1,2]", [1,2]},
+		{"\"ab\"", "ab"},
+		{"[97,98,99] (LIST_EXT)", {etf, unhex("836c000000036161616261636a")}},
+		{"\"ac\"", "ac"},
+		{"[a]", [a]},
+		{"[[]]", [[]]},
+		{"[[1]]", [[1]]},
+		{"[<<>>]", [<<>>]},
+		% Bitstrings: bit by bit, a prefix first
+		{"<<>>", <<>>},
+		{"<<0:1>>", <<0:1>>},
+		{"<<0>>", <<0>>},
+		{"<<0,1:1>>", <<0,1:1>>},
+		{"<<1,2>>", <<1,2>>},
+		{"<<2>>", <<2>>},
+		{"<<127>>", <<127>>},
+		{"<<1:1>>", <<1:1>>},
+		{"<<128>>", <<128>>},
+		{"<<255>>", <<255>>}
+	].
+
+% {Text, A, B} of terms that compare equal
+equal_terms() ->
+	[
+		{"1 == 1.0", 1, 1.0},
+		{"9007199254740992 == 9007199254740992.0", 9007199254740992, 9007199254740992.0},
+		{"1 bsl 64 == 18446744073709551616.0", 1 bsl 64, 18446744073709551616.0},
+		{"1000 (SMALL_BIG_EXT) == 1000", {etf, unhex("836e0200e803")}, 1000},
+		{"'caf\\x{e9}' (ATOM_EXT) == 'caf\\x{e9}'", {etf, unhex("83640004636166e9")}, 'caf\x{e9}'},
+		{"'caf\\x{e9}' (SMALL_ATOM_EXT) == 'caf\\x{e9}'", {etf, unhex("837304636166e9")}, 'caf\x{e9}'},
+		{"\"abc\" == [97,98,99] (LIST_EXT)", "abc", {etf, unhex("836c000000036161616261636a")}},
+		{"\"\" (STRING_EXT) == []", {etf, unhex("836b0000")}, []},
+		{"#{a => 1,b => 2} == #{b => 2,a => 1} (keys out of order)", #{a => 1,b => 2}, {etf, unhex("83740000000277016261027701616101")}},
+		{"#Port<a@h.5> == #Port<a@h.5> (V4_PORT_EXT)", {etf, unhex("835977036140680000000500000001")}, {etf, unhex("83787703614068000000000000000500000001")}},
+		{"#Ref<a@h.0.0.7> == #Ref<a@h.7> (NEW_REFERENCE_EXT)", {etf, unhex("835a0003770361406800000001000000070000000000000000")}, {etf, unhex("8372000177036140680100000007")}}
+	].
+
+
+term(Term) -> binary_to_term(etf(Term)).
+
+etf({etf, Bin}) -> Bin;
+etf(Term) -> term_to_binary(Term).
+
+unhex(Hex) -> << <<(list_to_integer([H, L], 16))>> || <<H, L>> <= list_to_binary(Hex) >>.
+
+hex(Bin) -> lists:flatten([io_lib:format("~2.16.0b", [X]) || <<X>> <= Bin]).
+
+escape(Text) -> lists:flatmap(fun($") -> "\\\""; ($\\) -> "\\\\"; (C) -> [C] end, Text).
@@ -6,7 +6,7 @@
 -module(client).
 -behaviour(gen_server).
 
--export([start/1, ping/0, command1/0, close/0, stop/0]).
+-export([start/1, ping/0, command1/0, metrics/0, binary/1, batch/1, scan/1, file/1, hits/1, sort/1, close/0, stop/0]).
 -export([init/1, handle_call/3, handle_cast/2, handle_info/2, terminate/2, code_change/3]).
 
 -define(SERVER, ?MODULE).
@@ -14,14 +14,24 @@
 -define(CMD_COMMAND1, 1).
 -define(CMD_PING, 2).
 -define(CMD_CLOSE, 3).
+-define(CMD_BINARY, 4). % echo, {'$shm',Offset,Size} instead of Bin needs the shared memory region (--shm)
+-define(CMD_SCAN, 6). % ErlAsync: N rows streamed as {chunk,DS,Rows}..., {done,DS,N}
+-define(CMD_FILE, 7). % ErlAsync: {file,DS,Contents}, sent by sendfile; {packet,4} for files over 64KB
+-define(CMD_HITS, 8). % ErlAsync: {hits,DS,Count}, Key is the 3rd element for --affinity 3
+-define(CMD_SORT, 9). % ErlAsync: {sorted,DS,Sorted}, as lists:sort(List); {packet,4} for long lists
+-define(CMD_METRICS, 0). % reserved by the library (Metrics::COMMAND)
+-define(TIMEOUT, 5000). % ms, sent as {'$deadline',...}; {'$cancel',DS} when no reply by then
+-define(CALL_TIMEOUT, ?TIMEOUT + 1000).
 
 -record
 (
 	state,
 	{
-		ds,			% reference() - digital sign
+		ds,			% reference() - digital sign of the command in progress, new for every command
 		cmdq,		% queue:new() - command queue
 		process_cmd,% bool() - if command is in progress
+		batch,		% [{DS,Reply | pending}] - requests of the batch in progress, undefined if none
+		chunks=[],	% [[Row]] - chunks of the scan in progress, last first
 		port		% port() - external program port
 	}
 ).
@@ -31,10 +41,41 @@ start(Args) ->
 	gen_server:start({local,?SERVER},?MODULE,Args,[]).
 
 command1() ->
-	gen_server:call(?SERVER,command1).
+	gen_server:call(?SERVER,command1,?CALL_TIMEOUT).
 
 ping() ->
-	gen_server:call(?SERVER,ping).
+	gen_server:call(?SERVER,ping,?CALL_TIMEOUT).
+
+metrics() ->
+	gen_server:call(?SERVER,metrics,?CALL_TIMEOUT).
+
+binary(Bin) when is_binary(Bin) ->
+	gen_server:call(?SERVER,{binary,Bin},?CALL_TIMEOUT).
+
+% [ping | metrics | {binary,Bin}] in one {'$batch',[...]} frame, answered in {'$batch',[...]} frames;
+% returns the replies in the order of the calls. Needs a PortServer port (ErlAsync), not ErlPort.
+batch([]) ->
+	[];
+batch(Calls) when is_list(Calls) ->
+	gen_server:call(?SERVER,{batch,Calls},?CALL_TIMEOUT).
+
+% Rows of a streamed reply; the chunks are gathered here, a consumer that can use rows early
+% would take each {chunk,DS,Rows} as it comes
+scan(N) when is_integer(N), N >= 0 ->
+	gen_server:call(?SERVER,{scan,N},?CALL_TIMEOUT).
+
+% Contents of a file of the port's host, Path is a binary or a string
+file(Path) ->
+	gen_server:call(?SERVER,{file,iolist_to_binary(Path)},?CALL_TIMEOUT).
+
+% Times Key was counted by the port; with --affinity 3 the worker of a key is
+% erlang:phash2(Key,Workers), the port hashes the encoded Key the same way
+hits(Key) ->
+	gen_server:call(?SERVER,{hits,Key},?CALL_TIMEOUT).
+
+% lists:sort(List) done by the port on the encoded terms, on several threads for long lists
+sort(List) when is_list(List) ->
+	gen_server:call(?SERVER,{sort,List},?CALL_TIMEOUT).
 
 close() ->
 	gen_server:cast(?SERVER,close).
@@ -55,6 +96,48 @@ handle_call(ping,From,State) ->
 	self() ! process_cmdq,
 	{noreply,State#state{cmdq=CmdQ2}};
 
+handle_call(metrics,From,State) ->
+	#state{cmdq=CmdQ} = State,
+	CmdQ2 = queue:in({?CMD_METRICS,From},CmdQ),
+	self() ! process_cmdq,
+	{noreply,State#state{cmdq=CmdQ2}};
+
+handle_call({binary,Bin},From,State) ->
+	#state{cmdq=CmdQ} = State,
+	CmdQ2 = queue:in({?CMD_BINARY,From,Bin},CmdQ),
+	self() ! process_cmdq,
+	{noreply,State#state{cmdq=CmdQ2}};
+
+handle_call({batch,Calls},From,State) ->
+	#state{cmdq=CmdQ} = State,
+	CmdQ2 = queue:in({batch,From,Calls},CmdQ),
+	self() ! process_cmdq,
+	{noreply,State#state{cmdq=CmdQ2}};
+
+handle_call({scan,N},From,State) ->
+	#state{cmdq=CmdQ} = State,
+	CmdQ2 = queue:in({?CMD_SCAN,From,N},CmdQ),
+	self() ! process_cmdq,
+	{noreply,State#state{cmdq=CmdQ2}};
+
+handle_call({file,Path},From,State) ->
+	#state{cmdq=CmdQ} = State,
+	CmdQ2 = queue:in({?CMD_FILE,From,Path},CmdQ),
+	self() ! process_cmdq,
+	{noreply,State#state{cmdq=CmdQ2}};
+
+handle_call({hits,Key},From,State) ->
+	#state{cmdq=CmdQ} = State,
+	CmdQ2 = queue:in({?CMD_HITS,From,Key},CmdQ),
+	self() ! process_cmdq,
+	{noreply,State#state{cmdq=CmdQ2}};
+
+handle_call({sort,List},From,State) ->
+	#state{cmdq=CmdQ} = State,
+	CmdQ2 = queue:in({?CMD_SORT,From,List},CmdQ),
+	self() ! process_cmdq,
+	{noreply,State#state{cmdq=CmdQ2}};
+
 handle_call(command1,From,State) ->
 	#state{cmdq=CmdQ} = State,
 	CmdQ2 = queue:in({?CMD_COMMAND1,From},CmdQ),
@@ -82,6 +165,21 @@ handle_info(Info,State) ->
 		process_cmdq ->
 			State2 = process_cmdq(State),
 			{noreply,State2};
+		{timeout,DS} when DS =:= State#state.ds, State#state.process_cmd, State#state.batch =/= undefined ->
+			[erlang:port_command(Port,term_to_binary({'$cancel',Ref})) || {Ref,pending} <- State#state.batch],
+			self() ! process_cmdq,
+			{{value,{batch,From,_}},CmdQ2} = queue:out(State#state.cmdq),
+			gen_server:reply(From,[batch_result(R) || {_,R} <- State#state.batch]),
+			{noreply,State#state{cmdq=CmdQ2,process_cmd=false,batch=undefined}};
+		{timeout,DS} when DS =:= State#state.ds, State#state.process_cmd ->
+			% the port drops or stops the command, a reply that is already on its way is ignored
+			erlang:port_command(Port,term_to_binary({'$cancel',DS})),
+			self() ! process_cmdq,
+			{{value,Cmd},CmdQ2} = queue:out(State#state.cmdq),
+			gen_server:reply(element(2,Cmd),{error,timeout}),
+			{noreply,State#state{cmdq=CmdQ2,process_cmd=false,chunks=[]}};
+		{timeout,_OldDS} ->
+			{noreply,State};
 		{Port,{exit_status,0}} ->
 			io:format("port exited status OK ~n",[]),
 			{stop,shutdown,State};
@@ -98,6 +196,26 @@ handle_info(Info,State) ->
 process_port_data(State,Data) ->
 	#state{ds=DS,cmdq=CmdQ} = State,
 	case (catch binary_to_term(Data,[safe])) of
+		{'$batch',Replies} when is_list(Replies), State#state.batch =/= undefined ->
+			Batch = lists:foldl(fun batch_reply/2,State#state.batch,Replies),
+			case lists:keymember(pending,2,Batch) of
+				true ->
+					{noreply,State#state{batch=Batch}};
+				false ->
+					self() ! process_cmdq,
+					{{value,{batch,From,_}},CmdQ2} = queue:out(CmdQ),
+					gen_server:reply(From,[R || {_,R} <- Batch]),
+					{noreply,State#state{cmdq=CmdQ2,process_cmd=false,batch=undefined}}
+			end;
+		{'$batch',_} ->
+			{noreply,State}; % late replies of a batch that timed out
+		{chunk,DS,Rows} when is_list(Rows) ->
+			{noreply,State#state{chunks=[Rows|State#state.chunks]}};
+		{done,DS,_Count} ->
+			self() ! process_cmdq,
+			{{value,{?CMD_SCAN,From,_}},CmdQ2} = queue:out(CmdQ),
+			gen_server:reply(From,{port_answer,lists:append(lists:reverse(State#state.chunks))}),
+			{noreply,State#state{cmdq=CmdQ2,process_cmd=false,chunks=[]}};
 		{command1,1,DS,{0,_UnicodeString}} = Answer ->
 			io:format("Got answer from Port ~p~n",[Answer]),
 			self() ! process_cmdq,
@@ -110,6 +228,44 @@ process_port_data(State,Data) ->
 			{{value,{?CMD_PING,From}},CmdQ2} = queue:out(CmdQ),
 			gen_server:reply(From,{port_answer,Answer}),
 			{noreply,State#state{cmdq=CmdQ2,process_cmd=false}};
+		{metrics,DS,{_Counters,_Gauges,_Timings}} = Answer ->
+			self() ! process_cmdq,
+			{{value,{?CMD_METRICS,From}},CmdQ2} = queue:out(CmdQ),
+			gen_server:reply(From,{port_answer,Answer}),
+			{noreply,State#state{cmdq=CmdQ2,process_cmd=false}};
+		{binary,DS,Bin} when is_binary(Bin) ->
+			self() ! process_cmdq,
+			{{value,{?CMD_BINARY,From,_}},CmdQ2} = queue:out(CmdQ),
+			gen_server:reply(From,{port_answer,Bin}),
+			{noreply,State#state{cmdq=CmdQ2,process_cmd=false}};
+		{file,DS,Bin} when is_binary(Bin) ->
+			self() ! process_cmdq,
+			{{value,{?CMD_FILE,From,_}},CmdQ2} = queue:out(CmdQ),
+			gen_server:reply(From,{port_answer,Bin}),
+			{noreply,State#state{cmdq=CmdQ2,process_cmd=false}};
+		{hits,DS,Count} when is_integer(Count) ->
+			self() ! process_cmdq,
+			{{value,{?CMD_HITS,From,_}},CmdQ2} = queue:out(CmdQ),
+			gen_server:reply(From,{port_answer,Count}),
+			{noreply,State#state{cmdq=CmdQ2,process_cmd=false}};
+		{sorted,DS,Sorted} when is_list(Sorted) ->
+			self() ! process_cmdq,
+			{{value,{?CMD_SORT,From,_}},CmdQ2} = queue:out(CmdQ),
+			gen_server:reply(From,{port_answer,Sorted}),
+			{noreply,State#state{cmdq=CmdQ2,process_cmd=false}};
+		{error,DS,Reason} -> % overloaded (admission control of PortServer) or unknown_command
+			self() ! process_cmdq,
+			{{value,Cmd},CmdQ2} = queue:out(CmdQ),
+			gen_server:reply(element(2,Cmd),{error,Reason}),
+			{noreply,State#state{cmdq=CmdQ2,process_cmd=false}};
+		U when is_tuple(U) ->
+			case [E || E <- tuple_to_list(U), is_reference(E)] of
+				[R|_] when R =/= DS ->
+					{noreply,State}; % late reply of a command that timed out
+				_ ->
+					error_logger:error_msg("handle_info couldn't decode/process port data: ~w~n",[U]),
+					{noreply,State}
+			end;
 		U ->
 			error_logger:error_msg("handle_info couldn't decode/process port data: ~w~n",[U]),
 			{noreply, State}
@@ -124,10 +280,38 @@ code_change(_OldVsn, State, _Extra) ->
 
 %%--------------------------------------------------------------------
 
+batch_cmd(ping,DS) -> {?CMD_PING,DS};
+batch_cmd(metrics,DS) -> {?CMD_METRICS,DS};
+batch_cmd({binary,Bin},DS) when is_binary(Bin) -> {?CMD_BINARY,DS,Bin}.
+
+% Reply of a batch goes to its request by the first reference in it
+batch_reply(Reply,Batch) when is_tuple(Reply) ->
+	case [E || E <- tuple_to_list(Reply), is_reference(E)] of
+		[DS|_] ->
+			case lists:keyfind(DS,1,Batch) of
+				{DS,pending} -> lists:keyreplace(DS,1,Batch,{DS,batch_answer(Reply)});
+				_ -> Batch
+			end;
+		[] ->
+			Batch
+	end;
+batch_reply(_Reply,Batch) ->
+	Batch.
+
+batch_answer({error,_DS,Reason}) -> {error,Reason};
+batch_answer({binary,_DS,Bin}) -> {port_answer,Bin};
+batch_answer(Answer) -> {port_answer,Answer}.
+
+batch_result(pending) -> {error,timeout};
+batch_result(R) -> R.
+
+%%--------------------------------------------------------------------
+
 process_cmdq(State) when State#state.process_cmd ->
 	State;
 process_cmdq(State) ->
-	#state{cmdq=CmdQ,port=Port,ds=DS} = State,
+	#state{cmdq=CmdQ,port=Port} = State,
+	DS = make_ref(),
 	Value = case queue:is_empty(CmdQ) of
 				true -> empty;
 				false -> queue:get(CmdQ)
@@ -138,20 +322,51 @@ process_cmdq(State) ->
 		{?CMD_COMMAND1,_From} ->
 			Cmd = {?CMD_COMMAND1,DS,"hi there !",'a.t.o.m',[],"",<<>>,[11025,11206,10255]},
 			io:format("Send to port ~p~n",[Cmd]),
-			CmdBin = term_to_binary(Cmd,[{compressed,0}]),
-			erlang:port_command(Port,CmdBin), % [nosuspend]
-			State#state{process_cmd=true};
+			send_cmd(State#state{ds=DS},Cmd,[{compressed,0}]);
 		{?CMD_PING,_From} ->
 			Cmd = {?CMD_PING,DS,[-1.23,<<"Чело"/utf8>>],9223372036854775807},
 			io:format("Send to port ~p~n",[Cmd]),
-			CmdBin = term_to_binary(Cmd,[{minor_version,1}]),
+			send_cmd(State#state{ds=DS},Cmd,[{minor_version,1}]);
+		{?CMD_METRICS,_From} ->
+			Cmd = {?CMD_METRICS,DS},
+			send_cmd(State#state{ds=DS},Cmd,[{minor_version,1}]);
+		{?CMD_BINARY,_From,Bin} ->
+			Cmd = {?CMD_BINARY,DS,Bin},
+			send_cmd(State#state{ds=DS},Cmd,[{minor_version,1}]);
+		{?CMD_FILE,_From,Path} ->
+			Cmd = {?CMD_FILE,DS,Path},
+			send_cmd(State#state{ds=DS},Cmd,[{minor_version,1}]);
+		{?CMD_HITS,_From,Key} ->
+			Cmd = {?CMD_HITS,DS,Key},
+			send_cmd(State#state{ds=DS},Cmd,[{minor_version,1}]);
+		{?CMD_SORT,_From,List} ->
+			Cmd = {?CMD_SORT,DS,List},
+			send_cmd(State#state{ds=DS},Cmd,[{minor_version,1}]);
+		{?CMD_SCAN,_From,N} ->
+			Cmd = {?CMD_SCAN,DS,N},
+			send_cmd(State#state{ds=DS,chunks=[]},Cmd,[{minor_version,1}]);
+		{batch,_From,Calls} ->
+			% every request has its own DS and deadline, DS of the state times the batch out
+			Cmds = [batch_cmd(Call,make_ref()) || Call <- Calls],
+			Deadline = erlang:system_time(millisecond) + ?TIMEOUT,
+			CmdBin = term_to_binary({'$batch',[{'$deadline',Deadline,Cmd} || Cmd <- Cmds]},[{minor_version,1}]),
 			erlang:port_command(Port,CmdBin), % [nosuspend]
-			State#state{process_cmd=true};
+			erlang:send_after(?TIMEOUT,self(),{timeout,DS}),
+			State#state{ds=DS,process_cmd=true,batch=[{element(2,Cmd),pending} || Cmd <- Cmds]};
 		{?CMD_CLOSE} ->
 			Cmd = {?CMD_CLOSE,DS},
 			io:format("Send to port ~p~n",[Cmd]),
 			CmdBin = term_to_binary(Cmd,[{minor_version,1}]),
 			erlang:port_command(Port,CmdBin), % [nosuspend]
-			State#state{process_cmd=true}
+			State#state{ds=DS,process_cmd=true}
 	end.
 
+% {'$deadline',DeadlineMs,Cmd}: the port drops Cmd if it gets to it after DeadlineMs (system time)
+send_cmd(State,Cmd,Opts) ->
+	#state{port=Port,ds=DS} = State,
+	Deadline = erlang:system_time(millisecond) + ?TIMEOUT,
+	CmdBin = term_to_binary({'$deadline',Deadline,Cmd},Opts),
+	erlang:port_command(Port,CmdBin), % [nosuspend]
+	erlang:send_after(?TIMEOUT,self(),{timeout,DS}),
+	State#state{process_cmd=true}.
+
@@ -0,0 +1,278 @@
+/*
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/optional.hpp>
+
+#include "IOStream.hpp"
+#include "Erlang.hpp"
+#include "Capture.hpp"
+#include "Defines.hpp"
+
+//-------------------------------------------------------------------------------------------------
+// Fuzz target of ETFReader: a frame (version number and one term) is walked by tag with the Read*
+// a port would use. Any exception is a valid answer to a broken frame; a crash, a sanitizer report
+// or a leak is not. The differential part: a frame that passed Validate is complete, so reading it
+// must not run out of the buffer and must end exactly at its end, and the Try* readers must agree
+// with the throwing ones.
+//
+// Built with clang and -DERLPORT_FUZZ=ON it is a libFuzzer target (ErlFuzz corpus/ -max_len=65536);
+// otherwise main() reads the inputs from files - single frames, or capture files (see Capture.hpp)
+// whose frames are run one by one - so AFL can drive it too (afl-fuzz -i in -o out ErlFuzz @@).
+
+// Elements of tuples, lists and maps are counted, not recursed into, as SkipTerms does
+static void Walk(Erlang::ETFReader& er)
+{
+	UInt64 terms = 1;
+	while(terms) {
+		--terms;
+		switch(er.GetNextTag()) {
+			case Erlang::SMALL_TUPLE_EXT:
+			case Erlang::LARGE_TUPLE_EXT:
+				terms += er.ReadTuple();
+				break;
+			case Erlang::LIST_EXT:
+			{
+				// A list may be a string of character codes, tried on a copy
+				try
+				{
+					Erlang::ETFReader str(er);
+					delete[] str.ReadUnicode();
+				}
+				catch(const std::exception&)
+				{
+				}
+				terms += (UInt64)er.ReadList() + 1; // Elements and the tail
+				break;
+			}
+			case Erlang::NIL_EXT:
+				er.ReadNil();
+				break;
+			case Erlang::STRING_EXT:
+				delete[] er.ReadASCII();
+				break;
+			case Erlang::ATOM_EXT:
+			case Erlang::SMALL_ATOM_EXT:
+			case Erlang::ATOM_UTF8_EXT:
+			case Erlang::SMALL_ATOM_UTF8_EXT:
+				delete[] er.ReadAtom();
+				break;
+			case Erlang::SMALL_INTEGER_EXT:
+			case Erlang::INTEGER_EXT:
+			case Erlang::NEW_FLOAT_EXT:
+			case Erlang::SMALL_BIG_EXT:
+			case Erlang::LARGE_BIG_EXT:
+				er.ReadNumber<double>();
+				break;
+			case Erlang::BINARY_EXT:
+				er.ReadBinary();
+				break;
+			case Erlang::REFERENCE_EXT:
+			case Erlang::NEW_REFERENCE_EXT:
+			case Erlang::NEWER_REFERENCE_EXT:
+				er.ReadReference();
+				break;
+			case Erlang::PID_EXT:
+			case Erlang::NEW_PID_EXT:
+				er.ReadPid();
+				break;
+			case Erlang::PORT_EXT:
+			case Erlang::NEW_PORT_EXT:
+			case Erlang::V4_PORT_EXT:
+				er.ReadPort();
+				break;
+			case Erlang::NEW_FUN_EXT:
+			case Erlang::EXPORT_EXT:
+				er.ReadFun();
+				break;
+			default: // FLOAT_EXT, BIT_BINARY_EXT, MAP_EXT, ATOM_CACHE_REF and garbage
+				er.SkipTerm();
+				break;
+		}
+	}
+}
+
+// Walk with the Try* readers, must agree with Walk on whether the frame can be read
+static Erlang::ETFStatus TryWalk(Erlang::ETFReader& er)
+{
+	Erlang::ETFStatus status;
+	UInt64 terms = 1;
+	while(terms && status) {
+		--terms;
+		switch(er.GetNextTag()) {
+			case Erlang::SMALL_TUPLE_EXT:
+			case Erlang::LARGE_TUPLE_EXT:
+			{
+				UInt32 size = 0;
+				if((status = er.TryReadTuple(size)))
+					terms += size;
+				break;
+			}
+			case Erlang::LIST_EXT:
+			{
+				UInt32 size = 0;
+				UInt16* str = NULL;
+				Erlang::ETFReader copy(er);
+				if(copy.TryReadUnicode(str))
+					delete[] str;
+				if((status = er.TryReadList(size)))
+					terms += (UInt64)size + 1;
+				break;
+			}
+			case Erlang::NIL_EXT:
+				status = er.TryReadNil();
+				break;
+			case Erlang::STRING_EXT:
+			case Erlang::ATOM_EXT:
+			case Erlang::SMALL_ATOM_EXT:
+			case Erlang::ATOM_UTF8_EXT:
+			case Erlang::SMALL_ATOM_UTF8_EXT:
+			{
+				UInt8* str = NULL;
+				if((status = (er.GetNextTag() == Erlang::STRING_EXT ? er.TryReadASCII(str) : er.TryReadAtom(str))))
+					delete[] str;
+				break;
+			}
+			case Erlang::SMALL_INTEGER_EXT:
+			case Erlang::INTEGER_EXT:
+			case Erlang::NEW_FLOAT_EXT:
+			case Erlang::SMALL_BIG_EXT:
+			case Erlang::LARGE_BIG_EXT:
+			{
+				double number = 0;
+				status = er.TryReadNumber(number);
+				break;
+			}
+			case Erlang::BINARY_EXT:
+			{
+				boost::optional<Erlang::Binary> binary;
+				status = er.TryReadBinary(binary);
+				break;
+			}
+			case Erlang::REFERENCE_EXT:
+			case Erlang::NEW_REFERENCE_EXT:
+			case Erlang::NEWER_REFERENCE_EXT:
+			{
+				boost::optional<Erlang::Reference> ref;
+				status = er.TryReadReference(ref);
+				break;
+			}
+			case Erlang::PID_EXT:
+			case Erlang::NEW_PID_EXT:
+			{
+				boost::optional<Erlang::Pid> pid;
+				status = er.TryReadPid(pid);
+				break;
+			}
+			case Erlang::PORT_EXT:
+			case Erlang::NEW_PORT_EXT:
+			case Erlang::V4_PORT_EXT:
+			{
+				boost::optional<Erlang::Port> port;
+				status = er.TryReadPort(port);
+				break;
+			}
+			case Erlang::NEW_FUN_EXT:
+			case Erlang::EXPORT_EXT:
+			{
+				boost::optional<Erlang::Fun> fun;
+				status = er.TryReadFun(fun);
+				break;
+			}
+			default:
+				status = er.TrySkipTerm();
+				break;
+		}
+	}
+	return status;
+}
+
+static void Fail(const char* what, const uint8_t* data, size_t size)
+{
+	fprintf(stderr, "ErlFuzz: %s (%u bytes)\n", what, (unsigned)size);
+	for(size_t i = 0; i < size && i < 256; ++i)
+		fprintf(stderr, "%u%s", (unsigned)data[i], (i + 1 < size ? "," : "\n"));
+	abort();
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+	Erlang::ETFStatus status;
+	Erlang::ETFReader tr(data, size, true, status); // Copy, so ASan sees the exact end of the frame
+	bool valid = (status && tr.TryValidate());
+	if(status)
+		status = TryWalk(tr);
+	
+	bool read = false;
+	size_t rest = 0;
+	try
+	{
+		Erlang::ETFReader er(data, size);
+		Walk(er);
+		read = true;
+		rest = er.RestSize();
+		if(valid && rest)
+			Fail("validated frame not read to its end", data, size);
+	}
+	catch(const std::out_of_range& e)
+	{
+		if(valid)
+			Fail(e.what(), data, size);
+	}
+	catch(const std::exception&)
+	{
+	}
+	if(read != (bool)status || (read && rest != tr.RestSize()))
+		Fail("Try* and Read* disagree", data, size);
+	if(!status && status.Offset > size)
+		Fail("error offset out of the frame", data, size);
+	return 0;
+}
+//-------------------------------------------------------------------------------------------------
+#ifndef ERLFUZZ_LIBFUZZER
+static bool ReadFile(const char* fileName, std::vector<uint8_t>& data)
+{
+	FILE* f = fopen(fileName, "rb");
+	if(!f)
+		return false;
+	uint8_t buf[65536];
+	for(size_t n = 0; (n = fread(buf, 1, sizeof(buf), f)) > 0; )
+		data.insert(data.end(), buf, buf + n);
+	fclose(f);
+	return true;
+}
+
+// ErlFuzz FILE... - runs every file (every frame of a capture file) through the target
+int main(int argc, char* argv[])
+{
+	size_t frames = 0;
+	for(int i = 1; i < argc; ++i) {
+		std::vector<uint8_t> data;
+		if(!ReadFile(argv[i], data)) {
+			fprintf(stderr, "%s: can't read\n", argv[i]);
+			return 1;
+		}
+		if(data.size() >= Capture::HEADER_SIZE && !memcmp(&data[0], Capture::Magic(), Capture::HEADER_SIZE)) {
+			Replay replay(argv[i]);
+			Replay::Frame f;
+			while(replay.Next(f)) {
+				LLVMFuzzerTestOneInput(f.Data, f.Size);
+				++frames;
+			}
+			continue;
+		}
+		LLVMFuzzerTestOneInput(data.empty() ? NULL : &data[0], data.size());
+		++frames;
+	}
+	printf("%u frames\n", (unsigned)frames);
+	return 0;
+}
+#endif /* ERLFUZZ_LIBFUZZER */
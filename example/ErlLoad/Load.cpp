@@ -0,0 +1,1076 @@
+/*
+
+*/
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/chrono.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include "IOStream.hpp"
+#include "Erlang.hpp"
+#include "PendingTable.hpp"
+#include "Cancellation.hpp"
+#include "SharedBinary.hpp"
+#include "Defines.hpp"
+
+//-------------------------------------------------------------------------------------------------
+// Log-linear latency histogram (HDR style): every power of two is split into SUB_BUCKETS linear
+// buckets, so any recorded value is kept with better than 1% precision over the full 64-bit range.
+class Histogram
+{
+	private: static const unsigned SUB_BITS = 7;
+	private: static const UInt64 SUB_BUCKETS = 1 << SUB_BITS;
+	
+	private: std::vector<UInt64> Counts_;
+	private: UInt64 Total_;
+	private: UInt64 Max_;
+	private: double Sum_;
+	
+	public: Histogram(void):
+		Counts_((64 - SUB_BITS + 1)*SUB_BUCKETS, 0),
+		Total_(0),
+		Max_(0),
+		Sum_(0)
+	{
+	}
+	
+	// Values below SUB_BUCKETS are exact, above that the top SUB_BITS + 1 bits select the bucket
+	private: static size_t Index(UInt64 value)
+	{
+		if(value < SUB_BUCKETS)
+			return (size_t)value;
+		unsigned shift = 0;
+		while((value >> shift) >= 2*SUB_BUCKETS)
+			++shift;
+		return (size_t)((shift + 1)*SUB_BUCKETS + ((value >> shift) - SUB_BUCKETS));
+	}
+	
+	// Highest value that falls into bucket
+	private: static UInt64 Value(size_t index)
+	{
+		if(index < SUB_BUCKETS)
+			return index;
+		unsigned shift = (unsigned)(index/SUB_BUCKETS - 1);
+		UInt64 sub = index % SUB_BUCKETS + SUB_BUCKETS;
+		return ((sub + 1) << shift) - 1;
+	}
+	
+	public: void Record(UInt64 value)
+	{
+		++Counts_[Index(value)];
+		++Total_;
+		Sum_ += (double)value;
+		Max_ = std::max(Max_, value);
+	}
+	
+	public: UInt64 Count(void) const
+	{
+		return Total_;
+	}
+	
+	public: UInt64 Max(void) const
+	{
+		return Max_;
+	}
+	
+	public: double Mean(void) const
+	{
+		return (Total_ ? Sum_/Total_ : 0);
+	}
+	
+	public: UInt64 Percentile(double percentile) const
+	{
+		if(!Total_)
+			return 0;
+		UInt64 rank = (UInt64)(percentile/100*Total_ + 0.5);
+		rank = std::min(std::max<UInt64>(rank, 1), Total_);
+		UInt64 seen = 0;
+		for(size_t i = 0; i < Counts_.size(); ++i) {
+			seen += Counts_[i];
+			if(seen >= rank)
+				return std::min(Value(i), Max_);
+		}
+		return Max_;
+	}
+};
+//-------------------------------------------------------------------------------------------------
+// Fake Erlang peer: spawns the port with its stdin and stdout on pipes, as open_port does, or
+// connects to the Unix domain socket of a running one, sends commands as {Command,Ref,...} and
+// matches replies by the first reference in the reply tuple.
+class Load
+{
+	private: typedef boost::chrono::steady_clock Clock;
+	private: static const size_t FRAME_SIZE = 256;
+	
+	public: struct Options
+	{
+		public: std::vector<std::string> Port; // Executable and its own arguments
+		public: std::string Connect;           // Socket of a running server instead of Port
+		public: std::string Control;           // Socket of the control lane, pinged while the load runs
+		public: UInt32 PacketSize;
+		public: double Rate;          // Requests per second, 0 - as fast as the window allows
+		public: size_t Concurrency;   // Requests in flight
+		public: size_t Requests;
+		public: double Duration;      // Seconds, overrides Requests
+		public: double Timeout;       // Seconds to wait for outstanding replies at the end
+		public: std::string Command;  // ping, command1, metrics, binary, sleep, scan, file, hits or sort
+		public: size_t BinarySize;    // Payload of binary command
+		public: UInt32 Rows;          // Of scan command
+		public: std::string File;     // Of file command, its contents are checked in replies
+		public: UInt32 Keys;          // Of hits command, request n counts key n % Keys
+		public: UInt32 Elements;      // Of sort command, the list sent
+		public: size_t Shm;           // Shared memory region for binaries, 0 - inline only
+		public: UInt32 Deadline;      // Ms, requests go as {'$deadline',...} and are cancelled when late, 0 - none
+		public: UInt32 Batch;         // Requests per {'$batch',[...]} frame, 1 - a frame each
+		public: bool PortLog;
+		
+		public: Options(void):
+			PacketSize(2),
+			Rate(0),
+			Concurrency(16),
+			Requests(100000),
+			Duration(0),
+			Timeout(5),
+			Command("ping"),
+			BinarySize(256*1024),
+			Rows(1000),
+			Keys(1024),
+			Elements(1000),
+			Shm(0),
+			Deadline(0),
+			Batch(1),
+			PortLog(false)
+		{
+		}
+	};
+	
+	private: Options Options_;
+	private: pid_t Child_;
+	private: int ToPort_;
+	private: int FromPort_;
+	
+	// Request frame: the reference ids are patched for every request
+	private: std::vector<byte> Frame_;
+	private: size_t RefOffset_;
+	private: size_t RefSize_;
+	private: size_t KeyOffset_; // Of the INTEGER_EXT value patched for hits, 0 - none
+	private: std::vector<byte> Payload_; // Binary command, checked in replies
+	private: SharedMemory* pShm_;
+	
+	private: Erlang::PendingTable<Erlang::Reference, Clock::time_point> Pending_;
+	private: boost::mutex Mutex_;
+	private: boost::condition_variable Window_;
+	private: size_t InFlight_;
+	private: UInt64 Expired_; // Cancelled by the sender when the deadline passed without a reply
+	
+	// Receiver side, owned by the receiver thread until it is joined
+	private: Histogram Latency_;
+	private: UInt64 Unmatched_;
+	private: UInt64 Errors_; // {error,DS,Reason} replies, e.g. overloaded
+	private: UInt64 BytesIn_;
+	private: Clock::time_point LastReply_;
+	private: UInt64 Corrupt_;
+	private: UInt64 SharedIn_;
+	private: UInt64 BatchesIn_;
+	private: Erlang::PendingTable<Erlang::Reference, bool> Streaming_; // Scans that sent a chunk
+	private: Histogram FirstChunk_;
+	private: UInt64 Chunks_;
+	private: UInt64 ChunkRows_;
+	
+	// Control lane pinger, owned by its thread until it is joined
+	private: Histogram Control_;
+	private: boost::atomic<bool> Done_;
+	
+	private: explicit Load(const Options& opt):
+		Options_(opt),
+		Child_(-1),
+		ToPort_(-1),
+		FromPort_(-1),
+		RefOffset_(0),
+		RefSize_(0),
+		KeyOffset_(0),
+		pShm_(NULL),
+		Pending_(opt.Concurrency*2),
+		InFlight_(0),
+		Expired_(0),
+		Unmatched_(0),
+		Errors_(0),
+		BytesIn_(0),
+		Corrupt_(0),
+		SharedIn_(0),
+		BatchesIn_(0),
+		Streaming_(opt.Concurrency*2),
+		Chunks_(0),
+		ChunkRows_(0),
+		Done_(false)
+	{
+	}
+	
+	private: ~Load(void)
+	{
+		delete pShm_;
+	}
+	
+	private: static double Seconds(Clock::duration d)
+	{
+		return boost::chrono::duration_cast<boost::chrono::duration<double> >(d).count();
+	}
+	
+	private: static UInt64 Nanoseconds(Clock::duration d)
+	{
+		return (UInt64)std::max<Int64>(0, (Int64)boost::chrono::duration_cast<boost::chrono::nanoseconds>(d).count());
+	}
+	
+	//---------------------------------------------------------------------------------------------
+	// Requests
+	
+	// NEWER_REFERENCE_EXT with three ids, as make_ref() on current OTP
+	private: static std::vector<byte> ReferenceTerm(void)
+	{
+		const char node[] = "load@localhost";
+		std::vector<byte> ref;
+		ref.push_back(Erlang::NEWER_REFERENCE_EXT);
+		ref.push_back(0);
+		ref.push_back(3);
+		ref.push_back(Erlang::SMALL_ATOM_UTF8_EXT);
+		ref.push_back((byte)(sizeof(node) - 1));
+		ref.insert(ref.end(), node, node + sizeof(node) - 1);
+		ref.resize(ref.size() + 4 + 3*4, 0); // Creation, ids
+		RWBinary::Write(&ref[ref.size() - 4], (UInt32)getpid());
+		return ref;
+	}
+	
+	// Encoded reference (without version number) to handle
+	private: static Erlang::Reference MakeReference(const byte* p, size_t size)
+	{
+		byte term[FRAME_SIZE] = { 131 };
+		if(size >= sizeof(term))
+			throw std::length_error("Invalid Reference Size");
+		memcpy(&term[1], p, size);
+		Erlang::ETFReader er(term, size + 1);
+		return er.ReadReference();
+	}
+	
+	private: static Erlang::Binary MakeBinary(const byte* p, size_t size)
+	{
+		std::vector<byte> term(1, 131);
+		term.push_back(Erlang::BINARY_EXT);
+		term.resize(term.size() + 4);
+		RWBinary::Write(&term[2], (UInt32)size);
+		term.insert(term.end(), p, p + size);
+		Erlang::ETFReader er(&term[0], term.size());
+		return er.ReadBinary();
+	}
+	
+	// {?CMD_COMMAND1,DS,"hi there !",'a.t.o.m',[],"",<<>>,"???"}, {?CMD_METRICS,DS},
+	// {?CMD_PING,DS,[-1.23,<<"Чело"/utf8>>],9223372036854775807}, as client.erl sends them, or
+	// {?CMD_BINARY,DS,Bin} (Bin is sent by BinaryFrame when it goes through shared memory),
+	// {?CMD_SLEEP,DS,1000} (ErlAsync: 1 ms of blocking work), {?CMD_SCAN,DS,Rows} (ErlAsync:
+	// streamed in {chunk,DS,[...]} frames), {?CMD_FILE,DS,Path} (ErlAsync: {file,DS,Contents}) or
+	// {?CMD_HITS,DS,Key} (ErlAsync: {hits,DS,Count}) or {?CMD_SORT,DS,List} (ErlAsync:
+	// {sorted,DS,Sorted})
+	private: void MakeFrame(void)
+	{
+		std::vector<byte> refTerm = ReferenceTerm();
+		Erlang::Reference ref = MakeReference(&refTerm[0], refTerm.size());
+		Erlang::ETFWriter ewr(FRAME_SIZE, Options_.PacketSize); // Grows if the guess is short
+		if(Options_.Command == "command1") {
+			const wchar_t unicode[] = { 11025, 11206, 10255, 0 };
+			ewr.WriteTuple(8).
+					WriteNumber(1).
+					WriteReference(ref).
+					WriteASCII("hi there !").
+					WriteAtom("a.t.o.m").
+					WriteNil().
+					WriteNil().
+					WriteBinary(MakeBinary(NULL, 0)).
+					WriteString(unicode);
+		}
+		else if(Options_.Command == "binary") {
+			Payload_.resize(Options_.BinarySize);
+			for(size_t i = 0; i < Payload_.size(); ++i)
+				Payload_[i] = (byte)(i*31 + (i >> 8));
+			ewr.WriteTuple(3).
+					WriteNumber(4).
+					WriteReference(ref);
+			if(pShm_)
+				ewr.WriteBinary(NULL, 0); // Only the reference is patched in, see BinaryFrame
+			else
+				ewr.WriteBinary(&Payload_[0], Payload_.size());
+		}
+		else if(Options_.Command == "sleep") {
+			ewr.WriteTuple(3).
+					WriteNumber(5).
+					WriteReference(ref).
+					WriteNumber(1000);
+		}
+		else if(Options_.Command == "scan") {
+			ewr.WriteTuple(3).
+					WriteNumber(6).
+					WriteReference(ref).
+					WriteNumber(Options_.Rows);
+		}
+		else if(Options_.Command == "file") {
+			ReadFile(Options_.File, Payload_);
+			ewr.WriteTuple(3).
+					WriteNumber(7).
+					WriteReference(ref).
+					WriteBinary((const byte*)Options_.File.c_str(), Options_.File.size());
+		}
+		else if(Options_.Command == "hits") {
+			ewr.WriteTuple(3).
+					WriteNumber(8).
+					WriteReference(ref).
+					WriteNumber((Int32)0); // INTEGER_EXT, the last 4 bytes of the frame
+		}
+		else if(Options_.Command == "sort") {
+			ewr.WriteTuple(3).
+					WriteNumber(9).
+					WriteReference(ref);
+			if(Options_.Elements)
+				ewr.WriteList(Options_.Elements);
+			UInt32 seed = 12345;
+			for(UInt32 i = 0; i < Options_.Elements; ++i) { // Integers, floats and atoms mixed
+				seed = seed*1103515245 + 12345;
+				Int32 value = (Int32)(seed >> 8) - (1 << 23);
+				if(i % 3 == 0)
+					ewr.WriteNumber(value);
+				else if(i % 3 == 1)
+					ewr.WriteNumber(value/7.0);
+				else {
+					char atom[16];
+					snprintf(atom, sizeof(atom), "a%d", (int)value);
+					ewr.WriteAtom(atom);
+				}
+			}
+			ewr.WriteNil();
+		}
+		else if(Options_.Command == "metrics") {
+			ewr.WriteTuple(2).
+					WriteNumber(Metrics::COMMAND).
+					WriteReference(ref);
+		}
+		else {
+			const byte chelo[] = { 0xd0, 0xa7, 0xd0, 0xb5, 0xd0, 0xbb, 0xd0, 0xbe };
+			ewr.WriteTuple(4).
+					WriteNumber(2).
+					WriteReference(ref).
+					WriteList(2).
+						WriteNumber(-1.23).
+						WriteBinary(MakeBinary(chelo, sizeof(chelo))).
+						WriteNil().
+					WriteNumber((Int64)9223372036854775807LL); // SMALL_BIG_EXT
+		}
+		const byte* p = ewr.Packet();
+		Frame_.assign(p, p + ewr.PacketSize());
+		RefSize_ = refTerm.size();
+		RefOffset_ = std::search(Frame_.begin(), Frame_.end(), refTerm.begin(), refTerm.end()) - Frame_.begin();
+		KeyOffset_ = (Options_.Command == "hits" ? Frame_.size() - 4 : 0);
+	}
+	
+	// Whole file, the payload the port must send back for it
+	private: static void ReadFile(const std::string& path, std::vector<byte>& data)
+	{
+		FILE* f = fopen(path.c_str(), "rb");
+		if(!f)
+			boost::throw_exception(std::runtime_error("Can't Read " + path));
+		byte buf[65536];
+		for(size_t n = 0; (n = fread(buf, 1, sizeof(buf), f)) > 0; )
+			data.insert(data.end(), buf, buf + n);
+		fclose(f);
+	}
+	
+	// Unique reference for request n, patched into frame
+	private: Erlang::Reference Patch(std::vector<byte>& frame, UInt64 n) const
+	{
+		byte* ids = &frame[RefOffset_ + RefSize_ - 3*4];
+		RWBinary::Write(ids, (UInt32)(n & 0x3ffff));
+		RWBinary::Write(ids + 4, (UInt32)(n >> 18));
+		return MakeReference(&frame[RefOffset_], RefSize_);
+	}
+	
+	// {?CMD_BINARY,DS,Bin} with the payload copied to shared memory, inline when the ring is full
+	private: std::vector<byte> BinaryFrame(const Erlang::Reference& ref)
+	{
+		Erlang::ETFWriter ewr(FRAME_SIZE, Options_.PacketSize);
+		ewr.WriteTuple(3).
+				WriteNumber(4).
+				WriteReference(ref);
+		Erlang::WriteBinary(ewr, *pShm_, &Payload_[0], Payload_.size());
+		const byte* p = ewr.Packet();
+		return std::vector<byte>(p, p + ewr.PacketSize());
+	}
+	
+	// {?CMD_CLOSE,DS}
+	private: std::vector<byte> CloseFrame(void) const
+	{
+		std::vector<byte> refTerm = ReferenceTerm();
+		Erlang::ETFWriter ewr(64, Options_.PacketSize);
+		ewr.WriteTuple(2).WriteNumber(3).WriteReference(MakeReference(&refTerm[0], refTerm.size()));
+		const byte* p = ewr.Packet();
+		return std::vector<byte>(p, p + ewr.PacketSize());
+	}
+	
+	// {'$deadline',DeadlineMs,Request}, DeadlineMs is the system time in ms as Erlang gives it,
+	// inMs from now
+	private: std::vector<byte> DeadlineFrame(const std::vector<byte>& frame, UInt32 inMs) const
+	{
+		const size_t header = Options_.PacketSize;
+		Int64 deadlineMs = (Int64)boost::chrono::duration_cast<boost::chrono::milliseconds>(boost::chrono::system_clock::now().time_since_epoch()).count() + inMs;
+		Erlang::ETFWriter ewr(64, Options_.PacketSize);
+		ewr.WriteTuple(3).WriteAtom(Erlang::Cancellation::DeadlineAtom()).WriteNumber(deadlineMs);
+		const byte* p = ewr.Packet();
+		std::vector<byte> wrapped(p, p + ewr.PacketSize());
+		wrapped.insert(wrapped.end(), frame.begin() + header + 1, frame.end()); // Request without version number
+		if(header == 2)
+			RWBinary::Write(&wrapped[0], (UInt16)(wrapped.size() - header));
+		else
+			RWBinary::Write(&wrapped[0], (UInt32)(wrapped.size() - header));
+		return wrapped;
+	}
+	
+	// {'$cancel',DS}
+	private: std::vector<byte> CancelFrame(const Erlang::Reference& ref) const
+	{
+		Erlang::ETFWriter ewr(64, Options_.PacketSize);
+		ewr.WriteTuple(2).WriteAtom(Erlang::Cancellation::CancelAtom()).WriteReference(ref);
+		const byte* p = ewr.Packet();
+		return std::vector<byte>(p, p + ewr.PacketSize());
+	}
+	
+	// {'$batch',[Request,...]} of the requests in items (terms without version numbers), which is emptied
+	private: bool SendBatch(std::vector<byte>& items, UInt32& count, UInt64& bytesOut)
+	{
+		if(!count)
+			return true;
+		const size_t header = Options_.PacketSize;
+		Erlang::ETFWriter ewr(64, Options_.PacketSize);
+		ewr.WriteTuple(2).WriteAtom("$batch").WriteList(count);
+		const byte* p = ewr.Packet();
+		std::vector<byte> frame(p, p + ewr.PacketSize());
+		frame.insert(frame.end(), items.begin(), items.end());
+		frame.push_back(Erlang::NIL_EXT);
+		if(header == 2)
+			RWBinary::Write(&frame[0], (UInt16)(frame.size() - header));
+		else
+			RWBinary::Write(&frame[0], (UInt32)(frame.size() - header));
+		items.clear();
+		count = 0;
+		bytesOut += frame.size();
+		return Send(&frame[0], frame.size());
+	}
+	
+	private: struct Expired
+	{
+		public: Clock::time_point Before;
+		public: std::vector<Erlang::Reference>& Refs;
+		public: Expired(Clock::time_point before, std::vector<Erlang::Reference>& refs): Before(before), Refs(refs) {}
+		public: bool operator ()(const Erlang::Reference& ref, const Clock::time_point& due) const
+		{
+			if(due >= Before)
+				return false;
+			Refs.push_back(ref);
+			return true;
+		}
+	};
+	
+	// Give up on requests due more than Deadline ms ago and tell the port, sender thread only
+	private: bool Expire(void)
+	{
+		std::vector<Erlang::Reference> refs;
+		Pending_.Sweep(Expired(Clock::now() - boost::chrono::milliseconds(Options_.Deadline), refs));
+		bool alive = true;
+		for(size_t i = 0; i < refs.size() && alive; ++i) {
+			Streaming_.Erase(refs[i]);
+			std::vector<byte> cancel = CancelFrame(refs[i]);
+			alive = Send(&cancel[0], cancel.size());
+		}
+		Expired_ += refs.size();
+		boost::mutex::scoped_lock lock(Mutex_);
+		if(InFlight_ != (size_t)-1) {
+			InFlight_ -= std::min(InFlight_, refs.size());
+			Window_.notify_all();
+		}
+		return alive;
+	}
+	
+	// Until at most limit requests are in flight (false if the port is gone or the time is out)
+	private: bool Wait(size_t limit, const Clock::time_point* pUntil)
+	{
+		boost::mutex::scoped_lock lock(Mutex_);
+		while(InFlight_ > limit && InFlight_ != (size_t)-1 && (!pUntil || Clock::now() < *pUntil)) {
+			if(Options_.Deadline) {
+				Window_.wait_for(lock, boost::chrono::milliseconds(1));
+				lock.unlock();
+				Expire();
+				lock.lock();
+			}
+			else if(pUntil)
+				Window_.wait_until(lock, *pUntil);
+			else
+				Window_.wait(lock);
+		}
+		return InFlight_ <= limit;
+	}
+	
+	//---------------------------------------------------------------------------------------------
+	// Port process
+	
+	// Unix domain socket, retried for a second while the server is starting; -1 on failure
+	private: static int ConnectTo(const std::string& path)
+	{
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+		for(int attempt = 0; attempt < 100; ++attempt) {
+			int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+			if(fd < 0)
+				break;
+			if(!::connect(fd, (struct sockaddr*)&addr, sizeof(addr)))
+				return fd;
+			::close(fd);
+			if(errno != ENOENT && errno != ECONNREFUSED)
+				break;
+			boost::this_thread::sleep_for(boost::chrono::milliseconds(10));
+		}
+		perror(path.c_str());
+		return -1;
+	}
+	
+	private: bool Connect(void)
+	{
+		ToPort_ = FromPort_ = ConnectTo(Options_.Connect);
+		return ToPort_ >= 0;
+	}
+	
+	private: bool Spawn(void)
+	{
+		if(!Options_.Connect.empty())
+			return Connect();
+		int in[2], out[2];
+		if(::pipe(in) || ::pipe(out)) {
+			perror("pipe");
+			return false;
+		}
+		std::vector<std::string> args = Options_.Port;
+		args.push_back("--packet");
+		args.push_back(Options_.PacketSize == 4 ? "4" : "2");
+		if(!Options_.PortLog)
+			args.push_back("--no-log");
+		if(pShm_) {
+			args.push_back("--shm");
+			args.push_back(pShm_->Name());
+		}
+		std::vector<char*> argv;
+		for(size_t i = 0; i < args.size(); ++i)
+			argv.push_back(const_cast<char*>(args[i].c_str()));
+		argv.push_back(NULL);
+		
+		Child_ = ::fork();
+		if(Child_ < 0) {
+			perror("fork");
+			return false;
+		}
+		if(!Child_) {
+			::dup2(in[0], 0);
+			::dup2(out[1], 1);
+			::close(in[0]);
+			::close(in[1]);
+			::close(out[0]);
+			::close(out[1]);
+			::execv(argv[0], &argv[0]);
+			perror(argv[0]);
+			_exit(127);
+		}
+		::close(in[0]);
+		::close(out[1]);
+		ToPort_ = in[1];
+		FromPort_ = out[0];
+		return true;
+	}
+	
+	private: bool Send(const byte* p, size_t size)
+	{
+		return Send(ToPort_, p, size);
+	}
+	
+	private: static bool Send(int fd, const byte* p, size_t size)
+	{
+		while(size) {
+			ssize_t n = ::write(fd, p, size);
+			if(n < 0 && errno == EINTR)
+				continue;
+			if(n <= 0)
+				return false;
+			p += n;
+			size -= (size_t)n;
+		}
+		return true;
+	}
+	
+	private: static bool ReadFully(int fd, byte* p, size_t size)
+	{
+		while(size) {
+			ssize_t n = ::read(fd, p, size);
+			if(n < 0 && errno == EINTR)
+				continue;
+			if(n <= 0)
+				return false;
+			p += n;
+			size -= (size_t)n;
+		}
+		return true;
+	}
+	
+	// {?CMD_PING,DS} over the control lane every 10 ms, one at a time, while the load runs: the
+	// latency of small frames next to the bulk ones
+	private: void Ping(void)
+	{
+		int fd = ConnectTo(Options_.Control);
+		if(fd < 0)
+			return;
+		std::vector<byte> refTerm = ReferenceTerm();
+		refTerm.back() = 0xff; // Not one of the load
+		Erlang::ETFWriter ewr(64, Options_.PacketSize);
+		ewr.WriteTuple(2).WriteNumber(2).WriteReference(MakeReference(&refTerm[0], refTerm.size()));
+		const size_t header = Options_.PacketSize;
+		std::vector<byte> buf(1 << 16);
+		while(!Done_) {
+			Clock::time_point sent = Clock::now();
+			if(!Send(fd, ewr.Packet(), ewr.PacketSize()) || !ReadFully(fd, &buf[0], header))
+				break;
+			size_t size = (header == 2 ? (size_t)ByteOrder::Load<16>(&buf[0]) : (size_t)ByteOrder::Load<32>(&buf[0]));
+			if(buf.size() < size)
+				buf.resize(size);
+			if(!ReadFully(fd, &buf[0], size))
+				break;
+			Control_.Record(Nanoseconds(Clock::now() - sent));
+			boost::this_thread::sleep_for(boost::chrono::milliseconds(10));
+		}
+		::close(fd);
+	}
+	
+	//---------------------------------------------------------------------------------------------
+	// Replies
+	
+	// First reference in the reply tuple, at any position
+	private: static bool FindReference(Erlang::ETFReader& er, Erlang::Reference*& pRef)
+	{
+		UInt32 size = er.ReadTuple();
+		for(UInt32 i = 0; i < size; ++i) {
+			UInt8 tag = er.GetNextTag();
+			if(tag == Erlang::REFERENCE_EXT || tag == Erlang::NEW_REFERENCE_EXT || tag == Erlang::NEWER_REFERENCE_EXT) {
+				pRef = new Erlang::Reference(er.ReadReference());
+				return true;
+			}
+			er.SkipTerm();
+		}
+		return false;
+	}
+	
+	// {binary,DS,Bin}: the payload came back intact, the shared block is given back
+	private: bool CheckBinary(Erlang::ETFReader& er)
+	{
+		if(!pShm_) {
+			Erlang::Binary bin = er.ReadBinary();
+			return bin.Size() - 5 == Payload_.size() && !memcmp((const byte*)bin + 5, &Payload_[0], Payload_.size());
+		}
+		SharedMemory::View v = Erlang::ReadBinary(er, *pShm_);
+		bool intact = (v.Size == Payload_.size() && !memcmp(v.Data, &Payload_[0], v.Size));
+		SharedIn_ += (v.Shared ? 1 : 0);
+		return pShm_->Release(v) && intact; // The port's lane is not to be trusted any more otherwise
+	}
+	
+	// Rest of {sorted,DS,Sorted}: Elements terms in Erlang term order
+	private: bool CheckSorted(Erlang::ETFReader& er)
+	{
+		UInt32 count = 0;
+		if(er.GetNextTag() != Erlang::NIL_EXT)
+			count = er.ReadList();
+		if(count != Options_.Elements)
+			return false;
+		const byte* pEnd = er.Buffer() + er.Tell() + er.RestSize();
+		size_t last = er.Tell();
+		er.SkipTerm();
+		for(UInt32 i = 1; i < count; ++i) {
+			size_t next = er.Tell();
+			int order = 0;
+			if(Erlang::ETFReader::CompareAt(er.Buffer() + last, pEnd, er.Buffer() + next, pEnd, order) || order > 0)
+				return false;
+			er.SkipTerm();
+			last = next;
+		}
+		er.ReadNil();
+		return true;
+	}
+	
+	// {chunk,DS,Rows} of a scan: the request stays pending until {done,DS,Count}, the first
+	// chunk is timed. False for other terms.
+	private: bool Chunk(const byte* p, size_t size, Clock::time_point now)
+	{
+		Erlang::ETFStatus status;
+		Erlang::ETFReader er(p, size, false, status);
+		UInt32 arity = 0, count = 0;
+		boost::optional<Erlang::Reference> ref;
+		if(!status || !er.ReadTagged("chunk", arity))
+			return false;
+		Clock::time_point sent;
+		bool seen = false;
+		if(arity == 3 && er.TryReadReference(ref) && er.TryReadList(count) && Pending_.Find(*ref, sent) && !Streaming_.Find(*ref, seen)) {
+			Streaming_.Insert(*ref, true);
+			FirstChunk_.Record(Nanoseconds(now - sent));
+		}
+		++Chunks_;
+		ChunkRows_ += count;
+		return true;
+	}
+	
+	private: void Reply(const byte* p, size_t size)
+	{
+		Clock::time_point now = Clock::now();
+		if(Chunk(p, size, now))
+			return;
+		Erlang::Reference* pRef = NULL;
+		Clock::time_point sent;
+		bool matched = false;
+		bool intact = true;
+		bool error = false;
+		try {
+			Erlang::ETFReader er(p, size);
+			UInt32 arity = 0;
+			error = Erlang::ETFReader(p, size, false).ReadTagged("error", arity);
+			matched = FindReference(er, pRef) && Pending_.Take(*pRef, sent);
+			if(matched && !Payload_.empty() && !error) {
+				intact = false;
+				intact = CheckBinary(er);
+			}
+			if(matched && Options_.Command == "scan" && !error) {
+				Streaming_.Erase(*pRef);
+				intact = (er.ReadNumber<UInt32>() == Options_.Rows); // {done,DS,Count}
+			}
+			if(matched && Options_.Command == "sort" && !error) {
+				intact = false;
+				intact = CheckSorted(er);
+			}
+		}
+		catch(const std::exception&) {
+		}
+		delete pRef;
+		if(!matched) {
+			++Unmatched_;
+			return;
+		}
+		Corrupt_ += (intact ? 0 : 1);
+		Errors_ += (error ? 1 : 0);
+		Latency_.Record(Nanoseconds(now - sent));
+		LastReply_ = now;
+		boost::mutex::scoped_lock lock(Mutex_);
+		--InFlight_;
+		Window_.notify_one();
+	}
+	
+	// {'$batch',[Reply,...]}: every reply is matched on its own; false for other terms
+	private: bool Replies(const byte* p, size_t size)
+	{
+		Erlang::ETFStatus status;
+		Erlang::ETFReader er(p, size, false, status);
+		UInt32 arity = 0, count = 0;
+		if(!status || !er.ReadTagged("$batch", arity))
+			return false;
+		if(arity != 2 || !er.TryReadList(count))
+			return false;
+		std::vector<byte> item(1, 131);
+		for(UInt32 i = 0; i < count; ++i) {
+			size_t pos = er.Tell();
+			if(!er.TrySkipTerm())
+				break;
+			item.resize(1);
+			item.insert(item.end(), p + pos, p + er.Tell());
+			Reply(&item[0], item.size());
+		}
+		++BatchesIn_;
+		return true;
+	}
+	
+	// Buffered {packet,N} reader, runs until the port closes its stdout
+	private: void Receive(void)
+	{
+		std::vector<byte> buf(1 << 16);
+		size_t begin = 0, end = 0;
+		const size_t header = Options_.PacketSize;
+		while(true) {
+			while(end - begin >= header) {
+				UInt16 size16 = 0;
+				UInt32 size32 = 0;
+				if(header == 2)
+					RWBinary::Read(&buf[begin], size16);
+				else
+					RWBinary::Read(&buf[begin], size32);
+				size_t size = (header == 2 ? (size_t)size16 : (size_t)size32);
+				if(end - begin < header + size)
+					break;
+				if(!Replies(&buf[begin + header], size))
+					Reply(&buf[begin + header], size);
+				BytesIn_ += header + size;
+				begin += header + size;
+			}
+			if(begin == end)
+				begin = end = 0;
+			else if(begin) {
+				memmove(&buf[0], &buf[begin], end - begin);
+				end -= begin;
+				begin = 0;
+			}
+			if(buf.size() - end < 4096)
+				buf.resize(buf.size()*2);
+			ssize_t n = ::read(FromPort_, &buf[end], buf.size() - end);
+			if(n < 0 && errno == EINTR)
+				continue;
+			if(n <= 0)
+				break;
+			end += (size_t)n;
+		}
+		boost::mutex::scoped_lock lock(Mutex_);
+		InFlight_ = (size_t)-1; // Port is gone, unblock sender
+		Window_.notify_all();
+	}
+	
+	//---------------------------------------------------------------------------------------------
+	private: void Print(UInt64 sent, UInt64 sharedOut, double elapsed, UInt64 bytesOut, int status)
+	{
+		const double us = 1000.0;
+		UInt64 received = Latency_.Count();
+		printf("port        %s ({packet,%u}, %s)\n", (Options_.Connect.empty() ? Options_.Port[0] : Options_.Connect).c_str(), (unsigned)Options_.PacketSize, Options_.Command.c_str());
+		printf("requests    %llu sent, %llu replied (%llu errors), %llu expired, %llu lost, %llu unmatched\n", (unsigned long long)sent, (unsigned long long)received,
+			(unsigned long long)Errors_, (unsigned long long)Expired_, (unsigned long long)(sent - std::min(sent, received + Expired_)), (unsigned long long)Unmatched_);
+		if(Options_.Batch > 1)
+			printf("batches     %u requests per frame, %llu reply frames\n", (unsigned)Options_.Batch, (unsigned long long)BatchesIn_);
+		if(!Payload_.empty())
+			printf("binaries    %llu bytes, %llu corrupt, %llu sent and %llu replied in shared memory\n", (unsigned long long)Payload_.size(),
+				(unsigned long long)Corrupt_, (unsigned long long)sharedOut, (unsigned long long)SharedIn_);
+		printf("throughput  %.0f req/s, %.2f MB/s out, %.2f MB/s in (%.3f s)\n", received/elapsed, bytesOut/elapsed/1e6, BytesIn_/elapsed/1e6, elapsed);
+		printf("latency us  mean %.1f, p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n", Latency_.Mean()/us,
+			Latency_.Percentile(50)/us, Latency_.Percentile(90)/us, Latency_.Percentile(99)/us, Latency_.Percentile(99.9)/us, Latency_.Max()/us);
+		printf("\n%12s %12s %12s\n", "value us", "percentile", "count");
+		const double percentiles[] = { 0, 25, 50, 75, 90, 95, 99, 99.5, 99.9, 99.99, 99.999, 100 };
+		for(size_t i = 0; i < sizeof(percentiles)/sizeof(percentiles[0]); ++i)
+			printf("%12.1f %12.3f %12llu\n", Latency_.Percentile(percentiles[i])/us, percentiles[i], (unsigned long long)(percentiles[i]/100*received + 0.5));
+		if(Chunks_)
+			printf("chunks      %llu frames, %llu rows, first chunk us p50 %.1f, p99 %.1f\n", (unsigned long long)Chunks_, (unsigned long long)ChunkRows_,
+				FirstChunk_.Percentile(50)/us, FirstChunk_.Percentile(99)/us);
+		if(Control_.Count())
+			printf("control us  %llu pings, p50 %.1f, p99 %.1f, max %.1f\n", (unsigned long long)Control_.Count(),
+				Control_.Percentile(50)/us, Control_.Percentile(99)/us, Control_.Max()/us);
+		if(status)
+			printf("\nport exit status %d\n", status);
+	}
+	
+	// Open loop when Rate is set: request n is due at start + n/Rate and its latency is measured
+	// from that time, so a stalled port is charged for the requests it held back.
+	private: int Run(void)
+	{
+		if(Options_.Shm && Options_.Command == "binary") {
+			char name[64];
+			snprintf(name, sizeof(name), "/erlload.%d", (int)getpid());
+			pShm_ = new SharedMemory(name, Options_.Shm);
+		}
+		MakeFrame();
+		if(RefOffset_ + RefSize_ > Frame_.size() || !Spawn())
+			return 1;
+		boost::thread receiver(&Load::Receive, this);
+		boost::thread pinger;
+		if(!Options_.Control.empty())
+			pinger = boost::thread(&Load::Ping, this);
+		
+		std::vector<byte> frame = Frame_;
+		Clock::time_point start = Clock::now();
+		Clock::time_point stop = start + boost::chrono::duration_cast<Clock::duration>(boost::chrono::duration<double>(Options_.Duration));
+		UInt64 sent = 0, sharedOut = 0, bytesOut = 0;
+		std::vector<byte> items; // Of the batch being gathered
+		UInt32 batched = 0;
+		const size_t header = Options_.PacketSize;
+		bool alive = true;
+		while(alive && (Options_.Duration > 0 ? Clock::now() < stop : sent < Options_.Requests)) {
+			Clock::time_point due = Clock::now();
+			if(Options_.Rate > 0)
+				due = start + boost::chrono::duration_cast<Clock::duration>(boost::chrono::duration<double>(sent/Options_.Rate));
+			
+			// A batch goes before the sender waits, for the window or for the next request to be due
+			bool full = false;
+			if(batched) {
+				boost::mutex::scoped_lock lock(Mutex_);
+				full = (InFlight_ >= Options_.Concurrency);
+			}
+			if(batched && (full || Clock::now() < due))
+				alive = SendBatch(items, batched, bytesOut);
+			if(Options_.Rate > 0)
+				boost::this_thread::sleep_until(due);
+			if(!alive || !Wait(Options_.Concurrency - 1, NULL))
+				break;
+			{
+				boost::mutex::scoped_lock lock(Mutex_);
+				if(InFlight_ == (size_t)-1)
+					break;
+				++InFlight_;
+			}
+			if(Options_.Rate <= 0)
+				due = Clock::now();
+			Erlang::Reference ref = Patch(frame, sent);
+			if(KeyOffset_)
+				RWBinary::Write(&frame[KeyOffset_], (UInt32)(sent % Options_.Keys));
+			if(!Pending_.Insert(ref, due)) {
+				fprintf(stderr, "pending table is full\n");
+				break;
+			}
+			// The first request always goes wrapped (due after the drain timeout without --deadline), so
+			// every run takes the port through unwrapping a deadline
+			if(pShm_ || Options_.Deadline || !sent) {
+				std::vector<byte> built;
+				try {
+					built = (pShm_ ? BinaryFrame(ref) : frame);
+				}
+				catch(const std::exception& e) {
+					fprintf(stderr, "%s (shared memory is full, use --packet 4)\n", e.what());
+					Pending_.Take(ref, due);
+					break;
+				}
+				sharedOut += (pShm_ && built.size() < Payload_.size() ? 1 : 0);
+				if(Options_.Deadline || !sent)
+					built = DeadlineFrame(built, Options_.Deadline ? Options_.Deadline : (UInt32)(Options_.Timeout*1000) + 1000);
+				if(Options_.Batch > 1)
+					items.insert(items.end(), built.begin() + header + 1, built.end());
+				else {
+					alive = Send(&built[0], built.size());
+					bytesOut += built.size();
+				}
+			}
+			else if(Options_.Batch > 1)
+				items.insert(items.end(), frame.begin() + header + 1, frame.end());
+			else {
+				alive = Send(&frame[0], frame.size());
+				bytesOut += frame.size();
+			}
+			// {packet,2} frames end at 64KB, the next request might not fit
+			if(Options_.Batch > 1 && (++batched == Options_.Batch || (header == 2 && items.size() + frame.size() > 0xffff - 64)))
+				alive = SendBatch(items, batched, bytesOut);
+			++sent;
+		}
+		if(alive)
+			SendBatch(items, batched, bytesOut);
+		
+		// Drain outstanding replies, then ask the port to close
+		Clock::time_point until = Clock::now() + boost::chrono::duration_cast<Clock::duration>(boost::chrono::duration<double>(Options_.Timeout));
+		Wait(0, &until);
+		Done_ = true;
+		if(pinger.joinable())
+			pinger.join();
+		std::vector<byte> close = CloseFrame();
+		Send(&close[0], close.size());
+		if(ToPort_ == FromPort_)
+			::shutdown(ToPort_, SHUT_WR); // Server closes its end when the replies are out
+		else
+			::close(ToPort_);
+		receiver.join();
+		::close(FromPort_);
+		int status = 0;
+		if(Child_ > 0)
+			::waitpid(Child_, &status, 0);
+		
+		Clock::time_point last = (Latency_.Count() ? LastReply_ : Clock::now());
+		Print(sent, sharedOut, std::max(Seconds(last - start), 1e-9), bytesOut, WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+		// Late replies to expired requests are unmatched, not an error with --deadline
+		return (Latency_.Count() + Expired_ == sent && (!Unmatched_ || Options_.Deadline) && !Corrupt_ ? 0 : 2);
+	}
+	
+	public: static int Main(int argc, char* argv[])
+	{
+		Options opt;
+		int i = 1;
+		for(; i < argc && argv[i][0] == '-'; ++i) {
+			std::string arg = argv[i];
+			bool value = (i + 1 < argc);
+			if(arg == "--packet" && value)
+				opt.PacketSize = (strtoul(argv[++i], NULL, 10) == 4 ? 4 : 2);
+			else if(arg == "--rate" && value)
+				opt.Rate = strtod(argv[++i], NULL);
+			else if(arg == "--concurrency" && value)
+				opt.Concurrency = std::max<size_t>(1, (size_t)strtoul(argv[++i], NULL, 10));
+			else if(arg == "--requests" && value)
+				opt.Requests = (size_t)strtoul(argv[++i], NULL, 10);
+			else if(arg == "--duration" && value)
+				opt.Duration = strtod(argv[++i], NULL);
+			else if(arg == "--timeout" && value)
+				opt.Timeout = strtod(argv[++i], NULL);
+			else if(arg == "--command" && value && (std::string(argv[i + 1]) == "ping" || std::string(argv[i + 1]) == "command1" ||
+					std::string(argv[i + 1]) == "metrics" || std::string(argv[i + 1]) == "binary" || std::string(argv[i + 1]) == "sleep" ||
+					std::string(argv[i + 1]) == "scan" || std::string(argv[i + 1]) == "file" || std::string(argv[i + 1]) == "hits" ||
+					std::string(argv[i + 1]) == "sort"))
+				opt.Command = argv[++i];
+			else if(arg == "--binary-size" && value)
+				opt.BinarySize = std::max<size_t>(1, (size_t)strtoul(argv[++i], NULL, 10));
+			else if(arg == "--rows" && value)
+				opt.Rows = (UInt32)strtoul(argv[++i], NULL, 10);
+			else if(arg == "--file" && value) {
+				char* path = realpath(argv[++i], NULL); // The server may run elsewhere
+				opt.File = (path ? path : argv[i]);
+				free(path);
+			}
+			else if(arg == "--keys" && value)
+				opt.Keys = std::max<UInt32>(1, (UInt32)strtoul(argv[++i], NULL, 10));
+			else if(arg == "--elements" && value)
+				opt.Elements = (UInt32)strtoul(argv[++i], NULL, 10);
+			else if(arg == "--shm" && value)
+				opt.Shm = (size_t)strtoull(argv[++i], NULL, 10);
+			else if(arg == "--deadline" && value)
+				opt.Deadline = (UInt32)strtoul(argv[++i], NULL, 10);
+			else if(arg == "--batch" && value)
+				opt.Batch = std::max<UInt32>(1, (UInt32)strtoul(argv[++i], NULL, 10));
+			else if(arg == "--port-log")
+				opt.PortLog = true;
+			else if(arg == "--connect" && value)
+				opt.Connect = argv[++i];
+			else if(arg == "--control" && value)
+				opt.Control = argv[++i];
+			else
+				break;
+		}
+		if((opt.Connect.empty() && i >= argc) || (i < argc && argv[i][0] == '-') || (!opt.Connect.empty() && opt.Shm) || (opt.Command == "file" && opt.File.empty())) {
+			fprintf(stderr, "usage: %s [--packet 2|4] [--rate REQ/S] [--concurrency N] [--requests N | --duration S]\n"
+				"          [--timeout S] [--command ping|command1|metrics|binary|sleep|scan|file|hits|sort] [--binary-size BYTES]\n"
+				"          [--rows N] [--file PATH] [--keys N] [--elements N] [--shm BYTES] [--deadline MS] [--batch N] [--port-log] [--control PATH] PORT [PORT ARGS...]\n"
+				"       %s [options but --shm] --connect PATH\n", argv[0], argv[0]);
+			return 1;
+		}
+		opt.Port.assign(argv + i, argv + argc);
+		signal(SIGPIPE, SIG_IGN); // Port death shows up as EPIPE
+		try {
+			Load load(opt);
+			return load.Run();
+		}
+		catch(const std::exception& e) {
+			fprintf(stderr, "%s\n", e.what());
+			return 1;
+		}
+	}
+};
+//-------------------------------------------------------------------------------------------------
+int main(int argc, char* argv[])
+{
+	return Load::Main(argc, argv);
+}
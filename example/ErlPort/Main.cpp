@@ -3,16 +3,33 @@
 */
 
 #include <sys/stat.h>
+#ifdef _WIN32
 #include <crtdbg.h>
 #include <eh.h>
-#include <fstream>
+#endif
+#include <string.h>
+#include <algorithm>
+#include <exception>
+#include <string>
+#include <vector>
+
+#include <boost/optional.hpp>
 
 #include "IOStream.hpp"
 #include "Erlang.hpp"
+#include "ETFTemplate.hpp"
+#include "Logger.hpp"
+#include "SharedBinary.hpp"
+#include "Capture.hpp"
+#include "Cancellation.hpp"
 #include "Defines.hpp"
 
 class Application
 {
+	private: static UInt32 PacketSize_; // {packet,2} or {packet,4}
+	private: static bool Logging_;
+	private: static SharedMemory* pShm_; // --shm, bulk binaries of command 4
+	
 	private: Application(void)
 	{
 	}
@@ -20,45 +37,109 @@ class Application
 	private: static void unexpected_function(void)
 	{
 		Log("An Unexpected Exception! Terminate!");
-		terminate();
+		Terminate();
 	}
 	
+	// Queued for the background thread of Logger, written to Log.txt in batches
 	private: template<typename T> static void Log(const T& s)
 	{
-		std::wofstream OFStream;
-		try
-		{
-			OFStream.open(L"Log.txt", std::ios::app);
-			OFStream<<s<<L"\n";
-			OFStream.flush();
-			OFStream.close();
-		}
-		catch(...)
-		{
-			OFStream.flush();
-			OFStream.close();
-			std::cerr<<"Log Error";
-		}
+		LOG_INFO("{}", s);
+	}
+	
+	// Write what is logged before the process dies
+	private: static void Terminate(void)
+	{
+		Capture::Stop();
+		Logger::Stop();
+		std::terminate();
 	}
 	
-	public: static void Initialize(int argc, wchar_t* argv[])
+	// {command1,N,DS,{Ret,"Unicode String"}} - encoded once, holes: 0 - N, 1 - DS, 2 - Ret
+	private: static const Erlang::ETFTemplate& Command1Reply(void)
 	{
-		(void)(argc);
-		(void)(argv);
+		static Erlang::ETFTemplate t;
+		if(!t.HolesCount())
+			t.WriteTuple(4).
+				WriteAtom("command1").
+				IntegerHole().
+				ReferenceHole().
+				WriteTuple(2).
+					IntegerHole().
+					WriteString(L"Unicode String");
+		return t;
+	}
+	
+	// Options: --packet 2|4 (as in open_port), --no-log, --shm NAME (region created by the peer),
+	// --capture FILE (frames in and out appended for Replay)
+	public: template<typename T> static void Initialize(int argc, T* argv[])
+	{
+		std::string shmName, captureName;
+		for(int i = 1; i < argc; ++i) {
+			std::basic_string<T> arg(argv[i]);
+			if(arg.size() == 8 && std::equal(arg.begin(), arg.end(), "--packet") && i + 1 < argc)
+				PacketSize_ = (argv[++i][0] == '4' ? 4 : 2);
+			else if(arg.size() == 8 && std::equal(arg.begin(), arg.end(), "--no-log"))
+				Logging_ = false;
+			else if(arg.size() == 5 && std::equal(arg.begin(), arg.end(), "--shm") && i + 1 < argc) {
+				std::basic_string<T> name(argv[++i]);
+				shmName.assign(name.begin(), name.end());
+			}
+			else if(arg.size() == 9 && std::equal(arg.begin(), arg.end(), "--capture") && i + 1 < argc) {
+				std::basic_string<T> name(argv[++i]);
+				captureName.assign(name.begin(), name.end());
+			}
+		}
+#ifdef _WIN32
 		set_unexpected(unexpected_function);
+#endif /* _WIN32 */
+		if(Logging_)
+			Logger::Start("Log.txt");
+		if(!shmName.empty()) {
+			try
+			{
+				pShm_ = new SharedMemory(shmName);
+			}
+			catch(const std::exception& e)
+			{
+				Log("Can't Open Shared Memory :");
+				Log(e.what());
+				Terminate();
+			}
+		}
+		if(!captureName.empty() && !Capture::Start(captureName.c_str()))
+			Log("Can't Open Capture File");
 		Stream::SetMode(Stream::StdIn, Stream::Binary);
 		Stream::SetMode(Stream::StdOut, Stream::Binary);
 	}
 	
+	private: static UInt32 Read(std::vector<byte>& buf, ErrorInfo* pErrorInfo)
+	{
+		if(PacketSize_ == 4)
+			return Stream::Read4(buf, pErrorInfo);
+		return Stream::Read2(&buf[0], pErrorInfo);
+	}
+	
+	private: static void Write(const byte* pBuf, size_t size, ErrorInfo* pErrorInfo)
+	{
+		if(PacketSize_ == 4)
+			Stream::Write4(pBuf, (UInt32)size, pErrorInfo);
+		else if(size <= MAX_MESSAGE_LENGTH)
+			Stream::Write2(pBuf, (UInt16)size, pErrorInfo);
+		else {
+			Log("Reply Too Long For {packet,2}");
+			Terminate();
+		}
+	}
+	
 	public: static int Run(void)
 	{
+		std::vector<byte> Buffer(MAX_MESSAGE_LENGTH);
 		while(true)
 		{
 			ErrorInfo rei;
-			byte Buffer[MAX_MESSAGE_LENGTH] = { 0 };
 			
 			// Suspend While Read Buffer
-			UInt16 size = Stream::Read2(Buffer, &rei); 
+			UInt32 size = Read(Buffer, &rei);
 			
 			// Port Closed
 			if(!rei.WasError && !rei.ReturnValue && !rei.ErrorCode && !size) {
@@ -67,15 +148,35 @@ class Application
 			}
 			// An Error Occured!!!
 			else if(rei.WasError || rei.ErrorCode || !size) {
-				Log("An IO Runtime Error Occured While Read Stream");
-				terminate();
+				Log(rei.ErrorCode == EMSGSIZE ? "Frame Too Long" : "An IO Runtime Error Occured While Read Stream");
+				Terminate();
 			}
 			
 			// Read the Command Id and DS (Digital Sign)
-			Erlang::ETFReader er(Buffer, size);
-			unsigned tupleSize = er.ReadTuple();
-			int command = er.ReadNumber<int>();
-			Erlang::Reference ds = er.ReadReference();
+			Metrics::Timer timer;
+			Erlang::ETFReader er(&Buffer[0], size, false);
+			
+			// Commands run one at a time, {'$cancel',DS} comes after the reply and has nothing to stop.
+			// A command that waited in the pipe past its {'$deadline',...} is dropped without a reply.
+			UInt32 arity = 0;
+			if(er.ReadTagged(Erlang::Cancellation::CancelAtom(), arity))
+				continue;
+			Int64 deadlineMs = Erlang::Cancellation::ReadDeadline(er);
+			if(deadlineMs >= 0 && Erlang::CancelToken::Create(deadlineMs).Cancelled()) {
+				Metrics::Add(Metrics::Cancelled);
+				continue;
+			}
+			UInt32 tupleSize = 0;
+			int command = -1;
+			boost::optional<Erlang::Reference> optDS;
+			Erlang::ETFStatus status;
+			if(!(status = er.TryReadTuple(tupleSize)) || !(status = er.TryReadNumber(command)) || !(status = er.TryReadReference(optDS))) {
+				Log("Not a Command, Skipped :");
+				Log(status.What());
+				Log(status.Offset);
+				continue;
+			}
+			const Erlang::Reference& ds = *optDS;
 			
 			if(command == 1)
 			{
@@ -85,54 +186,51 @@ class Application
 				long ret = 0;
 				try
 				{
-					UInt8 tag = er.GetNextTag();
 					void* p = (void*)er.ReadASCII();
 					Log("Got ascii string from command 1 :");
 					Log((char*)p);
-					delete[] p;
-
+					delete[] (UInt8*)p;
+					
 					p = er.ReadAtom();
 					Log("Got atom from command 1 :");
 					Log((char*)p);
-					delete[] p;
-
+					delete[] (UInt8*)p;
+					
 					er.ReadNil();
 					Log("Got empty list from command 1");
-
+					
 					er.ReadNil();
 					Log("Got empty string from command 1");
-
+					
 					Erlang::Binary emptyBinary = er.ReadBinary();
 					Log("Got empty bynary, size :");
 					Log(emptyBinary.Size() - 5);
-
+					
 					p = (void*)er.ReadUnicode();
 					Log("Got unocode string from command 1 :");
-					Log((int)(((wchar_t*)p)[0])); // 11025
-					Log((int)(((wchar_t*)p)[1])); // 11206
-					Log((int)(((wchar_t*)p)[0])); // 10255
-					delete[] p;
+					Log((int)(((UInt16*)p)[0])); // 11025
+					Log((int)(((UInt16*)p)[1])); // 11206
+					Log((int)(((UInt16*)p)[2])); // 10255
+					delete[] (UInt16*)p;
 				}
 				catch(const std::exception& e)
 				{
 					Log("An Exception When Read Command 1");
 					Log(e.what());
 					// NOTE: Use er.ToVector<int>() to check bytes were read
-					terminate();
+					Terminate();
 				}
-				Erlang::ETFWriter ewr; // {command1,1,DS,{0,"Unicode String"}}
-				ewr.WriteTuple(4).
-						WriteAtom("command1").
-						WriteNumber(command).
-						WriteReference(ds).
-						WriteTuple(2).
-							WriteNumber(ret).
-							WriteString(L"Unicode String");
-				Stream::Write2(ewr, (UInt16)ewr.BytesCount(), &ei);
+				timer.Record(Metrics::Decode, command);
+				static Erlang::ETFInstance ewr(Command1Reply()); // {command1,1,DS,{0,"Unicode String"}}
+				ewr.Reset().SetNumber(0, command).
+						SetReference(1, ds).
+						SetNumber(2, ret);
+				timer.Record(Metrics::Encode, command);
+				Write(ewr, ewr.BytesCount(), &ei);
 				if(ei.WasError || ei.ErrorCode) {
 					// NOTE: Use ewr.ToVector<int>() to check bytes were written
 					Log("IO Error When Command 1");
-					terminate();
+					Terminate();
 				}
 			}
 			else if(command == 2)
@@ -144,18 +242,19 @@ class Application
 				Log("Got value from command 2 :");
 				Log(*((double*)&value));
 				Erlang::Binary p = er.ReadBinary();
-				std::wstring wstr((const wchar_t*)((const byte*)(p) + 5), (p.Size() - 5)/2);
+				std::wstring wstr((const wchar_t*)((const byte*)(p) + 5), (p.Size() - 5)/sizeof(wchar_t));
 				Log("Got utf8 binary from command 2 :");
 				Log(wstr.c_str());
 				er.ReadNil(); // read end of list
 				Int64 bigValue = er.ReadNumber<Int64>();
 				Log("Got big value from command 2 :");
 				Log(bigValue);
-
+				timer.Record(Metrics::Decode, command);
+				
 				byte buf[] = {131,109,0,0,0,0};
 				Erlang::ETFReader er(buf, sizeof(buf)/sizeof(buf[0]));
 				Erlang::Binary emptyBinary = er.ReadBinary();
-
+				
 				ErrorInfo ei;
 				Erlang::ETFWriter ewr; // {'pi.ng',[{value,"ASCII string","",<<>>,[]},-123.456],2,DS,pong}
 				ewr.WriteTuple(5).
@@ -173,11 +272,57 @@ class Application
 						WriteNumber(command).
 						WriteReference(ds).
 						WriteAtom("pong");
-				Stream::Write2(ewr, (UInt16)ewr.BytesCount(), &ei);
+				timer.Record(Metrics::Encode, command);
+				Write(ewr, ewr.BytesCount(), &ei);
 				if(ei.WasError || ei.ErrorCode) {
 					// NOTE: Use ewr.ToVector<int>() to check bytes were written
 					Log("IO Error When Command 2");
-					terminate();
+					Terminate();
+				}
+			}
+			else if(command == 4)
+			{
+				// {?CMD_BINARY,DS,Bin} -> {binary,DS,Bin}, Bin inline or {'$shm',Offset,Size} with --shm
+				_ASSERTE(tupleSize == 3);
+				ErrorInfo ei;
+				Erlang::ETFWriter ewr;
+				ewr.WriteTuple(3).
+						WriteAtom("binary").
+						WriteReference(ds);
+				if(pShm_) {
+					SharedMemory::View v = Erlang::ReadBinary(er, *pShm_);
+					timer.Record(Metrics::Decode, command);
+					Erlang::WriteBinary(ewr, *pShm_, v.Data, v.Size);
+					if(!pShm_->Release(v))
+						Log("Shared Memory Lane Corrupt");
+				}
+				else {
+					Erlang::Binary bin = er.ReadBinary();
+					timer.Record(Metrics::Decode, command);
+					ewr.WriteBinary((const byte*)bin + 5, bin.Size() - 5);
+				}
+				timer.Record(Metrics::Encode, command);
+				Write(ewr, ewr.BytesCount(), &ei);
+				if(ei.WasError || ei.ErrorCode) {
+					Log("IO Error When Binary Command");
+					Terminate();
+				}
+			}
+			else if(command == (int)Metrics::COMMAND)
+			{
+				// {?CMD_METRICS,DS} -> {metrics,DS,{Counters,Gauges,Timings}}
+				Metrics::Snapshot snapshot;
+				Metrics::Collect(snapshot);
+				ErrorInfo ei;
+				Erlang::ETFWriter ewr;
+				ewr.WriteTuple(3).
+						WriteAtom("metrics").
+						WriteReference(ds);
+				Metrics::Write(ewr, snapshot);
+				Write(ewr, ewr.BytesCount(), &ei);
+				if(ei.WasError || ei.ErrorCode) {
+					Log("IO Error When Metrics Command");
+					Terminate();
 				}
 			}
 			else if(command == 3)
@@ -189,10 +334,14 @@ class Application
 			{
 				_ASSERTE(false);
 				Log("Unknown Command Given");
-				terminate();
+				Terminate();
 			}
 		} // while(true)
 		
+		delete pShm_;
+		pShm_ = NULL;
+		Capture::Stop();
+		Logger::Stop();
 		return 0;
 	}
 	
@@ -205,8 +354,16 @@ class Application
 		return 0;
 	}
 };
-	
+
+UInt32 Application::PacketSize_ = 2;
+bool Application::Logging_ = true;
+SharedMemory* Application::pShm_ = NULL;
+
+#ifdef _WIN32
 int wmain(int argc, wchar_t* argv[])
+#else
+int main(int argc, char* argv[])
+#endif /* _WIN32 */
 {
 	Application::Initialize(argc, argv);
 	return Application::Run();
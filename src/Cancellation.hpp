@@ -0,0 +1,186 @@
+/*
+
+*/
+
+#ifndef __CANCELLATION_HPP__
+#define __CANCELLATION_HPP__
+//-------------------------------------------------------------------------------------------------
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/chrono.hpp>
+#include <boost/optional.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "Erlang.hpp"
+#include "PendingTable.hpp"
+//-------------------------------------------------------------------------------------------------
+namespace Erlang
+{
+	// Cancelled by {'$cancel',DS} or by its deadline. Copies share the state; a default token is
+	// never cancelled. Cancelled() is an atomic load, plus a clock read if there is a deadline.
+	class CancelToken
+	{
+		private: typedef boost::chrono::system_clock Clock;
+		
+		private: struct State
+		{
+			public: boost::atomic<bool> Cancelled;
+			public: bool HasDeadline;
+			public: Clock::time_point Deadline;
+			
+			public: State(void):
+				Cancelled(false),
+				HasDeadline(false)
+			{
+			}
+		};
+		
+		private: boost::shared_ptr<State> pState_;
+		
+		public: CancelToken(void)
+		{
+		}
+		
+		// deadlineMs - system time in ms since epoch (erlang:system_time(millisecond)), < 0 for none
+		public: static CancelToken Create(Int64 deadlineMs)
+		{
+			CancelToken token;
+			token.pState_.reset(new State());
+			if(deadlineMs >= 0) {
+				token.pState_->HasDeadline = true;
+				token.pState_->Deadline = Clock::time_point(boost::chrono::duration_cast<Clock::duration>(boost::chrono::milliseconds(deadlineMs)));
+			}
+			return token;
+		}
+		
+		public: bool Cancelled(void) const
+		{
+			if(!pState_)
+				return false;
+			if(pState_->Cancelled.load(boost::memory_order_relaxed))
+				return true;
+			if(!pState_->HasDeadline || Clock::now() < pState_->Deadline)
+				return false;
+			pState_->Cancelled.store(true, boost::memory_order_relaxed);
+			return true;
+		}
+		
+		public: void Cancel(void) const
+		{
+			if(pState_)
+				pState_->Cancelled.store(true, boost::memory_order_relaxed);
+		}
+	};
+	
+	// In-flight requests by reference (the DS of {Command,DS,...}) and their tokens.
+	// Erlang side of the protocol:
+	//   {'$deadline',DeadlineMs,{Command,DS,...}} - not worth running after system time DeadlineMs
+	//   {'$cancel',DS}                            - caller gave up (gen_server:call timed out)
+	// The dispatcher unwraps and registers every request as it is read, drops a request whose token
+	// is already cancelled instead of running it and completes it when the handler is done; the
+	// handler polls the token in long work. Cancel messages are not requests, they have no reply.
+	// Every request needs its own DS (make_ref() per call) to be cancelled alone.
+	class Cancellation
+	{
+		private: PendingTable<Reference, CancelToken> Table_;
+		
+		public: explicit Cancellation(size_t capacity = 4096):
+			Table_(capacity)
+		{
+		}
+		
+		private: Cancellation(const Cancellation&);
+		private: Cancellation& operator =(const Cancellation&);
+		
+		public: static const char* CancelAtom(void)
+		{
+			return "$cancel";
+		}
+		
+		public: static const char* DeadlineAtom(void)
+		{
+			return "$deadline";
+		}
+		
+		// The token of a request that can't be registered (table full) still has its deadline
+		public: CancelToken Register(const Reference& ds, Int64 deadlineMs = -1)
+		{
+			CancelToken token = CancelToken::Create(deadlineMs);
+			Table_.Insert(ds, token);
+			return token;
+		}
+		
+		// Returns false if the request is not in flight (done already, or never seen)
+		public: bool Cancel(const Reference& ds)
+		{
+			CancelToken token;
+			if(!Table_.Find(ds, token))
+				return false;
+			token.Cancel();
+			return true;
+		}
+		
+		public: void Complete(const Reference& ds)
+		{
+			Table_.Erase(ds);
+		}
+		
+		// {'$cancel',DS}: applies it and returns true, otherwise the reader is left as it was. A
+		// malformed cancel message is not a request either, it is read and ignored.
+		public: bool ReadCancel(ETFReader& er)
+		{
+			UInt32 arity = 0;
+			boost::optional<Reference> ds;
+			if(!er.ReadTagged(CancelAtom(), arity))
+				return false;
+			if(arity == 2 && er.TryReadReference(ds))
+				Cancel(*ds);
+			return true;
+		}
+		
+		// {'$deadline',DeadlineMs,Request}: returns DeadlineMs and the reader is at Request, otherwise
+		// (not an envelope, or a malformed one) returns -1 and the reader is left as it was
+		public: static Int64 ReadDeadline(ETFReader& er)
+		{
+			UInt32 arity = 0;
+			Int64 deadlineMs = -1;
+			size_t pos = er.Tell();
+			if(!er.ReadTagged(DeadlineAtom(), arity))
+				return -1;
+			if(arity != 3 || !er.TryReadNumber(deadlineMs) || deadlineMs < 0) {
+				er.Seek(pos);
+				return -1;
+			}
+			return deadlineMs;
+		}
+		
+		// Strip {'$deadline',DeadlineMs,Request} from the frame in place (frame keeps its version
+		// number) and return DeadlineMs, -1 if the frame is not wrapped. Never throws.
+		public: static Int64 Unwrap(std::vector<byte>& frame)
+		{
+			return (frame.empty() ? -1 : Unwrap(&frame[0], frame.size(), frame));
+		}
+		
+		// Frame at pBuf stripped into frame, which may hold it already (or anything else: it is
+		// only compared with pBuf when it is not empty)
+		public: static Int64 Unwrap(const byte* pBuf, size_t size, std::vector<byte>& frame)
+		{
+			ETFStatus status;
+			ETFReader er(pBuf, size, false, status);
+			Int64 deadlineMs = ReadDeadline(er);
+			if(deadlineMs < 0)
+				return -1;
+			size_t inner = size - er.RestSize();
+			if(!frame.empty() && &frame[0] == pBuf)
+				frame.erase(frame.begin() + 1, frame.begin() + inner);
+			else {
+				frame.assign(pBuf, pBuf + 1);
+				frame.insert(frame.end(), pBuf + inner, pBuf + size);
+			}
+			return deadlineMs;
+		}
+	};
+}
+//-------------------------------------------------------------------------------------------------
+#endif /* __CANCELLATION_HPP__ */
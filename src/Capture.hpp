@@ -0,0 +1,286 @@
+/*
+
+*/
+
+#ifndef __CAPTURE_HPP__
+#define __CAPTURE_HPP__
+//-------------------------------------------------------------------------------------------------
+#include <stdio.h>
+#include <string.h>
+#include <stdexcept>
+#include <string>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif /* _WIN32 */
+
+#include <boost/atomic.hpp>
+#include <boost/chrono.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/throw_exception.hpp>
+
+#include "Defines.hpp"
+//-------------------------------------------------------------------------------------------------
+namespace IOStream
+{
+	// Capture file: "ERLCAP" 0 1, then one record per frame that went through Stream
+	//   Size:32 Direction:8 Packet:8 Reserved:16 TimeNs:64 (big-endian), Size bytes of the term
+	// Packet is the header size the frame had on the wire (2 or 4), TimeNs is the system clock.
+	//
+	// Capture::Start("frames.cap") turns it on for Read2\Read4\Write2\Write4\WritePacket\WriteFile;
+	// frames are appended to a buffered file under one mutex, when it is off Stream only tests a flag.
+	class Capture
+	{
+		public: enum Direction
+		{
+			In,  // Read from Erlang
+			Out, // Written to Erlang
+		};
+		
+		public: static const size_t HEADER_SIZE = 8;
+		public: static const size_t RECORD_SIZE = 16;
+		
+		private: struct State
+		{
+			public: boost::mutex Mutex;
+			public: boost::atomic<bool> Active;
+			public: FILE* File;
+			public: char* pBuffer;
+			
+			public: State(void):
+				Active(false),
+				File(NULL),
+				pBuffer(NULL)
+			{
+			}
+		};
+		
+		private: Capture(void);
+		
+		private: static State& GetState(void)
+		{
+			static State state;
+			return state;
+		}
+		
+		public: static const byte* Magic(void)
+		{
+			static const byte magic[HEADER_SIZE] = { 'E', 'R', 'L', 'C', 'A', 'P', 0, 1 };
+			return magic;
+		}
+		
+		// Append to fileName (new file gets the header), returns false if it can't be opened
+		public: static bool Start(const char* fileName, size_t bufferSize = 1 << 20)
+		{
+			State& s = GetState();
+			boost::mutex::scoped_lock lock(s.Mutex);
+			if(s.File)
+				return false;
+			FILE* f = fopen(fileName, "ab");
+			if(!f)
+				return false;
+			s.pBuffer = new char[bufferSize];
+			setvbuf(f, s.pBuffer, _IOFBF, bufferSize);
+			fseek(f, 0, SEEK_END);
+			if(!ftell(f))
+				fwrite(Magic(), 1, HEADER_SIZE, f);
+			s.File = f;
+			s.Active.store(true);
+			return true;
+		}
+		
+		public: static void Stop(void)
+		{
+			State& s = GetState();
+			boost::mutex::scoped_lock lock(s.Mutex);
+			s.Active.store(false);
+			if(s.File)
+				fclose(s.File);
+			delete[] s.pBuffer;
+			s.File = NULL;
+			s.pBuffer = NULL;
+		}
+		
+		public: static void Flush(void)
+		{
+			State& s = GetState();
+			boost::mutex::scoped_lock lock(s.Mutex);
+			if(s.File)
+				fflush(s.File);
+		}
+		
+		public: static bool Active(void)
+		{
+			return GetState().Active.load(boost::memory_order_relaxed);
+		}
+		
+		// Term of len bytes (without the packet header)
+		public: static void Frame(Direction direction, UInt8 packet, const byte* pBuf, size_t len)
+		{
+			byte record[RECORD_SIZE] = { 0 };
+			Int64 now = (Int64)boost::chrono::duration_cast<boost::chrono::nanoseconds>(boost::chrono::system_clock::now().time_since_epoch()).count();
+			Put(&record[0], (UInt64)len, 4);
+			record[4] = (byte)direction;
+			record[5] = packet;
+			Put(&record[8], (UInt64)now, 8);
+			State& s = GetState();
+			boost::mutex::scoped_lock lock(s.Mutex);
+			if(!s.File)
+				return;
+			fwrite(record, 1, sizeof(record), s.File);
+			fwrite(pBuf, 1, len, s.File);
+		}
+		
+		// Packet that starts with its own header, as Stream::WritePacket gets it
+		public: static void Packet(Direction direction, const byte* pBuf, size_t size)
+		{
+			if(size >= 2 && (((size_t)pBuf[0] << 8) | pBuf[1]) == size - 2)
+				Frame(direction, 2, pBuf + 2, size - 2);
+			else if(size >= 4 && (((size_t)pBuf[0] << 24) | ((size_t)pBuf[1] << 16) | ((size_t)pBuf[2] << 8) | pBuf[3]) == size - 4)
+				Frame(direction, 4, pBuf + 4, size - 4);
+		}
+		
+		// Big-endian, RWBinary is not declared yet where Stream includes this
+		private: static void Put(byte* p, UInt64 value, int bytes)
+		{
+			for(int i = bytes - 1; i >= 0; --i, value >>= 8)
+				p[i] = (byte)value;
+		}
+	};
+	
+	// Capture file mapped read-only, frames point into the mapping:
+	//   Replay r("frames.cap");
+	//   Replay::Frame f;
+	//   while(r.Next(f))
+	//       if(f.Direction == Capture::In) { Erlang::ETFReader er(f.Data, f.Size, false); ... }
+	// A record cut short (the port died while capturing) ends the replay.
+	class Replay
+	{
+		public: struct Frame
+		{
+			public: const byte* Data;
+			public: UInt32 Size;
+			public: Capture::Direction Direction;
+			public: UInt8 Packet;
+			public: Int64 TimeNs;
+		};
+		
+		private: const byte* pBase_;
+		private: size_t Size_;
+		private: size_t Pos_;
+#ifdef _WIN32
+		private: HANDLE File_;
+		private: HANDLE Mapping_;
+#endif /* _WIN32 */
+		
+		public: explicit Replay(const std::string& fileName):
+			pBase_(NULL),
+			Size_(0),
+			Pos_(Capture::HEADER_SIZE)
+		{
+#ifdef _WIN32
+			File_ = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+			if(File_ == INVALID_HANDLE_VALUE)
+				boost::throw_exception(std::runtime_error("Can't Open Capture File"));
+			LARGE_INTEGER size;
+			GetFileSizeEx(File_, &size);
+			Size_ = (size_t)size.QuadPart;
+			Mapping_ = (Size_ >= Capture::HEADER_SIZE ? CreateFileMappingA(File_, NULL, PAGE_READONLY, 0, 0, NULL) : NULL);
+			pBase_ = (Mapping_ ? (const byte*)MapViewOfFile(Mapping_, FILE_MAP_READ, 0, 0, 0) : NULL);
+			if(!pBase_) {
+				if(Mapping_)
+					CloseHandle(Mapping_);
+				CloseHandle(File_);
+				boost::throw_exception(std::runtime_error("Can't Map Capture File"));
+			}
+#else
+			int fd = ::open(fileName.c_str(), O_RDONLY);
+			if(fd < 0)
+				boost::throw_exception(std::runtime_error("Can't Open Capture File"));
+			struct stat st;
+			void* p = MAP_FAILED;
+			if(!fstat(fd, &st) && (size_t)st.st_size >= Capture::HEADER_SIZE) {
+				Size_ = (size_t)st.st_size;
+				p = mmap(NULL, Size_, PROT_READ, MAP_PRIVATE, fd, 0);
+			}
+			::close(fd);
+			if(p == MAP_FAILED)
+				boost::throw_exception(std::runtime_error("Can't Map Capture File"));
+			madvise(p, Size_, MADV_SEQUENTIAL);
+			pBase_ = (const byte*)p;
+#endif /* _WIN32 */
+			if(memcmp(pBase_, Capture::Magic(), Capture::HEADER_SIZE)) {
+				Unmap();
+				boost::throw_exception(std::runtime_error("Invalid Capture File"));
+			}
+		}
+		
+		public: ~Replay(void)
+		{
+			Unmap();
+		}
+		
+		private: Replay(const Replay&);
+		private: Replay& operator =(const Replay&);
+		
+		private: void Unmap(void)
+		{
+#ifdef _WIN32
+			UnmapViewOfFile(pBase_);
+			CloseHandle(Mapping_);
+			CloseHandle(File_);
+#else
+			munmap((void*)pBase_, Size_);
+#endif /* _WIN32 */
+		}
+		
+		// Is the file a capture (and not e.g. a raw {packet,2} stream)
+		public: static bool IsCapture(const std::string& fileName)
+		{
+			byte magic[Capture::HEADER_SIZE];
+			FILE* f = fopen(fileName.c_str(), "rb");
+			if(!f)
+				return false;
+			bool is = (fread(magic, 1, sizeof(magic), f) == sizeof(magic) && !memcmp(magic, Capture::Magic(), sizeof(magic)));
+			fclose(f);
+			return is;
+		}
+		
+		public: bool Next(Frame& frame)
+		{
+			if(Size_ - Pos_ < Capture::RECORD_SIZE)
+				return false;
+			const byte* p = pBase_ + Pos_;
+			UInt32 len = ((UInt32)p[0] << 24) | ((UInt32)p[1] << 16) | ((UInt32)p[2] << 8) | p[3];
+			if(Size_ - Pos_ - Capture::RECORD_SIZE < len)
+				return false;
+			UInt64 time = 0;
+			for(int i = 8; i < 16; ++i)
+				time = (time << 8) | p[i];
+			frame.Data = p + Capture::RECORD_SIZE;
+			frame.Size = len;
+			frame.Direction = (p[4] ? Capture::Out : Capture::In);
+			frame.Packet = p[5];
+			frame.TimeNs = (Int64)time;
+			Pos_ += Capture::RECORD_SIZE + len;
+			return true;
+		}
+		
+		public: void Rewind(void)
+		{
+			Pos_ = Capture::HEADER_SIZE;
+		}
+		
+		// Bytes of the file, header included
+		public: size_t Size(void) const
+		{
+			return Size_;
+		}
+	};
+}
+//-------------------------------------------------------------------------------------------------
+#endif /* __CAPTURE_HPP__ */
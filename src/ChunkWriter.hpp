@@ -0,0 +1,120 @@
+/*
+
+*/
+
+#ifndef __CHUNKWRITER_HPP__
+#define __CHUNKWRITER_HPP__
+//-------------------------------------------------------------------------------------------------
+#include <boost/function.hpp>
+
+#include "Erlang.hpp"
+#include "Defines.hpp"
+//-------------------------------------------------------------------------------------------------
+namespace Erlang
+{
+	// Streamed reply of a result produced piece by piece (query rows, a file scan): rows go out as
+	// they are written, in {chunk,DS,[Row,...]} frames of about maxBytes, and {done,DS,Rows} ends
+	// the reply. The frame buffer is reused, so memory does not grow with the result, and Erlang
+	// has the first rows before the last one is produced.
+	//   Erlang::ChunkWriter chunks(DS, ReplySink()); // or a function writing a frame
+	//   while(...) {
+	//       chunks.Row().WriteTuple(2).WriteNumber(id).WriteBinary(data, size); // one term a row
+	//       if(!chunks.EndRow())
+	//           break;                                // peer gone
+	//   }
+	//   chunks.Done();
+	// Rows counted in a frame are back-patched into its list header (ETFWriter::BeginList), so
+	// nothing needs the count up front. A row longer than maxBytes makes a frame of its own,
+	// which {packet,2} can't send above 64KB.
+	class ChunkWriter
+	{
+		// Writes one frame (term with version number), false if the peer is gone
+		public: typedef boost::function<bool(const byte*, size_t)> Sink;
+		
+		private: Reference DS_;
+		private: Sink Sink_;
+		private: size_t MaxBytes_;
+		private: ETFWriter Writer_;
+		private: size_t ListPos_; // Of the rows of the frame being written
+		private: UInt32 Count_;   // Rows in it
+		private: bool Begun_;
+		private: bool Failed_;
+		private: UInt64 Rows_;
+		private: UInt64 Frames_;
+		
+		public: ChunkWriter(const Reference& ds, const Sink& sink, size_t maxBytes = 16384):
+			DS_(ds),
+			Sink_(sink),
+			MaxBytes_(maxBytes),
+			ListPos_(0),
+			Count_(0),
+			Begun_(false),
+			Failed_(false),
+			Rows_(0),
+			Frames_(0)
+		{
+		}
+		
+		private: ChunkWriter(const ChunkWriter&);
+		private: ChunkWriter& operator =(const ChunkWriter&);
+		
+		// Writer to put the next row in, as one term
+		public: ETFWriter& Row(void)
+		{
+			if(!Begun_) {
+				Writer_.WriteTuple(3).WriteAtom("chunk").WriteReference(DS_);
+				ListPos_ = Writer_.BeginList();
+				Begun_ = true;
+			}
+			return Writer_;
+		}
+		
+		// The row is written; sends the frame once it is maxBytes long. False if the peer is gone.
+		public: bool EndRow(void)
+		{
+			++Count_;
+			++Rows_;
+			if(Writer_.BytesCount() >= MaxBytes_)
+				return Flush();
+			return !Failed_;
+		}
+		
+		// Sends the rows written so far (nothing if there are none)
+		public: bool Flush(void)
+		{
+			if(!Begun_ || Failed_)
+				return !Failed_;
+			Writer_.EndList(ListPos_, Count_);
+			Failed_ = !Sink_(Writer_, Writer_.BytesCount());
+			Writer_.Truncate(1);
+			Count_ = 0;
+			Begun_ = false;
+			++Frames_;
+			return !Failed_;
+		}
+		
+		// Rest of the rows and {done,DS,Rows}
+		public: bool Done(void)
+		{
+			if(!Flush())
+				return false;
+			ETFWriter ewr(64);
+			ewr.WriteTuple(3).WriteAtom("done").WriteReference(DS_).WriteNumber(Rows_);
+			Failed_ = !Sink_(ewr, ewr.BytesCount());
+			return !Failed_;
+		}
+		
+		public: UInt64 Rows(void) const
+		{
+			return Rows_;
+		}
+		
+		// {chunk,...} frames sent
+		public: UInt64 Frames(void) const
+		{
+			return Frames_;
+		}
+	};
+}
+//-------------------------------------------------------------------------------------------------
+#endif /* __CHUNKWRITER_HPP__ */
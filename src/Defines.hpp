@@ -2,7 +2,7 @@
 #ifndef __DEFINES_HPP__
 #define __DEFINES_HPP__
 
-#include <boost/Integer.hpp>
+#include <boost/integer.hpp>
 
 
 typedef boost::int_t<8>::least   Int8;
@@ -12,7 +12,7 @@ typedef boost::uint_t<8>::least  UInt8;
 typedef boost::uint_t<16>::least UInt16;
 typedef boost::uint_t<32>::least UInt32;
 
-#ifdef _LONGLONG
+#if defined(_LONGLONG) || !defined(_MSC_VER)
 typedef long long Int64;
 typedef unsigned long long UInt64;
 #endif /* _LONGLONG */
@@ -29,4 +29,30 @@ typedef UInt8         byte;
 
 #define MAX_MESSAGE_LENGTH		UInt16(-1)
 
+#ifdef _WIN32
+#include <crtdbg.h>
+#else
+#include <assert.h>
+#define _ASSERTE(expr)			assert(expr)
+#endif /* _WIN32 */
+
+// Per-thread storage of plain (POD) variables
+#ifdef _MSC_VER
+#define THREAD_LOCAL			__declspec(thread)
+#else
+#define THREAD_LOCAL			__thread
+#endif /* _MSC_VER */
+
+// Data written by different threads is kept this far apart (no false sharing)
+#define CACHE_LINE_SIZE			64
+
+// Host Byte Order (ETF is big-endian on the wire)
+#if defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#define HOST_LITTLE_ENDIAN		0
+#elif defined(__BIG_ENDIAN__) || defined(__ARMEB__) || defined(__MIPSEB__)
+#define HOST_LITTLE_ENDIAN		0
+#else
+#define HOST_LITTLE_ENDIAN		1 // x86, x64, ARM (Windows and the default elsewhere)
+#endif
+
 #endif /* __DEFINES_HPP__ */
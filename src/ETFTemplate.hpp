@@ -0,0 +1,310 @@
+/*
+
+*/
+
+#ifndef __ETFTEMPLATE_HPP__
+#define __ETFTEMPLATE_HPP__
+//-------------------------------------------------------------------------------------------------
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+#include <string.h>
+
+#include "Erlang.hpp"
+//-------------------------------------------------------------------------------------------------
+namespace Erlang
+{
+	// Pre-encoded reply shape with holes. The fixed part is encoded once with ETFWriter, holes record
+	// where the changing leaves go:
+	//   IntegerHole - INTEGER_EXT slot (5 bytes)
+	//   FloatHole - NEW_FLOAT_EXT slot (9 bytes)
+	//   ReferenceHole - encoded handle (Reference, Pid, Port, Binary ...), no slot
+	//   TailHole - any subterm encoded by another ETFWriter, no slot
+	//
+	// Erlang::ETFTemplate reply; // {command1,N,Ref,{Ret,"Unicode String"}}
+	// reply.WriteTuple(4).WriteAtom("command1").IntegerHole().ReferenceHole().
+	//       WriteTuple(2).IntegerHole().WriteString(L"Unicode String");
+	// Erlang::ETFInstance ewr(reply); // Once, then for every reply:
+	// ewr.Reset().SetNumber(0, command).SetReference(1, ds).SetNumber(2, ret);
+	// Stream::Write2(ewr, (UInt16)ewr.BytesCount(), &ei);
+	class ETFTemplate
+	{
+		friend class ETFInstance;
+		
+		public: enum HoleType
+		{
+			Integer,
+			Float,
+			Handle,
+			Tail,
+		};
+		
+		private: struct Hole
+		{
+			public: HoleType Type;
+			public: size_t Offset;
+			
+			public: Hole(HoleType type, size_t offset):
+				Type(type),
+				Offset(offset)
+			{
+			}
+		};
+		
+		private: ETFWriter Writer_;
+		private: std::vector<Hole> Holes_;
+		
+		public: ETFTemplate(void)
+		{
+		}
+		
+		public: size_t HolesCount(void) const
+		{
+			return Holes_.size();
+		}
+		
+		public: size_t BytesCount(void) const
+		{
+			return Writer_.BytesCount();
+		}
+		
+		// Fixed part - same as ETFWriter
+		public: ETFTemplate& WriteTuple(UInt32 tupleSize)
+		{
+			Writer_.WriteTuple(tupleSize);
+			return *this;
+		}
+		
+		public: template<typename T> ETFTemplate& WriteNumber(T number)
+		{
+			Writer_.WriteNumber(number);
+			return *this;
+		}
+		
+		public: ETFTemplate& WriteNil(void)
+		{
+			Writer_.WriteNil();
+			return *this;
+		}
+		
+		public: template<typename T> ETFTemplate& WriteString(const T* str)
+		{
+			Writer_.WriteString(str);
+			return *this;
+		}
+		
+		public: ETFTemplate& WriteList(UInt32 listSize)
+		{
+			Writer_.WriteList(listSize);
+			return *this;
+		}
+		
+		public: template<typename T> ETFTemplate& WriteAtom(const T* atomName)
+		{
+			Writer_.WriteAtom(atomName);
+			return *this;
+		}
+		
+		public: ETFTemplate& WriteReference(const Reference& ref)
+		{
+			Writer_.WriteReference(ref);
+			return *this;
+		}
+		
+		public: ETFTemplate& WriteBinary(const Binary& bin)
+		{
+			Writer_.WriteBinary(bin);
+			return *this;
+		}
+		
+		// Holes - numbered in order of appearance, starting from 0
+		public: ETFTemplate& IntegerHole(void)
+		{
+			Holes_.push_back(Hole(Integer, Writer_.BytesCount()));
+			Writer_.WriteNumber((Int32)0);
+			return *this;
+		}
+		
+		public: ETFTemplate& FloatHole(void)
+		{
+			Holes_.push_back(Hole(Float, Writer_.BytesCount()));
+			Writer_.WriteNumber((double)0);
+			return *this;
+		}
+		
+		public: ETFTemplate& ReferenceHole(void)
+		{
+			Holes_.push_back(Hole(Handle, Writer_.BytesCount()));
+			return *this;
+		}
+		
+		public: ETFTemplate& TailHole(void)
+		{
+			Holes_.push_back(Hole(Tail, Writer_.BytesCount()));
+			return *this;
+		}
+	};
+	
+	// One reply made from ETFTemplate in a single pass. Holes are set in order: each copies the
+	// template bytes up to and over its slot, then writes its own bytes after them, so nothing is
+	// ever shifted. The buffer is the caller's or one kept by the instance, Reset starts the next
+	// reply in it:
+	//   Erlang::ETFInstance ewr(reply); // or ewr(reply, buf, sizeof(buf)) - never allocates
+	//   ewr.Reset().SetNumber(0, command).SetReference(1, ds).SetNumber(2, ret);
+	class ETFInstance
+	{
+		private: static const size_t RESERVE_SIZE = 256;
+		
+		private: const ETFTemplate& Template_;
+		private: std::vector<byte> Own_; // Buffer if the caller gave none, grows when a hole needs it
+		private: byte* pBuf_;
+		private: size_t Size_;
+		private: size_t Count_; // Bytes written
+		private: size_t Copied_; // Template bytes copied, slots of the set holes included
+		private: size_t Next_; // Hole to set next
+		
+		public: explicit ETFInstance(const ETFTemplate& tmpl):
+			Template_(tmpl),
+			Own_(tmpl.BytesCount() + RESERVE_SIZE),
+			pBuf_(&Own_[0]),
+			Size_(Own_.size()),
+			Count_(0),
+			Copied_(0),
+			Next_(0)
+		{
+			Reset();
+		}
+		
+		// Write into caller provided buffer, throws std::overflow_error if the reply does not fit
+		public: ETFInstance(const ETFTemplate& tmpl, byte* pBuf, size_t size):
+			Template_(tmpl),
+			pBuf_(pBuf),
+			Size_(size),
+			Count_(0),
+			Copied_(0),
+			Next_(0)
+		{
+			if(!pBuf)
+				throw std::invalid_argument("Zero Buffer Argument");
+			Reset();
+		}
+		
+		private: ETFInstance(const ETFInstance&);
+		private: ETFInstance& operator =(const ETFInstance&);
+		
+		// Forget the holes set, the buffer is kept for the next reply
+		public: ETFInstance& Reset(void)
+		{
+			Count_ = Copied_ = Next_ = 0;
+			if(Template_.Holes_.empty())
+				memcpy(Reserve(Template_.BytesCount()), (const byte*)Template_.Writer_, Template_.BytesCount());
+			return *this;
+		}
+		
+		// The reply is there once every hole is set, std::logic_error before
+		public: operator const byte*(void) const
+		{
+			Check();
+			return pBuf_;
+		}
+		
+		public: template<typename T> std::vector<T> ToVector(void) const
+		{
+			Check();
+			return std::vector<T>(pBuf_, pBuf_ + Count_);
+		}
+		
+		public: size_t BytesCount(void) const
+		{
+			Check();
+			return Count_;
+		}
+		
+		private: void Check(void) const
+		{
+			if(Next_ < Template_.Holes_.size())
+				throw std::logic_error("Holes Not Set");
+		}
+		
+		// Template bytes a hole takes: the number slots, nothing for inserted holes
+		private: static size_t Slot(ETFTemplate::HoleType type)
+		{
+			return (type == ETFTemplate::Integer ? 1 + 4 : (type == ETFTemplate::Float ? 1 + 8 : 0));
+		}
+		
+		// Room for size more bytes, nothing is written or moved if it throws
+		private: byte* Reserve(size_t size)
+		{
+			if(Size_ - Count_ < size) {
+				if(Own_.empty())
+					throw std::overflow_error("Out of Buffer Range");
+				Own_.resize(std::max(Own_.size()*2, Count_ + size));
+				pBuf_ = &Own_[0];
+				Size_ = Own_.size();
+			}
+			byte* p = pBuf_ + Count_;
+			Count_ += size;
+			return p;
+		}
+		
+		// Copy the template up to the end of the hole slot and make room for size bytes after it,
+		// the rest of the template too after the last hole. Returns where the slot starts.
+		private: byte* Fill(size_t hole, ETFTemplate::HoleType type, size_t size)
+		{
+			if(hole >= Template_.Holes_.size())
+				throw std::out_of_range("Out of Holes Range");
+			if(Template_.Holes_[hole].Type != type)
+				throw std::invalid_argument("Invalid Hole Type");
+			if(hole != Next_)
+				throw std::logic_error("Holes Set Out of Order");
+			const byte* pTemplate = Template_.Writer_;
+			size_t offset = Template_.Holes_[hole].Offset;
+			size_t fixed = offset + Slot(type) - Copied_;
+			size_t rest = (hole + 1 == Template_.Holes_.size() ? Template_.BytesCount() - offset - Slot(type) : 0);
+			byte* p = Reserve(fixed + size + rest);
+			memcpy(p, pTemplate + Copied_, fixed);
+			if(rest)
+				memcpy(p + fixed + size, pTemplate + offset + Slot(type), rest);
+			Copied_ = offset + Slot(type);
+			++Next_;
+			return p + fixed - Slot(type);
+		}
+		
+		// Integer or float hole, the hole type decides the encoding. An integer hole is INTEGER_EXT:
+		// a number out of the Int32 range throws std::out_of_range (write it with ETFWriter instead)
+		public: template<typename T> ETFInstance& SetNumber(size_t hole, T number)
+		{
+			if(hole < Template_.Holes_.size() && Template_.Holes_[hole].Type == ETFTemplate::Float)
+				RWBinary::Write(Fill(hole, ETFTemplate::Float, 0) + 1, (1.0*number)); // convert to double
+			else {
+				if(NumberEncoding<T>::IsFloat() ? !(number >= -2147483648.0 && number <= 2147483647.0) : !NumberEncoding<T>::IsSmall(number))
+					throw std::out_of_range("Number Out of Integer Hole Range");
+				RWBinary::Write(Fill(hole, ETFTemplate::Integer, 0) + 1, (Int32)number);
+			}
+			return *this;
+		}
+		
+		// Reference hole - any encoded handle
+		public: ETFInstance& SetReference(size_t hole, const RawData& data)
+		{
+			size_t size = data.Size();
+			byte* p = Fill(hole, ETFTemplate::Handle, size);
+			if(size)
+				memcpy(p, (const byte*)data, size);
+			return *this;
+		}
+		
+		// Tail hole - subterm encoded by ETFWriter (without its version number)
+		public: ETFInstance& SetTail(size_t hole, const ETFWriter& ewr)
+		{
+			const byte* pTerm = ewr;
+			size_t size = ewr.BytesCount() - 1;
+			byte* p = Fill(hole, ETFTemplate::Tail, size);
+			if(size)
+				memcpy(p, pTerm + 1, size);
+			return *this;
+		}
+	};
+}
+//-------------------------------------------------------------------------------------------------
+#endif /* __ETFTEMPLATE_HPP__ */
@@ -5,20 +5,47 @@
 #ifndef __ERLANG_HPP__
 #define __ERLANG_HPP__
 //-------------------------------------------------------------------------------------------------
+#include <algorithm>
 #include <stdexcept>
+#include <typeinfo>
 #include <vector>
 #include <memory>
 #include <limits>
+#include <utility>
+#include <stdlib.h>
 #include <string.h>
-#include <crtdbg.h>
 #include <math.h>
 
+#include <boost/atomic.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/optional.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/throw_exception.hpp>
+#include <boost/type_traits/is_integral.hpp>
+#include <boost/type_traits/is_signed.hpp>
+
 #include "IOStream.hpp"
 //-------------------------------------------------------------------------------------------------
 using namespace IOStream;
 //-------------------------------------------------------------------------------------------------
 namespace Erlang
 {
+	// std::bad_cast with a message (std::bad_cast(const char*) is MSVC only)
+	class BadCast: public std::bad_cast
+	{
+		private: const char* What_;
+		
+		public: explicit BadCast(const char* what):
+			What_(what)
+		{
+		}
+		
+		public: virtual const char* what(void) const throw()
+		{
+			return What_;
+		}
+	};
+	
 	enum ETFTag // External Term Format Tag
 	{
 		ERL_VERSION = 131,
@@ -36,42 +63,315 @@ namespace Erlang
 		ATOM_EXT = 100,
 		SMALL_ATOM_EXT = 115,
 		ATOM_CACHE_REF = 82,
+		ATOM_UTF8_EXT = 118,
+		SMALL_ATOM_UTF8_EXT = 119,
 		REFERENCE_EXT = 101,
 		NEW_REFERENCE_EXT = 114,
+		NEWER_REFERENCE_EXT = 90,
+		PID_EXT = 103,
+		NEW_PID_EXT = 88,
+		PORT_EXT = 102,
+		NEW_PORT_EXT = 89,
+		V4_PORT_EXT = 120,
+		NEW_FUN_EXT = 112,
+		EXPORT_EXT = 113,
+		FLOAT_EXT = 99,
+		BIT_BINARY_EXT = 77,
+		MAP_EXT = 116,
+	};
+	
+	// Heap block of the library, counted in Metrics::Allocations
+	template<typename T> inline T* NewArray(size_t count)
+	{
+		Metrics::Add(Metrics::Allocations);
+		return new T[count];
+	}
+	
+	// Reference counted copy of size bytes, one heap block (counted as NewArray)
+	inline boost::shared_ptr<const byte> NewSharedBlock(const byte* p, size_t size)
+	{
+		Metrics::Add(Metrics::Allocations);
+		boost::shared_ptr<byte[]> block = boost::make_shared_noinit<byte[]>(size);
+		if(size)
+			memcpy(block.get(), p, size);
+		return boost::shared_ptr<const byte>(block, block.get());
+	}
+	
+	// 64-bit hash of a byte string, 8 bytes per step (handles are short and not aligned)
+	inline UInt64 HashBytes(const byte* p, size_t size)
+	{
+		const UInt64 m = 0x9E3779B97F4A7C15ULL;
+		UInt64 h = (UInt64)size*m;
+		for(; size >= sizeof(UInt64); size -= sizeof(UInt64), p += sizeof(UInt64)) {
+			UInt64 w;
+			memcpy(&w, p, sizeof(w));
+			h = (h ^ (w*m)) * 0xFF51AFD7ED558CCDULL;
+			h ^= (h >> 32);
+		}
+		if(size) {
+			UInt64 w = 0;
+			memcpy(&w, p, size);
+			h = (h ^ (w*m)) * 0xFF51AFD7ED558CCDULL;
+		}
+		h ^= (h >> 29);
+		h *= 0xC4CEB9FE1A85EC53ULL;
+		h ^= (h >> 32);
+		return (h ? h : m); // 0 is reserved for "not computed"
+	}
+	
+	// Running value of erlang:phash2 (make_hash2 of the emulator): Bob Jenkins' lookup2 mix over
+	// 32-bit words, each type with its own multiple of the golden ratio, fed in the order the
+	// terms are encoded (ETFReader::TryPHash2 walks a buffer). Value is phash2(Term, 1 bsl 32),
+	// phash2(Term) is Value & 0x7ffffff and phash2(Term, N) is Value % N. phash2 values do not
+	// change between OTP releases, so a port and the Erlang nodes can shard by them alike.
+	class PHash2
+	{
+		public: UInt32 Value;
+		private: UInt32 Run_; // Bytes of a list (a string) are mixed 4 at a time
+		private: UInt32 RunSize_;
+		
+		public: PHash2(void):
+			Value(0),
+			Run_(0),
+			RunSize_(0)
+		{
+		}
+		
+		// Element 0..255 of a list
+		public: void Byte(UInt8 b)
+		{
+			Run_ = (Run_ << 8) + b;
+			if(RunSize_ == 3) {
+				Mix2(Run_, 0, Const(4));
+				Run_ = RunSize_ = 0;
+			}
+			else
+				++RunSize_;
+		}
+		
+		// A run of bytes ends with its list, or at an element that is not a byte
+		public: void EndRun(void)
+		{
+			if(RunSize_)
+				Mix2(Run_, 0, Const(4));
+			Run_ = RunSize_ = 0;
+		}
+		
+		public: void Nil(void)
+		{
+			if(!Value)
+				Value = 3468870702U;
+			else
+				Mix2(2, 0, Const(2)); // NIL_DEF
+		}
+		
+		// hashpjw of the atom table; the table keeps UTF-8, a latin1 character in two bytes counts
+		// as one
+		public: void Atom(const byte* p, size_t size, bool utf8)
+		{
+			UInt32 h = 0;
+			while(size--) {
+				UInt32 v = *p++;
+				if(utf8 && size && (v & 0xfe) == 0xc2 && (*p & 0xc0) == 0x80) {
+					v = ((v << 6) | (*p++ & 0x3f)) & 0xff;
+					--size;
+				}
+				h = (h << 4) + v;
+				if(UInt32 g = (h & 0xf0000000U)) {
+					h ^= (g >> 24);
+					h ^= g;
+				}
+			}
+			if(!Value)
+				Value = h;
+			else
+				Mix2(h, 0, Const(3));
+		}
+		
+		// Out of 28 bits an integer is a bignum to the emulator
+		public: void Integer(Int64 v)
+		{
+			if(v >= -(1 << 27) && v < (1 << 27)) {
+				Int32 y = (Int32)v;
+				if(y < 0)
+					Mix2((UInt32)-y, 0, Const(0));
+				Mix2((UInt32)y, 0, Const(0));
+				return;
+			}
+			UInt64 magnitude = (v < 0 ? 0 - (UInt64)v : (UInt64)v);
+			byte digits[8];
+			for(size_t i = 0; i < sizeof(digits); ++i)
+				digits[i] = (byte)(magnitude >> (8*i));
+			Big(v < 0, digits, sizeof(digits));
+		}
+		
+		// Magnitude of SMALL_BIG_EXT\LARGE_BIG_EXT, little-endian base 256
+		public: void Big(bool negative, const byte* digits, size_t size)
+		{
+			while(size && !digits[size - 1])
+				--size;
+			UInt32 low = Word(digits, 0, size);
+			if(size <= 4 && (low < (1U << 27) || (negative && low == (1U << 27)))) {
+				Integer(negative ? -(Int64)low : (Int64)low);
+				return;
+			}
+			for(size_t i = 0; i < size; i += 8)
+				Mix2(Word(digits, i, size), Word(digits, i + 4, size), Const(negative ? 10 : 11));
+		}
+		
+		// NEW_FLOAT_EXT bits, -0.0 counts as 0.0
+		public: void Float(UInt64 bits)
+		{
+			if(!(bits << 1))
+				bits = 0;
+			Mix2((UInt32)(bits >> 32), (UInt32)bits, Const(12));
+		}
+		
+		// Binary, or bitstring of size whole bytes and bits (1..7) of p[size]
+		public: void Binary(const byte* p, size_t size, UInt32 bits = 0)
+		{
+			UInt32 seed = Const(13) + Value;
+			if(!size && !bits) {
+				Value = seed;
+				return;
+			}
+			Value = BlockHash(p, size, seed);
+			if(bits)
+				Mix2(bits, p[size] >> (8 - bits), Const(15));
+		}
+		
+		// Elements follow
+		public: void Tuple(UInt32 arity)
+		{
+			Mix2(arity, 0, Const(9));
+		}
+		
+		// HCONST_n of the emulator, HCONST*(n + 1)
+		private: static UInt32 Const(UInt32 n)
+		{
+			return 0x9e3779b9U*(n + 1);
+		}
+		
+		// Little-endian word at at, bytes from size on are 0
+		private: static UInt32 Word(const byte* p, size_t at, size_t size)
+		{
+			UInt32 w = 0;
+			for(size_t i = 0; i < 4 && at + i < size; ++i)
+				w |= (UInt32)p[at + i] << (8*i);
+			return w;
+		}
+		
+		private: static void Mix(UInt32& a, UInt32& b, UInt32& c)
+		{
+			a -= b; a -= c; a ^= (c >> 13);
+			b -= c; b -= a; b ^= (a << 8);
+			c -= a; c -= b; c ^= (b >> 13);
+			a -= b; a -= c; a ^= (c >> 12);
+			b -= c; b -= a; b ^= (a << 16);
+			c -= a; c -= b; c ^= (b >> 5);
+			a -= b; a -= c; a ^= (c >> 3);
+			b -= c; b -= a; b ^= (a << 10);
+			c -= a; c -= b; c ^= (b >> 15);
+		}
+		
+		private: void Mix2(UInt32 x, UInt32 y, UInt32 k)
+		{
+			UInt32 a = k + x, b = k + y;
+			Mix(a, b, Value);
+		}
+		
+		// lookup2 of the bytes, seeded with the value so far
+		private: static UInt32 BlockHash(const byte* k, size_t size, UInt32 seed)
+		{
+			UInt32 a = 0x9e3779b9U, b = 0x9e3779b9U, c = seed;
+			size_t len = size;
+			for(; len >= 12; k += 12, len -= 12) {
+				a += Word(k, 0, 12);
+				b += Word(k, 4, 12);
+				c += Word(k, 8, 12);
+				Mix(a, b, c);
+			}
+			c += (UInt32)size;
+			a += Word(k, 0, len);
+			b += Word(k, 4, len);
+			c += Word(k, 8, len) << 8; // The low byte of c is the length
+			Mix(a, b, c);
+			return c;
+		}
 	};
 	
+	// Encoded term kept by value. Up to INLINE_SIZE bytes (references, pids and ports of usual node
+	// names) live in the object itself, so reading, copying or storing a handle does not allocate.
+	// A longer term lives in a reference counted block, its own or the frame buffer of the reader it
+	// was read from (a slice, see ETFReader): copies share the bytes, moves take them over. A slice
+	// keeps the whole frame alive.
 	class RawData
 	{
-		private: byte* pBuffer_;
+		public: enum { INLINE_SIZE = 64 };
+		
+		private: const byte* pBuffer_; // Inline_ or into pShared_
 		private: size_t Size_;
 		private: ETFTag TermTag_;
-
-		protected: RawData(ETFTag termTag, const byte* pBuffer, size_t size):
+		private: mutable boost::atomic<UInt64> Hash_; // 0 - not computed yet, filled in by Hash() on any thread
+		private: boost::shared_ptr<const byte> pShared_; // Points at pBuffer_ (own block or frame slice), empty for inline terms
+		private: byte Inline_[INLINE_SIZE];
+		
+		// pFrame owns pBuffer if given, a long term is then sliced out of it instead of copied
+		protected: RawData(ETFTag termTag, const byte* pBuffer, size_t size, const boost::shared_ptr<const byte>& pFrame):
+			pBuffer_(Inline_),
+			Size_(size),
 			TermTag_(termTag),
-			pBuffer_(NULL),
-			Size_(0)
+			Hash_(0)
 		{
-			pBuffer_ = new byte[size];
-			Size_ = size;
-			memcpy(pBuffer_, pBuffer, Size_);
+			if(size > INLINE_SIZE) {
+				pShared_ = (pFrame ? boost::shared_ptr<const byte>(pFrame, pBuffer) : NewSharedBlock(pBuffer, size));
+				pBuffer_ = pShared_.get();
+			}
+			else if(size)
+				memcpy(Inline_, pBuffer, size);
 		}
 		
 		public: RawData(const RawData& rhs):
-			pBuffer_(NULL),
-			Size_(0)
+			pBuffer_(Inline_),
+			Size_(rhs.Size_),
+			TermTag_(rhs.TermTag_),
+			Hash_(rhs.Hash_.load(boost::memory_order_relaxed)),
+			pShared_(rhs.pShared_)
 		{
-			operator =(rhs);
+			if(pShared_)
+				pBuffer_ = rhs.pBuffer_;
+			else
+				memcpy(Inline_, rhs.Inline_, Size_);
+		}
+		
+#ifndef BOOST_NO_CXX11_RVALUE_REFERENCES
+		public: RawData(RawData&& rhs):
+			pBuffer_(Inline_),
+			Size_(rhs.Size_),
+			TermTag_(rhs.TermTag_),
+			Hash_(rhs.Hash_.load(boost::memory_order_relaxed)),
+			pShared_(std::move(rhs.pShared_))
+		{
+			if(pShared_)
+				pBuffer_ = rhs.pBuffer_;
+			else
+				memcpy(Inline_, rhs.Inline_, Size_);
+			rhs.Clear();
 		}
+#endif
 		
 		public: virtual ~RawData(void)
 		{
-			if(pBuffer_)
-				delete[] pBuffer_;
 		}
 		
 		public: bool operator ==(const RawData& rhs) const
 		{
-			return (Size_ != rhs.Size_ ? false : !memcmp(pBuffer_, rhs.pBuffer_, Size_));
+			if(Size_ != rhs.Size_)
+				return false;
+			UInt64 hash = Hash_.load(boost::memory_order_relaxed), rhsHash = rhs.Hash_.load(boost::memory_order_relaxed);
+			if(hash && rhsHash && hash != rhsHash)
+				return false;
+			return (pBuffer_ == rhs.pBuffer_ || !memcmp(pBuffer_, rhs.pBuffer_, Size_));
 		}
 		
 		public: bool operator !=(const RawData& rhs) const
@@ -82,15 +382,48 @@ namespace Erlang
 		public: RawData& operator =(const RawData& rhs)
 		{
 			if(&rhs != this) {
-				byte* p = new byte[rhs.Size_];
-				if(pBuffer_)
-					delete[] pBuffer_;
-				pBuffer_ = p;
+				pShared_ = rhs.pShared_;
+				if(pShared_)
+					pBuffer_ = rhs.pBuffer_;
+				else {
+					memcpy(Inline_, rhs.Inline_, rhs.Size_);
+					pBuffer_ = Inline_;
+				}
+				Size_ = rhs.Size_;
+				TermTag_ = rhs.TermTag_;
+				Hash_.store(rhs.Hash_.load(boost::memory_order_relaxed), boost::memory_order_relaxed);
+			}
+			return *this;
+		}
+		
+#ifndef BOOST_NO_CXX11_RVALUE_REFERENCES
+		public: RawData& operator =(RawData&& rhs)
+		{
+			if(&rhs != this) {
+				pShared_ = std::move(rhs.pShared_);
+				if(pShared_)
+					pBuffer_ = rhs.pBuffer_;
+				else {
+					memcpy(Inline_, rhs.Inline_, rhs.Size_);
+					pBuffer_ = Inline_;
+				}
 				Size_ = rhs.Size_;
-				memcpy(pBuffer_, rhs.pBuffer_, Size_);
+				TermTag_ = rhs.TermTag_;
+				Hash_.store(rhs.Hash_.load(boost::memory_order_relaxed), boost::memory_order_relaxed);
+				rhs.Clear();
 			}
 			return *this;
 		}
+#endif
+		
+		// Moved-from: empty term of the same type
+		private: void Clear(void)
+		{
+			pShared_.reset();
+			pBuffer_ = Inline_;
+			Size_ = 0;
+			Hash_.store(0, boost::memory_order_relaxed);
+		}
 		
 		public: operator const byte*(void) const
 		{
@@ -101,19 +434,38 @@ namespace Erlang
 		{
 			return Size_;
 		}
-
+		
 		public: ETFTag TermTag(void) const
 		{
 			return TermTag_;
 		}
+		
+		// True if the bytes are shared with the frame or other copies rather than held inline
+		public: bool Shared(void) const
+		{
+			return !!pShared_;
+		}
+		
+		// Hash of the encoded term. Handles (Reference, Pid, Port) compute it once on read,
+		// binaries and funs on first use. A const term may be hashed and compared from several
+		// threads at once: they store the same value, so relaxed order is enough.
+		public: UInt64 Hash(void) const
+		{
+			UInt64 hash = Hash_.load(boost::memory_order_relaxed);
+			if(!hash) {
+				hash = HashBytes(pBuffer_, Size_);
+				Hash_.store(hash, boost::memory_order_relaxed);
+			}
+			return hash;
+		}
 	};
 	
 	class Binary: public RawData
 	{
 		friend class ETFReader; // friend cReference cETFReader::ReadReference(void);
-
-		private: Binary(const byte* pBuffer, size_t size):
-			RawData(BINARY_EXT, pBuffer, size)
+		
+		private: Binary(const byte* pBuffer, size_t size, const boost::shared_ptr<const byte>& pFrame):
+			RawData(BINARY_EXT, pBuffer, size, pFrame)
 		{
 		}
 	};
@@ -121,71 +473,226 @@ namespace Erlang
 	class Reference: public RawData
 	{
 		friend class ETFReader; // friend cReference cETFReader::ReadReference(void);
-
-		private: Reference(const byte* pBuffer, size_t size):
-			RawData(NEW_REFERENCE_EXT, pBuffer, size)
+		
+		private: Reference(ETFTag termTag, const byte* pBuffer, size_t size, const boost::shared_ptr<const byte>& pFrame):
+			RawData(termTag, pBuffer, size, pFrame)
 		{
 			if(!pBuffer || !size)
-				throw std::invalid_argument("Zero Buffer Argument");
+				boost::throw_exception(std::invalid_argument("Zero Buffer Argument"));
+			Hash(); // Precompute, handles are used as keys
 		}
 	};
-
+	
+	// Pid, Port and Fun are opaque handles: they keep the encoded term as is (PID_EXT/NEW_PID_EXT,
+	// PORT_EXT/NEW_PORT_EXT/V4_PORT_EXT, NEW_FUN_EXT/EXPORT_EXT), so they can be compared and
+	// sent back to Erlang without term_to_binary() wrapping on the Erlang side.
+	class Pid: public RawData
+	{
+		friend class ETFReader;
+		
+		private: Pid(ETFTag termTag, const byte* pBuffer, size_t size, const boost::shared_ptr<const byte>& pFrame):
+			RawData(termTag, pBuffer, size, pFrame)
+		{
+			if(!pBuffer || !size)
+				boost::throw_exception(std::invalid_argument("Zero Buffer Argument"));
+			Hash(); // Precompute, handles are used as keys
+		}
+	};
+	
+	class Port: public RawData
+	{
+		friend class ETFReader;
+		
+		private: Port(ETFTag termTag, const byte* pBuffer, size_t size, const boost::shared_ptr<const byte>& pFrame):
+			RawData(termTag, pBuffer, size, pFrame)
+		{
+			if(!pBuffer || !size)
+				boost::throw_exception(std::invalid_argument("Zero Buffer Argument"));
+			Hash(); // Precompute, handles are used as keys
+		}
+	};
+	
+	class Fun: public RawData
+	{
+		friend class ETFReader;
+		
+		private: Fun(ETFTag termTag, const byte* pBuffer, size_t size, const boost::shared_ptr<const byte>& pFrame):
+			RawData(termTag, pBuffer, size, pFrame)
+		{
+			if(!pBuffer || !size)
+				boost::throw_exception(std::invalid_argument("Zero Buffer Argument"));
+		}
+	};
+	
+	// Why a term could not be read. The throwing Read* raise the exception noted for each kind.
+	enum ETFError
+	{
+		ETF_OK = 0,
+		ETF_OUT_OF_RANGE,     // std::out_of_range - the term runs past the end of the buffer
+		ETF_INVALID_TAG,      // std::runtime_error - a term of another type
+		ETF_INVALID_SIZE,     // std::length_error - size or arity field out of its range
+		ETF_BAD_CAST,         // BadCast - the number does not fit the type asked for
+		ETF_OVERFLOW,         // std::overflow_error - the bignum does not fit 64 bits
+		ETF_BYTES_AFTER_TERM, // std::length_error - Validate found more than the terms
+		ETF_INVALID_VERSION,  // std::invalid_argument - the buffer does not start with 131
+		ETF_INVALID_SHM,      // std::out_of_range - {'$shm',...} outside of the region
+	};
+	
+	// Result of the Try* readers of ETFReader: true if the term was read. Otherwise the reader is
+	// where it was and Offset is the position in the buffer (the version number is at 0) of the
+	// field that was found wrong.
+	struct ETFStatus
+	{
+		public: ETFError Error;
+		public: size_t Offset;
+		
+		public: ETFStatus(ETFError error = ETF_OK, size_t offset = 0):
+			Error(error),
+			Offset(offset)
+		{
+		}
+		
+		public: operator bool(void) const
+		{
+			return Error == ETF_OK;
+		}
+		
+		public: const char* What(void) const
+		{
+			switch(Error) {
+				case ETF_OK: return "OK";
+				case ETF_OUT_OF_RANGE: return "Out of Buffer Range";
+				case ETF_INVALID_TAG: return "Invalid Operation";
+				case ETF_INVALID_SIZE: return "Invalid Size";
+				case ETF_BAD_CAST: return "Cast to Smaller Type";
+				case ETF_OVERFLOW: return "Overflow Integer";
+				case ETF_BYTES_AFTER_TERM: return "Bytes After Term";
+				case ETF_INVALID_VERSION: return "Invalid Version (Current is 131)";
+				case ETF_INVALID_SHM: return "Invalid Shared Memory Block";
+			}
+			return "Unknown Error";
+		}
+	};
+	
+	// Every Read* has a Try* twin that returns ETFStatus instead of throwing, for frames that are
+	// expected to be wrong or of several shapes (probing, hostile peers) where a throw per frame
+	// costs more than the decode. Read* are the Try* plus one out-of-line throw. The reader itself
+	// only throws through boost::throw_exception, so it builds with -fno-exceptions as long as the
+	// throwing Read* are not used (define boost::throw_exception, see boost/throw_exception.hpp).
 	class ETFReader // External Term Format Reader
 	{
-		private: byte* Ptr_;
+		private: const byte* Ptr_;
 		private: const byte* pBuffer_;
+		private: const byte* pEnd_;
 		private: size_t Size_;
+		private: boost::shared_ptr<const byte> Frame_; // Owner of Ptr_, empty if read in place
 		
-		public: ETFReader(const byte* pBuf, size_t size):
+		// copy = false reads the buffer in place, it must outlive the reader (mapped capture file,
+		// frame buffer of the read loop) and whatever is read from it is copied out. A copied buffer
+		// is shared by copies of the reader and by the long binaries and handles read from it.
+		public: ETFReader(const byte* pBuf, size_t size, bool copy = true):
 			Ptr_(NULL),
 			pBuffer_(NULL),
+			pEnd_(NULL),
 			Size_(0)
 		{
-			if(!size)
-				return;
-			if(!pBuf)
-				throw std::invalid_argument("Zero Buffer Argument");
-			if(*pBuf != ERL_VERSION)
-				throw std::invalid_argument("Invalid Version (Current is 131)");
-			
-			byte* p = new byte[size];
-			Size_ = size;
-			memcpy(p, pBuf, Size_);
-			pBuffer_ = Ptr_ = p;
-			++pBuffer_; // Omit Version Number
+			Check(Open(pBuf, size, copy));
 		}
 		
-		public: ETFReader(const ETFReader& rhs):
+		// Never throws but std::bad_alloc of the copy: a buffer without the version number leaves
+		// the reader empty and status says why
+		public: ETFReader(const byte* pBuf, size_t size, bool copy, ETFStatus& status):
 			Ptr_(NULL),
 			pBuffer_(NULL),
+			pEnd_(NULL),
 			Size_(0)
 		{
-			operator =(rhs);
+			status = Open(pBuf, size, copy);
+		}
+		
+		// Frame owned by the caller and shared with the reader: nothing is copied, binaries and
+		// handles longer than RawData::INLINE_SIZE are slices of the frame
+		public: ETFReader(const boost::shared_ptr<const byte>& pFrame, size_t size):
+			Ptr_(NULL),
+			pBuffer_(NULL),
+			pEnd_(NULL),
+			Size_(0)
+		{
+			Check(Open(pFrame, size));
+		}
+		
+		public: ETFReader(const boost::shared_ptr<const byte>& pFrame, size_t size, ETFStatus& status):
+			Ptr_(NULL),
+			pBuffer_(NULL),
+			pEnd_(NULL),
+			Size_(0)
+		{
+			status = Open(pFrame, size);
 		}
 		
-		public: ~ETFReader(void)
+		public: ETFReader(const ETFReader& rhs):
+			Ptr_(NULL),
+			pBuffer_(NULL),
+			pEnd_(NULL),
+			Size_(0)
 		{
-			if(Ptr_)
-				delete[] Ptr_;
+			operator =(rhs);
 		}
 		
 		public: ETFReader& operator =(const ETFReader& rhs)
 		{
 			if(this != &rhs) {
-				byte* p = new byte[rhs.Size_];
-				if(Ptr_)
-					delete[] Ptr_;
-				pBuffer_ = Ptr_ = p;
+				Frame_ = (rhs.Frame_ || !rhs.Size_ ? rhs.Frame_ : NewSharedBlock(rhs.Ptr_, rhs.Size_));
+				Ptr_ = (Frame_ ? Frame_.get() : NULL);
 				Size_ = rhs.Size_;
-				memcpy(Ptr_, rhs.Ptr_, Size_);
-				pBuffer_ += (rhs.pBuffer_ - rhs.Ptr_);
+				pEnd_ = Ptr_ + Size_;
+				pBuffer_ = Ptr_ + (rhs.pBuffer_ - rhs.Ptr_);
 			}
 			return *this;
 		}
 		
-		private: size_t RestSize(void) const
+		// Second cursor over the buffer of rhs, at pos: it shares the frame or reads in place as rhs
+		// does (the copy constructor copies a buffer read in place), so a cursor per thread is free
+		public: ETFReader(const ETFReader& rhs, size_t pos):
+			Ptr_(rhs.Ptr_),
+			pBuffer_(rhs.Ptr_ + (rhs.Size_ ? 1 : 0)),
+			pEnd_(rhs.pEnd_),
+			Size_(rhs.Size_),
+			Frame_(rhs.Frame_)
+		{
+			Seek(pos);
+		}
+		
+		private: ETFStatus Open(const byte* pBuf, size_t size, bool copy)
+		{
+			if(!size)
+				return ETFStatus();
+			if(!pBuf || *pBuf != ERL_VERSION)
+				return ETFStatus(ETF_INVALID_VERSION, 0);
+			
+			Size_ = size;
+			if(copy) {
+				Frame_ = NewSharedBlock(pBuf, size);
+				pBuf = Frame_.get();
+			}
+			pBuffer_ = Ptr_ = pBuf;
+			pEnd_ = Ptr_ + Size_;
+			++pBuffer_; // Omit Version Number
+			return ETFStatus();
+		}
+		
+		private: ETFStatus Open(const boost::shared_ptr<const byte>& pFrame, size_t size)
+		{
+			ETFStatus status = Open(pFrame.get(), size, false);
+			if(status && size)
+				Frame_ = pFrame;
+			return status;
+		}
+		
+		// Bytes not read yet, the term read next starts at Size - RestSize() of the buffer
+		public: size_t RestSize(void) const
 		{
-			return (Size_ - (pBuffer_ - Ptr_));
+			return (size_t)(pEnd_ - pBuffer_);
 		}
 		
 		public: operator bool(void) const
@@ -200,408 +707,1744 @@ namespace Erlang
 		
 		public: UInt8 GetNextTag(void) const
 		{
-			UInt8 tag = 0;
+			return (pBuffer_ < pEnd_ ? *pBuffer_ : 0);
+		}
+		
+		// Position of the next term in the buffer, to come back to with Seek after probing
+		public: size_t Tell(void) const
+		{
+			return (size_t)(pBuffer_ - Ptr_);
+		}
+		
+		// Frame being read (version number at 0) that positions of Tell are in; it ends at
+		// Buffer() + Tell() + RestSize()
+		public: const byte* Buffer(void) const
+		{
+			return Ptr_;
+		}
+		
+		public: void Seek(size_t pos)
+		{
+			if(pos && pos <= Size_)
+				pBuffer_ = Ptr_ + pos;
+		}
+		
+		private: ETFStatus Fail(ETFError error, const byte* pPos) const
+		{
+			return ETFStatus(error, (size_t)(pPos - Ptr_));
+		}
+		
+		// n bytes left at pPos: one compare against the end of the buffer
+		private: bool Has(const byte* pPos, size_t n) const
+		{
+			return (size_t)(pEnd_ - pPos) >= n;
+		}
+		
+		private: void Check(const ETFStatus& status) const
+		{
+			if(status.Error != ETF_OK)
+				Raise(status);
+		}
+		
+		// The exception Read* throws for status (an error). Out of line, so the throwing Read* stay
+		// small enough to inline.
+		public: BOOST_NOINLINE BOOST_NORETURN static void Raise(const ETFStatus& status)
+		{
+			switch(status.Error) {
+				case ETF_INVALID_TAG:
+					boost::throw_exception(std::runtime_error(status.What()));
+				case ETF_INVALID_SIZE:
+				case ETF_BYTES_AFTER_TERM:
+					boost::throw_exception(std::length_error(status.What()));
+				case ETF_BAD_CAST:
+					boost::throw_exception(BadCast(status.What()));
+				case ETF_OVERFLOW:
+					boost::throw_exception(std::overflow_error(status.What()));
+				case ETF_INVALID_VERSION:
+					boost::throw_exception(std::invalid_argument(status.What()));
+				default:
+					boost::throw_exception(std::out_of_range(status.What()));
+			}
+		}
+		
+		// One structural pass over the rest of the buffer: terms complete terms and nothing after
+		// them (a frame is one term). Fails as Read* would on a broken or truncated term, so a frame
+		// can be rejected before anything in it is decoded; the pass costs about as much as a decode.
+		public: ETFStatus TryValidate(UInt64 terms = 1) const
+		{
 			const byte* pPos = pBuffer_;
-			if(RestSize() < sizeof(tag))
-				return 0;
-			RWBinary::Read(pPos, tag);
-			return tag;
+			if(ETFError error = SkipTerms(pPos, pEnd_, terms))
+				return Fail(error, pPos);
+			if(pPos != pEnd_)
+				return Fail(ETF_BYTES_AFTER_TERM, pPos);
+			return ETFStatus();
 		}
 		
-		public: UInt32 ReadTuple(void)
+		public: void Validate(UInt64 terms = 1) const
+		{
+			Check(TryValidate(terms));
+		}
+		
+		public: ETFStatus TryReadTuple(UInt32& size)
 		{
-			UInt8 tag = 0;
 			UInt8 smallTuple = 0;
 			UInt32 largeTuple = 0;
 			const byte* pPos = pBuffer_;
-			size_t count = RestSize();
 			
-			if(count < sizeof(tag))
-				throw std::out_of_range("Out of Buffer Range");
-			count -= sizeof(tag);
-			pPos = RWBinary::Read(pPos, tag);
+			if(!Has(pPos, sizeof(UInt8)))
+				return Fail(ETF_OUT_OF_RANGE, pPos);
+			UInt8 tag = *pPos++;
 			if(!(tag == SMALL_TUPLE_EXT || tag == LARGE_TUPLE_EXT))
-				throw std::runtime_error("Invalid Operation");
-			if(	(tag == SMALL_TUPLE_EXT && count < sizeof(smallTuple)) || 
-					(tag == LARGE_TUPLE_EXT && count < sizeof(largeTuple)))
-				throw std::out_of_range("Out of Buffer Range");
+				return Fail(ETF_INVALID_TAG, pBuffer_);
+			if(!Has(pPos, (tag == SMALL_TUPLE_EXT ? sizeof(smallTuple) : sizeof(largeTuple))))
+				return Fail(ETF_OUT_OF_RANGE, pPos);
 			
 			pBuffer_ = (tag == SMALL_TUPLE_EXT ? RWBinary::Read(pPos, smallTuple) : RWBinary::Read(pPos, largeTuple));
-			return (tag == SMALL_TUPLE_EXT ? smallTuple : largeTuple);
+			size = (tag == SMALL_TUPLE_EXT ? smallTuple : largeTuple);
+			return ETFStatus();
+		}
+		
+		public: UInt32 ReadTuple(void)
+		{
+			UInt32 size = 0;
+			Check(TryReadTuple(size));
+			return size;
 		}
 		
 		// T is the signed/unsigned number: 8bit, 16bit, 32bit, 64bit.
 		// A float is stored as 8 bytes in big-endian IEEE format.
 		// IEEE float format is used in minor version 1 of the external format.
-		public: template<typename T> T ReadNumber(void)
+		public: template<typename T> ETFStatus TryReadNumber(T& number)
 		{
-			UInt8 tag = 0;
 			const byte* pPos = pBuffer_;
-			size_t count = RestSize();
-			
-			if(count < sizeof(tag))
-				throw std::out_of_range("Out of Buffer Range");
-			count -= sizeof(tag);
-			pPos = RWBinary::Read(pPos, tag);
+			if(!Has(pPos, sizeof(UInt8)))
+				return Fail(ETF_OUT_OF_RANGE, pPos);
+			UInt8 tag = *pPos++;
 			
-			if(tag == SMALL_BIG_EXT || tag == LARGE_BIG_EXT) {
-				T value = T();
-				T maxT = (*std::numeric_limits<T>::max)();
+			if(tag == SMALL_INTEGER_EXT || tag == INTEGER_EXT) {
+				UInt8 value8 = 0;
+				UInt32 value32 = 0;
+				if(tag == INTEGER_EXT && sizeof(T) < sizeof(value32))
+					return Fail(ETF_BAD_CAST, pBuffer_);
+				if(!Has(pPos, (tag == SMALL_INTEGER_EXT ? sizeof(value8) : sizeof(value32))))
+					return Fail(ETF_OUT_OF_RANGE, pPos);
+				
+				pBuffer_ = (tag == SMALL_INTEGER_EXT ? RWBinary::Read(pPos, value8) : RWBinary::Read(pPos, value32));
+				if(tag == SMALL_INTEGER_EXT)
+					number = (T)value8;
+				else
+					number = (std::numeric_limits<T>::is_signed ? (T)(Int32)value32 : (T)value32); // INTEGER_EXT is signed
+				return ETFStatus();
+			}
+			else if(tag == SMALL_BIG_EXT || tag == LARGE_BIG_EXT) {
 				bool hasTSign = !((T)(-1) > 0);
 				UInt8 sign = 0;
 				UInt8 size8 = 0;
 				UInt32 size32 = 0;
 				
-				if((tag == SMALL_BIG_EXT && count < sizeof(size8)) || (tag == LARGE_BIG_EXT && count < sizeof(size32)))
-					throw std::out_of_range("Out of Buffer Range");
-				count -= (tag == SMALL_BIG_EXT ? sizeof(size8) : sizeof(size32));
+				if(!Has(pPos, (tag == SMALL_BIG_EXT ? sizeof(size8) : sizeof(size32)) + sizeof(sign)))
+					return Fail(ETF_OUT_OF_RANGE, pPos);
 				pPos = (tag == SMALL_BIG_EXT ? RWBinary::Read(pPos, size8) : RWBinary::Read(pPos, size32));
-				if(count < sizeof(sign))
-					throw std::out_of_range("Out of Buffer Range");
-				count -= sizeof(sign);
 				pPos = RWBinary::Read(pPos, sign);
 				if(sign == 1 && !hasTSign)
-					throw std::bad_cast("Cast Negative Integer to Unsigned");
+					return Fail(ETF_BAD_CAST, pPos - sizeof(sign));
 				
 				UInt32 size = (tag == SMALL_BIG_EXT ? size8 : size32);
-				for(UInt32 i = 0; i < size; ++i) {
-					UInt8 digit = 0;
-					if(count < sizeof(digit))
-						throw std::out_of_range("Out of Buffer Range");
-					count -= sizeof(digit);
-					pPos = RWBinary::Read(pPos, digit);
-					long double frame = digit*pow(256.0, (double)i);
-					if(errno == ERANGE || !frame)
-						throw std::overflow_error("pow Overflow");
-					if(frame > maxT || value > maxT - frame) // ERROR: as frame can be negative value
-						throw std::overflow_error("Overflow Integer");
-					value = (T)value + (T)frame; // Can't use value += ... because of warning for type < int
+				if(!Has(pPos, size))
+					return Fail(ETF_OUT_OF_RANGE, pPos);
+				const byte* digits = pPos; // Little-endian, base 256
+				
+				if(!std::numeric_limits<T>::is_integer) {
+					long double value = 0;
+					for(UInt32 i = size; i > 0; --i)
+						value = value*256 + digits[i - 1];
+					number = (T)(sign == 1 ? -value : value);
+					pBuffer_ = pPos + size;
+					return ETFStatus();
 				}
 				
-				pBuffer_ = pPos;
-				return (sign == 1 ? (T)(-1)*value : value);
-			}
-			else if(tag == SMALL_INTEGER_EXT || tag == INTEGER_EXT) {
-				UInt8 value8 = 0;
-				UInt32 value32 = 0;
-				if(	(tag == SMALL_INTEGER_EXT && count < sizeof(value8)) || 
-						(tag == INTEGER_EXT && count < sizeof(value32)))
-					throw std::out_of_range("Out of Buffer Range");
-				if(tag == INTEGER_EXT && sizeof(T) < sizeof(value32))
-					throw std::bad_cast("Cast Big Integer to Small Integer");
-				
-				pBuffer_ = (tag == SMALL_INTEGER_EXT ? RWBinary::Read(pPos, value8) : RWBinary::Read(pPos, value32));
-				return (tag == SMALL_INTEGER_EXT ? (T)value8 : (T)value32);
+				// Magnitude must fit T: max for positive, max + 1 for negative signed numbers
+				UInt64 magnitude = 0;
+				for(UInt32 i = 0; i < size; ++i) {
+					if(!digits[i])
+						continue;
+					if(i >= sizeof(UInt64))
+						return Fail(ETF_OVERFLOW, pBuffer_);
+					magnitude |= (UInt64(digits[i]) << (8*i));
+				}
+				UInt64 limit = (UInt64)(*std::numeric_limits<T>::max)() + (sign == 1 ? 1 : 0);
+				if(magnitude > limit)
+					return Fail(ETF_OVERFLOW, pBuffer_);
+				number = (sign == 1 ? (T)(0 - magnitude) : (T)magnitude);
+				pBuffer_ = pPos + size;
+				return ETFStatus();
 			}
 			else if(tag == NEW_FLOAT_EXT) {
 				UInt64 value = 0;
-				if(count < sizeof(value))
-					throw std::out_of_range("Out of Buffer Range");
 				if(sizeof(T) < sizeof(value))
-					throw std::bad_cast("Cast Big Type to Small Type");
+					return Fail(ETF_BAD_CAST, pBuffer_);
+				if(!Has(pPos, sizeof(value)))
+					return Fail(ETF_OUT_OF_RANGE, pPos);
 				pBuffer_ = RWBinary::Read(pPos, value);
-				return *(T*)(&value);
+				memcpy(&number, &value, sizeof(value));
+				return ETFStatus();
 			}
-			else
-				throw std::invalid_argument("Invalid Operation");
+			return Fail(ETF_INVALID_TAG, pBuffer_);
+		}
+		
+		public: template<typename T> T ReadNumber(void)
+		{
+			T number = T();
+			Check(TryReadNumber(number));
+			return number;
+		}
+		
+		public: ETFStatus TryReadNil(void)
+		{
+			if(!Has(pBuffer_, sizeof(UInt8)))
+				return Fail(ETF_OUT_OF_RANGE, pBuffer_);
+			if(*pBuffer_ != NIL_EXT)
+				return Fail(ETF_INVALID_TAG, pBuffer_);
+			++pBuffer_;
+			return ETFStatus();
 		}
 		
 		public: void ReadNil(void)
 		{
-			UInt8 tag = 0;
-			const byte* pPos = pBuffer_;
-			size_t count = RestSize();
-			
-			if(count < sizeof(tag))
-				throw std::out_of_range("Out of Buffer Range");
-			count -= sizeof(tag);
-			pPos = RWBinary::Read(pPos, tag);
-			if(tag != NIL_EXT)
-				throw std::runtime_error("Invalid Operation");
-			
-			pBuffer_ = pPos;
+			Check(TryReadNil());
 		}
 		
-		public: UInt8* ReadASCII(void)
+		public: ETFStatus TryReadASCII(UInt8*& str)
 		{
-			UInt8 tag = 0;
 			UInt16 size = 0;
-			UInt8* str = NULL;
 			const byte* pPos = pBuffer_;
-			size_t count = RestSize();
 			
-			if(sizeof(count) < sizeof(size))
-				throw std::bad_cast("Huge Size of Array");
-			if(count < sizeof(tag))
-				throw std::out_of_range("Out of Buffer Range");
-			count -= sizeof(tag);
-			pPos = RWBinary::Read(pPos, tag);
+			if(!Has(pPos, sizeof(UInt8)))
+				return Fail(ETF_OUT_OF_RANGE, pPos);
+			UInt8 tag = *pPos++;
 			if(tag == NIL_EXT) {
 				pBuffer_ = pPos;
-				str = new UInt8[1];
+				str = NewArray<UInt8>(1);
 				str[0] = '\0';
-				return str;
+				return ETFStatus();
 			}
 			if(tag != STRING_EXT)
-				throw std::runtime_error("Invalid Operation");
-			if(count < sizeof(size))
-				throw std::out_of_range("Out of Buffer Range");
-			count -= sizeof(size);
+				return Fail(ETF_INVALID_TAG, pBuffer_);
+			if(!Has(pPos, sizeof(size)))
+				return Fail(ETF_OUT_OF_RANGE, pPos);
 			pPos = RWBinary::Read(pPos, size);
 			if(!size)
-				throw std::length_error("Invalid Null String Size");
-			if(count < size)
-				throw std::out_of_range("Out of Buffer Range");
+				return Fail(ETF_INVALID_SIZE, pPos - sizeof(size));
+			if(!Has(pPos, size))
+				return Fail(ETF_OUT_OF_RANGE, pPos);
 			
-			str = new UInt8[size + 1];
+			str = NewArray<UInt8>(size + 1);
 			pPos = RWBinary::Read(pPos, str, size);
 			str[size] = '\0';
 			
 			pBuffer_ = pPos;
+			return ETFStatus();
+		}
+		
+		public: UInt8* ReadASCII(void)
+		{
+			UInt8* str = NULL;
+			Check(TryReadASCII(str));
 			return str;
 		}
 		
-		public: UInt16* ReadUnicode(void)
+		// List of character codes, SMALL_INTEGER_EXT (0..255) or INTEGER_EXT (up to 65535)
+		public: ETFStatus TryReadUnicode(UInt16*& result)
 		{
-			UInt8 tag = 0;
 			UInt32 size = 0;
 			UInt16* str = NULL;
-			UInt16 c = 0;
-			UInt16 maxUInt16 = (*std::numeric_limits<UInt16>::max)();
 			const byte* pPos = pBuffer_;
-			size_t count = RestSize();
 			
-			if(sizeof(count) < sizeof(size))
-				throw std::bad_cast("Huge Size of Array");
-			if(count < sizeof(tag))
-				throw std::out_of_range("Out of Buffer Range");
-			count -= sizeof(tag);
-			pPos = RWBinary::Read(pPos, tag);
+			if(!Has(pPos, sizeof(UInt8)))
+				return Fail(ETF_OUT_OF_RANGE, pPos);
+			UInt8 tag = *pPos++;
 			if(tag == NIL_EXT) {
 				pBuffer_ = pPos;
-				str = new UInt16[1];
-				str[0] = L'\0';
-				return str;
+				result = NewArray<UInt16>(1);
+				result[0] = L'\0';
+				return ETFStatus();
 			}
 			if(tag != LIST_EXT)
-				throw std::runtime_error("Invalid Operation");
-			if(count < sizeof(size))
-				throw std::out_of_range("Out of Buffer Range");
-			count -= sizeof(size);
+				return Fail(ETF_INVALID_TAG, pBuffer_);
+			if(!Has(pPos, sizeof(size)))
+				return Fail(ETF_OUT_OF_RANGE, pPos);
 			pPos = RWBinary::Read(pPos, size);
 			if(!size)
-				throw std::length_error("Invalid Null String Size");
+				return Fail(ETF_INVALID_SIZE, pPos - sizeof(size));
+			// Two bytes a character at least and the tail: checked before allocating, then only the
+			// wider INTEGER_EXT characters need a check of their own
+			if(!Has(pPos, 2*(size_t)size + 1))
+				return Fail(ETF_OUT_OF_RANGE, pPos);
 			
 			// Read String
-			str = new UInt16[size + 1];
+			str = NewArray<UInt16>(size + 1);
+			ETFError error = ETF_OK;
 			for(UInt32 i = 0; i < size; ++i) {
-				if(count < sizeof(tag)) {
-					delete[] str;
-					throw std::out_of_range("Out of Buffer Range");
+				tag = *pPos;
+				if(tag == SMALL_INTEGER_EXT) {
+					str[i] = pPos[1];
+					pPos += 1 + sizeof(UInt8);
+					continue;
+				}
+				Int32 value32 = 0;
+				if(tag != INTEGER_EXT) {
+					error = ETF_INVALID_TAG;
+					break;
+				}
+				if(!Has(pPos, 1 + sizeof(value32) + 2*(size_t)(size - i - 1) + 1)) {
+					error = ETF_OUT_OF_RANGE;
+					break;
+				}
+				RWBinary::Read(pPos + 1, value32);
+				if(value32 < 0 || value32 > (*std::numeric_limits<UInt16>::max)()) {
+					error = ETF_BAD_CAST;
+					break;
+				}
+				str[i] = (UInt16)value32;
+				pPos += 1 + sizeof(value32);
+			}
+			
+			// Read Tail - Nil
+			if(!error && *pPos != NIL_EXT)
+				error = ETF_INVALID_TAG;
+			if(error) {
+				delete[] str;
+				return Fail(error, pPos);
+			}
+			
+			str[size] = 0;
+			pBuffer_ = pPos + 1;
+			result = str;
+			return ETFStatus();
+		}
+		
+		public: UInt16* ReadUnicode(void)
+		{
+			UInt16* str = NULL;
+			Check(TryReadUnicode(str));
+			return str;
+		}
+		
+		public: ETFStatus TryReadList(UInt32& size)
+		{
+			const byte* pPos = pBuffer_;
+			
+			if(!Has(pPos, sizeof(UInt8)))
+				return Fail(ETF_OUT_OF_RANGE, pPos);
+			if(*pPos++ != LIST_EXT)
+				return Fail(ETF_INVALID_TAG, pBuffer_);
+			if(!Has(pPos, sizeof(size)))
+				return Fail(ETF_OUT_OF_RANGE, pPos);
+			
+			pBuffer_ = RWBinary::Read(pPos, size);
+			return ETFStatus();
+		}
+		
+		public: UInt32 ReadList(void)
+		{
+			UInt32 size = 0;
+			Check(TryReadList(size));
+			return size;
+		}
+		
+		public: ETFStatus TryReadAtom(UInt8*& str)
+		{
+			UInt16 size = 0, size16 = 0;
+			UInt8 size8 = 0;
+			const byte* pPos = pBuffer_;
+			
+			if(!Has(pPos, sizeof(UInt8)))
+				return Fail(ETF_OUT_OF_RANGE, pPos);
+			UInt8 tag = *pPos++;
+			// Current OTP emits atoms as (SMALL_)ATOM_UTF8_EXT, the name is returned as UTF-8 bytes
+			bool isSmall = (tag == SMALL_ATOM_EXT || tag == SMALL_ATOM_UTF8_EXT);
+			bool isUTF8 = (tag == ATOM_UTF8_EXT || tag == SMALL_ATOM_UTF8_EXT);
+			if(!(isSmall || tag == ATOM_EXT || tag == ATOM_UTF8_EXT))
+				return Fail(ETF_INVALID_TAG, pBuffer_);
+			if(!Has(pPos, (isSmall ? sizeof(size8) : sizeof(size16))))
+				return Fail(ETF_OUT_OF_RANGE, pPos);
+			pPos = (isSmall ? RWBinary::Read(pPos, size8) : RWBinary::Read(pPos, size16));
+			size = (isSmall ? size8 : size16);
+			if(!size || size > (isUTF8 ? 4*255 : 255))
+				return Fail(ETF_INVALID_SIZE, pBuffer_ + 1);
+			if(!Has(pPos, size))
+				return Fail(ETF_OUT_OF_RANGE, pPos);
+			
+			str = NewArray<UInt8>(size + 1);
+			pPos = RWBinary::Read(pPos, str, size);
+			str[size] = '\0';
+			
+			pBuffer_ = pPos;
+			return ETFStatus();
+		}
+		
+		public: UInt8* ReadAtom(void)
+		{
+			UInt8* str = NULL;
+			Check(TryReadAtom(str));
+			return str;
+		}
+		
+		// The skip helpers move pPos over a part of a term; on error pPos is left at the field
+		// that was found wrong. Move over N bytes of fixed size fields:
+		private: static ETFError Skip(const byte*& pPos, const byte* pEnd, size_t n)
+		{
+			if((size_t)(pEnd - pPos) < n)
+				return ETF_OUT_OF_RANGE;
+			pPos += n;
+			return ETF_OK;
+		}
+		
+		// Read a fixed size field (sizes of the variable ones) at pPos
+		private: template<typename T> static ETFError ReadField(const byte*& pPos, const byte* pEnd, T& value)
+		{
+			if((size_t)(pEnd - pPos) < sizeof(value))
+				return ETF_OUT_OF_RANGE;
+			pPos = RWBinary::Read(pPos, value);
+			return ETF_OK;
+		}
+		
+		// Move over atom - Node name of pid, port and reference, module and function of export
+		private: static ETFError SkipAtom(const byte*& pPos, const byte* pEnd)
+		{
+			if(pEnd - pPos < 2)
+				return ETF_OUT_OF_RANGE;
+			UInt8 tag = *pPos;
+			size_t size = pPos[1], header = 2;
+			if(tag == ATOM_CACHE_REF) {
+				pPos += 2;
+				return ETF_OK;
+			}
+			if(tag == ATOM_EXT || tag == ATOM_UTF8_EXT) {
+				if(pEnd - pPos < 3)
+					return ETF_OUT_OF_RANGE;
+				size = (size << 8) | pPos[2];
+				header = 3;
+			}
+			else if(!(tag == SMALL_ATOM_EXT || tag == SMALL_ATOM_UTF8_EXT))
+				return ETF_INVALID_TAG;
+			if(!size || size > (tag == ATOM_UTF8_EXT || tag == SMALL_ATOM_UTF8_EXT ? 4*255 : 255))
+				return ETF_INVALID_SIZE;
+			if((size_t)(pEnd - pPos) < header + size)
+				return ETF_OUT_OF_RANGE;
+			pPos += header + size;
+			return ETF_OK;
+		}
+		
+		// Move over body (after tag) of reference, pid, port or fun
+		private: static ETFError SkipHandle(UInt8 tag, const byte*& pPos, const byte* pEnd)
+		{
+			UInt16 len = 0;
+			UInt32 size = 0;
+			
+			switch(tag) {
+				case REFERENCE_EXT:
+					// Node, 4 bytes (ID), 1 byte (Creation)
+					if(ETFError error = SkipAtom(pPos, pEnd))
+						return error;
+					return Skip(pPos, pEnd, sizeof(UInt32) + sizeof(UInt8));
+				
+				case NEW_REFERENCE_EXT:
+				case NEWER_REFERENCE_EXT:
+					// Len (2 bytes), Node, Creation (1 or 4 bytes for NEWER_REFERENCE_EXT), N*4-bytes (ID)
+					if(ETFError error = ReadField(pPos, pEnd, len))
+						return error;
+					if(!len) {
+						pPos -= sizeof(len);
+						return ETF_INVALID_SIZE;
+					}
+					if(ETFError error = SkipAtom(pPos, pEnd))
+						return error;
+					return Skip(pPos, pEnd, (tag == NEW_REFERENCE_EXT ? sizeof(UInt8) : sizeof(UInt32)) + 4U*len);
+				
+				case PID_EXT:
+				case NEW_PID_EXT:
+					// Node, 4 bytes (ID), 4 bytes (Serial), 1 byte (PID_EXT) or 4 bytes (NEW_PID_EXT) Creation
+					if(ETFError error = SkipAtom(pPos, pEnd))
+						return error;
+					return Skip(pPos, pEnd, 2*sizeof(UInt32) + (tag == PID_EXT ? sizeof(UInt8) : sizeof(UInt32)));
+				
+				case PORT_EXT:
+				case NEW_PORT_EXT:
+				case V4_PORT_EXT:
+					// Node, ID (4 or 8 bytes for V4_PORT_EXT), Creation (1 or 4 bytes for NEW_PORT_EXT, V4_PORT_EXT)
+					if(ETFError error = SkipAtom(pPos, pEnd))
+						return error;
+					if(tag == PORT_EXT)
+						return Skip(pPos, pEnd, sizeof(UInt32) + sizeof(UInt8));
+					else if(tag == NEW_PORT_EXT)
+						return Skip(pPos, pEnd, sizeof(UInt32) + sizeof(UInt32));
+					return Skip(pPos, pEnd, sizeof(UInt64) + sizeof(UInt32));
+				
+				case NEW_FUN_EXT:
+				{
+					// Size is the total number of bytes, including the Size field
+					const byte* pSize = pPos;
+					if(ETFError error = ReadField(pSize, pEnd, size))
+						return error;
+					if(size < sizeof(size))
+						return ETF_INVALID_SIZE;
+					return Skip(pPos, pEnd, size);
+				}
+				
+				case EXPORT_EXT:
+				{
+					// Module (atom), Function (atom), Arity (SMALL_INTEGER_EXT)
+					UInt8 arityTag = 0;
+					if(ETFError error = SkipAtom(pPos, pEnd))
+						return error;
+					if(ETFError error = SkipAtom(pPos, pEnd))
+						return error;
+					if(ETFError error = ReadField(pPos, pEnd, arityTag))
+						return error;
+					if(arityTag != SMALL_INTEGER_EXT) {
+						pPos -= sizeof(arityTag);
+						return ETF_INVALID_TAG;
+					}
+					return Skip(pPos, pEnd, sizeof(UInt8));
+				}
+				
+				default:
+					--pPos; // At the tag
+					return ETF_INVALID_TAG;
+			}
+		}
+		
+		// Move over terms of any type without decoding them, this is also the structural check of
+		// Validate. Containers add their elements to the number of terms left, so nesting depth costs
+		// no stack; integers, the most common elements of lists, take the short way.
+		private: static ETFError SkipTerms(const byte*& pPos, const byte* pEnd, UInt64 terms)
+		{
+			ETFError error = ETF_OK;
+			while(terms) {
+				--terms;
+				if(pPos >= pEnd)
+					return ETF_OUT_OF_RANGE;
+				UInt8 tag = *pPos;
+				if(tag == SMALL_INTEGER_EXT) {
+					if((error = Skip(pPos, pEnd, 1 + sizeof(UInt8))) != ETF_OK)
+						return error;
+					continue;
+				}
+				if(tag == INTEGER_EXT) {
+					if((error = Skip(pPos, pEnd, 1 + sizeof(UInt32))) != ETF_OK)
+						return error;
+					continue;
+				}
+				switch(tag) {
+					case ATOM_EXT:
+					case SMALL_ATOM_EXT:
+					case ATOM_UTF8_EXT:
+					case SMALL_ATOM_UTF8_EXT:
+					case ATOM_CACHE_REF:
+						if((error = SkipAtom(pPos, pEnd)) != ETF_OK)
+							return error;
+						continue;
+				}
+				++pPos;
+				switch(tag) {
+					case NIL_EXT:
+						break;
+					case NEW_FLOAT_EXT:
+						error = Skip(pPos, pEnd, sizeof(UInt64));
+						break;
+					case FLOAT_EXT:
+						error = Skip(pPos, pEnd, 31);
+						break;
+					case SMALL_TUPLE_EXT:
+					{
+						UInt8 size8 = 0;
+						error = ReadField(pPos, pEnd, size8);
+						terms += size8;
+						break;
+					}
+					case LARGE_TUPLE_EXT:
+					case LIST_EXT:
+					case MAP_EXT:
+					{
+						UInt32 size32 = 0;
+						error = ReadField(pPos, pEnd, size32);
+						// Elements; list also has a tail, map has key-value pairs
+						terms += (tag == LARGE_TUPLE_EXT ? (UInt64)size32 : (tag == LIST_EXT ? (UInt64)size32 + 1 : 2*(UInt64)size32));
+						break;
+					}
+					case STRING_EXT:
+					{
+						UInt16 size16 = 0;
+						if((error = ReadField(pPos, pEnd, size16)) == ETF_OK)
+							error = Skip(pPos, pEnd, size16);
+						break;
+					}
+					case BINARY_EXT:
+					case BIT_BINARY_EXT:
+					{
+						UInt32 size32 = 0;
+						if((error = ReadField(pPos, pEnd, size32)) == ETF_OK)
+							error = Skip(pPos, pEnd, (tag == BIT_BINARY_EXT ? sizeof(UInt8) : 0) + (size_t)size32);
+						break;
+					}
+					case SMALL_BIG_EXT:
+					{
+						UInt8 size8 = 0;
+						if((error = ReadField(pPos, pEnd, size8)) == ETF_OK)
+							error = Skip(pPos, pEnd, sizeof(UInt8) + (size_t)size8); // Sign, digits
+						break;
+					}
+					case LARGE_BIG_EXT:
+					{
+						UInt32 size32 = 0;
+						if((error = ReadField(pPos, pEnd, size32)) == ETF_OK)
+							error = Skip(pPos, pEnd, sizeof(UInt8) + (size_t)size32); // Sign, digits
+						break;
+					}
+					default:
+						error = SkipHandle(tag, pPos, pEnd);
+						break;
 				}
-				count -= sizeof(tag);
-				pPos = RWBinary::Read(pPos, tag);
+				if(error)
+					return error;
+			}
+			return ETF_OK;
+		}
+		
+		// Move over next term of any type (tuples, lists and maps with all their elements)
+		public: ETFStatus TrySkipTerm(void)
+		{
+			const byte* pPos = pBuffer_;
+			if(ETFError error = SkipTerms(pPos, pEnd_, 1))
+				return Fail(error, pPos);
+			pBuffer_ = pPos;
+			return ETFStatus();
+		}
+		
+		public: void SkipTerm(void)
+		{
+			Check(TrySkipTerm());
+		}
+		
+		// erlang:phash2(Term, 1 bsl 32) of the next term (see PHash2), computed on the encoded bytes
+		// in one pass, and the reader moves over it. Numbers, atoms, binaries, bitstrings and lists
+		// and tuples of them; pids, ports, references, funs, maps and old FLOAT_EXT are
+		// ETF_INVALID_TAG (their hash needs the emulator's view of the node or map order).
+		public: ETFStatus TryPHash2(UInt32& hash)
+		{
+			const byte* pPos = pBuffer_;
+			Erlang::PHash2 h;
+			if(ETFError error = PHash2Terms(pPos, pEnd_, h))
+				return Fail(error, pPos);
+			pBuffer_ = pPos;
+			hash = h.Value;
+			return ETFStatus();
+		}
+		
+		public: UInt32 PHash2(void)
+		{
+			UInt32 hash = 0;
+			Check(TryPHash2(hash));
+			return hash;
+		}
+		
+		// Feeds the next term to hash. Tuples and lists being walked are kept as the count of their
+		// terms left, a list counting its tail too (OPEN_LIST marks them), so the bytes of a list are
+		// told from its tail and nesting costs no native stack.
+		private: static ETFError PHash2Terms(const byte*& pPos, const byte* pEnd, Erlang::PHash2& hash)
+		{
+			const UInt64 OPEN_LIST = 1ULL << 63;
+			UInt64 fixed[32];
+			std::vector<UInt64> grown;
+			UInt64* open = fixed;
+			size_t depth = 0, capacity = sizeof(fixed)/sizeof(fixed[0]);
+			open[depth++] = 1; // The term
+			ETFError error = ETF_OK;
+			while(depth) {
+				UInt64& top = open[depth - 1];
+				if(!(top & ~OPEN_LIST)) {
+					--depth;
+					continue;
+				}
+				--top;
+				bool element = ((top & OPEN_LIST) && (top & ~OPEN_LIST)); // Of a list, not its tail
+				bool tail = ((top & OPEN_LIST) && !element);
+				if(pPos >= pEnd)
+					return ETF_OUT_OF_RANGE;
+				UInt8 tag = *pPos;
+				UInt64 push = 0;
 				if(tag == SMALL_INTEGER_EXT || tag == INTEGER_EXT) {
-					Int8 value8 = 0;
-					Int32 value32 = 0;
-					if(	(tag == SMALL_INTEGER_EXT && count < sizeof(value8)) || 
-							(tag == INTEGER_EXT && count < sizeof(value32))) {
-						delete[] str;
-						throw std::out_of_range("Out of Buffer Range");
+					UInt8 value8 = 0;
+					UInt32 value32 = 0;
+					++pPos;
+					if((error = (tag == SMALL_INTEGER_EXT ? ReadField(pPos, pEnd, value8) : ReadField(pPos, pEnd, value32))) != ETF_OK)
+						return error;
+					Int64 value = (tag == SMALL_INTEGER_EXT ? (Int64)value8 : (Int64)(Int32)value32);
+					if(element && value >= 0 && value <= 255) {
+						hash.Byte((UInt8)value);
+						continue;
+					}
+					hash.EndRun();
+					hash.Integer(value);
+					continue;
+				}
+				if(tail && tag == LIST_EXT) { // [...|[...]] is one list
+					UInt32 size32 = 0;
+					++pPos;
+					if((error = ReadField(pPos, pEnd, size32)) != ETF_OK)
+						return error;
+					top = OPEN_LIST | ((UInt64)size32 + 1);
+					continue;
+				}
+				if(tag == STRING_EXT) { // Bytes and the tail, a run of the list it is the tail of
+					UInt16 size16 = 0;
+					if(!tail)
+						hash.EndRun();
+					++pPos;
+					if((error = ReadField(pPos, pEnd, size16)) != ETF_OK)
+						return error;
+					if((size_t)(pEnd - pPos) < size16)
+						return ETF_OUT_OF_RANGE;
+					for(UInt16 i = 0; i < size16; ++i)
+						hash.Byte(*pPos++);
+					hash.EndRun();
+					hash.Nil();
+					continue;
+				}
+				
+				hash.EndRun();
+				switch(tag) {
+					case ATOM_EXT:
+					case SMALL_ATOM_EXT:
+					case ATOM_UTF8_EXT:
+					case SMALL_ATOM_UTF8_EXT:
+					{
+						const byte* pAtom = pPos;
+						if((error = SkipAtom(pPos, pEnd)) != ETF_OK)
+							return error;
+						size_t header = (tag == ATOM_EXT || tag == ATOM_UTF8_EXT ? 3 : 2);
+						hash.Atom(pAtom + header, (size_t)(pPos - pAtom) - header, (tag == ATOM_UTF8_EXT || tag == SMALL_ATOM_UTF8_EXT));
+						break;
+					}
+					case NIL_EXT:
+						++pPos;
+						hash.Nil();
+						break;
+					case NEW_FLOAT_EXT:
+					{
+						UInt64 bits = 0;
+						++pPos;
+						if((error = ReadField(pPos, pEnd, bits)) != ETF_OK)
+							return error;
+						hash.Float(bits);
+						break;
+					}
+					case SMALL_BIG_EXT:
+					case LARGE_BIG_EXT:
+					{
+						UInt8 size8 = 0, sign = 0;
+						UInt32 size32 = 0;
+						++pPos;
+						if((error = (tag == SMALL_BIG_EXT ? ReadField(pPos, pEnd, size8) : ReadField(pPos, pEnd, size32))) != ETF_OK ||
+								(error = ReadField(pPos, pEnd, sign)) != ETF_OK)
+							return error;
+						size_t size = (tag == SMALL_BIG_EXT ? size8 : size32);
+						if((size_t)(pEnd - pPos) < size)
+							return ETF_OUT_OF_RANGE;
+						hash.Big(sign != 0, pPos, size);
+						pPos += size;
+						break;
+					}
+					case BINARY_EXT:
+					case BIT_BINARY_EXT:
+					{
+						UInt32 size32 = 0;
+						UInt8 bits = 8;
+						++pPos;
+						if((error = ReadField(pPos, pEnd, size32)) != ETF_OK || (tag == BIT_BINARY_EXT && (error = ReadField(pPos, pEnd, bits)) != ETF_OK))
+							return error;
+						if((size_t)(pEnd - pPos) < size32)
+							return ETF_OUT_OF_RANGE;
+						if(size32 && bits && bits < 8)
+							hash.Binary(pPos, size32 - 1, bits);
+						else
+							hash.Binary(pPos, size32);
+						pPos += size32;
+						break;
+					}
+					case SMALL_TUPLE_EXT:
+					case LARGE_TUPLE_EXT:
+					{
+						UInt8 size8 = 0;
+						UInt32 size32 = 0;
+						++pPos;
+						if((error = (tag == SMALL_TUPLE_EXT ? ReadField(pPos, pEnd, size8) : ReadField(pPos, pEnd, size32))) != ETF_OK)
+							return error;
+						push = (tag == SMALL_TUPLE_EXT ? size8 : size32);
+						hash.Tuple((UInt32)push);
+						break;
 					}
-					count -= (tag == SMALL_INTEGER_EXT ? sizeof(value8) : sizeof(value32));
-					pPos = (tag == SMALL_INTEGER_EXT ? RWBinary::Read(pPos, value8) : RWBinary::Read(pPos, value32));
-					if(value32 > maxUInt16) {
-						delete[] str;
-						throw std::bad_cast("Cast Big Integer to Small Integer");
+					case LIST_EXT:
+					{
+						UInt32 size32 = 0;
+						++pPos;
+						if((error = ReadField(pPos, pEnd, size32)) != ETF_OK)
+							return error;
+						push = OPEN_LIST | ((UInt64)size32 + 1);
+						break;
 					}
-					c = (UInt16)(tag == SMALL_INTEGER_EXT ? value8 : value32);
+					default:
+						return ETF_INVALID_TAG;
 				}
-				else {
-					delete[] str;
-					throw std::runtime_error("Invalid Operation");
+				if(push) {
+					if(depth == capacity) {
+						if(open == fixed)
+							grown.assign(fixed, fixed + depth);
+						grown.resize(capacity *= 2);
+						open = &grown[0];
+					}
+					open[depth++] = push;
+				}
+			}
+			return ETF_OK;
+		}
+		
+		// Standard term order of the next term of this reader against the next term of other, decided
+		// on the encoded bytes: number < atom < reference < fun < port < pid < tuple < map < [] < list
+		// < bitstring. Numbers compare by value (1 == 1.0, exactly for bignums against floats), a
+		// string as the list of its codes, atoms by their characters whatever the encoding, maps by
+		// size, then keys in order, then values. order is negative, 0 (==) or positive; neither reader
+		// moves. Pids, ports and references compare by node name, the numbers from the most
+		// significant and creation; local funs by module, index, uniq and free variables, before
+		// export funs (module, function, arity). ATOM_CACHE_REF is ETF_INVALID_TAG, maps nested
+		// deeper than MAX_MAP_DEPTH are ETF_INVALID_SIZE. On error Offset is in this reader's term.
+		public: ETFStatus TryCompare(const ETFReader& other, int& order) const
+		{
+			const byte* pA = pBuffer_;
+			const byte* pB = other.pBuffer_;
+			if(ETFError error = CompareTerms(pA, pEnd_, pB, other.pEnd_, order, false, 0))
+				return Fail(error, pA);
+			return ETFStatus();
+		}
+		
+		public: int Compare(const ETFReader& other) const
+		{
+			int order = 0;
+			Check(TryCompare(other, order));
+			return order;
+		}
+		
+		// TryCompare of the terms at pA and pB (no version number) of buffers ending at pEndA and
+		// pEndB, for sorting positions of terms (TermSort); exact is the order of map keys, where 1 <
+		// 1.0
+		public: static ETFError CompareAt(const byte* pA, const byte* pEndA, const byte* pB, const byte* pEndB, int& order, bool exact = false)
+		{
+			return CompareTerms(pA, pEndA, pB, pEndB, order, exact, 0);
+		}
+		
+		public: static const size_t MAX_MAP_DEPTH = 64;
+		
+		// Container being compared: a tuple (fun free variables) has the same terms left on both
+		// sides, a list on each side the elements before its tail, or the bytes of a STRING_EXT
+		private: struct OrderOpen
+		{
+			public: UInt64 Terms;
+			public: bool List;
+			public: UInt32 Left[2];
+			public: bool String[2];
+		};
+		
+		// Number as the order sees it: a double, or sign and little-endian magnitude without leading
+		// zeros
+		private: struct OrderNumber
+		{
+			public: bool Float;
+			public: double Value;
+			public: bool Negative;
+			public: const byte* pDigits;
+			public: size_t Size;
+			public: byte Small[4];
+		};
+		
+		// Pid, port or reference: node, the numbers from the most significant (references of fewer
+		// words are padded with zeros in front), creation
+		private: struct OrderHandle
+		{
+			public: const byte* pNode;
+			public: size_t NodeSize;
+			public: bool NodeUtf8;
+			public: UInt32 Words[8];
+			public: UInt32 Creation;
+		};
+		
+		// Class of the term at pPos (pPos < pEnd) in the standard order, 0 if it can't be compared
+		private: static int OrderClass(const byte* pPos, const byte* pEnd)
+		{
+			switch(*pPos) {
+				case SMALL_INTEGER_EXT:
+				case INTEGER_EXT:
+				case FLOAT_EXT:
+				case NEW_FLOAT_EXT:
+				case SMALL_BIG_EXT:
+				case LARGE_BIG_EXT:
+					return 1;
+				case ATOM_EXT:
+				case SMALL_ATOM_EXT:
+				case ATOM_UTF8_EXT:
+				case SMALL_ATOM_UTF8_EXT:
+					return 2;
+				case REFERENCE_EXT:
+				case NEW_REFERENCE_EXT:
+				case NEWER_REFERENCE_EXT:
+					return 3;
+				case NEW_FUN_EXT:
+				case EXPORT_EXT:
+					return 4;
+				case PORT_EXT:
+				case NEW_PORT_EXT:
+				case V4_PORT_EXT:
+					return 5;
+				case PID_EXT:
+				case NEW_PID_EXT:
+					return 6;
+				case SMALL_TUPLE_EXT:
+				case LARGE_TUPLE_EXT:
+					return 7;
+				case MAP_EXT:
+					return 8;
+				case NIL_EXT:
+					return 9;
+				case STRING_EXT:
+					return (pEnd - pPos >= 3 && !pPos[1] && !pPos[2] ? 9 : 10); // "" is []
+				case LIST_EXT:
+					return 10;
+				case BINARY_EXT:
+				case BIT_BINARY_EXT:
+					return 11;
+			}
+			return 0;
+		}
+		
+		private: static int Sign(int value)
+		{
+			return (value < 0 ? -1 : (value > 0 ? 1 : 0));
+		}
+		
+		private: static ETFError ReadOrderNumber(const byte*& pPos, const byte* pEnd, OrderNumber& n)
+		{
+			ETFError error = ETF_OK;
+			UInt8 tag = *pPos++;
+			n.Float = false;
+			n.Value = 0;
+			n.Negative = false;
+			n.pDigits = n.Small;
+			n.Size = 0;
+			switch(tag) {
+				case SMALL_INTEGER_EXT:
+				{
+					UInt8 value8 = 0;
+					if((error = ReadField(pPos, pEnd, value8)) != ETF_OK)
+						return error;
+					n.Small[0] = value8;
+					n.Size = 1;
+					break;
 				}
-				str[i] = c;
+				case INTEGER_EXT:
+				{
+					UInt32 value32 = 0;
+					if((error = ReadField(pPos, pEnd, value32)) != ETF_OK)
+						return error;
+					n.Negative = ((Int32)value32 < 0);
+					UInt32 magnitude = (n.Negative ? 0 - value32 : value32);
+					for(n.Size = 0; n.Size < 4; ++n.Size, magnitude >>= 8)
+						n.Small[n.Size] = (byte)magnitude;
+					break;
+				}
+				case SMALL_BIG_EXT:
+				case LARGE_BIG_EXT:
+				{
+					UInt8 size8 = 0, sign = 0;
+					UInt32 size32 = 0;
+					if((error = (tag == SMALL_BIG_EXT ? ReadField(pPos, pEnd, size8) : ReadField(pPos, pEnd, size32))) != ETF_OK ||
+							(error = ReadField(pPos, pEnd, sign)) != ETF_OK)
+						return error;
+					n.Size = (tag == SMALL_BIG_EXT ? size8 : size32);
+					if((size_t)(pEnd - pPos) < n.Size)
+						return ETF_OUT_OF_RANGE;
+					n.Negative = (sign != 0);
+					n.pDigits = pPos;
+					pPos += n.Size;
+					break;
+				}
+				case NEW_FLOAT_EXT:
+				{
+					UInt64 bits = 0;
+					if((error = ReadField(pPos, pEnd, bits)) != ETF_OK)
+						return error;
+					n.Float = true;
+					memcpy(&n.Value, &bits, sizeof(bits));
+					return ETF_OK;
+				}
+				default: // FLOAT_EXT, "%.20e" padded with zeros
+				{
+					char text[32] = { 0 };
+					if((size_t)(pEnd - pPos) < 31)
+						return ETF_OUT_OF_RANGE;
+					memcpy(text, pPos, 31);
+					pPos += 31;
+					n.Float = true;
+					n.Value = strtod(text, NULL);
+					return ETF_OK;
+				}
+			}
+			while(n.Size && !n.pDigits[n.Size - 1])
+				--n.Size;
+			n.Negative = (n.Negative && n.Size);
+			return ETF_OK;
+		}
+		
+		private: static int CompareMagnitudes(const byte* pA, size_t sizeA, const byte* pB, size_t sizeB)
+		{
+			if(sizeA != sizeB)
+				return (sizeA < sizeB ? -1 : 1);
+			for(size_t i = sizeA; i--; )
+				if(pA[i] != pB[i])
+					return (pA[i] < pB[i] ? -1 : 1);
+			return 0;
+		}
+		
+		// Integer against a float, exactly: below 2^53 the integer is a double without rounding, above
+		// it a double is an integer and is compared digit by digit
+		private: static int CompareToFloat(const OrderNumber& n, double value)
+		{
+			if(n.Size < 7 || (n.Size == 7 && n.pDigits[6] < 0x20)) {
+				double d = 0;
+				for(size_t i = n.Size; i--; )
+					d = d*256 + n.pDigits[i];
+				d = (n.Negative ? -d : d);
+				return (d < value ? -1 : (d > value ? 1 : 0));
+			}
+			if(fabs(value) < 9007199254740992.0)
+				return (n.Negative ? -1 : 1);
+			bool negative = (value < 0);
+			if(n.Negative != negative)
+				return (n.Negative ? -1 : 1);
+			int exponent = 0;
+			UInt64 mantissa = (UInt64)ldexp(frexp(fabs(value), &exponent), 53); // |value| = mantissa*2^(exponent - 53)
+			size_t shift = (size_t)(exponent - 53);
+			byte digits[8 + 1024/8] = { 0 };
+			mantissa <<= shift % 8; // 53 + 7 bits
+			for(size_t i = 0; i < 8; ++i, mantissa >>= 8)
+				digits[shift/8 + i] = (byte)mantissa;
+			size_t size = shift/8 + 8;
+			while(!digits[size - 1])
+				--size;
+			int order = CompareMagnitudes(n.pDigits, n.Size, digits, size);
+			return (negative ? -order : order);
+		}
+		
+		private: static int CompareNumbers(const OrderNumber& a, const OrderNumber& b, bool exact)
+		{
+			if(a.Float && b.Float)
+				return (a.Value < b.Value ? -1 : (a.Value > b.Value ? 1 : 0));
+			if(!a.Float && !b.Float) {
+				if(a.Negative != b.Negative)
+					return (a.Negative ? -1 : 1);
+				int order = CompareMagnitudes(a.pDigits, a.Size, b.pDigits, b.Size);
+				return (a.Negative ? -order : order);
+			}
+			int order = (a.Float ? -CompareToFloat(b, a.Value) : CompareToFloat(a, b.Value));
+			if(!order && exact)
+				order = (a.Float ? 1 : -1); // Integer first
+			return order;
+		}
+		
+		private: static ETFError ReadOrderAtom(const byte*& pPos, const byte* pEnd, const byte*& pText, size_t& size, bool& utf8)
+		{
+			if(pPos >= pEnd)
+				return ETF_OUT_OF_RANGE;
+			UInt8 tag = *pPos;
+			if(tag == ATOM_CACHE_REF)
+				return ETF_INVALID_TAG;
+			const byte* pAtom = pPos;
+			if(ETFError error = SkipAtom(pPos, pEnd))
+				return error;
+			pText = pAtom + (tag == ATOM_EXT || tag == ATOM_UTF8_EXT ? 3 : 2);
+			size = (size_t)(pPos - pText);
+			utf8 = (tag == ATOM_UTF8_EXT || tag == SMALL_ATOM_UTF8_EXT);
+			return ETF_OK;
+		}
+		
+		// UTF-8 bytes compare in code point order, a latin1 atom is made UTF-8 first
+		private: static int CompareAtomText(const byte* pA, size_t sizeA, bool utf8A, const byte* pB, size_t sizeB, bool utf8B)
+		{
+			byte text[2*255];
+			if(utf8A != utf8B) {
+				const byte*& pLatin1 = (utf8A ? pB : pA);
+				size_t& size = (utf8A ? sizeB : sizeA);
+				size_t n = 0;
+				for(size_t i = 0; i < size; ++i) {
+					if(pLatin1[i] < 0x80)
+						text[n++] = pLatin1[i];
+					else {
+						text[n++] = (byte)(0xc0 | (pLatin1[i] >> 6));
+						text[n++] = (byte)(0x80 | (pLatin1[i] & 0x3f));
+					}
+				}
+				pLatin1 = text;
+				size = n;
+			}
+			int order = memcmp(pA, pB, std::min(sizeA, sizeB));
+			if(order)
+				return Sign(order);
+			return (sizeA < sizeB ? -1 : (sizeA > sizeB ? 1 : 0));
+		}
+		
+		private: static ETFError ReadOrderHandle(const byte*& pPos, const byte* pEnd, OrderHandle& h)
+		{
+			ETFError error = ETF_OK;
+			UInt8 tag = *pPos++;
+			UInt16 len = 1;
+			UInt8 creation8 = 0;
+			UInt32 creation32 = 0;
+			memset(h.Words, 0, sizeof(h.Words));
+			if((tag == NEW_REFERENCE_EXT || tag == NEWER_REFERENCE_EXT) && (error = ReadField(pPos, pEnd, len)) != ETF_OK)
+				return error;
+			if(!len || len > 8)
+				return ETF_INVALID_SIZE;
+			if((error = ReadOrderAtom(pPos, pEnd, h.pNode, h.NodeSize, h.NodeUtf8)) != ETF_OK)
+				return error;
+			switch(tag) {
+				case REFERENCE_EXT:
+				case PORT_EXT:
+					error = ReadField(pPos, pEnd, h.Words[7]);
+					if(!error)
+						error = ReadField(pPos, pEnd, creation8);
+					break;
+				case NEW_REFERENCE_EXT:
+				case NEWER_REFERENCE_EXT:
+					error = (tag == NEW_REFERENCE_EXT ? ReadField(pPos, pEnd, creation8) : ReadField(pPos, pEnd, creation32));
+					for(UInt16 i = 0; i < len && !error; ++i)
+						error = ReadField(pPos, pEnd, h.Words[7 - i]); // ID[0] is the least significant
+					break;
+				case PID_EXT:
+				case NEW_PID_EXT:
+					error = ReadField(pPos, pEnd, h.Words[7]); // ID, then serial
+					if(!error)
+						error = ReadField(pPos, pEnd, h.Words[6]);
+					if(!error)
+						error = (tag == PID_EXT ? ReadField(pPos, pEnd, creation8) : ReadField(pPos, pEnd, creation32));
+					break;
+				case NEW_PORT_EXT:
+					error = ReadField(pPos, pEnd, h.Words[7]);
+					if(!error)
+						error = ReadField(pPos, pEnd, creation32);
+					break;
+				default: // V4_PORT_EXT
+					error = ReadField(pPos, pEnd, h.Words[6]);
+					if(!error)
+						error = ReadField(pPos, pEnd, h.Words[7]);
+					if(!error)
+						error = ReadField(pPos, pEnd, creation32);
+					break;
+			}
+			h.Creation = (creation32 ? creation32 : creation8);
+			return error;
+		}
+		
+		private: static int CompareHandles(const OrderHandle& a, const OrderHandle& b)
+		{
+			if(int order = CompareAtomText(a.pNode, a.NodeSize, a.NodeUtf8, b.pNode, b.NodeSize, b.NodeUtf8))
+				return order;
+			for(size_t i = 0; i < 8; ++i)
+				if(a.Words[i] != b.Words[i])
+					return (a.Words[i] < b.Words[i] ? -1 : 1);
+			return (a.Creation < b.Creation ? -1 : (a.Creation > b.Creation ? 1 : 0));
+		}
+		
+		// Funs at pA and pB up to their free variables, of which freeTerms are left to compare
+		private: static ETFError CompareFuns(const byte*& pA, const byte* pEndA, const byte*& pB, const byte* pEndB, int& order, UInt64& freeTerms)
+		{
+			ETFError error = ETF_OK;
+			UInt8 tagA = *pA++, tagB = *pB++;
+			if(tagA != tagB) {
+				order = (tagA == NEW_FUN_EXT ? -1 : 1); // Local funs first
+				return ETF_OK;
 			}
+			const byte* pFields[2] = { pA, pB };
+			if(tagA == NEW_FUN_EXT) {
+				if((error = Skip(pA, pEndA, 4 + 1 + 16 + 4 + 4)) != ETF_OK || (error = Skip(pB, pEndB, 4 + 1 + 16 + 4 + 4)) != ETF_OK)
+					return error;
+			}
+			// Module, then function (export)
+			for(int i = 0; i < (tagA == NEW_FUN_EXT ? 1 : 2) && !order; ++i) {
+				const byte* pTextA = NULL;
+				const byte* pTextB = NULL;
+				size_t sizeA = 0, sizeB = 0;
+				bool utf8A = false, utf8B = false;
+				if((error = ReadOrderAtom(pA, pEndA, pTextA, sizeA, utf8A)) != ETF_OK || (error = ReadOrderAtom(pB, pEndB, pTextB, sizeB, utf8B)) != ETF_OK)
+					return error;
+				order = CompareAtomText(pTextA, sizeA, utf8A, pTextB, sizeB, utf8B);
+			}
+			if(tagA == EXPORT_EXT) {
+				if((error = Skip(pA, pEndA, 2)) != ETF_OK || (error = Skip(pB, pEndB, 2)) != ETF_OK)
+					return error;
+				if(!order)
+					order = Sign((int)pA[-1] - (int)pB[-1]); // Arity
+				return ETF_OK;
+			}
+			// Size, Arity, Uniq, Index, NumFree; then OldIndex, OldUniq and Pid are passed over
+			UInt32 indexA = 0, indexB = 0, freeA = 0, freeB = 0;
+			RWBinary::Read(pFields[0] + 4 + 1 + 16, indexA);
+			RWBinary::Read(pFields[1] + 4 + 1 + 16, indexB);
+			RWBinary::Read(pFields[0] + 4 + 1 + 16 + 4, freeA);
+			RWBinary::Read(pFields[1] + 4 + 1 + 16 + 4, freeB);
+			if(!order && indexA != indexB)
+				order = (indexA < indexB ? -1 : 1);
+			if(!order)
+				order = Sign(memcmp(pFields[0] + 4 + 1, pFields[1] + 4 + 1, 16));
+			if(!order && freeA != freeB)
+				order = (freeA < freeB ? -1 : 1);
+			if(order)
+				return ETF_OK;
+			if((error = SkipTerms(pA, pEndA, 3)) != ETF_OK || (error = SkipTerms(pB, pEndB, 3)) != ETF_OK)
+				return error;
+			freeTerms = freeA;
+			return ETF_OK;
+		}
+		
+		private: static ETFError ReadOrderBits(const byte*& pPos, const byte* pEnd, const byte*& pData, UInt64& bits)
+		{
+			ETFError error = ETF_OK;
+			UInt8 tag = *pPos++;
+			UInt32 size32 = 0;
+			UInt8 last = 8;
+			if((error = ReadField(pPos, pEnd, size32)) != ETF_OK || (tag == BIT_BINARY_EXT && (error = ReadField(pPos, pEnd, last)) != ETF_OK))
+				return error;
+			if((size_t)(pEnd - pPos) < size32)
+				return ETF_OUT_OF_RANGE;
+			last = (last && last < 8 ? last : 8);
+			bits = (size32 ? 8*((UInt64)size32 - 1) + last : 0);
+			pData = pPos;
+			pPos += size32;
+			return ETF_OK;
+		}
+		
+		// Bits in order, then the shorter first
+		private: static int CompareBits(const byte* pA, UInt64 bitsA, const byte* pB, UInt64 bitsB)
+		{
+			UInt64 common = std::min(bitsA, bitsB);
+			if(int order = memcmp(pA, pB, (size_t)(common/8)))
+				return Sign(order);
+			unsigned rest = (unsigned)(common % 8);
+			if(rest) {
+				unsigned a = pA[common/8] >> (8 - rest), b = pB[common/8] >> (8 - rest);
+				if(a != b)
+					return (a < b ? -1 : 1);
+			}
+			return (bitsA < bitsB ? -1 : (bitsA > bitsB ? 1 : 0));
+		}
+		
+		// Key and value positions of a map, sorted by key in the exact order
+		private: struct OrderPair
+		{
+			public: const byte* pKey;
+			public: const byte* pValue;
+		};
+		
+		private: class OrderKeyLess
+		{
+			private: const byte* pEnd_;
+			private: size_t Depth_;
+			private: ETFError* pError_;
 			
-			// Read Tail - Nil
-			if(count < sizeof(tag)) {
-				delete[] str;
-				throw std::out_of_range("Out of Buffer Range");
+			public: OrderKeyLess(const byte* pEnd, size_t depth, ETFError* pError):
+				pEnd_(pEnd),
+				Depth_(depth),
+				pError_(pError)
+			{
 			}
-			count -= sizeof(tag);
-			pPos = RWBinary::Read(pPos, tag);
-			if(tag != NIL_EXT) {
-				delete[] str;
-				throw std::runtime_error("Invalid Operation");
+			
+			public: bool operator ()(const OrderPair& a, const OrderPair& b) const
+			{
+				const byte* pA = a.pKey;
+				const byte* pB = b.pKey;
+				int order = 0;
+				if(ETFError error = CompareTerms(pA, pEnd_, pB, pEnd_, order, true, Depth_))
+					*pError_ = error;
+				return order < 0;
+			}
+		};
+		
+		private: static ETFError ReadOrderMap(const byte*& pPos, const byte* pEnd, std::vector<OrderPair>& pairs, size_t depth)
+		{
+			UInt32 arity = 0;
+			++pPos;
+			if(ETFError error = ReadField(pPos, pEnd, arity))
+				return error;
+			pairs.resize(arity);
+			for(UInt32 i = 0; i < arity; ++i) {
+				pairs[i].pKey = pPos;
+				if(ETFError error = SkipTerms(pPos, pEnd, 1))
+					return error;
+				pairs[i].pValue = pPos;
+				if(ETFError error = SkipTerms(pPos, pEnd, 1))
+					return error;
+			}
+			ETFError error = ETF_OK;
+			std::sort(pairs.begin(), pairs.end(), OrderKeyLess(pEnd, depth, &error));
+			return error;
+		}
+		
+		// Size, then the keys in order, then the values in the order of the keys. Maps in maps recurse
+		// (the keys are sorted for every comparison), up to MAX_MAP_DEPTH.
+		private: static ETFError CompareMaps(const byte*& pA, const byte* pEndA, const byte*& pB, const byte* pEndB, int& order, bool exact, size_t depth)
+		{
+			if(++depth > MAX_MAP_DEPTH)
+				return ETF_INVALID_SIZE;
+			std::vector<OrderPair> a, b;
+			if(ETFError error = ReadOrderMap(pA, pEndA, a, depth))
+				return error;
+			if(ETFError error = ReadOrderMap(pB, pEndB, b, depth))
+				return error;
+			if(a.size() != b.size()) {
+				order = (a.size() < b.size() ? -1 : 1);
+				return ETF_OK;
+			}
+			for(int values = 0; values < 2; ++values) {
+				for(size_t i = 0; i < a.size(); ++i) {
+					const byte* pTermA = (values ? a[i].pValue : a[i].pKey);
+					const byte* pTermB = (values ? b[i].pValue : b[i].pKey);
+					if(ETFError error = CompareTerms(pTermA, pEndA, pTermB, pEndB, order, (exact || !values), depth))
+						return error;
+					if(order)
+						return ETF_OK;
+				}
+			}
+			return ETF_OK;
+		}
+		
+		// Both terms are walked side by side until they differ. Containers are kept as OrderOpen, so
+		// nesting other than of maps costs no native stack. The lists of both sides are compared
+		// element by element whatever their encoding: [1,2|[3]], [1,2,3] and "\1\2\3" are one list.
+		private: static ETFError CompareTerms(const byte*& pA, const byte* pEndA, const byte*& pB, const byte* pEndB, int& order, bool exact, size_t mapDepth)
+		{
+			static const byte NIL[] = { NIL_EXT };
+			const byte* pPos[2] = { pA, pB };
+			const byte* pEnd[2] = { pEndA, pEndB };
+			OrderOpen fixed[16];
+			std::vector<OrderOpen> grown;
+			OrderOpen* open = fixed;
+			size_t depth = 0, capacity = sizeof(fixed)/sizeof(fixed[0]);
+			OrderOpen term = { 1, false, { 0, 0 }, { false, false } };
+			open[depth++] = term;
+			order = 0;
+			ETFError error = ETF_OK;
+			while(depth) {
+				OrderOpen& top = open[depth - 1];
+				const byte* pTerm[2] = { pPos[0], pPos[1] }; // Real terms, or bytes of a string and [] of its end
+				const byte* pTermEnd[2] = { pEnd[0], pEnd[1] };
+				byte code[2][2] = { { SMALL_INTEGER_EXT, 0 }, { SMALL_INTEGER_EXT, 0 } };
+				if(!top.List) {
+					if(!top.Terms) {
+						--depth;
+						continue;
+					}
+					--top.Terms;
+				}
+				else {
+					bool ended[2] = { false, false }, nil[2] = { false, false };
+					for(int s = 0; s < 2; ++s) {
+						while(!top.Left[s] && !ended[s]) {
+							if(top.String[s]) {
+								ended[s] = nil[s] = true;
+								break;
+							}
+							if(pPos[s] >= pEnd[s]) {
+								error = ETF_OUT_OF_RANGE;
+								break;
+							}
+							UInt8 tag = *pPos[s];
+							if(tag == LIST_EXT) {
+								++pPos[s];
+								error = ReadField(pPos[s], pEnd[s], top.Left[s]);
+							}
+							else if(tag == STRING_EXT) {
+								UInt16 size16 = 0;
+								++pPos[s];
+								error = ReadField(pPos[s], pEnd[s], size16);
+								top.Left[s] = size16;
+								top.String[s] = true;
+								ended[s] = nil[s] = !size16;
+							}
+							else if(tag == NIL_EXT) {
+								++pPos[s];
+								ended[s] = nil[s] = true;
+							}
+							else
+								ended[s] = true; // Improper tail
+							if(error)
+								break;
+						}
+						if(error)
+							break;
+					}
+					if(error)
+						break;
+					pTerm[0] = pPos[0]; // Past the headers of the tails read
+					pTerm[1] = pPos[1];
+					if(ended[0] != ended[1]) {
+						// A list going on against [] or an improper tail, which is not a list
+						int s = (ended[0] ? 0 : 1);
+						int tail = (nil[s] ? 9 : OrderClass(pPos[s], pEnd[s]));
+						if(!tail) {
+							error = ETF_INVALID_TAG;
+							break;
+						}
+						order = (tail < 10 ? -1 : 1)*(s ? -1 : 1);
+						break;
+					}
+					if(ended[0]) {
+						--depth; // Then the tails
+						if(nil[0] && nil[1])
+							continue;
+						for(int s = 0; s < 2; ++s) {
+							if(nil[s]) {
+								pTerm[s] = NIL;
+								pTermEnd[s] = NIL + sizeof(NIL);
+							}
+						}
+					}
+					else {
+						for(int s = 0; s < 2; ++s) {
+							--top.Left[s];
+							if(top.String[s]) {
+								if(pPos[s] >= pEnd[s]) {
+									error = ETF_OUT_OF_RANGE;
+									break;
+								}
+								code[s][1] = *pPos[s]++;
+								pTerm[s] = code[s];
+								pTermEnd[s] = code[s] + 2;
+							}
+						}
+						if(error)
+							break;
+					}
+				}
+				
+				// pTerm[0] against pTerm[1]
+				if(pTerm[0] >= pTermEnd[0] || pTerm[1] >= pTermEnd[1]) {
+					error = ETF_OUT_OF_RANGE;
+					break;
+				}
+				bool real[2] = { pTerm[0] == pPos[0], pTerm[1] == pPos[1] };
+				int classA = OrderClass(pTerm[0], pTermEnd[0]), classB = OrderClass(pTerm[1], pTermEnd[1]);
+				if(!classA || !classB) {
+					error = ETF_INVALID_TAG;
+					break;
+				}
+				if(classA != classB) {
+					order = (classA < classB ? -1 : 1);
+					break;
+				}
+				OrderOpen push = { 0, false, { 0, 0 }, { false, false } };
+				switch(classA) {
+					case 1:
+					{
+						OrderNumber a, b;
+						if((error = ReadOrderNumber(pTerm[0], pTermEnd[0], a)) == ETF_OK && (error = ReadOrderNumber(pTerm[1], pTermEnd[1], b)) == ETF_OK)
+							order = CompareNumbers(a, b, exact);
+						break;
+					}
+					case 2:
+					{
+						const byte* pText[2] = { NULL, NULL };
+						size_t size[2] = { 0, 0 };
+						bool utf8[2] = { false, false };
+						if((error = ReadOrderAtom(pTerm[0], pTermEnd[0], pText[0], size[0], utf8[0])) == ETF_OK &&
+								(error = ReadOrderAtom(pTerm[1], pTermEnd[1], pText[1], size[1], utf8[1])) == ETF_OK)
+							order = CompareAtomText(pText[0], size[0], utf8[0], pText[1], size[1], utf8[1]);
+						break;
+					}
+					case 3:
+					case 5:
+					case 6:
+					{
+						OrderHandle a, b;
+						if((error = ReadOrderHandle(pTerm[0], pTermEnd[0], a)) == ETF_OK && (error = ReadOrderHandle(pTerm[1], pTermEnd[1], b)) == ETF_OK)
+							order = CompareHandles(a, b);
+						break;
+					}
+					case 4:
+						error = CompareFuns(pTerm[0], pTermEnd[0], pTerm[1], pTermEnd[1], order, push.Terms);
+						break;
+					case 7:
+					{
+						UInt32 arity[2] = { 0, 0 };
+						for(int s = 0; s < 2 && !error; ++s) {
+							UInt8 tag = *pTerm[s]++, size8 = 0;
+							error = (tag == SMALL_TUPLE_EXT ? ReadField(pTerm[s], pTermEnd[s], size8) : ReadField(pTerm[s], pTermEnd[s], arity[s]));
+							arity[s] = (tag == SMALL_TUPLE_EXT ? size8 : arity[s]);
+						}
+						if(!error && arity[0] != arity[1])
+							order = (arity[0] < arity[1] ? -1 : 1);
+						push.Terms = arity[0];
+						break;
+					}
+					case 8:
+						error = CompareMaps(pTerm[0], pTermEnd[0], pTerm[1], pTermEnd[1], order, exact, mapDepth);
+						break;
+					case 9:
+						for(int s = 0; s < 2; ++s)
+							pTerm[s] += (*pTerm[s] == STRING_EXT ? 3 : 1);
+						break;
+					case 10:
+						push.List = true;
+						for(int s = 0; s < 2 && !error; ++s) {
+							UInt16 size16 = 0;
+							push.String[s] = (*pTerm[s]++ == STRING_EXT);
+							error = (push.String[s] ? ReadField(pTerm[s], pTermEnd[s], size16) : ReadField(pTerm[s], pTermEnd[s], push.Left[s]));
+							push.Left[s] = (push.String[s] ? size16 : push.Left[s]);
+						}
+						break;
+					default:
+					{
+						const byte* pData[2] = { NULL, NULL };
+						UInt64 bits[2] = { 0, 0 };
+						if((error = ReadOrderBits(pTerm[0], pTermEnd[0], pData[0], bits[0])) == ETF_OK && (error = ReadOrderBits(pTerm[1], pTermEnd[1], pData[1], bits[1])) == ETF_OK)
+							order = CompareBits(pData[0], bits[0], pData[1], bits[1]);
+						break;
+					}
+				}
+				for(int s = 0; s < 2; ++s)
+					if(real[s])
+						pPos[s] = pTerm[s];
+				if(error || order)
+					break;
+				if(push.Terms || push.List) {
+					if(depth == capacity) {
+						if(open == fixed)
+							grown.assign(fixed, fixed + depth);
+						grown.resize(capacity *= 2);
+						open = &grown[0];
+					}
+					open[depth++] = push;
+				}
+			}
+			pA = pPos[0];
+			pB = pPos[1];
+			return error;
+		}
+		
+		// Reference, pid, port or fun with a tag out of tags (up to 3, repeat one to fill): the
+		// term is [pBuffer_, pNext)
+		private: ETFStatus TryHandle(UInt8 tag1, UInt8 tag2, UInt8 tag3, const byte*& pNext) const
+		{
+			const byte* pPos = pBuffer_;
+			if(!Has(pPos, sizeof(UInt8)))
+				return Fail(ETF_OUT_OF_RANGE, pPos);
+			UInt8 tag = *pPos++;
+			if(!(tag == tag1 || tag == tag2 || tag == tag3))
+				return Fail(ETF_INVALID_TAG, pBuffer_);
+			if(ETFError error = SkipHandle(tag, pPos, pEnd_))
+				return Fail(error, pPos);
+			pNext = pPos;
+			return ETFStatus();
+		}
+		
+		public: ETFStatus TryReadReference(boost::optional<Reference>& ref)
+		{
+			const byte* pNext = NULL;
+			ETFStatus status = TryHandle(REFERENCE_EXT, NEW_REFERENCE_EXT, NEWER_REFERENCE_EXT, pNext);
+			if(status) {
+				ref = Reference((ETFTag)*pBuffer_, pBuffer_, (size_t)(pNext - pBuffer_), Frame_);
+				pBuffer_ = pNext;
+			}
+			return status;
+		}
+		
+		public: Reference ReadReference(void)
+		{
+			const byte* pNext = NULL;
+			Check(TryHandle(REFERENCE_EXT, NEW_REFERENCE_EXT, NEWER_REFERENCE_EXT, pNext));
+			
+			Reference ref((ETFTag)*pBuffer_, pBuffer_, (size_t)(pNext - pBuffer_), Frame_);
+			pBuffer_ = pNext;
+			return ref;
+		}
+		
+		public: ETFStatus TryReadPid(boost::optional<Pid>& pid)
+		{
+			const byte* pNext = NULL;
+			ETFStatus status = TryHandle(PID_EXT, NEW_PID_EXT, NEW_PID_EXT, pNext);
+			if(status) {
+				pid = Pid((ETFTag)*pBuffer_, pBuffer_, (size_t)(pNext - pBuffer_), Frame_);
+				pBuffer_ = pNext;
 			}
+			return status;
+		}
+		
+		public: Pid ReadPid(void)
+		{
+			const byte* pNext = NULL;
+			Check(TryHandle(PID_EXT, NEW_PID_EXT, NEW_PID_EXT, pNext));
 			
-			str[size] = 0;
-			pBuffer_ = pPos;
-			return str;
+			Pid pid((ETFTag)*pBuffer_, pBuffer_, (size_t)(pNext - pBuffer_), Frame_);
+			pBuffer_ = pNext;
+			return pid;
 		}
 		
-		public: UInt32 ReadList(void)
+		public: ETFStatus TryReadPort(boost::optional<Port>& port)
 		{
-			UInt8 tag = 0;
-			UInt32 value = 0;
-			const byte* pPos = pBuffer_;
-			size_t count = RestSize();
+			const byte* pNext = NULL;
+			ETFStatus status = TryHandle(PORT_EXT, NEW_PORT_EXT, V4_PORT_EXT, pNext);
+			if(status) {
+				port = Port((ETFTag)*pBuffer_, pBuffer_, (size_t)(pNext - pBuffer_), Frame_);
+				pBuffer_ = pNext;
+			}
+			return status;
+		}
+		
+		public: Port ReadPort(void)
+		{
+			const byte* pNext = NULL;
+			Check(TryHandle(PORT_EXT, NEW_PORT_EXT, V4_PORT_EXT, pNext));
 			
-			if(count < sizeof(tag))
-				throw std::out_of_range("Out of Buffer Range");
-			count -= sizeof(tag);
-			pPos = RWBinary::Read(pPos, tag);
-			if(tag != LIST_EXT)
-				throw std::runtime_error("Invalid Operation");
-			if(count < sizeof(value))
-				throw std::out_of_range("Out of Buffer Range");
+			Port port((ETFTag)*pBuffer_, pBuffer_, (size_t)(pNext - pBuffer_), Frame_);
+			pBuffer_ = pNext;
+			return port;
+		}
+		
+		public: ETFStatus TryReadFun(boost::optional<Fun>& fun)
+		{
+			const byte* pNext = NULL;
+			ETFStatus status = TryHandle(NEW_FUN_EXT, EXPORT_EXT, EXPORT_EXT, pNext);
+			if(status) {
+				fun = Fun((ETFTag)*pBuffer_, pBuffer_, (size_t)(pNext - pBuffer_), Frame_);
+				pBuffer_ = pNext;
+			}
+			return status;
+		}
+		
+		public: Fun ReadFun(void)
+		{
+			const byte* pNext = NULL;
+			Check(TryHandle(NEW_FUN_EXT, EXPORT_EXT, EXPORT_EXT, pNext));
 			
-			pBuffer_ = RWBinary::Read(pPos, value);
-			return value;
+			Fun fun((ETFTag)*pBuffer_, pBuffer_, (size_t)(pNext - pBuffer_), Frame_);
+			pBuffer_ = pNext;
+			return fun;
 		}
 		
-		public: UInt8* ReadAtom(void)
+		// BINARY_EXT: the term is [pBuffer_, pNext)
+		private: ETFStatus TryBinary(const byte*& pNext) const
 		{
-			UInt8 tag = 0;
-			UInt16 size = 0, size16 = 0;
-			UInt8 size8 = 0;
-			UInt8* str = NULL;
+			UInt32 len = 0;
 			const byte* pPos = pBuffer_;
-			size_t count = RestSize();
 			
-			if(sizeof(count) < sizeof(size))
-				throw std::bad_cast("Huge Size of Array");
-			if(count < sizeof(tag))
-				throw std::out_of_range("Out of Buffer Range");
-			count -= sizeof(tag);
-			pPos = RWBinary::Read(pPos, tag);
-			if(!(tag == SMALL_ATOM_EXT || tag == ATOM_EXT))
-				throw std::runtime_error("Invalid Operation");
-			if((tag == SMALL_ATOM_EXT && count < sizeof(size8)) || (tag == ATOM_EXT && count < sizeof(size16)))
-				throw std::out_of_range("Out of Buffer Range");
-			count -= (tag == SMALL_ATOM_EXT ? sizeof(size8) : sizeof(size16));
-			pPos = (tag == SMALL_ATOM_EXT ? RWBinary::Read(pPos, size8) : RWBinary::Read(pPos, size16));
-			size = (tag == SMALL_ATOM_EXT ? size8 : size16);
-			if(!size || size > 255)
-				throw std::length_error("Invalid String Size");
-			if(count < size)
-				throw std::out_of_range("Out of Buffer Range");
-			
-			str = new UInt8[size + 1];
-			pPos = RWBinary::Read(pPos, str, size);
-			str[size] = '\0';
+			if(!Has(pPos, sizeof(UInt8)))
+				return Fail(ETF_OUT_OF_RANGE, pPos);
+			if(*pPos++ != BINARY_EXT)
+				return Fail(ETF_INVALID_TAG, pBuffer_);
+			if(!Has(pPos, sizeof(len)))
+				return Fail(ETF_OUT_OF_RANGE, pPos);
+			pPos = RWBinary::Read(pPos, len);
+			if(!Has(pPos, len))
+				return Fail(ETF_OUT_OF_RANGE, pPos);
+			pNext = pPos + len;
+			return ETFStatus();
+		}
+		
+		public: ETFStatus TryReadBinary(boost::optional<Binary>& binary)
+		{
+			const byte* pNext = NULL;
+			ETFStatus status = TryBinary(pNext);
+			if(status) {
+				binary = Binary(pBuffer_, (size_t)(pNext - pBuffer_), Frame_);
+				pBuffer_ = pNext;
+			}
+			return status;
+		}
+		
+		public: Binary ReadBinary(void)
+		{
+			const byte* pNext = NULL;
+			Check(TryBinary(pNext));
 			
-			pBuffer_ = pPos;
-			return str;
+			Binary binary(pBuffer_, (size_t)(pNext - pBuffer_), Frame_);
+			pBuffer_ = pNext;
+			return binary;
 		}
 		
-		public: Reference ReadReference(void)
+		// {Tag,...} envelopes ({'$shm',...}, {'$deadline',...}, {'$cancel',...}): if the next term is
+		// a tuple that starts with atom tag, the reader moves past the atom and arity is the tuple
+		// size; otherwise nothing is read. The atom is compared in place, nothing is allocated.
+		public: bool ReadTagged(const char* tag, UInt32& arity)
 		{
- 			UInt8 tag = 0;
- 			UInt8 tag2 = 0;
-			UInt16 len = 0;
-			UInt16 size = 0, size16 = 0;
-			UInt8 size8 = 0;
 			const byte* pPos = pBuffer_;
+			UInt32 size = 0;
+			if(!TryReadTuple(size))
+				return false;
 			size_t count = RestSize();
-			
-			if(count < sizeof(tag))
-				throw std::out_of_range("Out of Buffer Range");
-			count -= sizeof(tag);
-			pPos = RWBinary::Read(pPos, tag);
-			if(!(tag == REFERENCE_EXT || tag == NEW_REFERENCE_EXT))
-				throw std::runtime_error("Invalid Operation");
-			
-			// Read Len (2 bytes) for NEW_REFERENCE_EXT
-			if(tag == NEW_REFERENCE_EXT) {
-				if(count < sizeof(len))
-					throw std::out_of_range("Out of Buffer Range");
-				count -= sizeof(len);
-				pPos = RWBinary::Read(pPos, len);
-			}
-			
-			// Move N-bytes atom - Node name of reference
-			if(count < sizeof(tag2))
-				throw std::out_of_range("Out of Buffer Range");
-			count -= sizeof(tag2);
-			pPos = RWBinary::Read(pPos, tag2);
-			if(tag2 == ATOM_CACHE_REF) {
-				if(count < sizeof(UInt8))
-					throw std::out_of_range("Out of Buffer Range");
-				count -= sizeof(UInt8);
-				pPos += sizeof(UInt8);
-			}
-			else if(tag2 == ATOM_EXT || tag2 == SMALL_ATOM_EXT) {
-				if((tag == SMALL_ATOM_EXT && count < sizeof(size8)) || (tag == ATOM_EXT && count < sizeof(size16)))
-					throw std::out_of_range("Out of Buffer Range");
-				count -= (tag == SMALL_ATOM_EXT ? sizeof(size8) : sizeof(size16));
-				pPos = (tag == SMALL_ATOM_EXT ? RWBinary::Read(pPos, size8) : RWBinary::Read(pPos, size16));
-				size = (tag == SMALL_ATOM_EXT ? size8 : size16);
-				if(!size || size > 255)
-					throw std::length_error("Invalid String Size");
-				if(count < size)
-					throw std::out_of_range("Out of Buffer Range");
-				pPos += (size_t)(size);
-				count -= size;
+			size_t len = 0, header = 0;
+			if(size && count >= 2 && (pBuffer_[0] == SMALL_ATOM_EXT || pBuffer_[0] == SMALL_ATOM_UTF8_EXT)) {
+				len = pBuffer_[1];
+				header = 2;
 			}
-			else
-				throw std::runtime_error("Invalid Operation");
-			
-			// Move 4 bytes (ID) for REFERENCE_EXT
-			if(tag == REFERENCE_EXT) {
-				if(count < sizeof(UInt32))
-					throw std::out_of_range("Out of Buffer Range");
-				count -= sizeof(UInt32);
-				pPos += sizeof(UInt32);
+			else if(size && count >= 3 && (pBuffer_[0] == ATOM_EXT || pBuffer_[0] == ATOM_UTF8_EXT)) {
+				len = ((size_t)pBuffer_[1] << 8) | pBuffer_[2];
+				header = 3;
 			}
-			
-			// Move 1 byte (Creation)
-			if(count < sizeof(UInt8))
-				throw std::out_of_range("Out of Buffer Range");
-			count -= sizeof(UInt8);
-			pPos += sizeof(UInt8);
-			
-			// Move N*-byte (ID) for NEW_REFERENCE_EXT
-			if(tag == NEW_REFERENCE_EXT) {
-				_ASSERTE(len);
-				if(count < 4U*len)
-					throw std::out_of_range("Out of Buffer Range");
-				count -= (size_t)(4U*len);
-				pPos += (4U*len);
+			if(!header || count < header + len || len != strlen(tag) || memcmp(pBuffer_ + header, tag, len)) {
+				pBuffer_ = pPos;
+				return false;
 			}
-			
-			Reference ref(pBuffer_, (size_t)(pPos - pBuffer_));
-			pBuffer_ = pPos;
-			return ref;
+			pBuffer_ += header + len;
+			arity = size;
+			return true;
 		}
-
-		public: Binary ReadBinary(void)
+	};
+	
+	// How numbers are written: floating point as NEW_FLOAT_EXT, integers as INTEGER_EXT when they fit
+	// 32 bits, otherwise as SMALL_BIG_EXT with as few digits as needed (counters, 64-bit ids)
+	template<typename T> struct NumberEncoding
+	{
+		public: static bool IsFloat(void)
 		{
-			UInt8 tag = 0;
-			UInt32 len = 0;
-			const byte* pPos = pBuffer_;
-			size_t count = RestSize();
-			
-			if(count < sizeof(tag))
-				throw std::out_of_range("Out of Buffer Range");
-			count -= sizeof(tag);
-			pPos = RWBinary::Read(pPos, tag);
-			if(tag != BINARY_EXT)
-				throw std::runtime_error("Invalid Operation");
-			if(count < sizeof(len))
-				throw std::out_of_range("Out of Buffer Range");
-			count -= sizeof(len);
-			pPos = RWBinary::Read(pPos, len);
-			if(count < len)
-				throw std::out_of_range("Out of Buffer Range");
-
-			count -= len;
-			pPos += len;
-			Binary binary(pBuffer_, (size_t)(pPos - pBuffer_));
-
-			pBuffer_ = pPos;
-			return binary;
+			return !boost::is_integral<T>::value;
+		}
+		
+		public: static bool IsSmall(T number)
+		{
+			if(boost::is_signed<T>::value)
+				return (Int64)number >= -2147483647LL - 1 && (Int64)number <= 2147483647LL;
+			return (UInt64)number <= 2147483647ULL;
+		}
+		
+		public: static UInt64 Magnitude(T number, bool& negative)
+		{
+			negative = (boost::is_signed<T>::value && (Int64)number < 0);
+			return (negative ? (UInt64)(-((Int64)number + 1)) + 1 : (UInt64)number);
+		}
+		
+		public: static size_t Digits(UInt64 magnitude)
+		{
+			size_t digits = 1;
+			while(magnitude >>= 8)
+				++digits;
+			return digits;
+		}
+		
+		public: static size_t Size(T number)
+		{
+			bool negative = false;
+			if(IsFloat())
+				return 1 + 8;
+			if(IsSmall(number))
+				return 1 + 4;
+			return 1 + 1 + 1 + Digits(Magnitude(number, negative));
 		}
 	};
 	
@@ -609,77 +2452,139 @@ namespace Erlang
 	{
 		private: static const size_t INITIAL_SIZE = 1024;
 		
-		private: byte* Ptr_;
+		private: byte* pBase_; // Start of buffer, packet length header (if reserved) goes here
+		private: byte* Ptr_; // Version Number
 		private: byte* pBuffer_;
 		private: size_t Size_;
+		private: size_t HeaderSize_;
+		private: bool Owner_;
 		
 		public: ETFWriter(void):
+			pBase_(NULL),
 			Ptr_(NULL),
 			pBuffer_(NULL),
-			Size_(0)
+			Size_(0),
+			HeaderSize_(0),
+			Owner_(true)
+		{
+			Allocate(INITIAL_SIZE);
+		}
+		
+		// Allocate exactly once: exactSize is the encoded term size including the version number
+		// (see ETFSizer), headerSize bytes are reserved in front of it for the packet length (2 or 4).
+		public: explicit ETFWriter(size_t exactSize, size_t headerSize = 0):
+			pBase_(NULL),
+			Ptr_(NULL),
+			pBuffer_(NULL),
+			Size_(0),
+			HeaderSize_(headerSize),
+			Owner_(true)
+		{
+			Allocate(exactSize ? exactSize : 1);
+		}
+		
+		// Write into caller provided buffer (stack, output slot, mapped memory), nothing is allocated.
+		// Throws std::overflow_error if the term does not fit.
+		public: ETFWriter(byte* pBuf, size_t size, size_t headerSize = 0):
+			pBase_(pBuf),
+			Ptr_(NULL),
+			pBuffer_(NULL),
+			Size_(0),
+			HeaderSize_(headerSize),
+			Owner_(false)
 		{
-			Ptr_ = pBuffer_ = new byte[INITIAL_SIZE];
-			Size_ = INITIAL_SIZE;
+			if(!pBuf)
+				boost::throw_exception(std::invalid_argument("Zero Buffer Argument"));
+			if(size <= headerSize)
+				boost::throw_exception(std::length_error("Invalid Buffer Size"));
+			Ptr_ = pBuffer_ = pBase_ + HeaderSize_;
+			Size_ = size - HeaderSize_;
 			*pBuffer_ = (byte)ERL_VERSION; // Write Version Number
 			++pBuffer_;
 		}
 		
 		public: ETFWriter(const ETFWriter& rhs):
+			pBase_(NULL),
 			Ptr_(NULL),
 			pBuffer_(NULL),
-			Size_(0)
+			Size_(0),
+			HeaderSize_(0),
+			Owner_(true)
 		{
 			operator =(rhs);
 		}
 		
 		public: ~ETFWriter(void)
 		{
-			if(Ptr_)
-				delete[] Ptr_;
+			if(pBase_ && Owner_)
+				delete[] pBase_;
 		}
 		
-		private: void WriteToBuffer(const byte* pSrcBuffer, size_t srcCount)
+		private: void Allocate(size_t size)
+		{
+			pBase_ = NewArray<byte>(HeaderSize_ + size);
+			Ptr_ = pBuffer_ = pBase_ + HeaderSize_;
+			Size_ = size;
+			*pBuffer_ = (byte)ERL_VERSION; // Write Version Number
+			++pBuffer_;
+		}
+		
+		// Make room for srcCount bytes, return where to write them
+		private: byte* Reserve(size_t srcCount)
 		{
-			_ASSERTE(pSrcBuffer);
 			_ASSERTE(srcCount);
 			
 			size_t count = BytesCount();
 			size_t rest = Size_ - count;
-			size_t maxSize = (std::numeric_limits<size_t>::max)();
+			size_t maxSize = (std::numeric_limits<size_t>::max)() - HeaderSize_;
 			
 			// Reallocate Buffer for New Chunk
 			if(rest < srcCount) {
+				if(!Owner_)
+					boost::throw_exception(std::overflow_error("Out of Buffer Range"));
 				size_t addSize = ((srcCount - rest)/INITIAL_SIZE + 1)*INITIAL_SIZE;
 				// If Size_ + addSize > maxSize then make addSize up to maxSize
 				addSize = (Size_ > maxSize - addSize ? maxSize - Size_ : addSize);
 				// Check if new size can cover written buffer size
 				if(rest + addSize < srcCount)
-					throw std::overflow_error("Can't Allocate");
+					boost::throw_exception(std::overflow_error("Can't Allocate"));
 				// Allocate New Buffer
 				_ASSERTE(Size_ <= maxSize - addSize);
-				byte* pNewBuffer = new byte[Size_ + addSize];
-				memcpy(pNewBuffer, Ptr_, count);
-				delete[] Ptr_;
-				Ptr_ = pBuffer_ = pNewBuffer;
+				byte* pNewBuffer = NewArray<byte>(HeaderSize_ + Size_ + addSize);
+				memcpy(pNewBuffer + HeaderSize_, Ptr_, count);
+				delete[] pBase_;
+				pBase_ = pNewBuffer;
+				Ptr_ = pBuffer_ = pBase_ + HeaderSize_;
 				pBuffer_ += count;
 				Size_ += addSize;
 				_ASSERTE(count == BytesCount());
 			}
 			
-			// Copy source buffer to dest
-			memcpy(pBuffer_, pSrcBuffer, srcCount);
+			byte* p = pBuffer_;
 			pBuffer_ += srcCount;
+			return p;
+		}
+		
+		private: void WriteToBuffer(const byte* pSrcBuffer, size_t srcCount)
+		{
+			_ASSERTE(pSrcBuffer);
+			
+			// Copy source buffer to dest
+			memcpy(Reserve(srcCount), pSrcBuffer, srcCount);
 		}
 		
 		public: ETFWriter& operator =(const ETFWriter& rhs)
 		{
 			if(this != &rhs) {
-				byte* p = new byte[rhs.Size_];
-				if(Ptr_)
-					delete[] Ptr_;
-				Ptr_ = pBuffer_ = p;
+				byte* p = NewArray<byte>(rhs.HeaderSize_ + rhs.Size_);
+				if(pBase_ && Owner_)
+					delete[] pBase_;
+				pBase_ = p;
+				Owner_ = true;
+				HeaderSize_ = rhs.HeaderSize_;
+				Ptr_ = pBuffer_ = pBase_ + HeaderSize_;
 				Size_ = rhs.Size_;
-				memcpy(Ptr_, rhs.Ptr_, Size_);
+				memcpy(pBase_, rhs.pBase_, HeaderSize_ + rhs.BytesCount());
 				pBuffer_ += rhs.BytesCount();
 			}
 			return *this;
@@ -700,6 +2605,35 @@ namespace Erlang
 			return size_t(pBuffer_ - Ptr_);
 		}
 		
+		// Packet with the reserved length header filled in (big-endian, {packet,2} or {packet,4}),
+		// ready for Stream::WritePacket as one write.
+		public: const byte* Packet(void)
+		{
+			if(HeaderSize_ != 2 && HeaderSize_ != 4)
+				boost::throw_exception(std::logic_error("No Packet Header Reserved"));
+			if(HeaderSize_ == 2) {
+				if(BytesCount() > MAX_MESSAGE_LENGTH)
+					boost::throw_exception(std::length_error("Packet Too Long"));
+				RWBinary::Write(pBase_, (UInt16)BytesCount());
+			}
+			else
+				RWBinary::Write(pBase_, (UInt32)BytesCount());
+			return pBase_;
+		}
+		
+		public: size_t PacketSize(void) const
+		{
+			return HeaderSize_ + BytesCount();
+		}
+		
+		// Drop what was written after the first count bytes (the version number stays), the buffer
+		// is kept for the next term
+		public: void Truncate(size_t count)
+		{
+			if(count < BytesCount())
+				pBuffer_ = Ptr_ + (count ? count : 1);
+		}
+		
 		public: ETFWriter& WriteTuple(UInt32 tupleSize)
 		{
 			byte tuple[] = { LARGE_TUPLE_EXT, 0, 0, 0, 0 };
@@ -710,16 +2644,29 @@ namespace Erlang
 		
 		public: template<typename T> ETFWriter& WriteNumber(T number)
 		{
-			if(sizeof(T)*8 > 32) {
+			typedef NumberEncoding<T> Encoding;
+			if(Encoding::IsFloat()) {
 				byte bnumber[] = { NEW_FLOAT_EXT, 0, 0, 0, 0, 0, 0, 0, 0 };
-				RWBinary::Write(&bnumber[1], (1.0*number)); // convert small type to double
+				RWBinary::Write(&bnumber[1], (double)number); // convert float to double
 				WriteToBuffer(bnumber, sizeof(bnumber));
 			}
-			else {
+			else if(Encoding::IsSmall(number)) {
 				byte bnumber[] = { INTEGER_EXT, 0, 0, 0, 0 };
-				RWBinary::Write(&bnumber[1], 1*number); // convert small type to integer
+				RWBinary::Write(&bnumber[1], (Int32)number); // convert small type to integer
 				WriteToBuffer(bnumber, sizeof(bnumber));
 			}
+			else {
+				// SMALL_BIG_EXT: digits count, sign, little-endian digits
+				bool negative = false;
+				UInt64 magnitude = Encoding::Magnitude(number, negative);
+				size_t digits = Encoding::Digits(magnitude);
+				byte* ptr = Reserve(1 + 1 + 1 + digits);
+				*ptr++ = SMALL_BIG_EXT;
+				*ptr++ = (byte)digits;
+				*ptr++ = (negative ? 1 : 0);
+				for(size_t i = 0; i < digits; ++i, magnitude >>= 8)
+					*ptr++ = (byte)(magnitude & 0xff);
+			}
 			return *this;
 		}
 		
@@ -739,44 +2686,52 @@ namespace Erlang
 		{
 			size_t strLen = (str ? strlen((const char*)str) : 0);
 			size_t listLen = 1 + 4 + (1 + 1)*strLen + 1;
-			std::auto_ptr<byte> list(new byte[listLen]);
-			byte* ptr = list.get();
+			byte* list = Reserve(listLen);
+			byte* ptr = list;
 			
 			*ptr++ = LIST_EXT;
-			RWBinary::Write(ptr, strLen);
-			ptr += 4;
+			ptr = RWBinary::Write(ptr, (UInt32)strLen);
 			for(size_t i = 0; i < strLen; ++i) {
 				*ptr++ = SMALL_INTEGER_EXT;
 				*ptr++ = str[i];
 			}
 			*ptr++ = NIL_EXT;
 			
-			_ASSERTE(size_t(ptr - list.get()) == listLen);
-			WriteToBuffer(list.get(), listLen);
-			
+			_ASSERTE(size_t(ptr - list) == listLen);
 			return *this;
-	}
+		}
+		
+		// STRING_EXT, as term_to_binary() encodes lists of bytes (up to 65535), read by ReadASCII
+		public: ETFWriter& WriteASCII(const char* str)
+		{
+			size_t strLen = (str ? strlen(str) : 0);
+			if(!strLen)
+				return WriteNil();
+			if(strLen > 0xffff)
+				boost::throw_exception(std::length_error("Invalid Length of String"));
+			byte* ptr = Reserve(1 + 2 + strLen);
+			*ptr++ = STRING_EXT;
+			ptr = RWBinary::Write(ptr, (UInt16)strLen);
+			memcpy(ptr, str, strLen);
+			return *this;
+		}
 		
 		public: ETFWriter& WriteString(const wchar_t* str)
 		{
 			size_t strLen = (str ? wcslen(str) : 0);
 			size_t listLen = 1 + 4 + (1 + 4)*strLen + 1;
-			std::auto_ptr<byte> list(new byte[listLen]);
-			byte* ptr = list.get();
+			byte* list = Reserve(listLen);
+			byte* ptr = list;
 			
 			*ptr++ = LIST_EXT;
-			RWBinary::Write(ptr, strLen);
-			ptr += 4;
+			ptr = RWBinary::Write(ptr, (UInt32)strLen);
 			for(size_t i = 0; i < strLen; ++i) {
 				*ptr++ = INTEGER_EXT;
-				RWBinary::Write(ptr, (UInt32)str[i]);
-				ptr += 4;
+				ptr = RWBinary::Write(ptr, (UInt32)str[i]);
 			}
 			*ptr++ = NIL_EXT;
 			
-			_ASSERTE(size_t(ptr - list.get()) == listLen);
-			WriteToBuffer(list.get(), listLen);
-			
+			_ASSERTE(size_t(ptr - list) == listLen);
 			return *this;
 		}
 		
@@ -788,12 +2743,33 @@ namespace Erlang
 			return *this;
 		}
 		
+		// List of elements counted as they are written: BeginList returns where its header is,
+		// EndList(pos, listSize) fills the count in and writes the NIL_EXT tail. An empty one
+		// becomes NIL_EXT.
+		public: size_t BeginList(void)
+		{
+			size_t pos = BytesCount();
+			WriteList(0);
+			return pos;
+		}
+		
+		public: ETFWriter& EndList(size_t pos, UInt32 listSize)
+		{
+			if(pos + 5 > BytesCount() || Ptr_[pos] != LIST_EXT)
+				boost::throw_exception(std::logic_error("No List Begun There"));
+			if(!listSize && pos + 5 == BytesCount())
+				Truncate(pos);
+			else
+				RWBinary::Write(Ptr_ + pos + 1, listSize);
+			return WriteNil();
+		}
+		
 		public: ETFWriter& WriteAtom(const unsigned char* atomName)
 		{
 			size_t atomNameLen = (atomName ? strlen((const char*)atomName) : 0);
 			byte atom[1 + 2 + 255] = { ATOM_EXT, 0, };
 			if(!atomNameLen || atomNameLen > 255)
-				throw std::length_error("Invalid Length of Atom Name");
+				boost::throw_exception(std::length_error("Invalid Length of Atom Name"));
 			RWBinary::Write(&atom[1], (UInt16)atomNameLen);
 			RWBinary::Write(&atom[3], atomName, NULL);
 			WriteToBuffer(atom, 1 + 2 + atomNameLen);
@@ -810,12 +2786,213 @@ namespace Erlang
 			WriteToBuffer(ref, ref.Size());
 			return *this;
 		}
-
+		
 		public: ETFWriter& WriteBinary(const Binary& bin)
 		{
 			WriteToBuffer(bin, bin.Size());
 			return *this;
 		}
+		
+		public: ETFWriter& WriteBinary(const byte* data, size_t size)
+		{
+			if((UInt64)size > 0xffffffffULL)
+				boost::throw_exception(std::length_error("Invalid Length of Binary"));
+			byte* ptr = Reserve(1 + 4 + size);
+			*ptr++ = BINARY_EXT;
+			ptr = RWBinary::Write(ptr, (UInt32)size);
+			if(size)
+				memcpy(ptr, data, size);
+			return *this;
+		}
+		
+		// BINARY_EXT and the length only, the size bytes of the payload are not in the buffer: they
+		// come from a file at this point of the frame (Stream::WriteFile, Coroutine::ReplyFile)
+		public: ETFWriter& WriteBinaryHeader(size_t size)
+		{
+			if((UInt64)size > 0xffffffffULL)
+				boost::throw_exception(std::length_error("Invalid Length of Binary"));
+			byte header[] = { BINARY_EXT, 0, 0, 0, 0 };
+			RWBinary::Write(&header[1], (UInt32)size);
+			WriteToBuffer(header, sizeof(header));
+			return *this;
+		}
+		
+		public: ETFWriter& WritePid(const Pid& pid)
+		{
+			WriteToBuffer(pid, pid.Size());
+			return *this;
+		}
+		
+		public: ETFWriter& WritePort(const Port& port)
+		{
+			WriteToBuffer(port, port.Size());
+			return *this;
+		}
+		
+		public: ETFWriter& WriteFun(const Fun& fun)
+		{
+			WriteToBuffer(fun, fun.Size());
+			return *this;
+		}
+		
+		// Term encoded elsewhere (without version number), e.g. an element of a received list
+		// found by ETFReader::Tell and SkipTerm, copied as it is
+		public: ETFWriter& WriteEncoded(const byte* pTerm, size_t size)
+		{
+			if(size)
+				WriteToBuffer(pTerm, size);
+			return *this;
+		}
+	};
+	
+	// Sizing pass for ETFWriter: same calls, no output, BytesCount() is the exact encoded size
+	// (version number included). Use it to allocate the writer once:
+	// Erlang::ETFSizer es;
+	// es.WriteTuple(2).WriteAtom("rows").WriteList(n)...;
+	// Erlang::ETFWriter ewr(es.BytesCount(), 2); // + {packet,2} header
+	// ewr.WriteTuple(2).WriteAtom("rows").WriteList(n)...;
+	// Stream::WritePacket(ewr.Packet(), ewr.PacketSize(), &ei);
+	class ETFSizer
+	{
+		private: size_t Size_;
+		
+		public: ETFSizer(void):
+			Size_(1) // Version Number
+		{
+		}
+		
+		public: size_t BytesCount(void) const
+		{
+			return Size_;
+		}
+		
+		public: static size_t TupleSize(void)
+		{
+			return 1 + 4;
+		}
+		
+		// Largest encoding of any number of type T
+		public: template<typename T> static size_t NumberSize(void)
+		{
+			if(NumberEncoding<T>::IsFloat())
+				return 1 + 8;
+			if(sizeof(T) < sizeof(Int32) || (sizeof(T) == sizeof(Int32) && boost::is_signed<T>::value))
+				return 1 + 4;
+			return 1 + 1 + 1 + sizeof(T);
+		}
+		
+		public: static size_t StringSize(const unsigned char* str)
+		{
+			return 1 + 4 + (1 + 1)*(str ? strlen((const char*)str) : 0) + 1;
+		}
+		
+		public: static size_t StringSize(const wchar_t* str)
+		{
+			return 1 + 4 + (1 + 4)*(str ? wcslen(str) : 0) + 1;
+		}
+		
+		public: static size_t AtomSize(const unsigned char* atomName)
+		{
+			return 1 + 2 + (atomName ? strlen((const char*)atomName) : 0);
+		}
+		
+		public: ETFSizer& WriteTuple(UInt32)
+		{
+			Size_ += TupleSize();
+			return *this;
+		}
+		
+		public: template<typename T> ETFSizer& WriteNumber(T number)
+		{
+			Size_ += NumberEncoding<T>::Size(number);
+			return *this;
+		}
+		
+		public: ETFSizer& WriteNil(void)
+		{
+			Size_ += 1;
+			return *this;
+		}
+		
+		public: ETFSizer& WriteString(const char* str)
+		{
+			return WriteString((const unsigned char*)str);
+		}
+		
+		public: ETFSizer& WriteString(const unsigned char* str)
+		{
+			Size_ += StringSize(str);
+			return *this;
+		}
+		
+		public: ETFSizer& WriteString(const wchar_t* str)
+		{
+			Size_ += StringSize(str);
+			return *this;
+		}
+		
+		public: ETFSizer& WriteASCII(const char* str)
+		{
+			size_t strLen = (str ? strlen(str) : 0);
+			Size_ += (strLen ? 1 + 2 + strLen : 1);
+			return *this;
+		}
+		
+		public: ETFSizer& WriteList(UInt32)
+		{
+			Size_ += 1 + 4;
+			return *this;
+		}
+		
+		public: ETFSizer& WriteAtom(const unsigned char* atomName)
+		{
+			Size_ += AtomSize(atomName);
+			return *this;
+		}
+		
+		public: ETFSizer& WriteAtom(const char* atomName)
+		{
+			return WriteAtom((const unsigned char*)atomName);
+		}
+		
+		// Reference, Binary, Pid, Port, Fun - written as is
+		public: ETFSizer& WriteReference(const RawData& data)
+		{
+			Size_ += data.Size();
+			return *this;
+		}
+		
+		public: ETFSizer& WriteBinary(const RawData& data)
+		{
+			return WriteReference(data);
+		}
+		
+		public: ETFSizer& WriteBinary(const byte*, size_t size)
+		{
+			Size_ += 1 + 4 + size;
+			return *this;
+		}
+		
+		public: ETFSizer& WritePid(const RawData& data)
+		{
+			return WriteReference(data);
+		}
+		
+		public: ETFSizer& WritePort(const RawData& data)
+		{
+			return WriteReference(data);
+		}
+		
+		public: ETFSizer& WriteFun(const RawData& data)
+		{
+			return WriteReference(data);
+		}
+		
+		public: ETFSizer& WriteEncoded(const byte*, size_t size)
+		{
+			Size_ += size;
+			return *this;
+		}
 	};
 }
 //-------------------------------------------------------------------------------------------------
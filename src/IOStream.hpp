@@ -7,15 +7,38 @@
 //-------------------------------------------------------------------------------------------------
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <new>
+#include <vector>
+#ifdef _WIN32
 #include <io.h>
+#else
+#include <unistd.h>
+#endif /* _WIN32 */
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif /* __linux__ */
+
+#if defined(__SSSE3__) || defined(__AVX__)
+#include <tmmintrin.h>
+#define IOSTREAM_SIMD_SSSE3
+#endif
 
 #include <boost/thread/thread.hpp>
 #include <boost/thread/mutex.hpp>
 
 #include "Defines.hpp"
+#include "Metrics.hpp"
+#include "Capture.hpp"
 //-------------------------------------------------------------------------------------------------
 namespace IOStream
 {
+	// Longest {packet,4} frame read by default: the length comes from the peer, a corrupt or hostile
+	// header must not make the reader allocate gigabytes
+	static const size_t DEFAULT_MAX_FRAME_SIZE = 128*1024*1024;
+	
 	struct ErrorInfo
 	{
 		public: bool WasError;
@@ -30,6 +53,124 @@ namespace IOStream
 		}
 	};
 	
+	namespace Detail
+	{
+		// Unsigned word of the given width and its byte swap (bswap/rev instruction, not shifts)
+		template<unsigned Bits> struct Word;
+		
+		template<> struct Word<8>
+		{
+			typedef UInt8 Type;
+			static Type Swap(Type v) { return v; }
+		};
+		
+		template<> struct Word<16>
+		{
+			typedef UInt16 Type;
+#if defined(_MSC_VER)
+			static Type Swap(Type v) { return _byteswap_ushort(v); }
+#else
+			static Type Swap(Type v) { return __builtin_bswap16(v); }
+#endif
+		};
+		
+		template<> struct Word<32>
+		{
+			typedef UInt32 Type;
+#if defined(_MSC_VER)
+			static Type Swap(Type v) { return (Type)_byteswap_ulong(v); }
+#else
+			static Type Swap(Type v) { return __builtin_bswap32(v); }
+#endif
+		};
+		
+		template<> struct Word<64>
+		{
+			typedef UInt64 Type;
+#if defined(_MSC_VER)
+			static Type Swap(Type v) { return _byteswap_uint64(v); }
+#else
+			static Type Swap(Type v) { return __builtin_bswap64(v); }
+#endif
+		};
+		
+		// Network (big-endian) <-> host conversion, selected at compile time by host byte order
+		template<unsigned Bits, bool LittleEndianHost = (HOST_LITTLE_ENDIAN != 0)> struct Endian
+		{
+			typedef typename Word<Bits>::Type Type;
+			static Type Convert(Type v) { return Word<Bits>::Swap(v); }
+		};
+		
+		template<unsigned Bits> struct Endian<Bits, false>
+		{
+			typedef typename Word<Bits>::Type Type;
+			static Type Convert(Type v) { return v; }
+		};
+		
+#if defined(IOSTREAM_SIMD_SSSE3)
+		// pshufb masks reversing every 2-, 4- or 8-byte lane of a 16-byte block
+		template<unsigned Bits> struct ShuffleMask;
+		template<> struct ShuffleMask<16>
+		{
+			static __m128i Get(void) { return _mm_set_epi8(14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1); }
+		};
+		template<> struct ShuffleMask<32>
+		{
+			static __m128i Get(void) { return _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3); }
+		};
+		template<> struct ShuffleMask<64>
+		{
+			static __m128i Get(void) { return _mm_set_epi8(8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7); }
+		};
+#endif /* IOSTREAM_SIMD_SSSE3 */
+	}
+	
+	class ByteOrder
+	{
+		// Load a big-endian value from possibly unaligned memory.
+		// memcpy of a fixed size compiles to a single mov, so no alignment or aliasing assumptions are made.
+		public: template<unsigned Bits> static typename Detail::Word<Bits>::Type Load(const byte* p)
+		{
+			typename Detail::Word<Bits>::Type v;
+			memcpy(&v, p, sizeof(v));
+			return Detail::Endian<Bits>::Convert(v);
+		}
+		
+		// Store a value to possibly unaligned memory in big-endian order.
+		public: template<unsigned Bits> static void Store(byte* p, typename Detail::Word<Bits>::Type v)
+		{
+			v = Detail::Endian<Bits>::Convert(v);
+			memcpy(p, &v, sizeof(v));
+		}
+		
+		// Convert count elements of Bits width between big-endian and host order (dst and src may be
+		// the same buffer or unaligned). On little-endian hosts the bulk is reversed 16 bytes at a time.
+		public: template<unsigned Bits> static void Convert(byte* dst, const byte* src, size_t count)
+		{
+			const size_t width = Bits/8;
+			size_t i = 0;
+			if(!(HOST_LITTLE_ENDIAN) || width == 1) {
+				if(dst != src)
+					memmove(dst, src, count*width);
+				return;
+			}
+#if defined(IOSTREAM_SIMD_SSSE3)
+			const __m128i mask = Detail::ShuffleMask<Bits>::Get();
+			const size_t perBlock = 16/width;
+			for(; i + perBlock <= count; i += perBlock) {
+				__m128i v = _mm_loadu_si128((const __m128i*)(src + i*width));
+				_mm_storeu_si128((__m128i*)(dst + i*width), _mm_shuffle_epi8(v, mask));
+			}
+#endif /* IOSTREAM_SIMD_SSSE3 */
+			for(; i < count; ++i) {
+				typename Detail::Word<Bits>::Type v;
+				memcpy(&v, src + i*width, width);
+				v = Detail::Word<Bits>::Swap(v);
+				memcpy(dst + i*width, &v, width);
+			}
+		}
+	};
+	
 	class Stream
 	{
 		public: enum FileDescriptor
@@ -47,9 +188,15 @@ namespace IOStream
 		
 		public: static int SetMode(Stream::FileDescriptor fd, Stream::Mode mode)
 		{
+#ifdef _WIN32
 			int m = (mode == Stream::Text ? _O_TEXT : _O_BINARY);
 			int f = (fd == Stream::StdIn ? _fileno(stdin) : (fd == Stream::StdOut ? _fileno(stdout) : _fileno(stderr)));
 			return _setmode(f, m);
+#else
+			(void)(fd); // POSIX has no text mode
+			(void)(mode);
+			return 0;
+#endif /* _WIN32 */
 		}
 		
 		private: static boost::mutex& GetReadMutex(void)
@@ -70,17 +217,82 @@ namespace IOStream
 			if(ReadImpl(pBuf, 2, pErrorInfo) != 2)
 				return 0;
 			UInt16 len = (UInt16(pBuf[0]) << 8) | (UInt16(pBuf[1]) << 0);
-			return (UInt16)ReadImpl(pBuf, len, pErrorInfo);
+			len = (UInt16)ReadImpl(pBuf, len, pErrorInfo);
+			Counted(Metrics::FramesIn, Metrics::BytesIn, len, 2);
+			if(len && Capture::Active())
+				Capture::Frame(Capture::In, 2, pBuf, len);
+			return len;
+		}
+		
+		// {packet,4}: buffer grows to the packet length, returns 0 on close or error. A length over
+		// maxSize is an error (EMSGSIZE, the stream is out of step after it), so is a buffer that
+		// can't grow (ENOMEM)
+		public: static UInt32 Read4(std::vector<byte>& buf, ErrorInfo* pErrorInfo = NULL, size_t maxSize = DEFAULT_MAX_FRAME_SIZE)
+		{
+			boost::mutex::scoped_lock lock(GetReadMutex());
+			byte blen[4];
+			if(ReadImpl(blen, 4, pErrorInfo) != 4)
+				return 0;
+			UInt32 len = ByteOrder::Load<32>(blen);
+			if(len > maxSize)
+				return Fail(EMSGSIZE, pErrorInfo);
+			if(buf.size() < len && !Grow(buf, len))
+				return Fail(ENOMEM, pErrorInfo);
+			len = (len ? (UInt32)ReadImpl(&buf[0], len, pErrorInfo) : 0);
+			Counted(Metrics::FramesIn, Metrics::BytesIn, len, 4);
+			if(len && Capture::Active())
+				Capture::Frame(Capture::In, 4, &buf[0], len);
+			return len;
+		}
+		
+		// std::vector throws when it can't grow, and Erlang.hpp (this header with it) builds with
+		// -fno-exceptions: the memory is asked for with nothrow new first, so running out of it is
+		// ENOMEM and not bad_alloc. Only when the frame is longer than any before.
+		private: static bool Grow(std::vector<byte>& buf, size_t size)
+		{
+			void* p = ::operator new(size, std::nothrow);
+			if(!p)
+				return false;
+			::operator delete(p);
+			buf.resize(size);
+			return true;
+		}
+		
+		// Frame refused before its bytes were read
+		private: static UInt32 Fail(int error, ErrorInfo* pErrorInfo)
+		{
+			Metrics::Add(Metrics::IOErrors);
+			if(pErrorInfo)
+				*pErrorInfo = ErrorInfo(true, -1, error);
+			return 0;
+		}
+		
+		// Frame and its bytes (with header) in metrics, nothing for closed stream or error
+		private: static void Counted(Metrics::Counter frames, Metrics::Counter bytes, size_t len, size_t headerSize)
+		{
+			if(!len)
+				return;
+			Metrics::Add(frames);
+			Metrics::Add(bytes, len + headerSize);
 		}
 		
 		private: static size_t ReadImpl(byte* pBuf, size_t len, ErrorInfo* pErrorInfo)
 		{
 			size_t got = 0;
 			do {
+				Metrics::Add(Metrics::ReadCalls);
+#ifdef _WIN32
 				int count = _read(0, pBuf + got, (unsigned)(len - got));
+#else
+				int count = (int)::read(0, pBuf + got, len - got);
+				if(count < 0 && errno == EINTR)
+					continue;
+#endif /* _WIN32 */
 				if(count <= 0) {
+					if(count < 0)
+						Metrics::Add(Metrics::IOErrors);
 					if(pErrorInfo)
-						*pErrorInfo = ErrorInfo(count < 0, count, errno);
+						*pErrorInfo = ErrorInfo(count < 0, count, (count < 0 ? errno : 0)); // 0 - end of stream
 					return 0;
 				}
 				got += (size_t)count;
@@ -94,15 +306,170 @@ namespace IOStream
 			byte blen[2] = { byte((len >> 8) & 0xff), byte((len >> 0) & 0xff) };
 			if(WriteImpl(blen, 2, pErrorInfo) != 2)
 				return 0;
-			return (UInt16)WriteImpl(pBuf, len, pErrorInfo);
+			len = (UInt16)WriteImpl(pBuf, len, pErrorInfo);
+			Counted(Metrics::FramesOut, Metrics::BytesOut, len, 2);
+			if(len && Capture::Active())
+				Capture::Frame(Capture::Out, 2, pBuf, len);
+			return len;
 		}
 		
-		private: static size_t WriteImpl(const byte* pBuf, size_t len, ErrorInfo* pErrorInfo)
+		public: static UInt32 Write4(const byte* pBuf, UInt32 len, ErrorInfo* pErrorInfo = NULL)
+		{
+			boost::mutex::scoped_lock lock(GetWriteMutex());
+			byte blen[4] = { byte((len >> 24) & 0xff), byte((len >> 16) & 0xff), byte((len >> 8) & 0xff), byte((len >> 0) & 0xff) };
+			if(WriteImpl(blen, 4, pErrorInfo) != 4)
+				return 0;
+			len = (UInt32)WriteImpl(pBuf, len, pErrorInfo);
+			Counted(Metrics::FramesOut, Metrics::BytesOut, len, 4);
+			if(len && Capture::Active())
+				Capture::Frame(Capture::Out, 4, pBuf, len);
+			return len;
+		}
+		
+		// Write complete packet: pBuf already starts with the length header ({packet,2} or {packet,4}),
+		// e.g. ETFWriter::Packet(), so header and term go out in one write.
+		public: static size_t WritePacket(const byte* pBuf, size_t size, ErrorInfo* pErrorInfo = NULL)
+		{
+			boost::mutex::scoped_lock lock(GetWriteMutex());
+			size = WriteImpl(pBuf, size, pErrorInfo);
+			Counted(Metrics::FramesOut, Metrics::BytesOut, size, 0);
+			if(size && Capture::Active())
+				Capture::Packet(Capture::Out, pBuf, size);
+			return size;
+		}
+		
+		// {packet,N} frame of a term whose binary payload is a file range: head is the term up to
+		// and including the BINARY_EXT header (ETFWriter::WriteBinaryHeader), then count bytes of
+		// fd from offset go out by SendFile, then tail, the rest of the term. The file does not
+		// go through user space, unless the frame is captured.
+		public: static bool WriteFile(UInt32 packetSize, const byte* pHead, size_t headSize, int fd, UInt64 offset, size_t count,
+			const byte* pTail, size_t tailSize, ErrorInfo* pErrorInfo = NULL)
+		{
+			UInt64 len = (UInt64)headSize + count + tailSize;
+			if(len > (packetSize == 2 ? 0xffffULL : 0xffffffffULL)) {
+				if(pErrorInfo)
+					*pErrorInfo = ErrorInfo(true, -1, EMSGSIZE);
+				return false;
+			}
+			if(Capture::Active()) {
+				std::vector<byte> frame(pHead, pHead + headSize);
+				frame.resize(headSize + count);
+				if(count && ReadAt(fd, &frame[headSize], count, offset) != count) {
+					if(pErrorInfo)
+						*pErrorInfo = ErrorInfo(true, -1, EIO);
+					return false;
+				}
+				frame.insert(frame.end(), pTail, pTail + tailSize);
+				const byte* p = (frame.empty() ? NULL : &frame[0]);
+				return (packetSize == 2 ? Write2(p, (UInt16)len, pErrorInfo) : Write4(p, (UInt32)len, pErrorInfo)) == len;
+			}
+			
+			byte header[4] = { byte((len >> 24) & 0xff), byte((len >> 16) & 0xff), byte((len >> 8) & 0xff), byte((len >> 0) & 0xff) };
+			boost::mutex::scoped_lock lock(GetWriteMutex());
+			if(WriteImpl(header + 4 - packetSize, packetSize, pErrorInfo) != packetSize || (headSize && WriteImpl(pHead, headSize, pErrorInfo) != headSize))
+				return false;
+			if(!SendFile(1, fd, offset, count, pErrorInfo))
+				return false;
+			if(tailSize && WriteImpl(pTail, tailSize, pErrorInfo) != tailSize)
+				return false;
+			Counted(Metrics::FramesOut, Metrics::BytesOut, (size_t)len, packetSize);
+			return true;
+		}
+		
+		// count bytes of file fd from offset to descriptor out. On Linux sendfile moves them from
+		// the page cache to the pipe or socket without a copy through user space, elsewhere (or
+		// for a file sendfile does not take) they go through a buffer. A file shorter than
+		// offset + count is padded with zeros, so the frame they belong to stays whole, and the
+		// call fails all the same.
+		public: static bool SendFile(int out, int fd, UInt64 offset, size_t count, ErrorInfo* pErrorInfo = NULL)
+		{
+			size_t sent = 0;
+			bool copy = true;
+#ifdef __linux__
+			copy = false;
+			while(sent < count) {
+				Metrics::Add(Metrics::WriteCalls);
+				off_t pos = (off_t)(offset + sent);
+				ssize_t n = ::sendfile(out, fd, &pos, count - sent);
+				if(n < 0 && errno == EINTR)
+					continue;
+				if(n < 0 && !sent && (errno == EINVAL || errno == ENOSYS)) {
+					copy = true;
+					break;
+				}
+				if(n < 0) {
+					Metrics::Add(Metrics::IOErrors);
+					if(pErrorInfo)
+						*pErrorInfo = ErrorInfo(true, (int)n, errno);
+					return false; // In the middle of a frame, the stream is broken
+				}
+				if(!n)
+					break; // File is short
+				sent += (size_t)n;
+				Metrics::Add(Metrics::FileBytes, (size_t)n);
+			}
+#endif /* __linux__ */
+			std::vector<byte> buf;
+			while(copy && sent < count) {
+				buf.resize(count - sent < 65536 ? count - sent : 65536);
+				size_t n = ReadAt(fd, &buf[0], buf.size(), offset + sent);
+				if(!n)
+					break;
+				if(WriteImpl(&buf[0], n, pErrorInfo, out) != n)
+					return false;
+				sent += n;
+			}
+			if(sent == count)
+				return true;
+			
+			buf.assign(count - sent < 65536 ? count - sent : 65536, 0);
+			for(size_t n = 0; sent < count; sent += n) {
+				n = (count - sent < buf.size() ? count - sent : buf.size());
+				if(WriteImpl(&buf[0], n, pErrorInfo, out) != n)
+					return false;
+			}
+			Metrics::Add(Metrics::IOErrors);
+			if(pErrorInfo)
+				*pErrorInfo = ErrorInfo(true, -1, EIO);
+			return false;
+		}
+		
+		// Up to size bytes of file fd at offset, fewer at its end, 0 on error
+		private: static size_t ReadAt(int fd, byte* pBuf, size_t size, UInt64 offset)
+		{
+			size_t got = 0;
+			while(got < size) {
+				Metrics::Add(Metrics::ReadCalls);
+#ifdef _WIN32
+				if(_lseeki64(fd, (__int64)(offset + got), SEEK_SET) < 0)
+					break;
+				int count = _read(fd, pBuf + got, (unsigned)(size - got));
+#else
+				ssize_t count = ::pread(fd, pBuf + got, size - got, (off_t)(offset + got));
+				if(count < 0 && errno == EINTR)
+					continue;
+#endif /* _WIN32 */
+				if(count <= 0)
+					break;
+				got += (size_t)count;
+			}
+			return got;
+		}
+		
+		private: static size_t WriteImpl(const byte* pBuf, size_t len, ErrorInfo* pErrorInfo, int fd = 1)
 		{
 			size_t wrote = 0;
 			do {
-				int count = _write(1, pBuf + wrote, (unsigned)(len - wrote));
+				Metrics::Add(Metrics::WriteCalls);
+#ifdef _WIN32
+				int count = _write(fd, pBuf + wrote, (unsigned)(len - wrote));
+#else
+				int count = (int)::write(fd, pBuf + wrote, len - wrote);
+				if(count < 0 && errno == EINTR)
+					continue;
+#endif /* _WIN32 */
 				if(count <= 0) {
+					Metrics::Add(Metrics::IOErrors);
 					if(pErrorInfo)
 						*pErrorInfo = ErrorInfo(count < 0, count, errno);
 					return 0;
@@ -117,120 +484,77 @@ namespace IOStream
 	{
 		private: template<typename T> struct RWHelper
 		{
-			public: template<unsigned> static const byte* ReadNumber(const byte*, T&);
-			public: template<unsigned> static const byte* ReadString(const byte*, T*, size_t);
-			public: template<unsigned> static byte* WriteNumber(byte*, const T&);
-			public: template<unsigned> static byte* WriteString(byte*, const T*, size_t*);
+			public: static const unsigned Bits = sizeof(T)*8;
+			public: typedef typename Detail::Word<Bits>::Type Word;
 			
-			public: template<> static const byte* ReadNumber<8>(const byte* p, T& v)
+			public: static const byte* ReadNumber(const byte* p, T& v)
 			{
-				v = (T(p[0]) << 0);
-				return &p[1];
-			}
-		
-			public: template<> static const byte* ReadNumber<16>(const byte* p, T& v)
-			{
-				v = (T(p[0]) << 8) | (T(p[1]) << 0);
-				return &p[2];
-			}
-			
-			public: template<> static const byte* ReadNumber<32>(const byte* p, T& v)
-			{
-				v = (T(p[0]) << 24) | (T(p[1]) << 16) | (T(p[2]) << 8) | (T(p[3]) << 0);
-				return &p[4];
-			}
-			
-			public: template<> static const byte* ReadNumber<64>(const byte* p, T& v)
-			{
-				UInt64 v64;
-				v64 = (UInt64(p[0]) << 56) | (UInt64(p[1]) << 48) | (UInt64(p[2]) << 40) | (UInt64(p[3]) << 32) | 
-							(UInt64(p[4]) << 24) | (UInt64(p[5]) << 16) | (UInt64(p[6]) << 8) | (UInt64(p[7]) << 0);
-				v = *(T*)(&v64);
-				return &p[8];
-			}
-		
-			public: template<> static const byte* ReadString<8>(const byte* p, T* str, size_t count) // ASCII
-			{
-				memcpy((char*)str, (char*)p, count);
-				return &p[count];
-			}
-			
-			public: template<> static const byte* ReadString<16>(const byte* p, T* str, size_t count) // Unicode
-			{
-				wmemcpy((wchar_t*)str, (wchar_t*)p, count);
-				return &p[2*count];
+				Word w = ByteOrder::Load<Bits>(p);
+				memcpy(&v, &w, sizeof(v)); // bit copy: exact for signed integers and IEEE doubles alike
+				return &p[sizeof(T)];
 			}
 			
-			public: template<> static byte* WriteNumber<8>(byte* p, const T& v)
+			public: static byte* WriteNumber(byte* p, const T& v)
 			{
-				p[0] = (UInt8(v >> 0) & 0xff);
-				return &p[1];
+				Word w;
+				memcpy(&w, &v, sizeof(w));
+				ByteOrder::Store<Bits>(p, w);
+				return &p[sizeof(T)];
 			}
 			
-			public: template<> static byte* WriteNumber<16>(byte* p, const T& v)
+			public: static const byte* ReadString(const byte* p, T* str, size_t count) // ASCII (8bit), Unicode (16bit)
 			{
-				p[0] = (UInt8(v >> 8) & 0xff);
-				p[1] = (UInt8(v >> 0) & 0xff);
-				return &p[2];
+				memcpy(str, p, count*sizeof(T));
+				return &p[count*sizeof(T)];
 			}
 			
-			public: template<> static byte* WriteNumber<32>(byte* p, const T& v)
+			public: static byte* WriteString(byte* p, const T* str, size_t* pCount) // ASCII (8bit), Unicode (16bit)
 			{
-				p[0] = (UInt8(v >> 24) & 0xff);
-				p[1] = (UInt8(v >> 16) & 0xff);
-				p[2] = (UInt8(v >> 8) & 0xff);
-				p[3] = (UInt8(v >> 0) & 0xff);
-				return &p[4];
-			}
-			
-			public: template<> static byte* WriteNumber<64>(byte* p, const T& v)
-			{
-				UInt64 v64 = *(UInt64*)(&v);
-				p[0] = (UInt8(v64 >> 56) & 0xff);
-				p[1] = (UInt8(v64 >> 48) & 0xff);
-				p[2] = (UInt8(v64 >> 40) & 0xff);
-				p[3] = (UInt8(v64 >> 32) & 0xff);
-				p[4] = (UInt8(v64 >> 24) & 0xff);
-				p[5] = (UInt8(v64 >> 16) & 0xff);
-				p[6] = (UInt8(v64 >> 8) & 0xff);
-				p[7] = (UInt8(v64 >> 0) & 0xff);
-				return &p[8];
-			}
-		
-			public: template<> static byte* WriteString<8>(byte* p, const T* str, size_t* pCount) // ASCII
-			{
-				*pCount = (str ? strlen((const char*)str) : 0 );
-				memcpy((char*)p, (char*)str, *pCount);
-				return &p[*pCount];
-			}
-			
-			public: template<> static byte* WriteString<16>(byte* p, const T* str, size_t* pCount) // Unicode
-			{
-				*pCount = (str ? wcslen((wchar_t*)str) : 0);
-				wmemcpy((wchar_t*)p, (wchar_t*)str, *pCount);
-				return &p[2*(*pCount)];
+				*pCount = 0;
+				while(str && str[*pCount])
+					++*pCount;
+				memcpy(p, str, (*pCount)*sizeof(T));
+				return &p[(*pCount)*sizeof(T)];
 			}
 		};
 		
 		public: template<typename T> static const byte* Read(const byte* p, T& v)
 		{
-			return (p ? RWHelper<T>::ReadNumber<sizeof(T)*8>(p, v) : p);
+			return (p ? RWHelper<T>::ReadNumber(p, v) : p);
 		}
 		
 		public: template<typename T> static const byte* Read(const byte* p, T* str, size_t count)
 		{
-			return ((p && str) ? RWHelper<T>::ReadString<sizeof(T)*8>(p, str, count) : p);
+			return ((p && str) ? RWHelper<T>::ReadString(p, str, count) : p);
 		}
 		
 		public: template<typename T> static byte* Write(byte* p, const T& v)
 		{
-			return (p ? RWHelper<T>::WriteNumber<sizeof(T)*8>(p, v) : p);
+			return (p ? RWHelper<T>::WriteNumber(p, v) : p);
 		}
 		
 		public: template<typename T> static byte* Write(byte* p, const T* str, size_t* pCount)
 		{
 			size_t temp;
-			return ((p && str) ? RWHelper<T>::WriteString<sizeof(T)*8>(p, str, (pCount ? pCount : &temp)) : p);
+			return ((p && str) ? RWHelper<T>::WriteString(p, str, (pCount ? pCount : &temp)) : p);
+		}
+		
+		// Read count big-endian numbers (16, 32 or 64 bit) into host order array
+		public: template<typename T> static const byte* ReadArray(const byte* p, T* values, size_t count)
+		{
+			if(!p || !values)
+				return p;
+			ByteOrder::Convert<sizeof(T)*8>((byte*)values, p, count);
+			return &p[count*sizeof(T)];
+		}
+		
+		// Write count host order numbers (16, 32 or 64 bit) as big-endian array
+		public: template<typename T> static byte* WriteArray(byte* p, const T* values, size_t count)
+		{
+			if(!p || !values)
+				return p;
+			ByteOrder::Convert<sizeof(T)*8>(p, (const byte*)values, count);
+			return &p[count*sizeof(T)];
 		}
 	};
 
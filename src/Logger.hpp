@@ -0,0 +1,648 @@
+/*
+
+*/
+
+#ifndef __LOGGER_HPP__
+#define __LOGGER_HPP__
+//-------------------------------------------------------------------------------------------------
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/chrono.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include "Defines.hpp"
+//-------------------------------------------------------------------------------------------------
+// Compile-time level: calls below LOG_LEVEL are removed with their arguments
+#define LOG_LEVEL_DEBUG			0
+#define LOG_LEVEL_INFO			1
+#define LOG_LEVEL_WARNING		2
+#define LOG_LEVEL_ERROR			3
+#define LOG_LEVEL_NONE			4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL				LOG_LEVEL_INFO
+#endif /* LOG_LEVEL */
+
+// LOG_INFO("Got {} bytes from {}", size, name) - format must be a string literal, {} are replaced
+// by the arguments in order (up to 4: numbers, chars, strings, wide strings, pointers)
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...)			IOStream::Logger::Write(IOStream::Logger::Debug, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...)			((void)0)
+#endif
+#if LOG_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(...)			IOStream::Logger::Write(IOStream::Logger::Info, __VA_ARGS__)
+#else
+#define LOG_INFO(...)			((void)0)
+#endif
+#if LOG_LEVEL <= LOG_LEVEL_WARNING
+#define LOG_WARNING(...)		IOStream::Logger::Write(IOStream::Logger::Warning, __VA_ARGS__)
+#else
+#define LOG_WARNING(...)		((void)0)
+#endif
+#if LOG_LEVEL <= LOG_LEVEL_ERROR
+#define LOG_ERROR(...)			IOStream::Logger::Write(IOStream::Logger::Error, __VA_ARGS__)
+#else
+#define LOG_ERROR(...)			((void)0)
+#endif
+//-------------------------------------------------------------------------------------------------
+namespace IOStream
+{
+	// Asynchronous logger. A handler thread only copies the format pointer, a time stamp and the
+	// arguments (binary) into its own ring buffer - no lock, no formatting, no syscall. A background
+	// thread drains all rings, orders each batch by time, formats it and appends it to the file with
+	// one write. If a ring is full the record is dropped and counted, the handler never waits.
+	//
+	// Logger::Start("Log.txt");
+	// LOG_INFO("Command {} done in {} us", command, us);
+	// Logger::Stop(); // drains everything and closes the file
+	class Logger
+	{
+		public: enum Level
+		{
+			Debug,
+			Info,
+			Warning,
+			Error,
+		};
+		
+		private: enum ArgType
+		{
+			Signed,
+			Unsigned,
+			Float,
+			Char,
+			String,
+			WideString,
+			Pointer,
+		};
+		
+		private: static const size_t MAX_RECORD = 1024;       // Longer strings are cut
+		private: static const size_t BATCH_SIZE = 64*1024;    // Formatted bytes per file write
+		private: static const unsigned FLUSH_INTERVAL = 10;  // ms between background passes
+		private: static const size_t ALIGN = 8;
+		
+		// Record: [size][time][format][level][argc] then per argument [type][value]
+		private: struct Header
+		{
+			public: UInt32 Size; // 0 - rest of the ring is padding
+			public: UInt32 Thread;
+			public: Int64 Time;  // ns since epoch
+			public: const char* Format;
+			public: UInt8 Level;
+			public: UInt8 Argc;
+		};
+		
+		// Single producer (owning thread), single consumer (background thread)
+		private: class Ring
+		{
+			private: byte* pData_;
+			private: size_t Mask_;
+			private: UInt32 Thread_;
+			private: byte Padding0_[CACHE_LINE_SIZE];
+			private: boost::atomic<size_t> Head_; // Written by producer
+			private: byte Padding1_[CACHE_LINE_SIZE];
+			private: boost::atomic<size_t> Tail_; // Written by consumer
+			private: byte Padding2_[CACHE_LINE_SIZE];
+			
+			public: Ring(size_t size, UInt32 thread):
+				pData_(NULL),
+				Mask_(0),
+				Thread_(thread),
+				Head_(0),
+				Tail_(0)
+			{
+				size_t s = 4096;
+				while(s < size)
+					s <<= 1;
+				pData_ = new byte[s];
+				Mask_ = s - 1;
+			}
+			
+			public: ~Ring(void)
+			{
+				delete[] pData_;
+			}
+			
+			public: UInt32 Thread(void) const
+			{
+				return Thread_;
+			}
+			
+			public: bool Push(const byte* pRecord, size_t size)
+			{
+				size_t head = Head_.load(boost::memory_order_relaxed);
+				size_t tail = Tail_.load(boost::memory_order_acquire);
+				size_t offset = head & Mask_;
+				size_t contiguous = Mask_ + 1 - offset;
+				size_t need = (contiguous < size ? contiguous + size : size);
+				if(Mask_ + 1 - (head - tail) < need)
+					return false;
+				if(contiguous < size) {
+					UInt32 padding = 0;
+					memcpy(pData_ + offset, &padding, sizeof(padding));
+					offset = 0;
+				}
+				memcpy(pData_ + offset, pRecord, size);
+				Head_.store(head + need, boost::memory_order_release);
+				return true;
+			}
+			
+			// Copy all complete records to out, free their space
+			public: void Drain(std::vector<byte>& out)
+			{
+				size_t tail = Tail_.load(boost::memory_order_relaxed);
+				size_t head = Head_.load(boost::memory_order_acquire);
+				while(tail != head) {
+					size_t offset = tail & Mask_;
+					UInt32 size = 0;
+					memcpy(&size, pData_ + offset, sizeof(size));
+					if(!size) {
+						tail += Mask_ + 1 - offset;
+						continue;
+					}
+					out.insert(out.end(), pData_ + offset, pData_ + offset + size);
+					tail += size;
+				}
+				Tail_.store(tail, boost::memory_order_release);
+			}
+		};
+		
+		private: struct State
+		{
+			public: boost::mutex Mutex;
+			public: boost::condition_variable Wake;
+			public: std::vector<Ring*> Rings; // Kept until exit, threads hold pointers to them
+			public: boost::atomic<bool> Running;
+			public: boost::atomic<UInt64> Dropped;
+			public: boost::atomic<UInt64> Requested; // Flush requests
+			public: UInt64 Done;
+			public: bool Stopping;
+			public: size_t RingSize;
+			public: FILE* pFile;
+			public: boost::thread* pThread;
+			
+			public: State(void):
+				Running(false),
+				Dropped(0),
+				Requested(0),
+				Done(0),
+				Stopping(false),
+				RingSize(64*1024),
+				pFile(NULL),
+				pThread(NULL)
+			{
+			}
+		};
+		
+		private: Logger(void);
+		
+		private: static State& GetState(void)
+		{
+			static State state;
+			return state;
+		}
+		
+		private: static Ring* Local(void)
+		{
+			static THREAD_LOCAL Ring* pRing = NULL;
+			if(!pRing) {
+				State& s = GetState();
+				boost::mutex::scoped_lock lock(s.Mutex);
+				pRing = new Ring(s.RingSize, (UInt32)s.Rings.size());
+				s.Rings.push_back(pRing);
+			}
+			return pRing;
+		}
+		
+		//---------------------------------------------------------------------------------------------
+		// Producer side
+		
+		private: class Record
+		{
+			private: union
+			{
+				Header Header_;
+				byte Buffer_[MAX_RECORD];
+			};
+			private: size_t Size_;
+			
+			public: Record(Level level, const char* format):
+				Size_(sizeof(Header))
+			{
+				Header_.Size = 0;
+				Header_.Thread = 0;
+				Header_.Time = (Int64)boost::chrono::duration_cast<boost::chrono::nanoseconds>(boost::chrono::system_clock::now().time_since_epoch()).count();
+				Header_.Format = format;
+				Header_.Level = (UInt8)level;
+				Header_.Argc = 0;
+			}
+			
+			public: const byte* Data(void) const
+			{
+				return Buffer_;
+			}
+			
+			public: size_t Size(void) const
+			{
+				return Header_.Size;
+			}
+			
+			public: void Finish(void)
+			{
+				Header_.Size = (UInt32)((Size_ + ALIGN - 1)/ALIGN*ALIGN);
+			}
+			
+			private: void Put(ArgType type, const void* p, size_t size)
+			{
+				if(Size_ + 1 + size > MAX_RECORD)
+					return;
+				Buffer_[Size_++] = (byte)type;
+				memcpy(Buffer_ + Size_, p, size);
+				Size_ += size;
+				++Header_.Argc;
+			}
+			
+			// [type][UInt16 count][count units]
+			private: void PutString(ArgType type, const void* p, size_t count, size_t unit)
+			{
+				if(Size_ + 1 + sizeof(UInt16) + unit > MAX_RECORD)
+					return;
+				count = std::min(count, (MAX_RECORD - Size_ - 1 - sizeof(UInt16))/unit);
+				UInt16 count16 = (UInt16)count;
+				Buffer_[Size_++] = (byte)type;
+				memcpy(Buffer_ + Size_, &count16, sizeof(count16));
+				Size_ += sizeof(count16);
+				memcpy(Buffer_ + Size_, p, count*unit);
+				Size_ += count*unit;
+				++Header_.Argc;
+			}
+			
+			public: void Add(Int64 v) { Put(Signed, &v, sizeof(v)); }
+			public: void Add(UInt64 v) { Put(Unsigned, &v, sizeof(v)); }
+			public: void Add(int v) { Add((Int64)v); }
+			public: void Add(long v) { Add((Int64)v); }
+			public: void Add(short v) { Add((Int64)v); }
+			public: void Add(signed char v) { Add((Int64)v); }
+			public: void Add(unsigned int v) { Add((UInt64)v); }
+			public: void Add(unsigned long v) { Add((UInt64)v); }
+			public: void Add(unsigned short v) { Add((UInt64)v); }
+			public: void Add(unsigned char v) { Add((UInt64)v); }
+			public: void Add(bool v) { Add((UInt64)(v ? 1 : 0)); }
+			public: void Add(double v) { Put(Float, &v, sizeof(v)); }
+			public: void Add(float v) { Add((double)v); }
+			public: void Add(long double v) { Add((double)v); }
+			public: void Add(char v) { Put(Char, &v, sizeof(v)); }
+			public: void Add(const void* v) { Put(Pointer, &v, sizeof(v)); }
+			public: void Add(const char* v) { PutString(String, (v ? v : "(null)"), (v ? strlen(v) : 6), 1); }
+			public: void Add(char* v) { Add((const char*)v); }
+			public: void Add(const unsigned char* v) { Add((const char*)v); }
+			public: void Add(unsigned char* v) { Add((const char*)v); }
+			public: void Add(const std::string& v) { PutString(String, v.c_str(), v.size(), 1); }
+			public: void Add(const wchar_t* v) { PutString(WideString, (v ? v : L""), (v ? wcslen(v) : 0), sizeof(wchar_t)); }
+			public: void Add(wchar_t* v) { Add((const wchar_t*)v); }
+			public: void Add(const std::wstring& v) { PutString(WideString, v.c_str(), v.size(), sizeof(wchar_t)); }
+		};
+		
+		private: static void Push(Record& r)
+		{
+			r.Finish();
+			if(!Local()->Push(r.Data(), r.Size()))
+				GetState().Dropped.fetch_add(1, boost::memory_order_relaxed);
+		}
+		
+		private: static bool Enabled(void)
+		{
+			return GetState().Running.load(boost::memory_order_relaxed);
+		}
+		
+		public: static void Write(Level level, const char* format)
+		{
+			if(!Enabled())
+				return;
+			Record r(level, format);
+			Push(r);
+		}
+		
+		public: template<typename A1> static void Write(Level level, const char* format, const A1& a1)
+		{
+			if(!Enabled())
+				return;
+			Record r(level, format);
+			r.Add(a1);
+			Push(r);
+		}
+		
+		public: template<typename A1, typename A2> static void Write(Level level, const char* format, const A1& a1, const A2& a2)
+		{
+			if(!Enabled())
+				return;
+			Record r(level, format);
+			r.Add(a1);
+			r.Add(a2);
+			Push(r);
+		}
+		
+		public: template<typename A1, typename A2, typename A3> static void Write(Level level, const char* format, const A1& a1, const A2& a2, const A3& a3)
+		{
+			if(!Enabled())
+				return;
+			Record r(level, format);
+			r.Add(a1);
+			r.Add(a2);
+			r.Add(a3);
+			Push(r);
+		}
+		
+		public: template<typename A1, typename A2, typename A3, typename A4> static void Write(Level level, const char* format, const A1& a1, const A2& a2, const A3& a3, const A4& a4)
+		{
+			if(!Enabled())
+				return;
+			Record r(level, format);
+			r.Add(a1);
+			r.Add(a2);
+			r.Add(a3);
+			r.Add(a4);
+			Push(r);
+		}
+		
+		//---------------------------------------------------------------------------------------------
+		// Consumer side
+		
+		private: static const char* LevelName(UInt8 level)
+		{
+			static const char* names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+			return (level < sizeof(names)/sizeof(names[0]) ? names[level] : "?");
+		}
+		
+		private: static void AppendUtf8(std::string& out, UInt32 c)
+		{
+			if(c < 0x80)
+				out += (char)c;
+			else if(c < 0x800) {
+				out += (char)(0xc0 | (c >> 6));
+				out += (char)(0x80 | (c & 0x3f));
+			}
+			else if(c < 0x10000) {
+				out += (char)(0xe0 | (c >> 12));
+				out += (char)(0x80 | ((c >> 6) & 0x3f));
+				out += (char)(0x80 | (c & 0x3f));
+			}
+			else {
+				out += (char)(0xf0 | ((c >> 18) & 0x07));
+				out += (char)(0x80 | ((c >> 12) & 0x3f));
+				out += (char)(0x80 | ((c >> 6) & 0x3f));
+				out += (char)(0x80 | (c & 0x3f));
+			}
+		}
+		
+		// Format one argument, return position of the next one
+		private: static const byte* FormatArg(const byte* p, std::string& out)
+		{
+			char text[64];
+			ArgType type = (ArgType)*p++;
+			switch(type) {
+				case Signed: {
+					Int64 v;
+					memcpy(&v, p, sizeof(v));
+					sprintf(text, "%lld", (long long)v);
+					out += text;
+					return p + sizeof(v);
+				}
+				case Unsigned: {
+					UInt64 v;
+					memcpy(&v, p, sizeof(v));
+					sprintf(text, "%llu", (unsigned long long)v);
+					out += text;
+					return p + sizeof(v);
+				}
+				case Float: {
+					double v;
+					memcpy(&v, p, sizeof(v));
+					sprintf(text, "%.15g", v);
+					out += text;
+					return p + sizeof(v);
+				}
+				case Char:
+					out += (char)*p;
+					return p + 1;
+				case Pointer: {
+					const void* v;
+					memcpy(&v, p, sizeof(v));
+					sprintf(text, "%p", v);
+					out += text;
+					return p + sizeof(v);
+				}
+				case String:
+				case WideString: {
+					UInt16 count;
+					memcpy(&count, p, sizeof(count));
+					p += sizeof(count);
+					if(type == String) {
+						out.append((const char*)p, count);
+						return p + count;
+					}
+					for(UInt16 i = 0; i < count; ++i, p += sizeof(wchar_t)) {
+						wchar_t c;
+						memcpy(&c, p, sizeof(c));
+						AppendUtf8(out, (UInt32)c);
+					}
+					return p;
+				}
+			}
+			return p;
+		}
+		
+		// "2014-01-31 12:00:00.123456 INFO  [0] message"
+		private: static void Format(const byte* pRecord, std::string& out)
+		{
+			Header h;
+			memcpy(&h, pRecord, sizeof(h));
+			const byte* p = pRecord + sizeof(Header);
+			
+			time_t seconds = (time_t)(h.Time/1000000000);
+			struct tm t;
+#ifdef _WIN32
+			localtime_s(&t, &seconds);
+#else
+			localtime_r(&seconds, &t);
+#endif /* _WIN32 */
+			char prefix[96];
+			sprintf(prefix, "%04d-%02d-%02d %02d:%02d:%02d.%06d %-5s [%u] ", t.tm_year + 1900, t.tm_mon + 1, t.tm_mday,
+				t.tm_hour, t.tm_min, t.tm_sec, (int)((h.Time/1000) % 1000000), LevelName(h.Level), (unsigned)h.Thread);
+			out += prefix;
+			
+			UInt8 args = 0;
+			for(const char* f = h.Format; *f; ++f) {
+				if(f[0] == '{' && f[1] == '}' && args < h.Argc) {
+					p = FormatArg(p, out);
+					++args;
+					++f;
+				}
+				else
+					out += *f;
+			}
+			for(; args < h.Argc; ++args) { // Arguments without {}
+				out += ' ';
+				p = FormatArg(p, out);
+			}
+			out += '\n';
+		}
+		
+		private: struct Entry
+		{
+			public: Int64 Time;
+			public: size_t Offset;
+			
+			public: bool operator <(const Entry& rhs) const
+			{
+				return Time < rhs.Time;
+			}
+		};
+		
+		// One pass: drain rings, order by time, format, write. Returns false if there was nothing.
+		private: static bool Pass(State& s, std::vector<byte>& records, std::string& text)
+		{
+			std::vector<Ring*> rings;
+			{
+				boost::mutex::scoped_lock lock(s.Mutex);
+				rings = s.Rings;
+			}
+			records.clear();
+			std::vector<Entry> entries;
+			for(size_t i = 0; i < rings.size(); ++i) {
+				size_t begin = records.size();
+				rings[i]->Drain(records);
+				while(begin < records.size()) {
+					Header h;
+					memcpy(&h, &records[begin], sizeof(h));
+					h.Thread = rings[i]->Thread();
+					memcpy(&records[begin], &h, sizeof(h));
+					Entry e = { h.Time, begin };
+					entries.push_back(e);
+					begin += h.Size;
+				}
+			}
+			if(entries.empty())
+				return false;
+			std::stable_sort(entries.begin(), entries.end());
+			text.clear();
+			for(size_t i = 0; i < entries.size(); ++i) {
+				Format(&records[entries[i].Offset], text);
+				if(text.size() >= BATCH_SIZE || i + 1 == entries.size()) {
+					if(s.pFile)
+						fwrite(text.data(), 1, text.size(), s.pFile);
+					text.clear();
+				}
+			}
+			if(s.pFile)
+				fflush(s.pFile);
+			return true;
+		}
+		
+		private: static void Run(void)
+		{
+			State& s = GetState();
+			std::vector<byte> records;
+			std::string text;
+			UInt64 dropped = 0;
+			while(true) {
+				UInt64 requested = s.Requested.load();
+				bool stopping = false;
+				{
+					boost::mutex::scoped_lock lock(s.Mutex);
+					stopping = s.Stopping;
+				}
+				while(Pass(s, records, text))
+					;
+				if(Dropped() != dropped && s.pFile) {
+					fprintf(s.pFile, "%llu log records dropped, ring buffers were full\n", (unsigned long long)(Dropped() - dropped));
+					fflush(s.pFile);
+					dropped = Dropped();
+				}
+				{
+					boost::mutex::scoped_lock lock(s.Mutex);
+					s.Done = requested;
+					s.Wake.notify_all();
+					if(stopping)
+						return;
+					s.Wake.wait_for(lock, boost::chrono::milliseconds(FLUSH_INTERVAL));
+				}
+			}
+		}
+		
+		//---------------------------------------------------------------------------------------------
+		// Control
+		
+		// Open file for appending (NULL - stderr), start background thread. ringSize is the bytes
+		// buffered per thread, for threads that log for the first time after this call.
+		public: static bool Start(const char* fileName = "Log.txt", size_t ringSize = 64*1024)
+		{
+			State& s = GetState();
+			boost::mutex::scoped_lock lock(s.Mutex);
+			if(s.pThread)
+				return true;
+			s.pFile = (fileName ? fopen(fileName, "a") : stderr);
+			if(!s.pFile)
+				return false;
+			s.RingSize = ringSize;
+			s.Stopping = false;
+			s.pThread = new boost::thread(&Logger::Run);
+			s.Running.store(true);
+			return true;
+		}
+		
+		// Write everything logged so far, wait for the background thread to finish it
+		public: static void Flush(void)
+		{
+			State& s = GetState();
+			UInt64 ticket = s.Requested.fetch_add(1) + 1;
+			boost::mutex::scoped_lock lock(s.Mutex);
+			if(!s.pThread)
+				return;
+			s.Wake.notify_all();
+			while(s.pThread && s.Done < ticket)
+				s.Wake.wait(lock);
+		}
+		
+		// Drain all rings, close file
+		public: static void Stop(void)
+		{
+			State& s = GetState();
+			boost::thread* pThread = NULL;
+			{
+				boost::mutex::scoped_lock lock(s.Mutex);
+				if(!s.pThread)
+					return;
+				s.Running.store(false);
+				s.Stopping = true;
+				s.Wake.notify_all();
+				pThread = s.pThread;
+			}
+			pThread->join();
+			boost::mutex::scoped_lock lock(s.Mutex);
+			delete s.pThread;
+			s.pThread = NULL;
+			if(s.pFile && s.pFile != stderr)
+				fclose(s.pFile);
+			s.pFile = NULL;
+		}
+		
+		// Records lost because a ring was full
+		public: static UInt64 Dropped(void)
+		{
+			return GetState().Dropped.load(boost::memory_order_relaxed);
+		}
+	};
+}
+//-------------------------------------------------------------------------------------------------
+#endif /* __LOGGER_HPP__ */
@@ -0,0 +1,307 @@
+/*
+
+*/
+
+#ifndef __METRICS_HPP__
+#define __METRICS_HPP__
+//-------------------------------------------------------------------------------------------------
+#include <string.h>
+
+#include <boost/atomic.hpp>
+#include <boost/chrono.hpp>
+
+#include "Defines.hpp"
+//-------------------------------------------------------------------------------------------------
+namespace IOStream
+{
+	// Hot-path counters and timings of the port. Every thread updates its own cache-line padded
+	// slot with plain (not locked) stores, Collect() sums all slots without stopping anybody, so
+	// a snapshot may lag behind by the updates in progress.
+	//
+	// Erlang side polls them with the reserved command {?CMD_METRICS,DS} (CMD_METRICS = 0), the
+	// port replies {metrics,DS,Metrics::Write(...)}:
+	//   {[{frames_in,N},...], [{queue_depth,Current,Max},{connections,Current,Max}], [{Command,decode|encode,Count,TotalNs,[{UpToNs,N},...]},...]}
+	class Metrics
+	{
+		public: enum Counter
+		{
+			FramesIn,
+			FramesOut,
+			BytesIn,
+			BytesOut,
+			ReadCalls,   // read() syscalls
+			WriteCalls,  // write() syscalls
+			Allocations, // heap blocks allocated by ETFReader\ETFWriter and handles
+			IOErrors,
+			Cancelled,   // requests dropped or stopped by '$cancel' or their deadline
+			Overloaded,  // requests answered {error,DS,overloaded} by admission control
+			BatchedIn,   // requests that came in {'$batch',[...]} frames
+			BatchedOut,  // {'$batch',[...]} reply frames
+			FileBytes,   // bytes sent from files by sendfile, not copied through user space
+			COUNTERS,
+		};
+		
+		public: enum Gauge
+		{
+			QueueDepth,
+			Connections, // Peers of a PortServer event loop (stdin, attached fds, accepted sockets)
+			GAUGES,
+		};
+		
+		public: enum Phase
+		{
+			Decode,
+			Encode,
+			PHASES,
+		};
+		
+		public: static const UInt32 COMMAND = 0;       // Reserved command id
+		public: static const size_t MAX_COMMANDS = 16; // Timings of commands above are kept with the last one
+		public: static const size_t BUCKETS = 32;      // Bucket b holds times below 2^(b+1) ns, the last one the rest
+		public: static const size_t MAX_THREADS = 64;  // Threads above share the last slot
+		
+		public: struct Snapshot
+		{
+			public: UInt64 Counters[COUNTERS];
+			public: UInt64 Gauges[GAUGES];
+			public: UInt64 GaugesMax[GAUGES];
+			public: UInt64 Buckets[PHASES][MAX_COMMANDS][BUCKETS];
+			public: UInt64 TotalNs[PHASES][MAX_COMMANDS];
+			
+			public: Snapshot(void)
+			{
+				memset(this, 0, sizeof(*this));
+			}
+			
+			public: UInt64 Count(Phase phase, size_t command) const
+			{
+				UInt64 count = 0;
+				for(size_t b = 0; b < BUCKETS; ++b)
+					count += Buckets[phase][command][b];
+				return count;
+			}
+		};
+		
+		// Elapsed time of the phases of one command: Metrics::Timer t; ...decode...; t.Record(Metrics::Decode, command);
+		public: class Timer
+		{
+			private: typedef boost::chrono::steady_clock Clock;
+			private: Clock::time_point Start_;
+			
+			public: Timer(void):
+				Start_(Clock::now())
+			{
+			}
+			
+			// Record time since construction or previous Record, start next phase
+			public: UInt64 Record(Phase phase, UInt32 command)
+			{
+				Clock::time_point now = Clock::now();
+				Int64 ns = (Int64)boost::chrono::duration_cast<boost::chrono::nanoseconds>(now - Start_).count();
+				Start_ = now;
+				Metrics::Record(phase, command, (UInt64)(ns > 0 ? ns : 0));
+				return (UInt64)(ns > 0 ? ns : 0);
+			}
+		};
+		
+		private: struct Slot
+		{
+			public: byte Padding0_[CACHE_LINE_SIZE];
+			public: boost::atomic<UInt64> Counters[COUNTERS];
+			public: boost::atomic<UInt64> Buckets[PHASES][MAX_COMMANDS][BUCKETS];
+			public: boost::atomic<UInt64> TotalNs[PHASES][MAX_COMMANDS];
+			public: bool Shared; // Last slot, used by several threads
+			public: byte Padding1_[CACHE_LINE_SIZE];
+			
+			public: explicit Slot(bool shared):
+				Shared(shared)
+			{
+				for(size_t i = 0; i < COUNTERS; ++i)
+					Counters[i].store(0, boost::memory_order_relaxed);
+				for(size_t p = 0; p < PHASES; ++p)
+					for(size_t c = 0; c < MAX_COMMANDS; ++c) {
+						TotalNs[p][c].store(0, boost::memory_order_relaxed);
+						for(size_t b = 0; b < BUCKETS; ++b)
+							Buckets[p][c][b].store(0, boost::memory_order_relaxed);
+					}
+			}
+			
+			// Single writer needs no read-modify-write instruction
+			public: void Add(boost::atomic<UInt64>& value, UInt64 n)
+			{
+				if(Shared)
+					value.fetch_add(n, boost::memory_order_relaxed);
+				else
+					value.store(value.load(boost::memory_order_relaxed) + n, boost::memory_order_relaxed);
+			}
+		};
+		
+		private: struct Registry
+		{
+			public: boost::atomic<Slot*> Slots[MAX_THREADS];
+			public: boost::atomic<size_t> Threads;
+			public: boost::atomic<UInt64> Gauges[GAUGES];
+			public: boost::atomic<UInt64> GaugesMax[GAUGES];
+			
+			public: Registry(void):
+				Threads(0)
+			{
+				for(size_t i = 0; i < MAX_THREADS; ++i)
+					Slots[i].store(NULL);
+				for(size_t i = 0; i < GAUGES; ++i) {
+					Gauges[i].store(0);
+					GaugesMax[i].store(0);
+				}
+			}
+		};
+		
+		private: Metrics(void);
+		
+		private: static Registry& GetRegistry(void)
+		{
+			static Registry registry;
+			return registry;
+		}
+		
+		// Slot of calling thread, claimed on first use and kept after the thread exits
+		private: static Slot& Local(void)
+		{
+			static THREAD_LOCAL Slot* pSlot = NULL;
+			if(pSlot)
+				return *pSlot;
+			Registry& r = GetRegistry();
+			size_t index = r.Threads.fetch_add(1);
+			bool shared = (index >= MAX_THREADS - 1);
+			if(shared)
+				index = MAX_THREADS - 1;
+			Slot* pNew = r.Slots[index].load(boost::memory_order_acquire);
+			if(!pNew) {
+				Slot* pExpected = NULL;
+				pNew = new Slot(shared);
+				if(!r.Slots[index].compare_exchange_strong(pExpected, pNew, boost::memory_order_acq_rel)) {
+					delete pNew; // Other thread created the shared slot
+					pNew = pExpected;
+				}
+			}
+			pSlot = pNew;
+			return *pSlot;
+		}
+		
+		public: static void Add(Counter counter, UInt64 n = 1)
+		{
+			Slot& slot = Local();
+			slot.Add(slot.Counters[counter], n);
+		}
+		
+		public: static void Record(Phase phase, UInt32 command, UInt64 ns)
+		{
+			Slot& slot = Local();
+			size_t c = (command < MAX_COMMANDS ? command : MAX_COMMANDS - 1);
+			size_t b = 0;
+			while(b < BUCKETS - 1 && (ns >> (b + 1)))
+				++b;
+			slot.Add(slot.Buckets[phase][c][b], 1);
+			slot.Add(slot.TotalNs[phase][c], ns);
+		}
+		
+		// Gauges are shared by all threads (queue depth is one number), their maximum is kept
+		public: static void SetGauge(Gauge gauge, UInt64 value)
+		{
+			Registry& r = GetRegistry();
+			r.Gauges[gauge].store(value, boost::memory_order_relaxed);
+			UInt64 max = r.GaugesMax[gauge].load(boost::memory_order_relaxed);
+			while(value > max && !r.GaugesMax[gauge].compare_exchange_weak(max, value, boost::memory_order_relaxed))
+				;
+		}
+		
+		public: static void AddGauge(Gauge gauge, Int64 delta)
+		{
+			Registry& r = GetRegistry();
+			UInt64 value = r.Gauges[gauge].fetch_add((UInt64)delta, boost::memory_order_relaxed) + (UInt64)delta;
+			UInt64 max = r.GaugesMax[gauge].load(boost::memory_order_relaxed);
+			while(delta > 0 && value > max && !r.GaugesMax[gauge].compare_exchange_weak(max, value, boost::memory_order_relaxed))
+				;
+		}
+		
+		public: static void Collect(Snapshot& s)
+		{
+			Registry& r = GetRegistry();
+			s = Snapshot();
+			for(size_t i = 0; i < GAUGES; ++i) {
+				s.Gauges[i] = r.Gauges[i].load(boost::memory_order_relaxed);
+				s.GaugesMax[i] = r.GaugesMax[i].load(boost::memory_order_relaxed);
+			}
+			for(size_t t = 0; t < MAX_THREADS; ++t) {
+				const Slot* pSlot = r.Slots[t].load(boost::memory_order_acquire);
+				if(!pSlot)
+					continue;
+				for(size_t i = 0; i < COUNTERS; ++i)
+					s.Counters[i] += pSlot->Counters[i].load(boost::memory_order_relaxed);
+				for(size_t p = 0; p < PHASES; ++p)
+					for(size_t c = 0; c < MAX_COMMANDS; ++c) {
+						s.TotalNs[p][c] += pSlot->TotalNs[p][c].load(boost::memory_order_relaxed);
+						for(size_t b = 0; b < BUCKETS; ++b)
+							s.Buckets[p][c][b] += pSlot->Buckets[p][c][b].load(boost::memory_order_relaxed);
+					}
+			}
+		}
+		
+		public: static const char* Name(Counter counter)
+		{
+			static const char* names[COUNTERS] = { "frames_in", "frames_out", "bytes_in", "bytes_out", "read_calls", "write_calls", "allocations", "io_errors", "cancelled", "overloaded", "batched_in", "batched_out", "file_bytes" };
+			return names[counter];
+		}
+		
+		public: static const char* Name(Gauge gauge)
+		{
+			static const char* names[GAUGES] = { "queue_depth", "connections" };
+			return names[gauge];
+		}
+		
+		// Snapshot as one term, W is ETFWriter, ETFSizer or ETFTemplate
+		public: template<typename W> static W& Write(W& w, const Snapshot& s)
+		{
+			w.WriteTuple(3);
+			
+			w.WriteList(COUNTERS);
+			for(size_t i = 0; i < COUNTERS; ++i)
+				w.WriteTuple(2).WriteAtom(Name((Counter)i)).WriteNumber(s.Counters[i]);
+			w.WriteNil();
+			
+			w.WriteList(GAUGES);
+			for(size_t i = 0; i < GAUGES; ++i)
+				w.WriteTuple(3).WriteAtom(Name((Gauge)i)).WriteNumber(s.Gauges[i]).WriteNumber(s.GaugesMax[i]);
+			w.WriteNil();
+			
+			UInt32 timings = 0;
+			for(size_t p = 0; p < PHASES; ++p)
+				for(size_t c = 0; c < MAX_COMMANDS; ++c)
+					timings += (s.Count((Phase)p, c) ? 1 : 0);
+			if(timings)
+				w.WriteList(timings);
+			for(size_t c = 0; c < MAX_COMMANDS; ++c)
+				for(size_t p = 0; p < PHASES; ++p) {
+					UInt64 count = s.Count((Phase)p, c);
+					if(!count)
+						continue;
+					UInt32 buckets = 0;
+					for(size_t b = 0; b < BUCKETS; ++b)
+						buckets += (s.Buckets[p][c][b] ? 1 : 0);
+					w.WriteTuple(5).
+						WriteNumber((UInt32)c).
+						WriteAtom(p == Decode ? "decode" : "encode").
+						WriteNumber(count).
+						WriteNumber(s.TotalNs[p][c]).
+						WriteList(buckets);
+					for(size_t b = 0; b < BUCKETS; ++b)
+						if(s.Buckets[p][c][b])
+							w.WriteTuple(2).WriteNumber((UInt64)2 << b).WriteNumber(s.Buckets[p][c][b]);
+					w.WriteNil();
+				}
+			w.WriteNil();
+			return w;
+		}
+	};
+}
+//-------------------------------------------------------------------------------------------------
+#endif /* __METRICS_HPP__ */
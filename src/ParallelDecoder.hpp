@@ -0,0 +1,194 @@
+/*
+
+*/
+
+#ifndef __PARALLELDECODER_HPP__
+#define __PARALLELDECODER_HPP__
+//-------------------------------------------------------------------------------------------------
+#include <algorithm>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/exception_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "Erlang.hpp"
+#include "ThreadPool.hpp"
+#include "Defines.hpp"
+//-------------------------------------------------------------------------------------------------
+namespace Erlang
+{
+	// Decode of a long list or tuple on several threads. Scan is the one serial pass: it skips
+	// over the elements (SkipTerm, nothing is decoded) to find where each of them starts. Run
+	// cuts them into a range of about equal bytes per thread and every thread reads its range
+	// with a reader of its own over the same frame. The sink gets each element with its index,
+	// so results land in order whichever thread decodes them:
+	//   Erlang::ParallelDecoder pd;
+	//   pd.Scan(er); // er at [Record,...] or {Record,...}, moved over it
+	//   std::vector<Record> records(pd.Count());
+	//   pd.Run(boost::bind(&ReadRecord, _1, _2, boost::ref(records))); // ReadRecord(er, i, records)
+	// The sink is copied for every thread; er, or the buffer it reads in place, must outlive Run.
+	class ParallelDecoder
+	{
+		public: static const size_t MIN_RANGE = 64*1024; // Bytes a thread gets at least
+		
+		private: typedef ThreadPool::Job Job;
+		
+		// Sink of Run as one of TryRun: the exception of the lowest index is kept to be rethrown
+		private: struct Failure
+		{
+			public: boost::mutex Mutex;
+			public: size_t Index;
+			public: boost::exception_ptr Error;
+		};
+		
+		private: template<typename Sink> class Throwing
+		{
+			private: Sink Sink_;
+			private: Failure* pFailure_;
+			
+			public: Throwing(const Sink& sink, Failure* pFailure):
+				Sink_(sink),
+				pFailure_(pFailure)
+			{
+			}
+			
+			public: ETFStatus operator ()(ETFReader& er, size_t index)
+			{
+				size_t pos = er.Tell();
+				try {
+					Sink_(er, index);
+					return ETFStatus();
+				}
+				catch(...) {
+					boost::mutex::scoped_lock lock(pFailure_->Mutex);
+					if(index < pFailure_->Index) {
+						pFailure_->Index = index;
+						pFailure_->Error = boost::current_exception();
+					}
+				}
+				return ETFStatus(ETF_INVALID_TAG, pos);
+			}
+		};
+		
+		private: const ETFReader* pReader_;
+		private: std::vector<size_t> Offsets_; // Of the elements in the frame, then of their end
+		
+		public: ParallelDecoder(void):
+			pReader_(NULL)
+		{
+		}
+		
+		// Elements of the tuple or proper list at er (not STRING_EXT, read it with ReadString);
+		// er moves over the term or stays where it was
+		public: ETFStatus TryScan(ETFReader& er)
+		{
+			size_t start = er.Tell();
+			UInt32 count = 0;
+			bool list = false;
+			ETFStatus status = er.TryReadNil();
+			if(!status) {
+				UInt8 tag = er.GetNextTag();
+				list = (tag == LIST_EXT);
+				if(!(status = (list ? er.TryReadList(count) : er.TryReadTuple(count))))
+					return status;
+			}
+			
+			Offsets_.resize(count + 1);
+			for(UInt32 i = 0; i < count && status; ++i) {
+				Offsets_[i] = er.Tell();
+				status = er.TrySkipTerm();
+			}
+			Offsets_[count] = er.Tell();
+			if(status && list)
+				status = er.TryReadNil(); // The tail would be an element of no index
+			if(!status) {
+				er.Seek(start);
+				Offsets_.clear();
+				pReader_ = NULL;
+				return status;
+			}
+			pReader_ = &er;
+			return ETFStatus();
+		}
+		
+		public: void Scan(ETFReader& er)
+		{
+			ETFStatus status = TryScan(er);
+			if(!status)
+				ETFReader::Raise(status);
+		}
+		
+		// Elements found by the last Scan
+		public: size_t Count(void) const
+		{
+			return (Offsets_.empty() ? 0 : Offsets_.size() - 1);
+		}
+		
+		// ETFStatus sink(ETFReader& er, size_t index) for every element, er at the element. The
+		// status of the lowest failed index is returned, ranges after it stop early.
+		// threads 0 - one per core.
+		public: template<typename Sink> ETFStatus TryRun(Sink sink, size_t threads = 0) const
+		{
+			std::vector<size_t> bounds = Ranges(threads);
+			std::vector<ETFStatus> statuses(bounds.size() - 1);
+			boost::atomic<size_t> failed(Count());
+			std::vector<Job> jobs;
+			for(size_t i = 0; i + 1 < bounds.size(); ++i)
+				jobs.push_back(boost::bind(&ParallelDecoder::Range<Sink>, this, bounds[i], bounds[i + 1], sink, &statuses[i], &failed));
+			ThreadPool::Shared().Run(jobs);
+			for(size_t i = 0; i < statuses.size(); ++i)
+				if(!statuses[i])
+					return statuses[i];
+			return ETFStatus();
+		}
+		
+		// void sink(ETFReader& er, size_t index), which reads with Read* and may throw: the
+		// exception of the lowest index is rethrown once all threads are done
+		public: template<typename Sink> void Run(Sink sink, size_t threads = 0) const
+		{
+			Failure failure;
+			failure.Index = Count();
+			if(!TryRun(Throwing<Sink>(sink, &failure), threads))
+				boost::rethrow_exception(failure.Error);
+		}
+		
+		// First index of every range and the end, ranges of about equal bytes
+		private: std::vector<size_t> Ranges(size_t threads) const
+		{
+			size_t n = Count();
+			std::vector<size_t> bounds(1, 0);
+			if(!n) {
+				bounds.push_back(0);
+				return bounds;
+			}
+			size_t bytes = Offsets_[n] - Offsets_[0];
+			size_t ranges = std::max<size_t>(1, std::min(std::min(ThreadPool::Threads(threads), bytes/MIN_RANGE), n));
+			for(size_t k = 1; k < ranges; ++k) {
+				size_t at = std::lower_bound(Offsets_.begin(), Offsets_.end() - 1, Offsets_[0] + bytes*k/ranges) - Offsets_.begin();
+				if(at > bounds.back() && at < n)
+					bounds.push_back(at);
+			}
+			bounds.push_back(n);
+			return bounds;
+		}
+		
+		private: template<typename Sink> void Range(size_t first, size_t last, Sink sink, ETFStatus* pStatus, boost::atomic<size_t>* pFailed) const
+		{
+			ETFReader er(*pReader_, Offsets_[first]);
+			for(size_t i = first; i < last && i < pFailed->load(boost::memory_order_relaxed); ++i) {
+				er.Seek(Offsets_[i]); // Whatever the sink read of the one before
+				ETFStatus status = sink(er, i);
+				if(!status) {
+					*pStatus = status;
+					size_t failed = pFailed->load();
+					while(i < failed && !pFailed->compare_exchange_weak(failed, i));
+					return;
+				}
+			}
+		}
+	};
+}
+//-------------------------------------------------------------------------------------------------
+#endif /* __PARALLELDECODER_HPP__ */
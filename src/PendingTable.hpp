@@ -0,0 +1,250 @@
+/*
+
+*/
+
+#ifndef __PENDINGTABLE_HPP__
+#define __PENDINGTABLE_HPP__
+//-------------------------------------------------------------------------------------------------
+
+#include <boost/atomic.hpp>
+#include <boost/optional.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "Erlang.hpp"
+//-------------------------------------------------------------------------------------------------
+namespace Erlang
+{
+	// Concurrent open-addressing table of in-flight requests keyed by Reference (or Pid, Port).
+	// Fixed capacity, linear probing on the precomputed handle hash. There is no table lock: every
+	// slot is claimed with a CAS on its state before its key or value is touched, so workers can
+	// register requests while the reply path takes them out. Keys must be unique (references are).
+	// A freed slot is left as a tombstone only while an entry after it probed past it, otherwise it
+	// goes back to Empty with the tombstones right before it, so misses stay short however many
+	// requests went through the table. An insert is published once the slots it probed past are
+	// checked again: if one was emptied meanwhile, it gives its slot back and probes anew.
+	template<typename K, typename T> class PendingTable
+	{
+		private: enum SlotState
+		{
+			Empty,   // unused - ends a probe sequence
+			Busy,    // claimed by one thread, key and value are being written or read
+			Full,
+			Deleted, // tombstone - probe sequences continue past it
+		};
+		
+		private: struct Slot
+		{
+			public: boost::atomic<UInt32> State;
+			public: boost::atomic<UInt64> Hash;
+			public: boost::optional<K> Key;
+			public: boost::optional<T> Value;
+			
+			public: Slot(void):
+				State(Empty),
+				Hash(0)
+			{
+			}
+		};
+		
+		private: Slot* pSlots_;
+		private: size_t Mask_;
+		private: boost::atomic<size_t> Count_;
+		
+		public: explicit PendingTable(size_t capacity):
+			pSlots_(NULL),
+			Mask_(0),
+			Count_(0)
+		{
+			size_t size = 16;
+			while(size < capacity)
+				size <<= 1;
+			pSlots_ = new Slot[size];
+			Mask_ = size - 1;
+		}
+		
+		public: ~PendingTable(void)
+		{
+			delete[] pSlots_;
+		}
+		
+		private: PendingTable(const PendingTable&);
+		private: PendingTable& operator =(const PendingTable&);
+		
+		public: size_t Capacity(void) const
+		{
+			return Mask_ + 1;
+		}
+		
+		public: size_t Count(void) const
+		{
+			return Count_.load(boost::memory_order_relaxed);
+		}
+		
+		// Claim slot in state 'from' for exclusive use
+		private: static bool Claim(Slot& slot, UInt32 from)
+		{
+			return slot.State.compare_exchange_strong(from, Busy, boost::memory_order_acquire, boost::memory_order_relaxed);
+		}
+		
+		private: static void Release(Slot& slot, UInt32 to)
+		{
+			slot.State.store(to, boost::memory_order_release);
+		}
+		
+		// Register in-flight request. Returns false if the table is full.
+		public: bool Insert(const K& key, const T& value)
+		{
+			UInt64 hash = key.Hash();
+			for(size_t i = 0; i <= Mask_; ++i) {
+				Slot& slot = pSlots_[(size_t(hash) + i) & Mask_];
+				UInt32 state = slot.State.load(boost::memory_order_relaxed);
+				if(state != Empty && state != Deleted)
+					continue;
+				if(!Claim(slot, state)) {
+					--i; // Lost the race for this slot, look at it again
+					continue;
+				}
+				if(!Probed(hash, i)) {
+					Release(slot, state);
+					boost::this_thread::yield();
+					i = (size_t)-1;
+					continue;
+				}
+				slot.Key = key;
+				slot.Value = value;
+				slot.Hash.store(hash, boost::memory_order_relaxed);
+				Release(slot, Full);
+				Count_.fetch_add(1, boost::memory_order_relaxed);
+				return true;
+			}
+			return false;
+		}
+		
+		// Find slot holding key and leave it claimed (Busy). Returns NULL if there is no such key.
+		private: Slot* Acquire(const K& key)
+		{
+			UInt64 hash = key.Hash();
+			for(size_t i = 0; i <= Mask_; ++i) {
+				Slot& slot = pSlots_[(size_t(hash) + i) & Mask_];
+				UInt32 state = slot.State.load(boost::memory_order_acquire);
+				if(state == Empty)
+					return NULL;
+				if(state == Busy) {
+					boost::this_thread::yield(); // Another thread owns the slot for a few instructions
+					--i;
+					continue;
+				}
+				if(state == Deleted || slot.Hash.load(boost::memory_order_relaxed) != hash)
+					continue;
+				if(!Claim(slot, Full)) {
+					--i;
+					continue;
+				}
+				if(*slot.Key == key)
+					return &slot;
+				Release(slot, Full); // Hash collision
+			}
+			return NULL;
+		}
+		
+		// The count slots from hash on are all in use, none was emptied while an insert probed
+		// past it. A busy one may be emptied yet, the insert probes anew then too.
+		private: bool Probed(UInt64 hash, size_t count) const
+		{
+			if(count)
+				boost::atomic_thread_fence(boost::memory_order_seq_cst); // Claim before looking, as Free does
+			for(size_t i = 0; i < count; ++i) {
+				UInt32 state = pSlots_[(size_t(hash) + i) & Mask_].State.load(boost::memory_order_acquire);
+				if(state == Empty || state == Busy)
+					return false;
+			}
+			return true;
+		}
+		
+		// No entry up to the next Empty slot probed past the one at index, it can be Empty. A busy
+		// slot on the way may be an insert that did, it keeps the tombstone.
+		private: bool Unprobed(size_t index) const
+		{
+			boost::atomic_thread_fence(boost::memory_order_seq_cst);
+			for(size_t i = 1; i <= Mask_; ++i) {
+				const Slot& slot = pSlots_[(index + i) & Mask_];
+				UInt32 state = slot.State.load(boost::memory_order_acquire);
+				if(state == Empty)
+					return true;
+				if(state == Busy || (state == Full && ((index + i - size_t(slot.Hash.load(boost::memory_order_relaxed))) & Mask_) >= i))
+					return false;
+			}
+			return false;
+		}
+		
+		// Slot claimed from Full is emptied, then the tombstones before it that no entry needs now
+		private: void Free(Slot& slot)
+		{
+			slot.Key = boost::none;
+			slot.Value = boost::none;
+			Count_.fetch_sub(1, boost::memory_order_relaxed);
+			size_t index = (size_t)(&slot - pSlots_);
+			for(size_t i = 0; i <= Mask_; ++i) {
+				Slot& current = pSlots_[(index - i) & Mask_];
+				if(i && !Claim(current, Deleted))
+					return;
+				if(!Unprobed((index - i) & Mask_)) {
+					Release(current, Deleted);
+					return;
+				}
+				Release(current, Empty);
+			}
+		}
+		
+		// Copy value of in-flight request out without removing it
+		public: bool Find(const K& key, T& value)
+		{
+			Slot* pSlot = Acquire(key);
+			if(!pSlot)
+				return false;
+			value = *pSlot->Value;
+			Release(*pSlot, Full);
+			return true;
+		}
+		
+		// Remove in-flight request (reply path). Returns false if it was not registered or already taken.
+		public: bool Take(const K& key, T& value)
+		{
+			Slot* pSlot = Acquire(key);
+			if(!pSlot)
+				return false;
+			value = *pSlot->Value;
+			Free(*pSlot);
+			return true;
+		}
+		
+		public: bool Erase(const K& key)
+		{
+			Slot* pSlot = Acquire(key);
+			if(!pSlot)
+				return false;
+			Free(*pSlot);
+			return true;
+		}
+		
+		// Visit every registered request; F returns true to remove it (timeouts, cancellation)
+		public: template<typename F> size_t Sweep(F f)
+		{
+			size_t removed = 0;
+			for(size_t i = 0; i <= Mask_; ++i) {
+				Slot& slot = pSlots_[i];
+				if(!Claim(slot, Full))
+					continue;
+				if(f(*slot.Key, *slot.Value)) {
+					Free(slot);
+					++removed;
+				}
+				else
+					Release(slot, Full);
+			}
+			return removed;
+		}
+	};
+}
+//-------------------------------------------------------------------------------------------------
+#endif /* __PENDINGTABLE_HPP__ */
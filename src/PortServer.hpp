@@ -0,0 +1,1089 @@
+/*
+
+*/
+
+#ifndef __PORTSERVER_HPP__
+#define __PORTSERVER_HPP__
+//-------------------------------------------------------------------------------------------------
+#include <algorithm>
+#include <deque>
+#include <exception>
+#include <map>
+#include <vector>
+#ifndef _WIN32
+#include <poll.h>
+#include <unistd.h>
+#endif /* _WIN32 */
+
+#include <boost/asio/coroutine.hpp>
+#include <boost/bind.hpp>
+#include <boost/chrono.hpp>
+#include <boost/function.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/optional.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include "IOStream.hpp"
+#include "Erlang.hpp"
+#include "Cancellation.hpp"
+#include "ChunkWriter.hpp"
+#include "Logger.hpp"
+#include "Metrics.hpp"
+#include "Transport.hpp"
+//-------------------------------------------------------------------------------------------------
+namespace Erlang
+{
+	// Port server with stackless coroutine handlers (boost::asio::coroutine, header-only). The
+	// calling thread reads frames, a few worker threads resume the handlers that are ready and
+	// blocking work (disk, subprocesses) runs on its own threads, so thousands of requests can be
+	// suspended at the cost of one small object each instead of a thread or a stack each.
+	//
+	// A handler keeps its state in members (locals do not survive a yield):
+	//   #include <boost/asio/yield.hpp> // after all other includes, defines reenter and yield
+	//   class Session: public Erlang::PortServer::Coroutine
+	//   {
+	//       private: Erlang::PortServer::Request Request_;
+	//       public: void operator ()(void)
+	//       {
+	//           reenter(this) for(;;) {
+	//               yield NextRequest(Request_);      // suspended until a frame arrives
+	//               if(Request_.Frame.empty())
+	//                   break;                        // port closed
+	//               yield Blocking(boost::bind(&Session::Load, this)); // runs on a blocking thread
+	//               if(Cancelled())
+	//                   continue;                     // '$cancel' or deadline, nobody waits for it
+	//               Reply(ewr);                       // written now, yield lets other handlers run
+	//           }
+	//       }
+	//   };
+	//   Erlang::PortServer server(2);
+	//   for(int i = 0; i < 1000; ++i)
+	//       server.Spawn(new Session);
+	//   server.Run(4, 16);
+	//
+	// Requests may come as {'$deadline',DeadlineMs,{Command,DS,...}} and be cancelled with
+	// {'$cancel',DS} (see Cancellation): a request cancelled or past its deadline before a handler
+	// takes it is dropped without a reply, a handler polls Cancelled() while it works on one.
+	//
+	// Admission control (SetAdmission) bounds the requests read but not taken by a handler and,
+	// per command, the requests in flight. A request over a limit either waits - the server stops
+	// reading stdin, the pipe fills up and the port gets busy in Erlang (port_command suspends the
+	// caller, [nosuspend] returns false) - or is answered {error,DS,overloaded} at once.
+	//
+	// Besides stdin/stdout the server can serve any number of peers from one process, sharing its
+	// handlers, threads and caches (POSIX): Listen accepts Unix domain socket connections, Attach
+	// adds the descriptors of open_port({fd,In,Out}) or a socketpair, ServeStdio(false) leaves
+	// stdio alone. The calling thread then runs an event loop (poll) over all of them, frames are
+	// cut out of whatever each peer sends and every reply goes back to the peer of its request.
+	//
+	// A control lane (ListenControl, AttachControl) is a second channel for small frames - pings,
+	// '$cancel', metrics - that must not wait behind bulk ones: it has its own reading thread and
+	// its replies their own descriptor, so neither a long frame being read or written nor stdin held
+	// back by admission control delays it. Its requests pass admission at once (still counted in
+	// the limits) and are handed to the next free handler before any other waiting request.
+	//
+	// Tiny requests cost more in per-message overhead (port_command, VM port scheduling, syscalls,
+	// framing) than in work, so a peer may send many in one {'$batch',[Request,...]} frame. The
+	// server fans them out to the handlers one by one as if they had come in frames of their own -
+	// deadlines, cancels and admission apply to each - and gathers their replies into
+	// {'$batch',[Reply,...]} frames, sent when every request of the batch is done, when MaxBytes
+	// are buffered, or DelayUs after the first buffered reply (SetBatching). The order of the
+	// replies is the order the handlers finish in, the peer matches them by DS as usual.
+	//
+	// With key affinity (SetAffinity) every worker thread has handlers and a request queue of its
+	// own, and a request goes to worker erlang:phash2(Key, Workers) of the key element of its
+	// tuple, hashed on the encoded bytes (ETFReader::TryPHash2). All requests of a key are then
+	// handled on one thread, so a handler keeps per-key state in tables of its Worker() without
+	// locks or cache lines moving between cores, and an Erlang side sharding with phash2 knows
+	// which worker a key lands on. A busy worker is not helped out by idle ones.
+	class PortServer
+	{
+		private: struct ReplyBatch;
+		
+		public: struct Request
+		{
+			public: std::vector<byte> Frame; // Term with version number, empty when the port closed
+			public: int Command;                   // Of {Command,DS,...}, -1 for other terms
+			public: boost::optional<Reference> DS; // Of {Command,DS,...}, none for other terms
+			public: CancelToken Token;
+			public: boost::shared_ptr<ReplyBatch> Batch; // Of the '$batch' frame the request came in
+			public: boost::optional<UInt32> KeyHash;     // erlang:phash2(Key, 1 bsl 32) of the affinity key
+			
+			public: Request(void):
+				Command(-1)
+			{
+			}
+			
+			public: void Swap(Request& other)
+			{
+				Frame.swap(other.Frame);
+				std::swap(Command, other.Command);
+				DS.swap(other.DS);
+				std::swap(Token, other.Token);
+				Batch.swap(other.Batch);
+				KeyHash.swap(other.KeyHash);
+			}
+		};
+		
+		public: struct Admission
+		{
+			public: size_t MaxQueued;             // Read and waiting for a handler, 0 - read only when one is idle
+			public: std::map<int, size_t> Limits; // Command -> in flight (waiting or handled), others are not limited
+			public: bool Reject;                  // Over a limit: {error,DS,overloaded} instead of waiting
+			
+			public: Admission(void):
+				MaxQueued(4096),
+				Reject(false)
+			{
+			}
+		};
+		
+		public: struct Batching
+		{
+			public: size_t MaxBytes; // Of the replies in one {'$batch',[...]} frame, a longer reply goes alone
+			public: UInt32 DelayUs;  // Longest a reply waits in its batch for the others
+			
+			public: Batching(void):
+				MaxBytes(16384),
+				DelayUs(1000)
+			{
+			}
+		};
+		
+		public: struct Affinity
+		{
+			public: UInt32 KeyElement; // 1-based element of the request tuple ({Command,DS,Key,...}: 3), 0 - off
+			
+			public: Affinity(void):
+				KeyElement(0)
+			{
+			}
+		};
+		
+		public: class Coroutine: public boost::asio::coroutine
+		{
+			friend class PortServer;
+			
+			private: enum Wait
+			{
+				Ready,
+				ForRequest,
+				ForBlocking,
+			};
+			
+			private: PortServer* pServer_;
+			private: Wait Wait_;
+			private: Request* pRequest_;
+			private: int Command_;                   // Request being handled
+			private: boost::optional<Reference> DS_;
+			private: CancelToken Token_;
+			private: boost::shared_ptr<Connection> Peer_; // Request came from, empty for stdin of Read
+			private: boost::shared_ptr<ReplyBatch> Batch_;
+			private: boost::function<void(void)> Job_;
+			private: size_t Shard_;
+			
+			public: Coroutine(void):
+				pServer_(NULL),
+				Wait_(Ready),
+				pRequest_(NULL),
+				Command_(-1),
+				Shard_(0)
+			{
+			}
+			
+			public: virtual ~Coroutine(void)
+			{
+			}
+			
+			// Handler body, resumed by a worker thread after every yield
+			public: virtual void operator ()(void) = 0;
+			
+			protected: PortServer& Server(void)
+			{
+				return *pServer_;
+			}
+			
+			// With key affinity the worker thread (0..workers - 1) the handler always runs on, and
+			// every request of a key comes to it: state per worker needs no lock (but for blocking
+			// jobs, which run elsewhere). 0 for all handlers without affinity.
+			protected: size_t Worker(void) const
+			{
+				return Shard_;
+			}
+			
+			// Suspend until the next frame is in request (empty once the port is closed)
+			protected: void NextRequest(Request& request)
+			{
+				Wait_ = ForRequest;
+				pRequest_ = &request;
+			}
+			
+			// Suspend until job has run on a blocking thread
+			protected: void Blocking(const boost::function<void(void)>& job)
+			{
+				Wait_ = ForBlocking;
+				Job_ = job;
+			}
+			
+			// Write the reply now (or add it to the batch of the request), false if the port is gone
+			// or the packet is too long
+			protected: bool Reply(const byte* pBuf, size_t size)
+			{
+				return pServer_->Reply(Peer_, Batch_, pBuf, size);
+			}
+			
+			protected: template<typename W> bool Reply(const W& ewr)
+			{
+				return Reply(ewr, ewr.BytesCount());
+			}
+			
+			// Reply as a function, for a ChunkWriter streaming the reply or a blocking job; bound
+			// to the request being handled
+			protected: ChunkWriter::Sink ReplySink(void) const
+			{
+				return boost::bind(&PortServer::Reply, pServer_, Peer_, Batch_, _1, _2);
+			}
+			
+			// Reply whose binary payload is size bytes of file fd from offset: ewr holds the term
+			// with WriteBinaryHeader(size) at split, the file goes in there by sendfile and never
+			// through a buffer. Written now and on its own, not in a batch.
+			protected: bool ReplyFile(const ETFWriter& ewr, size_t split, int fd, UInt64 offset, size_t size)
+			{
+				return pServer_->WriteFile(Peer_, ewr, split, fd, offset, size);
+			}
+			
+			// Erlang cancelled the request being handled or its deadline has passed
+			protected: bool Cancelled(void) const
+			{
+				return Token_.Cancelled();
+			}
+			
+			// Copy for blocking jobs to poll
+			protected: const CancelToken& Token(void) const
+			{
+				return Token_;
+			}
+		};
+		
+		private: typedef boost::chrono::steady_clock Clock;
+		
+		// Replies to the requests of one '$batch' frame
+		private: struct ReplyBatch
+		{
+			public: boost::shared_ptr<Connection> Peer;
+			public: size_t Pending;        // Requests not done with, and the frame while it is read
+			public: std::vector<byte> Buf; // HEAD_SIZE bytes for the head of the frame, then the replies without version numbers
+			public: UInt32 Count;          // Replies in Buf
+			public: Clock::time_point Due; // Buf is sent by then
+			
+			public: explicit ReplyBatch(const boost::shared_ptr<Connection>& peer):
+				Peer(peer),
+				Pending(1),
+				Count(0)
+			{
+			}
+		};
+		
+		// Version, SMALL_TUPLE_EXT 2, SMALL_ATOM_UTF8_EXT '$batch', LIST_EXT Count
+		private: enum { HEAD_SIZE = 1 + 2 + 2 + 6 + 5 };
+		
+		// Reply frame taken out of its batch under Mutex_, written after it is released
+		private: struct Outgoing
+		{
+			public: boost::shared_ptr<Connection> Peer;
+			public: std::vector<byte> Frame;
+		};
+		
+		private: UInt32 PacketSize_;
+		private: size_t MaxFrameSize_; // Of the frames read, longer ones close their connection
+		private: boost::mutex Mutex_;
+		private: boost::condition_variable JobCondition_;
+		private: boost::condition_variable DoneCondition_;
+		private: boost::condition_variable AdmitCondition_;
+		// Handlers and requests of one worker with key affinity, of all workers without
+		private: struct Shard
+		{
+			public: std::deque<Coroutine*> Ready;
+			public: std::deque<Coroutine*> Idle;  // Waiting for a request
+			public: std::deque<Request> Requests; // Waiting for an idle coroutine
+			public: std::deque<boost::shared_ptr<Connection> > Peers; // Of Requests, one each
+			public: size_t Urgent;                // Control lane requests at the front of Requests
+			public: boost::condition_variable ReadyCondition;
+			
+			public: Shard(void):
+				Urgent(0)
+			{
+			}
+		};
+		
+		private: std::vector<boost::shared_ptr<Shard> > Shards_; // One, or one per worker with affinity
+		private: size_t NextShard_;                 // Of handlers spawned and requests without a key
+		private: std::deque<Coroutine*> Jobs_;      // Waiting for a blocking thread
+		private: std::deque<std::pair<Clock::time_point, boost::shared_ptr<ReplyBatch> > > Due_; // Batches with replies, by the time they are due
+#ifndef _WIN32
+		private: UnixListener Listener_;
+		private: std::vector<std::pair<int, int> > Attached_;
+		private: UnixListener ControlListener_;
+		private: std::vector<std::pair<int, int> > ControlAttached_;
+		private: bool Stdio_;
+		private: int Wake_[2]; // Stop() writes to it, the event loop returns
+#endif /* _WIN32 */
+		private: Cancellation Cancellation_;
+		private: Admission Admission_;
+		private: Batching Batching_;
+		private: Affinity Affinity_;
+		private: std::map<int, size_t> InFlight_;   // Of limited commands
+		private: size_t Coroutines_;
+		private: bool Closed_;
+		private: bool Stopping_;
+		
+		// inFlight - requests that can be cancelled at once (queued and handled)
+		public: explicit PortServer(UInt32 packetSize = 2, size_t inFlight = 4096):
+			PacketSize_(packetSize == 4 ? 4 : 2),
+			MaxFrameSize_(DEFAULT_MAX_FRAME_SIZE),
+			NextShard_(0),
+			Cancellation_(inFlight),
+			Coroutines_(0),
+			Closed_(false),
+			Stopping_(false)
+		{
+			Shards_.push_back(boost::make_shared<Shard>());
+#ifndef _WIN32
+			Stdio_ = true;
+			if(::pipe(Wake_))
+				Wake_[0] = Wake_[1] = -1;
+#endif /* _WIN32 */
+		}
+		
+		public: ~PortServer(void)
+		{
+#ifndef _WIN32
+			if(Wake_[0] >= 0) {
+				::close(Wake_[0]);
+				::close(Wake_[1]);
+			}
+#endif /* _WIN32 */
+			for(size_t s = 0; s < Shards_.size(); ++s) {
+				for(size_t i = 0; i < Shards_[s]->Ready.size(); ++i)
+					delete Shards_[s]->Ready[i];
+				for(size_t i = 0; i < Shards_[s]->Idle.size(); ++i)
+					delete Shards_[s]->Idle[i];
+			}
+		}
+		
+		private: PortServer(const PortServer&);
+		private: PortServer& operator =(const PortServer&);
+		
+		// Before Run
+		public: void SetAdmission(const Admission& admission)
+		{
+			boost::mutex::scoped_lock lock(Mutex_);
+			Admission_ = admission;
+		}
+		
+		// Before Run
+		public: void SetBatching(const Batching& batching)
+		{
+			boost::mutex::scoped_lock lock(Mutex_);
+			Batching_ = batching;
+			if(PacketSize_ == 2)
+				Batching_.MaxBytes = std::min<size_t>(Batching_.MaxBytes, MAX_MESSAGE_LENGTH - HEAD_SIZE - 1);
+		}
+		
+		// Before Run
+		public: void SetAffinity(const Affinity& affinity)
+		{
+			boost::mutex::scoped_lock lock(Mutex_);
+			Affinity_ = affinity;
+		}
+		
+		// Before Run: a peer announcing a longer {packet,4} frame is disconnected (the port exits)
+		// instead of the server allocating what the header says
+		public: void SetMaxFrameSize(size_t maxFrameSize)
+		{
+			MaxFrameSize_ = maxFrameSize;
+		}
+		
+		public: static const char* BatchAtom(void)
+		{
+			return "$batch";
+		}
+
+#ifndef _WIN32
+		// Before Run: accept connections on the Unix domain socket path, framed with the packet size
+		// of the server
+		public: bool Listen(const char* path)
+		{
+			if(Listener_.Listen(path))
+				return true;
+			LOG_ERROR("Can't listen on {}: errno {}", path, errno);
+			return false;
+		}
+		
+		// Before Run: serve a peer on a pair of descriptors (one socket: in == out), closed when it
+		// hangs up or the server is destroyed
+		public: void Attach(int in, int out)
+		{
+			Attached_.push_back(std::make_pair(in, out));
+		}
+		
+		// Before Run: control lane, a Unix domain socket path or a pair of descriptors (see above)
+		public: bool ListenControl(const char* path)
+		{
+			if(ControlListener_.Listen(path))
+				return true;
+			LOG_ERROR("Can't listen on {}: errno {}", path, errno);
+			return false;
+		}
+		
+		public: void AttachControl(int in, int out)
+		{
+			ControlAttached_.push_back(std::make_pair(in, out));
+		}
+		
+		// Before Run: false - stdin/stdout are no peer (a server started by a shell, not a port)
+		public: void ServeStdio(bool serve)
+		{
+			Stdio_ = serve;
+		}
+		
+		// Event loop returns as if every peer had closed, e.g. from a signal handler
+		public: void Stop(void)
+		{
+			if(Wake_[1] >= 0 && ::write(Wake_[1], "", 1) < 0)
+				return;
+		}
+#endif /* _WIN32 */
+		
+		// Takes ownership, coroutine is deleted when its body completes. Also from inside a handler.
+		public: void Spawn(Coroutine* pCoroutine)
+		{
+			pCoroutine->pServer_ = this;
+			boost::mutex::scoped_lock lock(Mutex_);
+			++Coroutines_;
+			pCoroutine->Shard_ = NextShard_++ % Shards_.size();
+			Shard& shard = *Shards_[pCoroutine->Shard_];
+			shard.Ready.push_back(pCoroutine);
+			shard.ReadyCondition.notify_one();
+		}
+		
+		// Read frames until the port closes (or with ServeStdio(false): every peer without a
+		// listener, Stop with one), then wait until every coroutine has completed
+		public: int Run(size_t workers, size_t blockingThreads)
+		{
+			workers = std::max<size_t>(workers, 1);
+			if(Affinity_.KeyElement && workers > 1) {
+				// The handlers spawned so far are dealt out to the workers
+				boost::mutex::scoped_lock lock(Mutex_);
+				std::deque<Coroutine*> spawned;
+				spawned.swap(Shards_[0]->Ready);
+				while(Shards_.size() < workers)
+					Shards_.push_back(boost::make_shared<Shard>());
+				for(size_t i = 0; i < spawned.size(); ++i) {
+					spawned[i]->Shard_ = i % workers;
+					Shards_[i % workers]->Ready.push_back(spawned[i]);
+				}
+			}
+			boost::thread_group threads;
+			for(size_t i = 0; i < workers; ++i)
+				threads.create_thread(boost::bind(&PortServer::Work, this, i % Shards_.size()));
+			for(size_t i = 0; i < std::max<size_t>(blockingThreads, 1); ++i)
+				threads.create_thread(boost::bind(&PortServer::Block, this));
+
+#ifndef _WIN32
+			boost::thread control;
+			if(ControlListener_.Fd() >= 0 || !ControlAttached_.empty())
+				control = boost::thread(boost::bind(&PortServer::Control, this));
+			if(Listener_.Fd() >= 0 || !Attached_.empty() || !Stdio_) {
+				std::vector<boost::shared_ptr<Connection> > peers;
+				if(Stdio_)
+					peers.push_back(NewConnection(0, 1, false));
+				Poll(peers, Attached_, Listener_, false);
+			}
+			else
+#endif /* _WIN32 */
+				Read();
+#ifndef _WIN32
+			Stop(); // Control lane goes with the port
+			if(control.joinable())
+				control.join();
+#endif /* _WIN32 */
+			
+			boost::mutex::scoped_lock lock(Mutex_);
+			Closed_ = true;
+			for(size_t s = 0; s < Shards_.size(); ++s) {
+				Shard& shard = *Shards_[s];
+				while(!shard.Idle.empty()) {
+					*shard.Idle.front()->pRequest_ = Request();
+					shard.Ready.push_back(shard.Idle.front());
+					shard.Idle.pop_front();
+				}
+				shard.ReadyCondition.notify_all();
+			}
+			while(Coroutines_)
+				DoneCondition_.wait(lock);
+			Stopping_ = true;
+			for(size_t s = 0; s < Shards_.size(); ++s)
+				Shards_[s]->ReadyCondition.notify_all();
+			JobCondition_.notify_all();
+			lock.unlock();
+			threads.join_all();
+			return 0;
+		}
+		
+		private: void Read(void)
+		{
+			std::vector<byte> buf(MAX_MESSAGE_LENGTH);
+			while(true) {
+				ErrorInfo ei;
+				size_t size = (PacketSize_ == 4 ? Stream::Read4(buf, &ei, MaxFrameSize_) : Stream::Read2(&buf[0], &ei));
+				if(!size) {
+					if(ei.ErrorCode == EMSGSIZE || ei.ErrorCode == ENOMEM)
+						LOG_ERROR("Frame over {} bytes or out of memory, port closed", MaxFrameSize_);
+					break;
+				}
+				Take(&buf[0], size, boost::shared_ptr<Connection>());
+			}
+		}
+
+#ifndef _WIN32
+		// Reading thread of the control lane
+		private: void Control(void)
+		{
+			std::vector<boost::shared_ptr<Connection> > peers;
+			Poll(peers, ControlAttached_, ControlListener_, true);
+		}
+		
+		// Event loop over peers (stdin unless ServeStdio(false)), the attached descriptors and the
+		// connections accepted by the listener. A peer that hangs up is dropped, its descriptors are
+		// closed once the last of its requests is done with. Ends with stdin, or when nothing is
+		// left to serve, or on Stop.
+		private: void Poll(std::vector<boost::shared_ptr<Connection> >& peers, std::vector<std::pair<int, int> >& attached, UnixListener& listener, bool control)
+		{
+			for(size_t i = 0; i < attached.size(); ++i)
+				peers.push_back(NewConnection(attached[i].first, attached[i].second, true));
+			attached.clear();
+			Metrics::AddGauge(Metrics::Connections, (Int64)peers.size());
+			
+			std::vector<pollfd> fds;
+			bool portOpen = true;
+			while(!peers.empty() || listener.Fd() >= 0) {
+				fds.clear();
+				pollfd wake = { Wake_[0], POLLIN, 0 };
+				pollfd accept = { listener.Fd(), POLLIN, 0 }; // Ignored by poll when -1
+				fds.push_back(wake);
+				fds.push_back(accept);
+				for(size_t i = 0; i < peers.size(); ++i) {
+					pollfd peer = { peers[i]->In(), POLLIN, 0 };
+					fds.push_back(peer);
+				}
+				if(::poll(&fds[0], (nfds_t)fds.size(), -1) < 0) {
+					if(errno == EINTR)
+						continue;
+					LOG_ERROR("poll failed: errno {}", errno);
+					break;
+				}
+				if(fds[0].revents)
+					break;
+				
+				// Backwards, so a peer can be dropped; accepted ones are polled the next round. Whatever
+				// goes wrong with a peer (a frame too long, memory) closes that peer only.
+				for(size_t i = peers.size(); i-- > 0; ) {
+					if(!fds[i + 2].revents)
+						continue;
+					bool open = false;
+					try {
+						ErrorInfo ei;
+						open = peers[i]->Fill(&ei);
+						const byte* pFrame = NULL;
+						size_t size = 0;
+						while(peers[i]->Next(pFrame, size))
+							Take(pFrame, size, peers[i], control);
+						if(ei.ErrorCode == EMSGSIZE || ei.ErrorCode == ENOMEM)
+							LOG_WARNING("Frame over {} bytes or out of memory, peer {} closed", MaxFrameSize_, peers[i]->In());
+					}
+					catch(const std::exception& e) {
+						open = false;
+						LOG_ERROR("Peer {} closed: {}", peers[i]->In(), e.what());
+					}
+					if(!open && !control && Stdio_ && peers[i]->In() == 0)
+						portOpen = false;
+					if(!open) {
+						peers.erase(peers.begin() + i);
+						Metrics::AddGauge(Metrics::Connections, -1);
+					}
+				}
+				if(!portOpen)
+					break; // The port is closed, the process goes with it
+				if(fds[1].revents) {
+					for(int fd = listener.Accept(); fd >= 0; fd = listener.Accept()) {
+						try {
+							peers.push_back(NewConnection(fd, fd, true));
+						}
+						catch(const std::exception& e) {
+							::close(fd);
+							LOG_ERROR("Connection refused: {}", e.what());
+							continue;
+						}
+						Metrics::AddGauge(Metrics::Connections, 1);
+					}
+				}
+			}
+			Metrics::AddGauge(Metrics::Connections, -(Int64)peers.size());
+			listener.Close();
+		}
+		
+		private: boost::shared_ptr<Connection> NewConnection(int in, int out, bool owner) const
+		{
+			boost::shared_ptr<Connection> connection = boost::make_shared<Connection>(in, out, PacketSize_, owner);
+			connection->SetMaxFrameSize(MaxFrameSize_);
+			return connection;
+		}
+#endif /* _WIN32 */
+		
+		// Frame from peer (NULL - stdin of Read), a request or a batch of them
+		private: void Take(const byte* pBuf, size_t size, const boost::shared_ptr<Connection>& peer, bool control = false)
+		{
+			ETFStatus status;
+			ETFReader er(pBuf, size, false, status);
+			UInt32 arity = 0;
+			if(!er.ReadTagged(BatchAtom(), arity)) {
+				Take(pBuf, size, peer, control, boost::shared_ptr<ReplyBatch>());
+				return;
+			}
+			UInt32 count = 0;
+			if(arity != 2 || !er.TryReadList(count)) {
+				LOG_WARNING("Invalid batch: {} bytes", (UInt32)size);
+				return;
+			}
+			
+			// Every request of the batch gets the version number of a frame of its own
+			boost::shared_ptr<ReplyBatch> batch = boost::make_shared<ReplyBatch>(peer);
+			std::vector<byte> item(1, (byte)ERL_VERSION);
+			for(UInt32 i = 0; i < count; ++i) {
+				size_t pos = er.Tell();
+				if(!er.TrySkipTerm()) {
+					LOG_WARNING("Invalid batch: {} of {} requests read", i, count);
+					break;
+				}
+				item.resize(1);
+				item.insert(item.end(), pBuf + pos, pBuf + er.Tell());
+				Metrics::Add(Metrics::BatchedIn);
+				Take(&item[0], item.size(), peer, control, batch);
+			}
+			std::vector<Outgoing> out;
+			{
+				boost::mutex::scoped_lock lock(Mutex_);
+				Done(batch, out);
+			}
+			Send(out);
+		}
+		
+		// An admitted request goes to an idle handler or waits for one, a control lane one ahead of
+		// the others
+		private: void Take(const byte* pBuf, size_t size, const boost::shared_ptr<Connection>& peer, bool control, const boost::shared_ptr<ReplyBatch>& batch)
+		{
+			Request request;
+			if(!Parse(pBuf, size, request))
+				return;
+			std::vector<Outgoing> out;
+			boost::mutex::scoped_lock lock(Mutex_);
+			if(batch) {
+				request.Batch = batch;
+				++batch->Pending;
+			}
+			Shard& shard = ShardOf(request);
+			bool admitted = Admit(request, shard, peer, control, lock);
+			if(!admitted && batch)
+				Done(batch, out);
+			if(!admitted || Drop(request, out)) {
+				lock.unlock();
+				Send(out);
+				return;
+			}
+			if(shard.Idle.empty()) {
+				size_t at = (control ? shard.Urgent++ : shard.Requests.size());
+				shard.Requests.insert(shard.Requests.begin() + at, Request())->Swap(request);
+				shard.Peers.insert(shard.Peers.begin() + at, peer);
+				Metrics::AddGauge(Metrics::QueueDepth, 1);
+				return;
+			}
+			Coroutine* c = shard.Idle.front();
+			shard.Idle.pop_front();
+			Deliver(c, request, peer);
+			if(control)
+				shard.Ready.push_front(c);
+			else
+				shard.Ready.push_back(c);
+			shard.ReadyCondition.notify_one();
+		}
+		
+		// Worker of the key with affinity, requests without a key are dealt out in turn. Mutex_ held.
+		private: Shard& ShardOf(const Request& request)
+		{
+			if(Shards_.size() == 1)
+				return *Shards_[0];
+			return *Shards_[(request.KeyHash ? *request.KeyHash : NextShard_++) % Shards_.size()];
+		}
+		
+		// Front of the requests of shard is delivered or dropped. Mutex_ held.
+		private: void PopRequest(Shard& shard)
+		{
+			shard.Requests.pop_front();
+			shard.Peers.pop_front();
+			shard.Urgent -= (shard.Urgent ? 1 : 0);
+			Metrics::AddGauge(Metrics::QueueDepth, -1);
+		}
+		
+		// Applies {'$cancel',DS} and returns false, or unwraps the deadline and registers the request.
+		// Anything that is not a {Command,DS,...} request goes to the handler as it is; probing the
+		// frame costs no exceptions, a peer sending garbage slows nobody down.
+		private: bool Parse(const byte* pBuf, size_t size, Request& request)
+		{
+			ETFStatus status;
+			ETFReader er(pBuf, size, false, status);
+			if(Cancellation_.ReadCancel(er))
+				return false;
+			Int64 deadlineMs = Cancellation::Unwrap(pBuf, size, request.Frame);
+			if(deadlineMs < 0)
+				request.Frame.assign(pBuf, pBuf + size);
+			
+			const byte* pFrame = (request.Frame.empty() ? NULL : &request.Frame[0]);
+			ETFReader rr(pFrame, request.Frame.size(), false, status);
+			UInt32 arity = 0;
+			if(rr.TryReadTuple(arity) && arity >= 2) {
+				int command = -1;
+				if(rr.TryReadNumber(command))
+					request.Command = command;
+				else
+					rr.TrySkipTerm();
+				rr.TryReadReference(request.DS);
+			}
+			request.Token = (request.DS ? Cancellation_.Register(*request.DS, deadlineMs) : CancelToken::Create(deadlineMs));
+			
+			// Key element hashed as phash2 does, without decoding it
+			ETFStatus keyStatus;
+			ETFReader kr(pFrame, request.Frame.size(), false, keyStatus);
+			UInt32 hash = 0;
+			if(Affinity_.KeyElement && kr.TryReadTuple(arity) && arity >= Affinity_.KeyElement) {
+				bool found = true;
+				for(UInt32 i = 1; i < Affinity_.KeyElement && found; ++i)
+					found = kr.TrySkipTerm();
+				if(found && kr.TryPHash2(hash))
+					request.KeyHash = hash;
+			}
+			return true;
+		}
+		
+		private: bool Full(int command)
+		{
+			std::map<int, size_t>::const_iterator limit = Admission_.Limits.find(command);
+			return (limit != Admission_.Limits.end() && InFlight_[command] >= limit->second);
+		}
+		
+		// Wait while request is over a limit (stdin is not read meanwhile) or reject it, control lane
+		// requests are let in at once. MaxQueued counts the requests of the shard it goes to. Mutex_
+		// held.
+		private: bool Admit(const Request& request, const Shard& shard, const boost::shared_ptr<Connection>& peer, bool control, boost::mutex::scoped_lock& lock)
+		{
+			while(!control && ((shard.Idle.empty() && shard.Requests.size() >= Admission_.MaxQueued) || Full(request.Command))) {
+				if(Admission_.Reject && request.DS) {
+					lock.unlock();
+					Overloaded(request, peer);
+					lock.lock();
+					return false;
+				}
+				AdmitCondition_.wait(lock);
+			}
+			if(Admission_.Limits.count(request.Command))
+				++InFlight_[request.Command];
+			return true;
+		}
+		
+		// Request admitted is done with (handled or dropped), or a handler is free. Mutex_ held.
+		private: void Release(int command)
+		{
+			std::map<int, size_t>::iterator n = InFlight_.find(command);
+			if(n != InFlight_.end() && n->second)
+				--n->second;
+			AdmitCondition_.notify_one();
+		}
+		
+		// {error,DS,overloaded}
+		private: void Overloaded(const Request& request, const boost::shared_ptr<Connection>& peer)
+		{
+			Cancellation_.Complete(*request.DS);
+			Metrics::Add(Metrics::Overloaded);
+			ETFWriter ewr(64);
+			ewr.WriteTuple(3).WriteAtom("error").WriteReference(*request.DS).WriteAtom("overloaded");
+			Reply(peer, request.Batch, ewr, ewr.BytesCount());
+		}
+		
+		// Cancelled before a handler took it, Erlang does not wait for the reply any more. Mutex_ held.
+		private: bool Drop(const Request& request, std::vector<Outgoing>& out)
+		{
+			if(!request.Token.Cancelled())
+				return false;
+			if(request.DS)
+				Cancellation_.Complete(*request.DS);
+			if(request.Batch)
+				Done(request.Batch, out);
+			Release(request.Command);
+			Metrics::Add(Metrics::Cancelled);
+			return true;
+		}
+		
+		private: void Deliver(Coroutine* c, Request& request, const boost::shared_ptr<Connection>& peer)
+		{
+			c->Peer_ = peer;
+			c->pRequest_->Swap(request);
+			c->Command_ = c->pRequest_->Command;
+			c->DS_ = c->pRequest_->DS;
+			c->Token_ = c->pRequest_->Token;
+			c->Batch_.swap(c->pRequest_->Batch); // The handler keeps its request, not the peer in the batch
+		}
+		
+		// Request handled by c is done: it asked for the next one or completed. Mutex_ held.
+		private: void Complete(Coroutine* c, std::vector<Outgoing>& out)
+		{
+			if(c->DS_)
+				Cancellation_.Complete(*c->DS_);
+			if(c->Batch_) {
+				Done(c->Batch_, out);
+				c->Batch_.reset();
+			}
+			Release(c->Command_);
+			c->Command_ = -1;
+			c->DS_ = boost::none;
+			c->Token_ = CancelToken();
+			c->Peer_.reset();
+		}
+		
+		// A request of batch is done with (or the batch frame is read): the replies go once all are.
+		// Mutex_ held.
+		private: void Done(const boost::shared_ptr<ReplyBatch>& batch, std::vector<Outgoing>& out)
+		{
+			if(!--batch->Pending)
+				TakeReplies(*batch, out);
+		}
+		
+		// Replies buffered in batch as one {'$batch',[Reply,...]} frame. Mutex_ held.
+		private: void TakeReplies(ReplyBatch& batch, std::vector<Outgoing>& out)
+		{
+			if(!batch.Count)
+				return;
+			batch.Buf.push_back(NIL_EXT);
+			byte* p = &batch.Buf[0];
+			p[0] = ERL_VERSION;
+			p[1] = SMALL_TUPLE_EXT;
+			p[2] = 2;
+			p[3] = SMALL_ATOM_UTF8_EXT;
+			p[4] = 6;
+			memcpy(p + 5, BatchAtom(), 6);
+			p[11] = LIST_EXT;
+			RWBinary::Write(p + 12, batch.Count);
+			out.push_back(Outgoing());
+			out.back().Peer = batch.Peer;
+			out.back().Frame.swap(batch.Buf);
+			batch.Count = 0;
+			Metrics::Add(Metrics::BatchedOut);
+		}
+		
+		// Batches whose first reply has waited DelayUs. Mutex_ held.
+		private: void TakeDue(std::vector<Outgoing>& out)
+		{
+			if(Due_.empty())
+				return;
+			Clock::time_point now = Clock::now();
+			while(!Due_.empty() && Due_.front().first <= now) {
+				ReplyBatch& batch = *Due_.front().second;
+				if(batch.Count && batch.Due <= now)
+					TakeReplies(batch, out);
+				Due_.pop_front();
+			}
+		}
+		
+		private: bool Send(std::vector<Outgoing>& out)
+		{
+			bool written = true;
+			for(size_t i = 0; i < out.size(); ++i)
+				written = Write(out[i].Peer, &out[i].Frame[0], out[i].Frame.size()) && written;
+			out.clear();
+			return written;
+		}
+		
+		// Reply of a handler: into the batch its request came in, unless it is too long for one,
+		// otherwise written now
+		private: bool Reply(const boost::shared_ptr<Connection>& peer, const boost::shared_ptr<ReplyBatch>& batch, const byte* pBuf, size_t size)
+		{
+			if(!batch || size < 2 || pBuf[0] != ERL_VERSION || size - 1 > Batching_.MaxBytes)
+				return Write(peer, pBuf, size);
+			std::vector<Outgoing> out;
+			{
+				boost::mutex::scoped_lock lock(Mutex_);
+				if(batch->Count && batch->Buf.size() - HEAD_SIZE + size - 1 > Batching_.MaxBytes)
+					TakeReplies(*batch, out);
+				if(!batch->Count) {
+					batch->Buf.resize(HEAD_SIZE);
+					batch->Due = Clock::now() + boost::chrono::microseconds(Batching_.DelayUs);
+					for(size_t s = 0; Due_.empty() && s < Shards_.size(); ++s)
+						Shards_[s]->ReadyCondition.notify_one(); // An idle worker waits for it
+					Due_.push_back(std::make_pair(batch->Due, batch));
+				}
+				batch->Buf.insert(batch->Buf.end(), pBuf + 1, pBuf + size);
+				++batch->Count;
+			}
+			return Send(out);
+		}
+		
+		// To the peer a request came from, stdout if none
+		private: bool Write(const boost::shared_ptr<Connection>& peer, const byte* pBuf, size_t size)
+		{
+#ifndef _WIN32
+			if(peer)
+				return peer->Write(pBuf, size);
+#endif /* _WIN32 */
+			ErrorInfo ei;
+			if(PacketSize_ == 4)
+				Stream::Write4(pBuf, (UInt32)size, &ei);
+			else if(size <= MAX_MESSAGE_LENGTH)
+				Stream::Write2(pBuf, (UInt16)size, &ei);
+			else
+				return false;
+			return !(ei.WasError || ei.ErrorCode);
+		}
+		
+		// Frame of ewr with the file range spliced in at split, like Write
+		private: bool WriteFile(const boost::shared_ptr<Connection>& peer, const ETFWriter& ewr, size_t split, int fd, UInt64 offset, size_t size)
+		{
+			const byte* pBuf = ewr;
+			if(split > ewr.BytesCount())
+				split = ewr.BytesCount();
+#ifndef _WIN32
+			if(peer)
+				return peer->WriteFile(pBuf, split, fd, offset, size, pBuf + split, ewr.BytesCount() - split);
+#endif /* _WIN32 */
+			return Stream::WriteFile(PacketSize_, pBuf, split, fd, offset, size, pBuf + split, ewr.BytesCount() - split);
+		}
+		
+		private: void Work(size_t index)
+		{
+			Shard& shard = *Shards_[index];
+			std::vector<Outgoing> out;
+			boost::mutex::scoped_lock lock(Mutex_);
+			while(true) {
+				TakeDue(out);
+				if(!out.empty()) {
+					lock.unlock();
+					Send(out); // Replies of batches done with or due
+					lock.lock();
+					continue;
+				}
+				if(shard.Ready.empty()) {
+					if(Stopping_)
+						return;
+					if(Due_.empty())
+						shard.ReadyCondition.wait(lock);
+					else
+						shard.ReadyCondition.wait_until(lock, Due_.front().first);
+					continue;
+				}
+				Coroutine* c = shard.Ready.front();
+				shard.Ready.pop_front();
+				lock.unlock();
+				c->Wait_ = Coroutine::Ready;
+				try
+				{
+					(*c)();
+				}
+				catch(const std::exception& e)
+				{
+					LOG_ERROR("Coroutine failed: {}", e.what());
+					Finish(c, out);
+					lock.lock();
+					continue;
+				}
+				if(c->is_complete()) {
+					Finish(c, out);
+					lock.lock();
+				}
+				else {
+					lock.lock();
+					Suspend(c, out);
+				}
+			}
+		}
+		
+		// Park coroutine on what it yielded for, only after its body has returned, so no other
+		// thread can resume it while it still runs here. Mutex_ held.
+		private: void Suspend(Coroutine* c, std::vector<Outgoing>& out)
+		{
+			if(c->Wait_ == Coroutine::ForBlocking) {
+				Jobs_.push_back(c);
+				JobCondition_.notify_one();
+				return;
+			}
+			Shard& shard = *Shards_[c->Shard_];
+			if(c->Wait_ == Coroutine::ForRequest) {
+				Complete(c, out);
+				while(!shard.Requests.empty() && Drop(shard.Requests.front(), out))
+					PopRequest(shard);
+				if(!shard.Requests.empty()) {
+					Deliver(c, shard.Requests.front(), shard.Peers.front());
+					PopRequest(shard);
+				}
+				else if(Closed_)
+					*c->pRequest_ = Request();
+				else {
+					shard.Idle.push_back(c);
+					return;
+				}
+			}
+			shard.Ready.push_back(c);
+			shard.ReadyCondition.notify_one();
+		}
+		
+		private: void Finish(Coroutine* c, std::vector<Outgoing>& out)
+		{
+			{
+				boost::mutex::scoped_lock lock(Mutex_);
+				Complete(c, out);
+			}
+			delete c;
+			boost::mutex::scoped_lock lock(Mutex_);
+			if(!--Coroutines_)
+				DoneCondition_.notify_all();
+		}
+		
+		private: void Block(void)
+		{
+			boost::mutex::scoped_lock lock(Mutex_);
+			while(true) {
+				while(Jobs_.empty() && !Stopping_)
+					JobCondition_.wait(lock);
+				if(Jobs_.empty())
+					return;
+				Coroutine* c = Jobs_.front();
+				Jobs_.pop_front();
+				lock.unlock();
+				try
+				{
+					c->Job_();
+				}
+				catch(const std::exception& e)
+				{
+					LOG_ERROR("Blocking job failed: {}", e.what());
+				}
+				c->Job_.clear();
+				lock.lock();
+				Shard& shard = *Shards_[c->Shard_];
+				shard.Ready.push_back(c);
+				shard.ReadyCondition.notify_one();
+			}
+		}
+	};
+}
+//-------------------------------------------------------------------------------------------------
+#endif /* __PORTSERVER_HPP__ */
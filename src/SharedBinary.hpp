@@ -0,0 +1,90 @@
+/*
+
+*/
+
+#ifndef __SHAREDBINARY_HPP__
+#define __SHAREDBINARY_HPP__
+//-------------------------------------------------------------------------------------------------
+#include <string.h>
+
+#include "Erlang.hpp"
+#include "SharedMemory.hpp"
+//-------------------------------------------------------------------------------------------------
+namespace Erlang
+{
+	// Binaries through a SharedMemory region: the descriptor {'$shm',Offset,Size} goes in the frame
+	// in place of BINARY_EXT (see SharedMemory). Apart from Erlang.hpp, so the codec alone does not
+	// pull in the mapping headers:
+	//   SharedMemory::View v = Erlang::ReadBinary(er, shm);
+	//   Erlang::WriteBinary(ewr.WriteTuple(2).WriteAtom("echo"), shm, v.Data, v.Size);
+	//   shm.Release(v);
+	
+	// BINARY_EXT, or the descriptor of a binary in the region. Nothing is copied: the view points
+	// into the mapping or into the buffer of er, give it back with SharedMemory::Release when done.
+	// er moves over the term or stays where it was.
+	inline ETFStatus TryReadBinary(ETFReader& er, const SharedMemory& shm, SharedMemory::View& v)
+	{
+		size_t start = er.Tell();
+		
+		if(er.GetNextTag() == BINARY_EXT) {
+			ETFStatus status = er.TrySkipTerm();
+			if(status) {
+				size_t header = 1 + sizeof(UInt32);
+				SharedMemory::View view = { er.Buffer() + start + header, er.Tell() - start - header, 0, false };
+				v = view;
+			}
+			return status;
+		}
+		
+		UInt32 arity = 0;
+		UInt64 offset = 0, size = 0;
+		if(!er.ReadTagged(SharedMemory::Atom(), arity))
+			return ETFStatus(ETF_INVALID_TAG, start);
+		ETFStatus status;
+		if(arity != 3)
+			status = ETFStatus(ETF_INVALID_SIZE, start);
+		else if((status = er.TryReadNumber(offset)) && (status = er.TryReadNumber(size)) && !shm.Find(offset, size, v))
+			status = ETFStatus(ETF_INVALID_SHM, start);
+		if(!status)
+			er.Seek(start);
+		return status;
+	}
+	
+	inline SharedMemory::View ReadBinary(ETFReader& er, const SharedMemory& shm)
+	{
+		SharedMemory::View v = SharedMemory::View();
+		ETFStatus status = TryReadBinary(er, shm, v);
+		if(!status)
+			ETFReader::Raise(status);
+		return v;
+	}
+	
+	// Descriptor of a block filled in place: SharedMemory::Allocate, build payload, WriteBinary
+	inline ETFWriter& WriteBinary(ETFWriter& ewr, const SharedMemory::Block& block)
+	{
+		return ewr.WriteTuple(3).WriteAtom(SharedMemory::Atom()).WriteNumber(block.Offset).WriteNumber((UInt64)block.Size);
+	}
+	
+	// Copied to the region when big enough and there is room, inline otherwise
+	inline ETFWriter& WriteBinary(ETFWriter& ewr, SharedMemory& shm, const byte* data, size_t size)
+	{
+		SharedMemory::Block block;
+		if(size < shm.Threshold() || !shm.Allocate(size, block))
+			return ewr.WriteBinary(data, size);
+		memcpy(block.Data, data, size);
+		return WriteBinary(ewr, block);
+	}
+	
+	inline ETFSizer& WriteBinary(ETFSizer& es, const SharedMemory::Block& block)
+	{
+		return es.WriteTuple(3).WriteAtom(SharedMemory::Atom()).WriteNumber(block.Offset).WriteNumber((UInt64)block.Size);
+	}
+	
+	// Not known before the block is allocated: the inline size, the bigger one
+	inline ETFSizer& WriteBinary(ETFSizer& es, SharedMemory&, const byte* data, size_t size)
+	{
+		return es.WriteBinary(data, size);
+	}
+}
+//-------------------------------------------------------------------------------------------------
+#endif /* __SHAREDBINARY_HPP__ */
@@ -0,0 +1,371 @@
+/*
+
+*/
+
+#ifndef __SHAREDMEMORY_HPP__
+#define __SHAREDMEMORY_HPP__
+//-------------------------------------------------------------------------------------------------
+#include <stdexcept>
+#include <string>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif /* _WIN32 */
+
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/throw_exception.hpp>
+
+#include "Defines.hpp"
+//-------------------------------------------------------------------------------------------------
+namespace IOStream
+{
+	// Side channel for bulk binaries: a named shared memory region mapped by the port and its peer,
+	// with one ring per direction. The writer copies (or builds) the payload in its ring and sends
+	// only the descriptor term {'$shm',Offset,Size} through the pipe; the reader maps it back to
+	// a pointer into the region and releases it when done. Blocks may be released in any order, the
+	// ring space is reclaimed up to the oldest block still in use.
+	//
+	// Peer (Erlang side - a NIF, or a fake peer in tests) creates the region and passes its name to
+	// the port, the port opens it:
+	//   SharedMemory shm("/erlport.1234");                    // port: reads Lane 0, writes Lane 1
+	//   SharedMemory::View v = Erlang::ReadBinary(er, shm);   // points into the mapping, no copy
+	//   Erlang::WriteBinary(ewr, shm, v.Data, v.Size);        // copied into the ring, {'$shm',...} written
+	//   shm.Release(v);
+	// (Erlang::ReadBinary\WriteBinary of the descriptor are in SharedBinary.hpp)
+	class SharedMemory
+	{
+		public: enum Role
+		{
+			Peer, // Creates region, writes lane 0, reads lane 1
+			Port, // Opens region, writes lane 1, reads lane 0
+		};
+		
+		private: enum BlockState
+		{
+			Used,
+			Free,
+			Padding, // Rest of the ring before wrap
+		};
+		
+		private: static const UInt32 MAGIC = 0x45524c53; // "ERLS"
+		private: static const size_t ALIGN = 8;
+		
+		// Written block: pointer to fill in, then its descriptor goes to ETFWriter::WriteBinary
+		public: struct Block
+		{
+			public: byte* Data;
+			public: size_t Size;
+			public: UInt64 Offset;
+		};
+		
+		// Read binary: into the mapping (Shared) or into the ETF buffer the reader works on
+		public: struct View
+		{
+			public: const byte* Data;
+			public: size_t Size;
+			public: UInt64 Offset;
+			public: bool Shared;
+		};
+		
+		private: struct BlockHeader
+		{
+			public: UInt32 Size; // Whole block, header and alignment included
+			public: boost::atomic<UInt32> State;
+		};
+		
+		private: struct LaneHeader
+		{
+			public: boost::atomic<UInt64> Head; // Written by writer process
+			public: byte Padding0_[CACHE_LINE_SIZE - sizeof(UInt64)];
+			public: boost::atomic<UInt64> Tail; // Written by reader process
+			public: byte Padding1_[CACHE_LINE_SIZE - sizeof(UInt64)];
+		};
+		
+		private: struct RegionHeader
+		{
+			public: UInt32 Magic;
+			public: UInt32 Version;
+			public: UInt64 LaneSize;
+			public: UInt64 Threshold;
+			public: byte Padding_[CACHE_LINE_SIZE - 2*sizeof(UInt32) - 2*sizeof(UInt64)];
+			public: LaneHeader Lanes[2];
+		};
+		
+		private: std::string Name_;
+		private: Role Role_;
+		private: byte* pBase_;
+		private: size_t Size_;
+		private: RegionHeader* pHeader_;
+		private: byte* pLanes_[2];
+		private: boost::mutex AllocateMutex_; // Writers of the outgoing lane, any thread of the process
+		private: boost::mutex ReleaseMutex_;
+		private: boost::atomic<bool> Corrupt_; // Incoming lane, see Release
+#ifdef _WIN32
+		private: HANDLE Mapping_;
+#endif /* _WIN32 */
+		
+		// Peer: create region of size bytes (both lanes), binaries from threshold bytes go there
+		public: SharedMemory(const std::string& name, size_t size, size_t threshold = 64*1024):
+			Name_(name),
+			Role_(Peer),
+			pBase_(NULL),
+			Size_(0),
+			pHeader_(NULL),
+			Corrupt_(false)
+		{
+			UInt64 laneSize = ((size > sizeof(RegionHeader) ? size - sizeof(RegionHeader) : 0)/2)/ALIGN*ALIGN;
+			if(laneSize < 4096)
+				boost::throw_exception(std::length_error("Invalid Shared Memory Size"));
+			Map(true, sizeof(RegionHeader) + 2*(size_t)laneSize);
+			pHeader_->Magic = MAGIC;
+			pHeader_->Version = 1;
+			pHeader_->LaneSize = laneSize;
+			pHeader_->Threshold = threshold;
+			for(int i = 0; i < 2; ++i) {
+				pHeader_->Lanes[i].Head.store(0);
+				pHeader_->Lanes[i].Tail.store(0);
+			}
+			Init();
+		}
+		
+		// Port: open region created by peer
+		public: explicit SharedMemory(const std::string& name):
+			Name_(name),
+			Role_(Port),
+			pBase_(NULL),
+			Size_(0),
+			pHeader_(NULL),
+			Corrupt_(false)
+		{
+			Map(false, 0);
+			if(pHeader_->Magic != MAGIC || pHeader_->Version != 1 || sizeof(RegionHeader) + 2*pHeader_->LaneSize > Size_) {
+				Unmap();
+				boost::throw_exception(std::runtime_error("Invalid Shared Memory Region"));
+			}
+			Init();
+		}
+		
+		public: ~SharedMemory(void)
+		{
+			Unmap();
+#ifndef _WIN32
+			if(Role_ == Peer)
+				shm_unlink(Name_.c_str());
+#endif /* _WIN32 */
+		}
+		
+		private: SharedMemory(const SharedMemory&);
+		private: SharedMemory& operator =(const SharedMemory&);
+		
+		public: const std::string& Name(void) const
+		{
+			return Name_;
+		}
+		
+		// Tag of the descriptor term
+		public: static const char* Atom(void)
+		{
+			return "$shm";
+		}
+		
+		// Binaries below threshold are cheaper inline, both sides use the one set by peer
+		public: size_t Threshold(void) const
+		{
+			return (size_t)pHeader_->Threshold;
+		}
+		
+		private: void Init(void)
+		{
+			pLanes_[0] = pBase_ + sizeof(RegionHeader);
+			pLanes_[1] = pLanes_[0] + pHeader_->LaneSize;
+		}
+		
+		private: void Map(bool create, size_t size)
+		{
+#ifdef _WIN32
+			if(create)
+				Mapping_ = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)((UInt64)size >> 32), (DWORD)size, Name_.c_str());
+			else
+				Mapping_ = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, Name_.c_str());
+			if(!Mapping_)
+				boost::throw_exception(std::runtime_error("Can't Open Shared Memory"));
+			pBase_ = (byte*)MapViewOfFile(Mapping_, FILE_MAP_ALL_ACCESS, 0, 0, size);
+			if(!pBase_) {
+				CloseHandle(Mapping_);
+				boost::throw_exception(std::runtime_error("Can't Map Shared Memory"));
+			}
+			if(!create) {
+				MEMORY_BASIC_INFORMATION info;
+				VirtualQuery(pBase_, &info, sizeof(info));
+				size = info.RegionSize;
+			}
+#else
+			int fd = (create ? shm_open(Name_.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600) : shm_open(Name_.c_str(), O_RDWR, 0));
+			if(fd < 0)
+				boost::throw_exception(std::runtime_error("Can't Open Shared Memory"));
+			struct stat st;
+			if((create && ftruncate(fd, (off_t)size)) || fstat(fd, &st) || (size_t)st.st_size < sizeof(RegionHeader)) {
+				::close(fd);
+				if(create)
+					shm_unlink(Name_.c_str());
+				boost::throw_exception(std::runtime_error("Can't Size Shared Memory"));
+			}
+			size = (size_t)st.st_size;
+			void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			::close(fd);
+			if(p == MAP_FAILED) {
+				if(create)
+					shm_unlink(Name_.c_str());
+				boost::throw_exception(std::runtime_error("Can't Map Shared Memory"));
+			}
+			pBase_ = (byte*)p;
+#endif /* _WIN32 */
+			Size_ = size;
+			pHeader_ = (RegionHeader*)pBase_;
+		}
+		
+		private: void Unmap(void)
+		{
+			if(!pBase_)
+				return;
+#ifdef _WIN32
+			UnmapViewOfFile(pBase_);
+			CloseHandle(Mapping_);
+#else
+			munmap(pBase_, Size_);
+#endif /* _WIN32 */
+			pBase_ = NULL;
+		}
+		
+		private: int WriteLane(void) const
+		{
+			return (Role_ == Peer ? 0 : 1);
+		}
+		
+		private: int ReadLane(void) const
+		{
+			return 1 - WriteLane();
+		}
+		
+		private: BlockHeader* At(int lane, UInt64 offset) const
+		{
+			return (BlockHeader*)(pLanes_[lane] + offset);
+		}
+		
+		// Reserve block for size bytes in the outgoing lane. Returns false if the lane is full (the
+		// reader has not released enough), the caller then sends the binary inline. Threads may
+		// allocate at once, each gets a block of its own.
+		public: bool Allocate(size_t size, Block& block)
+		{
+			int lane = WriteLane();
+			LaneHeader& l = pHeader_->Lanes[lane];
+			UInt64 laneSize = pHeader_->LaneSize;
+			UInt64 need = (sizeof(BlockHeader) + (UInt64)size + ALIGN - 1)/ALIGN*ALIGN;
+			boost::mutex::scoped_lock lock(AllocateMutex_);
+			UInt64 head = l.Head.load(boost::memory_order_relaxed);
+			UInt64 tail = l.Tail.load(boost::memory_order_acquire);
+			UInt64 offset = head % laneSize;
+			UInt64 contiguous = laneSize - offset;
+			UInt64 total = (contiguous < need ? contiguous + need : need);
+			if(need > laneSize || laneSize - (head - tail) < total)
+				return false;
+			if(contiguous < need) {
+				BlockHeader* pPad = At(lane, offset);
+				pPad->Size = (UInt32)contiguous;
+				pPad->State.store(Padding, boost::memory_order_relaxed);
+				offset = 0;
+			}
+			BlockHeader* pBlock = At(lane, offset);
+			pBlock->Size = (UInt32)need;
+			pBlock->State.store(Used, boost::memory_order_relaxed);
+			l.Head.store(head + total, boost::memory_order_release);
+			block.Data = (byte*)pBlock + sizeof(BlockHeader);
+			block.Size = size;
+			block.Offset = offset;
+			return true;
+		}
+		
+		// Block at offset of the incoming lane, checked against the ring (offsets come from the pipe);
+		// false if there is no such block
+		public: bool Find(UInt64 offset, UInt64 size, View& v) const
+		{
+			int lane = ReadLane();
+			UInt64 laneSize = pHeader_->LaneSize;
+			if(Corrupt_.load(boost::memory_order_relaxed) || offset % ALIGN || offset >= laneSize || size > laneSize - offset - sizeof(BlockHeader))
+				return false;
+			const BlockHeader* pBlock = At(lane, offset);
+			if(pBlock->Size < sizeof(BlockHeader) + size || pBlock->Size > laneSize - offset || pBlock->State.load(boost::memory_order_acquire) != Used)
+				return false;
+			v.Data = (const byte*)pBlock + sizeof(BlockHeader);
+			v.Size = (size_t)size;
+			v.Offset = offset;
+			v.Shared = true;
+			return true;
+		}
+		
+		public: View Get(UInt64 offset, UInt64 size) const
+		{
+			View v;
+			if(!Find(offset, size, v))
+				boost::throw_exception(std::out_of_range("Invalid Shared Memory Block"));
+			return v;
+		}
+		
+		// Done with block of the incoming lane; inline views are ignored. The tail follows the block
+		// sizes the peer wrote: one that is not a whole aligned block within the written part of the
+		// lane, or a head past the lane, makes the lane corrupt. The tail stays before it, Find finds
+		// nothing from then on and Release returns false.
+		public: bool Release(const View& v)
+		{
+			if(!v.Shared)
+				return true;
+			int lane = ReadLane();
+			LaneHeader& l = pHeader_->Lanes[lane];
+			UInt64 laneSize = pHeader_->LaneSize;
+			boost::mutex::scoped_lock lock(ReleaseMutex_);
+			if(Corrupt_.load(boost::memory_order_relaxed))
+				return false;
+			At(lane, v.Offset)->State.store(Free, boost::memory_order_relaxed);
+			UInt64 tail = l.Tail.load(boost::memory_order_relaxed);
+			UInt64 head = l.Head.load(boost::memory_order_acquire);
+			bool corrupt = (head - tail > laneSize);
+			while(tail != head && !corrupt) {
+				UInt64 offset = tail % laneSize;
+				BlockHeader* pBlock = At(lane, offset);
+				UInt64 size = pBlock->Size;
+				UInt32 state = pBlock->State.load(boost::memory_order_relaxed);
+				if(state == Used)
+					break;
+				if(state > Padding || size < sizeof(BlockHeader) || size % ALIGN || size > head - tail || size > laneSize - offset)
+					corrupt = true;
+				else
+					tail += size;
+			}
+			l.Tail.store(tail, boost::memory_order_release);
+			if(corrupt)
+				Corrupt_.store(true, boost::memory_order_relaxed);
+			return !corrupt;
+		}
+		
+		// A block size or head written by the peer was out of the incoming lane (see Release)
+		public: bool Corrupt(void) const
+		{
+			return Corrupt_.load(boost::memory_order_relaxed);
+		}
+		
+		// Bytes of the outgoing lane in use
+		public: UInt64 Pending(void) const
+		{
+			const LaneHeader& l = pHeader_->Lanes[WriteLane()];
+			return l.Head.load(boost::memory_order_relaxed) - l.Tail.load(boost::memory_order_relaxed);
+		}
+	};
+}
+//-------------------------------------------------------------------------------------------------
+#endif /* __SHAREDMEMORY_HPP__ */
@@ -0,0 +1,245 @@
+/*
+
+*/
+
+#ifndef __TERMSORT_HPP__
+#define __TERMSORT_HPP__
+//-------------------------------------------------------------------------------------------------
+#include <algorithm>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+
+#include "Erlang.hpp"
+#include "ThreadPool.hpp"
+#include "Defines.hpp"
+//-------------------------------------------------------------------------------------------------
+namespace Erlang
+{
+	// lists:sort/1 and lists:merge/2 of lists received from Erlang, done on the encoded terms.
+	// One SkipTerm pass finds the elements, which are then sorted as positions in the frame with
+	// ETFReader::CompareAt and copied to the writer as they are, so no term is decoded. A long
+	// list is cut into a slice per thread and the slices are sorted at once. They are then merged
+	// pairwise; every merge is split by binary search into pieces that run in parallel too, so
+	// all threads work down to the last round. The sort is stable like lists:sort: elements that
+	// compare equal (1 and 1.0) keep their order, and a merge takes from the first list first.
+	//   Erlang::ETFWriter ewr;
+	//   ewr.WriteTuple(3).WriteAtom("sorted").WriteReference(DS);
+	//   if(!Erlang::TermSort::TrySort(er, ewr)) // er at the list, moved over it
+	//       ...
+	class TermSort
+	{
+		public: static const size_t MIN_SLICE = 4096; // Elements a thread gets at least
+		
+		private: struct Element
+		{
+			public: size_t Offset; // In the frame
+			public: size_t Size;
+		};
+		
+		private: class Less
+		{
+			private: const byte* pBuf_;
+			private: const byte* pEnd_;
+			private: boost::atomic<int>* pError_; // First ETFError met, 0 - none
+			
+			public: Less(const byte* pBuf, const byte* pEnd, boost::atomic<int>* pError):
+				pBuf_(pBuf),
+				pEnd_(pEnd),
+				pError_(pError)
+			{
+			}
+			
+			public: bool operator ()(const Element& a, const Element& b) const
+			{
+				int order = 0;
+				if(ETFError error = ETFReader::CompareAt(pBuf_ + a.Offset, pEnd_, pBuf_ + b.Offset, pEnd_, order)) {
+					int none = 0;
+					pError_->compare_exchange_strong(none, (int)error);
+				}
+				return order < 0;
+			}
+		};
+		
+		private: typedef ThreadPool::Job Job;
+		
+		// Proper list at er sorted into ewr, er moves over it. threads 0 - one per core.
+		public: static ETFStatus TrySort(ETFReader& er, ETFWriter& ewr, size_t threads = 0)
+		{
+			size_t start = er.Tell();
+			if(er.GetNextTag() == STRING_EXT)
+				return SortString(er, ewr);
+			std::vector<Element> elements;
+			ETFStatus status = ReadElements(er, elements);
+			if(!status)
+				return status;
+			
+			boost::atomic<int> error(0);
+			Less less(er.Buffer(), er.Buffer() + er.Tell() + er.RestSize(), &error);
+			size_t n = elements.size();
+			size_t slices = std::max<size_t>(1, std::min(ThreadPool::Threads(threads), n/MIN_SLICE));
+			std::vector<size_t> bounds(slices + 1);
+			for(size_t i = 0; i <= slices; ++i)
+				bounds[i] = n*i/slices;
+			std::vector<Job> jobs;
+			for(size_t i = 0; i < slices; ++i)
+				jobs.push_back(boost::bind(&TermSort::SortSlice, n ? &elements[0] + bounds[i] : NULL, n ? &elements[0] + bounds[i + 1] : NULL, less));
+			ThreadPool::Shared().Run(jobs);
+			
+			// Rounds of pairwise merges, slices/pairs threads for each merge
+			std::vector<Element> other(n);
+			std::vector<Element>* pFrom = &elements;
+			std::vector<Element>* pTo = &other;
+			for(size_t width = 1; width < slices; width *= 2) {
+				size_t pairs = (slices + 2*width - 1)/(2*width);
+				jobs.clear();
+				for(size_t i = 0; i < slices; i += 2*width) {
+					size_t lo = bounds[i], mid = bounds[std::min(i + width, slices)], hi = bounds[std::min(i + 2*width, slices)];
+					Split(&(*pFrom)[lo], mid - lo, &(*pFrom)[0] + mid, hi - mid, &(*pTo)[lo], std::max<size_t>(1, slices/pairs), less, jobs);
+				}
+				ThreadPool::Shared().Run(jobs);
+				std::swap(pFrom, pTo);
+			}
+			if(error) {
+				er.Seek(start);
+				return ETFStatus((ETFError)(int)error, start);
+			}
+			Write(er.Buffer(), *pFrom, ewr);
+			return ETFStatus();
+		}
+		
+		public: static void Sort(ETFReader& er, ETFWriter& ewr, size_t threads = 0)
+		{
+			ETFStatus status = TrySort(er, ewr, threads);
+			if(!status)
+				ETFReader::Raise(status);
+		}
+		
+		// Sorted lists at a and b merged into ewr, both readers move over their list; on ties the
+		// elements of a come first
+		public: static ETFStatus TryMerge(ETFReader& a, ETFReader& b, ETFWriter& ewr, size_t threads = 0)
+		{
+			size_t startA = a.Tell(), startB = b.Tell();
+			std::vector<Element> elementsA, elementsB;
+			ETFStatus status = ReadElements(a, elementsA);
+			if(!status)
+				return status;
+			if(!(status = ReadElements(b, elementsB))) {
+				a.Seek(startA);
+				return status;
+			}
+			
+			// b's elements get offsets in a merged copy of the two frames' terms, so that one Less
+			// serves both: the lists are copied after each other
+			const byte* pA = a.Buffer() + startA;
+			const byte* pB = b.Buffer() + startB;
+			size_t sizeA = a.Tell() - startA, sizeB = b.Tell() - startB;
+			std::vector<byte> terms(pA, pA + sizeA);
+			terms.insert(terms.end(), pB, pB + sizeB);
+			for(size_t i = 0; i < elementsA.size(); ++i)
+				elementsA[i].Offset -= startA;
+			for(size_t i = 0; i < elementsB.size(); ++i)
+				elementsB[i].Offset += sizeA - startB;
+			
+			boost::atomic<int> error(0);
+			const byte* pTerms = (terms.empty() ? NULL : &terms[0]);
+			Less less(pTerms, pTerms + terms.size(), &error);
+			std::vector<Element> merged(elementsA.size() + elementsB.size());
+			std::vector<Job> jobs;
+			size_t parts = std::max<size_t>(1, std::min(ThreadPool::Threads(threads), merged.size()/MIN_SLICE));
+			if(!merged.empty())
+				Split(elementsA.empty() ? NULL : &elementsA[0], elementsA.size(), elementsB.empty() ? NULL : &elementsB[0], elementsB.size(), &merged[0], parts, less, jobs);
+			ThreadPool::Shared().Run(jobs);
+			if(error) {
+				a.Seek(startA);
+				b.Seek(startB);
+				return ETFStatus((ETFError)(int)error, startA);
+			}
+			Write(pTerms, merged, ewr);
+			return ETFStatus();
+		}
+		
+		public: static void Merge(ETFReader& a, ETFReader& b, ETFWriter& ewr, size_t threads = 0)
+		{
+			ETFStatus status = TryMerge(a, b, ewr, threads);
+			if(!status)
+				ETFReader::Raise(status);
+		}
+		
+		// Elements of the proper list at er, [] and a list of one term each; er moves over the list
+		// or stays where it was
+		private: static ETFStatus ReadElements(ETFReader& er, std::vector<Element>& elements)
+		{
+			size_t start = er.Tell();
+			UInt32 count = 0;
+			ETFStatus status = er.TryReadNil();
+			if(status)
+				return status;
+			if(!(status = er.TryReadList(count)))
+				return status;
+			elements.resize(count);
+			for(UInt32 i = 0; i < count && status; ++i) {
+				elements[i].Offset = er.Tell();
+				status = er.TrySkipTerm();
+				elements[i].Size = er.Tell() - elements[i].Offset;
+			}
+			if(status)
+				status = er.TryReadNil(); // Improper lists are not sorted
+			if(!status)
+				er.Seek(start);
+			return status;
+		}
+		
+		// "..." as lists:sort gives it: the bytes in order, as STRING_EXT again
+		private: static ETFStatus SortString(ETFReader& er, ETFWriter& ewr)
+		{
+			size_t start = er.Tell();
+			ETFStatus status = er.TrySkipTerm();
+			if(!status)
+				return status;
+			std::vector<byte> str(er.Buffer() + start, er.Buffer() + er.Tell());
+			std::sort(str.begin() + 3, str.end()); // After tag and length
+			ewr.WriteEncoded(&str[0], str.size());
+			return ETFStatus();
+		}
+		
+		private: static void SortSlice(Element* pFirst, Element* pLast, const Less& less)
+		{
+			std::stable_sort(pFirst, pLast, less);
+		}
+		
+		private: static void MergePiece(const Element* pA, size_t countA, const Element* pB, size_t countB, Element* pOut, const Less& less)
+		{
+			std::merge(pA, pA + countA, pB, pB + countB, pOut, less);
+		}
+		
+		// Merge of a and b into out as parts jobs: a is cut evenly and each cut of a finds the first
+		// element of b not less than it, so the pieces write disjoint ranges of out
+		private: static void Split(const Element* pA, size_t countA, const Element* pB, size_t countB, Element* pOut, size_t parts, const Less& less, std::vector<Job>& jobs)
+		{
+			size_t fromA = 0, fromB = 0;
+			for(size_t k = 1; k <= parts; ++k) {
+				size_t toA = countA*k/parts;
+				size_t toB = (k == parts || toA == countA ? countB : (size_t)(std::lower_bound(pB, pB + countB, pA[toA], less) - pB));
+				toB = std::max(toB, fromB);
+				if(toA > fromA || toB > fromB)
+					jobs.push_back(boost::bind(&TermSort::MergePiece, pA + fromA, toA - fromA, pB + fromB, toB - fromB, pOut + fromA + fromB, less));
+				fromA = toA;
+				fromB = toB;
+			}
+		}
+		
+		private: static void Write(const byte* pBuf, const std::vector<Element>& elements, ETFWriter& ewr)
+		{
+			if(!elements.empty()) {
+				ewr.WriteList((UInt32)elements.size());
+				for(size_t i = 0; i < elements.size(); ++i)
+					ewr.WriteEncoded(pBuf + elements[i].Offset, elements[i].Size);
+			}
+			ewr.WriteNil();
+		}
+	};
+}
+//-------------------------------------------------------------------------------------------------
+#endif /* __TERMSORT_HPP__ */
@@ -0,0 +1,145 @@
+/*
+
+*/
+
+#ifndef __THREADPOOL_HPP__
+#define __THREADPOOL_HPP__
+//-------------------------------------------------------------------------------------------------
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "Defines.hpp"
+//-------------------------------------------------------------------------------------------------
+namespace IOStream
+{
+	// Threads kept for jobs cut from one call (ParallelDecoder ranges, TermSort slices and merge
+	// pieces), so a call does not start and join a thread per job. Run queues the jobs and the
+	// calling thread takes them from the queue as well until its own are done: a pool of no thread
+	// runs them in order on the caller, and a job may Run jobs of its own without a deadlock.
+	// Jobs must not throw.
+	//   std::vector<IOStream::ThreadPool::Job> jobs;
+	//   for(size_t i = 0; i < IOStream::ThreadPool::Threads(threads); ++i)
+	//       jobs.push_back(boost::bind(&Slice, i));
+	//   IOStream::ThreadPool::Shared().Run(jobs);
+	class ThreadPool
+	{
+		public: typedef boost::function<void(void)> Job;
+		
+		// Jobs of one Run, counted down as they finish
+		private: struct Batch
+		{
+			public: size_t Left;
+		};
+		
+		private: struct Task
+		{
+			public: Job Work;
+			public: Batch* pBatch;
+		};
+		
+		private: boost::mutex Mutex_;
+		private: boost::condition_variable JobCondition_;
+		private: boost::condition_variable DoneCondition_;
+		private: std::deque<Task> Tasks_;
+		private: boost::thread_group Threads_;
+		private: size_t Size_;
+		private: bool Stopping_;
+		
+		// threads 0 - one per core but the caller's
+		public: explicit ThreadPool(size_t threads = 0):
+			Size_(threads ? threads : Threads(0) - 1),
+			Stopping_(false)
+		{
+			for(size_t i = 0; i < Size_; ++i)
+				Threads_.create_thread(boost::bind(&ThreadPool::Work, this));
+		}
+		
+		private: ThreadPool(const ThreadPool&);
+		private: ThreadPool& operator =(const ThreadPool&);
+		
+		public: ~ThreadPool(void)
+		{
+			boost::mutex::scoped_lock lock(Mutex_);
+			Stopping_ = true;
+			JobCondition_.notify_all();
+			lock.unlock();
+			Threads_.join_all();
+		}
+		
+		// Pool of the process, started on first use
+		public: static ThreadPool& Shared(void)
+		{
+			static ThreadPool pool;
+			return pool;
+		}
+		
+		// Jobs a call cuts its work into: threads, 0 - one per core
+		public: static size_t Threads(size_t threads)
+		{
+			return (threads ? threads : std::max<size_t>(1, boost::thread::hardware_concurrency()));
+		}
+		
+		public: size_t Size(void) const
+		{
+			return Size_;
+		}
+		
+		// All jobs run once Run returns, the last of them on the calling thread
+		public: void Run(std::vector<Job>& jobs)
+		{
+			if(jobs.empty())
+				return;
+			Batch batch;
+			batch.Left = jobs.size();
+			boost::mutex::scoped_lock lock(Mutex_);
+			for(size_t i = 0; i + 1 < jobs.size(); ++i) {
+				Task task = { jobs[i], &batch };
+				Tasks_.push_back(task);
+			}
+			JobCondition_.notify_all();
+			lock.unlock();
+			jobs.back()();
+			lock.lock();
+			--batch.Left;
+			while(batch.Left) {
+				if(Tasks_.empty())
+					DoneCondition_.wait(lock);
+				else
+					Take(lock);
+			}
+		}
+		
+		// First queued job run with the lock released, Mutex_ is held before and after
+		private: void Take(boost::mutex::scoped_lock& lock)
+		{
+			Task task = Tasks_.front();
+			Tasks_.pop_front();
+			lock.unlock();
+			task.Work();
+			lock.lock();
+			if(!--task.pBatch->Left)
+				DoneCondition_.notify_all();
+		}
+		
+		private: void Work(void)
+		{
+			boost::mutex::scoped_lock lock(Mutex_);
+			while(true) {
+				while(Tasks_.empty() && !Stopping_)
+					JobCondition_.wait(lock);
+				if(Tasks_.empty())
+					return;
+				Take(lock);
+			}
+		}
+	};
+}
+//-------------------------------------------------------------------------------------------------
+#endif /* __THREADPOOL_HPP__ */
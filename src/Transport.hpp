@@ -0,0 +1,372 @@
+/*
+
+*/
+
+#ifndef __TRANSPORT_HPP__
+#define __TRANSPORT_HPP__
+//-------------------------------------------------------------------------------------------------
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <boost/thread/mutex.hpp>
+
+#include "Defines.hpp"
+#include "IOStream.hpp"
+#include "Metrics.hpp"
+#include "Capture.hpp"
+//-------------------------------------------------------------------------------------------------
+namespace IOStream
+{
+	// {packet,N} framed stream over a pair of descriptors, what Stream does for stdin/stdout only:
+	// the fds of open_port({fd,In,Out}), a socketpair, or a connection accepted by UnixListener
+	// (In == Out). Reading is cut for an event loop: Fill reads once what the descriptor has (call
+	// it when poll says it is readable, so it never blocks) and Next hands out the complete frames
+	// of the buffer. Writes block, header and term go out in one syscall, serialized per connection,
+	// so a slow peer holds up its own replies only. A frame longer than MaxFrameSize (or one that
+	// can't be allocated) fails Fill with EMSGSIZE (ENOMEM), the connection is to be closed. POSIX only.
+	class Connection
+	{
+		private: int In_;
+		private: int Out_;
+		private: UInt32 PacketSize_;
+		private: bool Owner_;  // Descriptors are closed with the connection
+		private: bool Socket_; // sendmsg with MSG_NOSIGNAL, a peer gone is EPIPE rather than SIGPIPE
+		private: size_t MaxFrameSize_;
+		private: std::vector<byte> Buf_;
+		private: size_t Begin_; // First byte not handed out by Next
+		private: size_t End_;
+		private: boost::mutex WriteMutex_;
+		
+		public: Connection(int in, int out, UInt32 packetSize, bool owner):
+			In_(in),
+			Out_(out),
+			PacketSize_(packetSize == 4 ? 4 : 2),
+			Owner_(owner),
+			Socket_(false),
+			MaxFrameSize_(DEFAULT_MAX_FRAME_SIZE),
+			Buf_(1 << 16),
+			Begin_(0),
+			End_(0)
+		{
+			struct stat st;
+			Socket_ = (!::fstat(out, &st) && S_ISSOCK(st.st_mode));
+		}
+		
+		public: ~Connection(void)
+		{
+			if(!Owner_)
+				return;
+			::close(In_);
+			if(Out_ != In_)
+				::close(Out_);
+		}
+		
+		private: Connection(const Connection&);
+		private: Connection& operator =(const Connection&);
+		
+		public: int In(void) const
+		{
+			return In_;
+		}
+		
+		public: UInt32 PacketSize(void) const
+		{
+			return PacketSize_;
+		}
+		
+		public: void SetMaxFrameSize(size_t maxFrameSize)
+		{
+			MaxFrameSize_ = maxFrameSize;
+		}
+		
+		// One read of what the descriptor has, false on end of stream or error. Frames handed out by
+		// Next before are gone.
+		public: bool Fill(ErrorInfo* pErrorInfo = NULL)
+		{
+			if(Begin_ == End_)
+				Begin_ = End_ = 0;
+			else if(Begin_) {
+				memmove(&Buf_[0], &Buf_[Begin_], End_ - Begin_);
+				End_ -= Begin_;
+				Begin_ = 0;
+			}
+			size_t len = (End_ >= PacketSize_ ? Length(&Buf_[0]) : 0); // Of a frame begun
+			int error = (len > MaxFrameSize_ ? EMSGSIZE : 0);
+			if(!error && Buf_.size() < PacketSize_ + len) {
+				try {
+					Buf_.resize(PacketSize_ + len);
+				}
+				catch(const std::bad_alloc&) {
+					error = ENOMEM;
+				}
+			}
+			if(error)
+				return Fail(error, pErrorInfo);
+			
+			while(true) {
+				Metrics::Add(Metrics::ReadCalls);
+				ssize_t count = ::read(In_, &Buf_[End_], Buf_.size() - End_);
+				if(count < 0 && errno == EINTR)
+					continue;
+				if(count <= 0) {
+					if(count < 0)
+						Metrics::Add(Metrics::IOErrors);
+					if(pErrorInfo)
+						*pErrorInfo = ErrorInfo(count < 0, (int)count, (count < 0 ? errno : 0)); // 0 - end of stream
+					return false;
+				}
+				End_ += (size_t)count;
+				
+				// A frame too long fails as soon as its header is in, the ones before it are handed out
+				for(size_t at = 0; at + PacketSize_ <= End_; at += PacketSize_ + Length(&Buf_[at]))
+					if(Length(&Buf_[at]) > MaxFrameSize_)
+						return Fail(EMSGSIZE, pErrorInfo);
+				return true;
+			}
+		}
+		
+		private: static bool Fail(int error, ErrorInfo* pErrorInfo)
+		{
+			Metrics::Add(Metrics::IOErrors);
+			if(pErrorInfo)
+				*pErrorInfo = ErrorInfo(true, -1, error);
+			return false;
+		}
+		
+		// Next complete frame of the buffer (without its header), valid until the next Fill
+		public: bool Next(const byte*& pFrame, size_t& size)
+		{
+			while(End_ - Begin_ >= PacketSize_) {
+				size_t len = Length(&Buf_[Begin_]);
+				if(End_ - Begin_ < PacketSize_ + len)
+					return false;
+				pFrame = &Buf_[Begin_ + PacketSize_];
+				size = len;
+				Begin_ += PacketSize_ + len;
+				if(!len)
+					continue; // Empty packet carries no term
+				Metrics::Add(Metrics::FramesIn);
+				Metrics::Add(Metrics::BytesIn, PacketSize_ + len);
+				if(Capture::Active())
+					Capture::Frame(Capture::In, PacketSize_, pFrame, len);
+				return true;
+			}
+			return false;
+		}
+		
+		// Header and term in one write, false if the peer is gone or the term is too long for the header
+		public: bool Write(const byte* pBuf, size_t size, ErrorInfo* pErrorInfo = NULL)
+		{
+			if(PacketSize_ == 2 && size > 0xffff)
+				return false;
+			byte header[4];
+			if(PacketSize_ == 2)
+				RWBinary::Write(header, (UInt16)size);
+			else
+				RWBinary::Write(header, (UInt32)size);
+			struct iovec iov[2];
+			iov[0].iov_base = header;
+			iov[0].iov_len = PacketSize_;
+			iov[1].iov_base = const_cast<byte*>(pBuf);
+			iov[1].iov_len = size;
+			
+			boost::mutex::scoped_lock lock(WriteMutex_);
+			if(!WriteV(iov, 2, 0, pErrorInfo))
+				return false;
+			Metrics::Add(Metrics::FramesOut);
+			Metrics::Add(Metrics::BytesOut, PacketSize_ + size);
+			if(Capture::Active())
+				Capture::Frame(Capture::Out, PacketSize_, pBuf, size);
+			return true;
+		}
+		
+		// Frame of a term with a file range for its binary payload, see Stream::WriteFile: header
+		// and head go out in one syscall (MSG_MORE on a socket, so they share a segment with the
+		// file), the file by sendfile, then the tail. sendfile has no MSG_NOSIGNAL, a server that
+		// sends files to sockets ignores SIGPIPE.
+		public: bool WriteFile(const byte* pHead, size_t headSize, int fd, UInt64 offset, size_t count,
+			const byte* pTail, size_t tailSize, ErrorInfo* pErrorInfo = NULL)
+		{
+			UInt64 len = (UInt64)headSize + count + tailSize;
+			if(len > (PacketSize_ == 2 ? 0xffffULL : 0xffffffffULL))
+				return false;
+			if(Capture::Active()) {
+				std::vector<byte> frame(pHead, pHead + headSize);
+				frame.resize(headSize + count);
+				if(count && ::pread(fd, &frame[headSize], count, (off_t)offset) != (ssize_t)count)
+					return false;
+				frame.insert(frame.end(), pTail, pTail + tailSize);
+				return Write(frame.empty() ? NULL : &frame[0], frame.size(), pErrorInfo);
+			}
+			byte header[4];
+			if(PacketSize_ == 2)
+				RWBinary::Write(header, (UInt16)len);
+			else
+				RWBinary::Write(header, (UInt32)len);
+			struct iovec iov[2];
+			iov[0].iov_base = header;
+			iov[0].iov_len = PacketSize_;
+			iov[1].iov_base = const_cast<byte*>(pHead);
+			iov[1].iov_len = headSize;
+			
+			boost::mutex::scoped_lock lock(WriteMutex_);
+			if(!WriteV(iov, 2, (count ? MSG_MORE : 0), pErrorInfo) || !Stream::SendFile(Out_, fd, offset, count, pErrorInfo))
+				return false;
+			if(tailSize) {
+				iov[0].iov_base = const_cast<byte*>(pTail);
+				iov[0].iov_len = tailSize;
+				if(!WriteV(iov, 1, 0, pErrorInfo))
+					return false;
+			}
+			Metrics::Add(Metrics::FramesOut);
+			Metrics::Add(Metrics::BytesOut, PacketSize_ + (size_t)len);
+			return true;
+		}
+		
+		// All of iov, flags (MSG_MORE) to sendmsg on a socket; WriteMutex_ is held
+		private: bool WriteV(struct iovec* pIov, int count, int flags, ErrorInfo* pErrorInfo)
+		{
+			while(count) {
+				Metrics::Add(Metrics::WriteCalls);
+				ssize_t n = -1;
+				if(Socket_) {
+					struct msghdr msg;
+					memset(&msg, 0, sizeof(msg));
+					msg.msg_iov = pIov;
+					msg.msg_iovlen = count;
+					n = ::sendmsg(Out_, &msg, MSG_NOSIGNAL | flags);
+				}
+				else
+					n = ::writev(Out_, pIov, count);
+				if(n < 0 && errno == EINTR)
+					continue;
+				if(n <= 0) {
+					Metrics::Add(Metrics::IOErrors);
+					if(pErrorInfo)
+						*pErrorInfo = ErrorInfo(true, (int)n, errno);
+					return false;
+				}
+				size_t done = (size_t)n;
+				for(; count && done >= pIov->iov_len; ++pIov, --count)
+					done -= pIov->iov_len;
+				if(count) {
+					pIov->iov_base = (byte*)pIov->iov_base + done;
+					pIov->iov_len -= done;
+				}
+			}
+			return true;
+		}
+		
+		private: size_t Length(const byte* pHeader) const
+		{
+			if(PacketSize_ == 2)
+				return ByteOrder::Load<16>(pHeader);
+			return ByteOrder::Load<32>(pHeader);
+		}
+	};
+	
+	// Listening Unix domain socket: one long-lived port process serves several local Erlang nodes
+	// (gen_tcp:connect({local,Path},0,[binary,{packet,2}]) or a NIF/C node), each connection
+	// framed like the stdio of a port. The listener does not block, Accept is called when poll
+	// says it is readable.
+	class UnixListener
+	{
+		private: int Fd_;
+		private: std::string Path_;
+		
+		public: UnixListener(void):
+			Fd_(-1)
+		{
+		}
+		
+		public: ~UnixListener(void)
+		{
+			Close();
+		}
+		
+		private: UnixListener(const UnixListener&);
+		private: UnixListener& operator =(const UnixListener&);
+		
+		// Binds path (a socket file left there is removed first), false with errno set on failure
+		public: bool Listen(const char* path, int backlog = 64)
+		{
+			Close();
+			struct sockaddr_un addr;
+			memset(&addr, 0, sizeof(addr));
+			addr.sun_family = AF_UNIX;
+			if(!path || strlen(path) >= sizeof(addr.sun_path)) {
+				errno = ENAMETOOLONG;
+				return false;
+			}
+			strcpy(addr.sun_path, path);
+			
+			struct stat st;
+			if(!::lstat(path, &st) && S_ISSOCK(st.st_mode))
+				::unlink(path);
+			int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+			if(fd < 0)
+				return false;
+			if(::bind(fd, (struct sockaddr*)&addr, sizeof(addr)) || ::listen(fd, backlog)) {
+				int error = errno;
+				::close(fd);
+				errno = error;
+				return false;
+			}
+			::fcntl(fd, F_SETFD, FD_CLOEXEC);
+			::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+			Fd_ = fd;
+			Path_ = path;
+			return true;
+		}
+		
+		// -1 if not listening
+		public: int Fd(void) const
+		{
+			return Fd_;
+		}
+		
+		// Accepted connection (blocking, close-on-exec), -1 when none is pending
+		public: int Accept(void)
+		{
+			while(Fd_ >= 0) {
+				int fd = ::accept(Fd_, NULL, NULL);
+				if(fd < 0 && errno == EINTR)
+					continue;
+				if(fd < 0)
+					return -1;
+				::fcntl(fd, F_SETFD, FD_CLOEXEC);
+				::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) & ~O_NONBLOCK); // Inherited on BSD
+				return fd;
+			}
+			return -1;
+		}
+		
+		public: void Close(void)
+		{
+			if(Fd_ < 0)
+				return;
+			::close(Fd_);
+			::unlink(Path_.c_str());
+			Fd_ = -1;
+			Path_.clear();
+		}
+	};
+}
+#else
+namespace IOStream
+{
+	class Connection; // Not on Windows, servers read stdin only
+}
+#endif /* _WIN32 */
+//-------------------------------------------------------------------------------------------------
+#endif /* __TRANSPORT_HPP__ */